@@ -0,0 +1,159 @@
+///
+/// @file pixel_bench.c
+/// @brief Benchmark of the pixel unpack and pack kernels for every PNG bit
+///        depth and color type
+/// @author Sam Cordry
+
+// clock_gettime is POSIX
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "cpu.h"
+#include "pixel.h"
+
+#ifdef CPU_X86
+#include <immintrin.h>
+#endif
+
+/// @brief The number of pixels in each benchmarked row.
+#define BENCH_WIDTH 4096
+
+/// @brief The number of rows converted per timed run.
+#define BENCH_ROWS 256
+
+/// @brief The number of timed runs, the fastest of which is reported.
+#define BENCH_RUNS 9
+
+/// @brief The ticks function reads the time stamp counter, or the monotonic
+///        clock in nanoseconds where there is none.
+/// @return The current tick count.
+static uint64_t ticks(void) {
+#ifdef CPU_X86
+    return __rdtsc();
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000u + (uint64_t) now.tv_nsec;
+#endif
+}
+
+/// @brief The bench_combo function times unpacking and packing rows of one
+///        bit depth and color type with one set of kernels.
+/// @param depth The bit depth.
+/// @param color_type The color type.
+/// @param format The working pixel format.
+/// @param isa The newest instruction set to use.
+/// @param unpack Set to the packed bytes unpacked per tick.
+/// @param pack Set to the packed bytes packed per tick.
+/// @return True if the combination converted, false otherwise.
+static bool bench_combo(unsigned char depth, unsigned char color_type, PIXEL_FORMAT format,
+                        PIXEL_ISA isa, double* unpack, double* pack) {
+    // a palette with one color per index the depth can address
+    uint32_t lut[PALETTE_SIZE];
+    unsigned char rgb[PALETTE_SIZE * 3];
+    unsigned int colors = color_type == 3 ? 1u << depth : 0;
+    for(unsigned int i = 0; i < colors * 3; i++)
+        rgb[i] = (unsigned char) (i * 97 + 13);
+    palette_pack(lut, rgb, colors);
+
+    PIXEL_CONVERTER* conv = pixel_converter_create_isa(depth, color_type, format,
+                                color_type == 3 ? lut : NULL, colors, isa);
+    if(conv == NULL)
+        return false;
+    size_t row_bytes = ((size_t) BENCH_WIDTH * conv->channels * depth + 7) / 8;
+    unsigned char* row = malloc(row_bytes);
+    unsigned char* packed = malloc(row_bytes);
+    void* pixels = malloc((size_t) BENCH_WIDTH * pixel_size(format));
+    if(row == NULL || packed == NULL || pixels == NULL) {
+        pixel_converter_free(conv);
+        free(row);
+        free(packed);
+        free(pixels);
+        return false;
+    }
+
+    // random samples, unpacked once so that packing sees valid pixels
+    uint32_t state = 12345;
+    for(size_t i = 0; i < row_bytes; i++) {
+        state = state * 1103515245 + 12345;
+        row[i] = (unsigned char) (state >> 16);
+    }
+    pixel_unpack_row(conv, row, BENCH_WIDTH, pixels);
+
+    uint64_t best_unpack = 0, best_pack = 0;
+    bool packs = true;
+    for(int run = 0; run < BENCH_RUNS; run++) {
+        uint64_t start = ticks();
+        for(int y = 0; y < BENCH_ROWS; y++)
+            pixel_unpack_row(conv, row, BENCH_WIDTH, pixels);
+        uint64_t middle = ticks();
+        for(int y = 0; y < BENCH_ROWS; y++)
+            packs = pixel_pack_row(conv, pixels, BENCH_WIDTH, packed) && packs;
+        uint64_t end = ticks();
+        if(run == 0 || middle - start < best_unpack)
+            best_unpack = middle - start;
+        if(run == 0 || end - middle < best_pack)
+            best_pack = end - middle;
+    }
+
+    *unpack = (double) row_bytes * BENCH_ROWS / (double) (best_unpack > 0 ? best_unpack : 1);
+    *pack = (double) row_bytes * BENCH_ROWS / (double) (best_pack > 0 ? best_pack : 1);
+    pixel_converter_free(conv);
+    free(row);
+    free(packed);
+    free(pixels);
+    return packs;
+}
+
+/// @brief The main function benchmarks every valid bit depth and color type
+///        against both working formats, scalar and SSSE3.
+/// @return Zero if every combination converted.
+int main(void) {
+    static const struct {
+        unsigned char color_type;
+        const char* name;
+        unsigned char depths[5];
+    } types[] = {
+        { 0, "gray", { 1, 2, 4, 8, 16 } },
+        { 2, "rgb", { 8, 16, 0, 0, 0 } },
+        { 3, "palette", { 1, 2, 4, 8, 0 } },
+        { 4, "gray+alpha", { 8, 16, 0, 0, 0 } },
+        { 6, "rgba", { 8, 16, 0, 0, 0 } }
+    };
+    static const char* format_names[] = { "RGBA8", "RGBA16" };
+
+#ifdef CPU_X86
+    const char* unit = "bytes/cycle";
+#else
+    const char* unit = "bytes/ns";
+#endif
+    bool ssse3 = cpu_has_ssse3();
+    printf("packed %s for %d-pixel rows, unpack/pack%s\n", unit, BENCH_WIDTH,
+            ssse3 ? "" : " (no SSSE3, the second pair is scalar too)");
+    printf("%-5s %-10s %-7s %17s %17s\n", "depth", "type", "format", "scalar", "ssse3");
+
+    bool converted = true;
+    for(unsigned int t = 0; t < sizeof(types) / sizeof(types[0]); t++)
+        for(int d = 0; d < 5 && types[t].depths[d] != 0; d++)
+            for(int f = PIXEL_RGBA8; f <= PIXEL_RGBA16; f++) {
+                double unpack[2], pack[2];
+                bool ok = bench_combo(types[t].depths[d], types[t].color_type, (PIXEL_FORMAT) f,
+                                        PIXEL_SCALAR, &unpack[0], &pack[0]) &&
+                            bench_combo(types[t].depths[d], types[t].color_type, (PIXEL_FORMAT) f,
+                                        PIXEL_SSSE3, &unpack[1], &pack[1]);
+                if(!ok) {
+                    printf("%-5u %-10s %-7s failed\n", types[t].depths[d], types[t].name,
+                            format_names[f]);
+                    converted = false;
+                    continue;
+                }
+                printf("%-5u %-10s %-7s %8.2f/%-8.2f %8.2f/%-8.2f\n", types[t].depths[d],
+                        types[t].name, format_names[f], unpack[0], pack[0], unpack[1], pack[1]);
+            }
+
+    return converted ? 0 : 1;
+}
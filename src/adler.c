@@ -0,0 +1,74 @@
+///
+/// @file adler.c
+/// @brief Adler-32 checksum implementation, as used by zlib streams
+/// @author Sam Cordry
+
+#include <stdint.h>
+
+#include "adler.h"
+
+/// @brief The modulus of both Adler-32 sums.
+#define ADLER_BASE 65521
+
+/// @brief The most bytes that can be summed before the sums must be reduced.
+#define ADLER_NMAX 5552
+
+/// @brief The adler_update function adds data to a running Adler-32 checksum.
+/// @param adler The running checksum, 1 for a new checksum.
+/// @param buf The data to add.
+/// @param len The length of the data.
+/// @return The updated checksum.
+unsigned long adler_update(unsigned long adler, const unsigned char* buf, size_t len) {
+    uint32_t a = adler & 0xffff;
+    uint32_t b = (adler >> 16) & 0xffff;
+
+    while(len > 0) {
+        // sum as much as possible before the 32-bit sums could overflow
+        size_t block = len < ADLER_NMAX ? len : ADLER_NMAX;
+        len -= block;
+        while(block >= 8) {
+            a += buf[0]; b += a;
+            a += buf[1]; b += a;
+            a += buf[2]; b += a;
+            a += buf[3]; b += a;
+            a += buf[4]; b += a;
+            a += buf[5]; b += a;
+            a += buf[6]; b += a;
+            a += buf[7]; b += a;
+            buf += 8;
+            block -= 8;
+        }
+        while(block > 0) {
+            a += *buf++;
+            b += a;
+            block--;
+        }
+        a %= ADLER_BASE;
+        b %= ADLER_BASE;
+    }
+
+    return ((unsigned long) b << 16) | a;
+}
+
+/// @brief The adler_combine function computes the checksum of two adjacent
+///        ranges from their separate checksums.
+/// @param adler1 The checksum of the first range.
+/// @param adler2 The checksum of the second range.
+/// @param len2 The length of the second range.
+/// @return The checksum of both ranges back to back.
+unsigned long adler_combine(unsigned long adler1, unsigned long adler2, size_t len2) {
+    uint32_t rem = (uint32_t) (len2 % ADLER_BASE);
+    uint32_t a1 = adler1 & 0xffff;
+    uint32_t b1 = (adler1 >> 16) & 0xffff;
+    uint32_t a2 = adler2 & 0xffff;
+    uint32_t b2 = (adler2 >> 16) & 0xffff;
+
+    // the second range's sums both start from 1 instead of the first's sums
+    uint32_t a = a1 + a2 + ADLER_BASE - 1;
+    uint32_t b = (uint32_t) (((uint64_t) rem * a1) % ADLER_BASE);
+    b += b1 + b2 + ADLER_BASE - rem;
+    a %= ADLER_BASE;
+    b %= ADLER_BASE;
+
+    return ((unsigned long) b << 16) | a;
+}
@@ -0,0 +1,15 @@
+///
+/// @file adler.h
+/// @brief Adler-32 checksum header
+/// @author Sam Cordry
+
+#ifndef ADLER_H
+#define ADLER_H
+
+#include <stddef.h>
+
+// Adler-32 functions
+unsigned long adler_update(unsigned long adler, const unsigned char* buf, size_t len);
+unsigned long adler_combine(unsigned long adler1, unsigned long adler2, size_t len2);
+
+#endif
@@ -0,0 +1,550 @@
+///
+/// @file apng.c
+/// @brief Animated PNG frame decoding and encoding implementation
+/// @author Sam Cordry
+
+#include "apng.h"
+#include "pool.h"
+#include "deflate.h"
+
+/// @brief The MEM_CHECK macro checks if the given pointer is NULL.
+#define MEM_CHECK(ptr) if(ptr == NULL) { printf("Unable to allocate memory");\
+                                            return false; }
+
+/// @brief One frame decoded by one pool job
+typedef struct {
+    PNG* png; ///< the animation
+    FCTL* fctl; ///< the frame to decode
+    PIXEL_FORMAT format; ///< the working format to unpack to
+    unsigned char* pixels; ///< pixels of the frame's region, NULL if it failed
+} DECODE_FRAME_JOB;
+
+/// @brief One frame encoded by one pool job
+typedef struct {
+    PNG* png; ///< the IHDR, sized to the canvas, and PLTE to encode with
+    const APNG_FRAME* frame; ///< the frame to encode
+    const PNG_ENCODE_OPTIONS* options; ///< how to filter and compress
+    unsigned char* rows; ///< the frame packed to the IHDR's format
+    const unsigned char* prev; ///< the previous frame packed, NULL for the first
+    FCTL fctl; ///< the region that changed since the previous frame
+    DEFLATE_BUFFER out; ///< the region as a zlib stream
+    bool encoded; ///< whether the region was filtered and compressed
+} ENCODE_FRAME_JOB;
+
+/// @brief The decode_frame_job function inflates, unfilters and unpacks one
+///        frame's image data.
+/// @param arg The DECODE_FRAME_JOB to run.
+static void decode_frame_job(void* arg) {
+    DECODE_FRAME_JOB* job = arg;
+    PNG* png = job->png;
+    FCTL* fctl = job->fctl;
+    job->pixels = NULL;
+
+    // view the frame as an image of its own, with the sequence numbers skipped
+    IHDR ihdr = *png->ihdr;
+    ihdr.width = fctl->width;
+    ihdr.height = fctl->height;
+    PNG frame = *png;
+    frame.ihdr = &ihdr;
+    frame.ffix = NULL;
+    IDAT* chunks = NULL;
+    if(!fctl->default_image) {
+        chunks = malloc(sizeof(IDAT) * fctl->num_chunks);
+        if(chunks == NULL)
+            return;
+        for(unsigned int i = 0; i < fctl->num_chunks; i++) {
+            chunks[i] = png->fdat[fctl->first_chunk + i];
+            chunks[i].data += 4;
+            chunks[i].length -= 4;
+            chunks[i].borrowed = true;
+        }
+        frame.idat = chunks;
+        frame.num_idat_chunks = fctl->num_chunks;
+    }
+
+    size_t length;
+    unsigned char* scanlines = png_decode(&frame, NULL, &length);
+    if(scanlines != NULL)
+        job->pixels = png_unpack(&frame, scanlines, job->format, &length);
+
+    free(scanlines);
+    free(chunks);
+}
+
+/// @brief The blend_over function draws pixels over the canvas, weighing
+///        both by their alpha.
+/// @param canvas The canvas pixels to draw on.
+/// @param pixels The pixels to draw.
+/// @param count The number of pixels.
+static void blend_over(unsigned char* canvas, const unsigned char* pixels, unsigned int count) {
+    for(unsigned int i = 0; i < count; i++, canvas += 4, pixels += 4) {
+        unsigned int alpha = pixels[3];
+        if(alpha == 255) {
+            memcpy(canvas, pixels, 4);
+        } else if(alpha != 0) {
+            // weigh the canvas by what shows through the new pixel
+            unsigned int source = alpha * 255;
+            unsigned int dest = (255 - alpha) * canvas[3];
+            unsigned int total = source + dest;
+            for(int c = 0; c < 3; c++)
+                canvas[c] = (unsigned char) ((pixels[c] * source + canvas[c] * dest) / total);
+            canvas[3] = (unsigned char) (total / 255);
+        }
+    }
+}
+
+/// @brief The blend_over16 function draws 16-bit pixels over the canvas,
+///        weighing both by their alpha.
+/// @param canvas The canvas pixels to draw on.
+/// @param pixels The pixels to draw.
+/// @param count The number of pixels.
+static void blend_over16(uint16_t* canvas, const uint16_t* pixels, unsigned int count) {
+    for(unsigned int i = 0; i < count; i++, canvas += 4, pixels += 4) {
+        uint64_t alpha = pixels[3];
+        if(alpha == 65535) {
+            memcpy(canvas, pixels, 8);
+        } else if(alpha != 0) {
+            // weigh the canvas by what shows through the new pixel
+            uint64_t source = alpha * 65535;
+            uint64_t dest = (65535 - alpha) * canvas[3];
+            uint64_t total = source + dest;
+            for(int c = 0; c < 3; c++)
+                canvas[c] = (uint16_t) ((pixels[c] * source + canvas[c] * dest) / total);
+            canvas[3] = (uint16_t) (total / 65535);
+        }
+    }
+}
+
+/// @brief The apng_decode function decodes every frame of an animation. The
+///        frames are inflated, unfiltered and unpacked in parallel on a
+///        thread pool, then blended and disposed of in order on the canvas.
+///        A 16-bit animation is composited in RGBA16 so no precision is lost.
+/// @param png The PNG struct to decode, with an acTL chunk.
+/// @param num_frames Where to store the number of frames.
+/// @return The frames, each composited onto the whole canvas, or NULL if the
+///         image is not an animation or a frame is invalid. Free them with
+///         apng_frames_free.
+APNG_FRAME* apng_decode(PNG* png, unsigned int* num_frames) {
+    if(png->ihdr == NULL || png->actl == NULL || png->num_frames == 0)
+        return NULL;
+
+    // decode every frame at once
+    PIXEL_FORMAT format = png->ihdr->bit_depth == 16 ? PIXEL_RGBA16 : PIXEL_RGBA8;
+    DECODE_FRAME_JOB* jobs = malloc(sizeof(DECODE_FRAME_JOB) * png->num_frames);
+    MEM_CHECK(jobs);
+    POOL* pool = pool_create(0);
+    for(unsigned int i = 0; i < png->num_frames; i++) {
+        jobs[i].png = png;
+        jobs[i].fctl = png->frames + i;
+        jobs[i].format = format;
+        if(pool == NULL || !pool_submit(pool, decode_frame_job, jobs + i))
+            decode_frame_job(jobs + i);
+    }
+    if(pool != NULL)
+        pool_wait(pool);
+    pool_free(pool);
+
+    bool decoded = true;
+    for(unsigned int i = 0; i < png->num_frames; i++)
+        decoded = decoded && jobs[i].pixels != NULL;
+
+    // the canvas starts out fully transparent
+    size_t size = pixel_size(format);
+    size_t stride = (size_t) png->ihdr->width * size;
+    size_t canvas_size = stride * png->ihdr->height;
+    unsigned char* canvas = calloc(canvas_size, 1);
+    unsigned char* saved = malloc(canvas_size);
+    APNG_FRAME* frames = calloc(png->num_frames, sizeof(APNG_FRAME));
+    if(canvas == NULL || saved == NULL || frames == NULL) {
+        printf("Unable to allocate memory");
+        decoded = false;
+    }
+
+    for(unsigned int i = 0; i < png->num_frames && decoded; i++) {
+        FCTL* fctl = png->frames + i;
+        size_t offset = (size_t) fctl->y_offset * stride + (size_t) fctl->x_offset * size;
+        size_t region = (size_t) fctl->width * size;
+
+        // there is nothing to go back to before the first frame
+        unsigned char dispose = fctl->dispose_op;
+        if(i == 0 && dispose == FCTL_DISPOSE_PREVIOUS)
+            dispose = FCTL_DISPOSE_BACKGROUND;
+        if(dispose == FCTL_DISPOSE_PREVIOUS)
+            for(unsigned int y = 0; y < fctl->height; y++)
+                memcpy(saved + offset + y * stride, canvas + offset + y * stride, region);
+
+        // draw the frame and keep a copy of the canvas as it is shown
+        for(unsigned int y = 0; y < fctl->height; y++) {
+            unsigned char* row = canvas + offset + y * stride;
+            const unsigned char* pixels = jobs[i].pixels + y * region;
+            if(fctl->blend_op == FCTL_BLEND_SOURCE)
+                memcpy(row, pixels, region);
+            else if(format == PIXEL_RGBA16)
+                blend_over16((uint16_t*) (void*) row, (const uint16_t*) (const void*) pixels,
+                                fctl->width);
+            else
+                blend_over(row, pixels, fctl->width);
+        }
+        frames[i].pixels = malloc(canvas_size);
+        if(frames[i].pixels == NULL) {
+            printf("Unable to allocate memory");
+            decoded = false;
+            break;
+        }
+        memcpy(frames[i].pixels, canvas, canvas_size);
+        frames[i].format = format;
+        frames[i].delay_num = fctl->delay_num;
+        frames[i].delay_den = fctl->delay_den;
+
+        // clear the region or put it back before the next frame
+        for(unsigned int y = 0; y < fctl->height; y++) {
+            if(dispose == FCTL_DISPOSE_BACKGROUND)
+                memset(canvas + offset + y * stride, 0, region);
+            else if(dispose == FCTL_DISPOSE_PREVIOUS)
+                memcpy(canvas + offset + y * stride, saved + offset + y * stride, region);
+        }
+    }
+
+    for(unsigned int i = 0; i < png->num_frames; i++)
+        free(jobs[i].pixels);
+    free(jobs);
+    free(canvas);
+    free(saved);
+    if(!decoded) {
+        apng_frames_free(frames, png->num_frames);
+        return NULL;
+    }
+
+    *num_frames = png->num_frames;
+    return frames;
+}
+
+/// @brief The apng_frames_free function frees decoded frames.
+/// @param frames The frames to free.
+/// @param num_frames The number of frames.
+void apng_frames_free(APNG_FRAME* frames, unsigned int num_frames) {
+    if(frames == NULL)
+        return;
+
+    for(unsigned int i = 0; i < num_frames; i++)
+        free(frames[i].pixels);
+    free(frames);
+}
+
+/// @brief The pack_frame_job function packs one frame to the IHDR's format.
+/// @param arg The ENCODE_FRAME_JOB to run.
+static void pack_frame_job(void* arg) {
+    ENCODE_FRAME_JOB* job = arg;
+    size_t length;
+    job->rows = png_pack(job->png, job->frame->pixels, job->frame->format, &length);
+}
+
+/// @brief The find_region function finds the smallest region holding every
+///        change since the previous frame. Sub-byte pixels are widened to
+///        whole bytes so the region can be cut out with byte copies.
+/// @param ihdr The IHDR chunk describing the canvas.
+/// @param rows The frame, packed.
+/// @param prev The previous frame, packed, or NULL for the first frame.
+/// @param fctl Where to store the region.
+static void find_region(IHDR* ihdr, const unsigned char* rows, const unsigned char* prev,
+                            FCTL* fctl) {
+    size_t row_bytes = png_row_bytes(ihdr, ihdr->width);
+    fctl->x_offset = 0;
+    fctl->y_offset = 0;
+    fctl->width = ihdr->width;
+    fctl->height = ihdr->height;
+    if(prev == NULL)
+        return;
+
+    // find the changed rows and the changed bytes across them
+    size_t first = row_bytes, last = 0;
+    unsigned int top = ihdr->height, bottom = 0;
+    for(unsigned int y = 0; y < ihdr->height; y++) {
+        const unsigned char* row = rows + y * row_bytes;
+        const unsigned char* above = prev + y * row_bytes;
+        if(memcmp(row, above, row_bytes) == 0)
+            continue;
+        size_t lo = 0, hi = row_bytes - 1;
+        while(row[lo] == above[lo])
+            lo++;
+        while(row[hi] == above[hi])
+            hi--;
+        first = lo < first ? lo : first;
+        last = hi > last ? hi : last;
+        top = y < top ? y : top;
+        bottom = y;
+    }
+
+    // an unchanged frame still needs a pixel of its own
+    if(top == ihdr->height) {
+        fctl->width = 1;
+        fctl->height = 1;
+        return;
+    }
+
+    unsigned int bits = png_channels(ihdr->color_type) * ihdr->bit_depth;
+    unsigned int left, right;
+    if(bits >= 8) {
+        left = (unsigned int) (first / (bits / 8));
+        right = (unsigned int) (last / (bits / 8)) + 1;
+    } else {
+        left = (unsigned int) (first * (8 / bits));
+        right = (unsigned int) ((last + 1) * (8 / bits));
+        right = right < ihdr->width ? right : ihdr->width;
+    }
+    fctl->x_offset = left;
+    fctl->y_offset = top;
+    fctl->width = right - left;
+    fctl->height = bottom - top + 1;
+}
+
+/// @brief The encode_frame_job function cuts out the region of one frame that
+///        changed, then filters and compresses it.
+/// @param arg The ENCODE_FRAME_JOB to run.
+static void encode_frame_job(void* arg) {
+    ENCODE_FRAME_JOB* job = arg;
+    IHDR* ihdr = job->png->ihdr;
+    deflate_buffer_init(&job->out);
+    job->encoded = false;
+    find_region(ihdr, job->rows, job->prev, &job->fctl);
+
+    // lay the region out as an image of its own
+    IHDR region = *ihdr;
+    region.width = job->fctl.width;
+    region.height = job->fctl.height;
+    size_t row_bytes = png_row_bytes(ihdr, ihdr->width);
+    size_t region_bytes = png_row_bytes(ihdr, region.width);
+    size_t skip = (size_t) job->fctl.x_offset * png_channels(ihdr->color_type) * ihdr->bit_depth / 8;
+    unsigned char* pixels = malloc(region_bytes * region.height);
+    if(pixels == NULL) {
+        printf("Unable to allocate memory");
+        return;
+    }
+    for(unsigned int y = 0; y < region.height; y++)
+        memcpy(pixels + y * region_bytes, job->rows + (job->fctl.y_offset + y) * row_bytes + skip,
+                region_bytes);
+
+    // the frames already run in parallel, so each compresses on its own
+    PNG_ENCODE_OPTIONS options = { FILTER_STRATEGY_AUTO, FILTER_NONE, DEFLATE_DEFAULT_LEVEL, 0 };
+    if(job->options != NULL)
+        options = *job->options;
+    options.index_rows = 0;
+    size_t length;
+    unsigned char* scanlines = png_filter(&region, pixels, &options, &length);
+    job->encoded = scanlines != NULL &&
+                    deflate_zlib(scanlines, length, options.level, NULL, &job->out);
+
+    free(scanlines);
+    free(pixels);
+}
+
+/// @brief The frame_data_write function writes a frame's zlib stream as IDAT
+///        chunks, or as numbered fdAT chunks, of at most PNG_IDAT_MAX bytes.
+/// @param out The zlib stream.
+/// @param idat Whether to write IDAT chunks rather than fdAT chunks.
+/// @param sequence The next sequence number, advanced past the fdAT chunks.
+/// @param sink The sink to write to.
+/// @return True if the chunks were written, false otherwise.
+static bool frame_data_write(DEFLATE_BUFFER* out, bool idat, uint32_t* sequence, SINK* sink) {
+    const unsigned char* data = out->data;
+    size_t left = out->length;
+    bool written = true;
+
+    do {
+        size_t length = left > PNG_IDAT_MAX ? PNG_IDAT_MAX : left;
+        left -= length;
+        sink_write_u32(sink, (uint32_t) (length + (idat ? 0 : 4)));
+        sink_crc_begin(sink);
+        sink_write(sink, idat ? IDAT_HEADER : FDAT_HEADER, 4);
+        if(!idat)
+            sink_write_u32(sink, (*sequence)++);
+        sink_write(sink, data, length);
+        written = sink_crc_end(sink) && written;
+        data += length;
+    } while(left > 0);
+
+    return written;
+}
+
+/// @brief The apng_encode function writes an animation. Every frame is packed
+///        to the IHDR's format, cut down to the region that changed since the
+///        previous frame, then filtered and compressed, each frame on its own
+///        pool job. The first frame is also the default image.
+/// @param png The PNG struct holding the IHDR and, for a palette image, the
+///        PLTE chunk. The animation is written without interlacing.
+/// @param frames The frames, each covering the whole canvas.
+/// @param num_frames The number of frames.
+/// @param num_plays The times to play the animation, 0 for forever.
+/// @param options How to choose each row's filter, or NULL for the default.
+/// @param file The file to write to.
+/// @return True if the file was written, false if a frame could not be
+///         packed or compressed or the file could not be written.
+bool apng_encode(PNG* png, const APNG_FRAME* frames, unsigned int num_frames,
+                    unsigned int num_plays, const PNG_ENCODE_OPTIONS* options, FILE* file) {
+    if(png->ihdr == NULL || num_frames == 0)
+        return false;
+    IHDR ihdr = *png->ihdr;
+    ihdr.interlace_method = 0;
+    PNG canvas = *png;
+    canvas.ihdr = &ihdr;
+
+    // pack every frame, since each region needs the frame before it
+    ENCODE_FRAME_JOB* jobs = malloc(sizeof(ENCODE_FRAME_JOB) * num_frames);
+    MEM_CHECK(jobs);
+    POOL* pool = pool_create(0);
+    for(unsigned int i = 0; i < num_frames; i++) {
+        jobs[i].png = &canvas;
+        jobs[i].frame = frames + i;
+        jobs[i].options = options;
+        if(pool == NULL || !pool_submit(pool, pack_frame_job, jobs + i))
+            pack_frame_job(jobs + i);
+    }
+    if(pool != NULL)
+        pool_wait(pool);
+    bool packed = true;
+    for(unsigned int i = 0; i < num_frames; i++)
+        packed = packed && jobs[i].rows != NULL;
+
+    // then find, filter and compress every region
+    for(unsigned int i = 0; i < num_frames && packed; i++) {
+        jobs[i].prev = i > 0 ? jobs[i - 1].rows : NULL;
+        if(pool == NULL || !pool_submit(pool, encode_frame_job, jobs + i))
+            encode_frame_job(jobs + i);
+    }
+    if(pool != NULL)
+        pool_wait(pool);
+    pool_free(pool);
+    bool encoded = packed;
+    for(unsigned int i = 0; i < num_frames && packed; i++)
+        encoded = encoded && jobs[i].encoded;
+
+    SINK sink;
+    bool written = encoded && sink_open(&sink, file);
+    if(written) {
+        // write the header chunks, then every frame's control and data chunks
+        ACTL actl = { num_frames, num_plays, { 0 } };
+        IEND iend = { { 0 } };
+        uint32_t sequence = 0;
+        sink_write(&sink, PNG_HEADER, 8);
+        written = ihdr_write(&ihdr, &sink) && actl_write(&actl, &sink);
+        if(png->plte != NULL)
+            written = written && plte_write(png->plte, &sink);
+        if(png->plte != NULL && png->plte->num_alpha > 0)
+            written = written && trns_write(png->plte, &sink);
+        for(unsigned int i = 0; i < num_frames && written; i++) {
+            FCTL* fctl = &jobs[i].fctl;
+            fctl->delay_num = frames[i].delay_num;
+            fctl->delay_den = frames[i].delay_den;
+            fctl->dispose_op = FCTL_DISPOSE_NONE;
+            fctl->blend_op = FCTL_BLEND_SOURCE;
+            written = fctl_write(fctl, sequence++, &sink) &&
+                        frame_data_write(&jobs[i].out, i == 0, &sequence, &sink);
+        }
+        written = written && iend_write(&iend, &sink);
+        written = sink_close(&sink) && written;
+    }
+
+    for(unsigned int i = 0; i < num_frames; i++) {
+        if(packed)
+            deflate_buffer_free(&jobs[i].out);
+        free(jobs[i].rows);
+    }
+    free(jobs);
+    return written;
+}
+
+/// @brief The fits_palette function checks that every frame only uses colors
+///        from the palette.
+/// @param png The PNG struct holding the IHDR and PLTE chunks.
+/// @param frames The frames.
+/// @param num_frames The number of frames.
+/// @param fits Set to whether every pixel is in the palette.
+/// @return True if the frames were checked, false if memory ran out.
+static bool fits_palette(PNG* png, const APNG_FRAME* frames, unsigned int num_frames, bool* fits) {
+    IHDR* ihdr = png->ihdr;
+    PIXEL_CONVERTER* conv = pixel_converter_create(ihdr->bit_depth, ihdr->color_type, PIXEL_RGBA8,
+                                png->plte->entries, png->plte->num_entries);
+    MEM_CHECK(conv);
+    unsigned char* row = malloc(png_row_bytes(ihdr, ihdr->width) + 1);
+    if(row == NULL) {
+        printf("Unable to allocate memory");
+        pixel_converter_free(conv);
+        return false;
+    }
+
+    *fits = true;
+    size_t stride = (size_t) ihdr->width * 4;
+    for(unsigned int i = 0; i < num_frames && *fits; i++)
+        for(unsigned int y = 0; y < ihdr->height && *fits; y++)
+            *fits = pixel_pack_row(conv, frames[i].pixels + y * stride, ihdr->width, row);
+
+    free(row);
+    pixel_converter_free(conv);
+    return true;
+}
+
+/// @brief The is_opaque function checks that no pixel of any frame shows
+///        the background through it.
+/// @param ihdr The IHDR chunk describing the canvas.
+/// @param frames The frames.
+/// @param num_frames The number of frames.
+/// @return True if every pixel has full alpha, false otherwise.
+static bool is_opaque(IHDR* ihdr, const APNG_FRAME* frames, unsigned int num_frames) {
+    size_t num_pixels = (size_t) ihdr->width * ihdr->height;
+
+    for(unsigned int i = 0; i < num_frames; i++) {
+        if(frames[i].format == PIXEL_RGBA16) {
+            const uint16_t* pixels = (const uint16_t*) (const void*) frames[i].pixels;
+            for(size_t p = 0; p < num_pixels; p++)
+                if(pixels[p * 4 + 3] != 65535)
+                    return false;
+        } else {
+            for(size_t p = 0; p < num_pixels; p++)
+                if(frames[i].pixels[p * 4 + 3] != 255)
+                    return false;
+        }
+    }
+
+    return true;
+}
+
+/// @brief The apng_reencode function decodes a read animation and encodes it
+///        again with new settings. A default image that is not part of the
+///        animation is dropped.
+/// @param png The PNG struct to re-encode, with an acTL chunk.
+/// @param options How to choose each row's filter, or NULL for the default.
+/// @param file The file to write to.
+/// @return True if the file was written, false otherwise.
+bool apng_reencode(PNG* png, const PNG_ENCODE_OPTIONS* options, FILE* file) {
+    unsigned int num_frames;
+    APNG_FRAME* frames = apng_decode(png, &num_frames);
+    if(frames == NULL)
+        return false;
+
+    // blending can make colors the palette lacks, which then need RGBA
+    IHDR ihdr = *png->ihdr;
+    PNG target = *png;
+    target.ihdr = &ihdr;
+    bool fits = false;
+    if(ihdr.color_type == 3 && png->plte != NULL &&
+            !fits_palette(png, frames, num_frames, &fits)) {
+        apng_frames_free(frames, num_frames);
+        return false;
+    }
+    if(ihdr.color_type == 3 && !fits) {
+        ihdr.color_type = 6;
+        ihdr.bit_depth = 8;
+        target.plte = NULL;
+    }
+
+    // disposing to the background leaves transparent pixels behind, which
+    // gray and RGB can only keep with an alpha channel added
+    if((ihdr.color_type == 0 || ihdr.color_type == 2) && !is_opaque(&ihdr, frames, num_frames)) {
+        ihdr.color_type += 4;
+        ihdr.bit_depth = ihdr.bit_depth < 8 ? 8 : ihdr.bit_depth;
+    }
+
+    bool written = apng_encode(&target, frames, num_frames, png->actl->num_plays, options, file);
+    apng_frames_free(frames, num_frames);
+    return written;
+}
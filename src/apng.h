@@ -0,0 +1,33 @@
+///
+/// @file apng.h
+/// @brief Animated PNG frame decoding and encoding header
+/// @author Sam Cordry
+
+#ifndef APNG_H
+#define APNG_H
+
+// include needed system libraries
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "png.h"
+
+/// @brief One frame of an animation, composited onto the whole canvas
+typedef struct {
+    unsigned char* pixels; ///< pixels of the format, IHDR width by height
+    PIXEL_FORMAT format; ///< RGBA16 for a 16-bit image, RGBA8 otherwise
+    uint16_t delay_num; ///< frame delay numerator, in seconds
+    uint16_t delay_den; ///< frame delay denominator, 0 meaning 100
+} APNG_FRAME;
+
+// animation functions
+APNG_FRAME* apng_decode(PNG* png, unsigned int* num_frames);
+void apng_frames_free(APNG_FRAME* frames, unsigned int num_frames);
+bool apng_encode(PNG* png, const APNG_FRAME* frames, unsigned int num_frames,
+                    unsigned int num_plays, const PNG_ENCODE_OPTIONS* options, FILE* file);
+bool apng_reencode(PNG* png, const PNG_ENCODE_OPTIONS* options, FILE* file);
+
+#endif
@@ -0,0 +1,626 @@
+///
+/// @file color.c
+/// @brief JPEG chroma resampling and color conversion implementation
+/// @author Sam Cordry
+
+#include "color.h"
+#include "cpu.h"
+
+#ifdef CPU_X86
+#include <immintrin.h>
+#endif
+
+// YCbCr to RGB uses the JFIF equations with libjpeg's 16-bit fixed-point
+// constants and rounding. The whole part of each constant is taken out so
+// that the rest fits the 16-bit multipliers of pmaddwd:
+//   R = Y + Cr + (0.40200 Cr)
+//   G = Y - Cr + (-0.34414 Cb + 0.28586 Cr)
+//   B = Y + 2 Cb + (-0.22800 Cb)
+#define FIX_CR_R 26345
+#define FIX_CB_G -22554
+#define FIX_CR_G 18734
+#define FIX_CB_B -14942
+#define FIX_HALF (1 << 15)
+
+// RGB to YCbCr uses libjpeg's constants. The green multiplier of Y is too
+// large for pmaddwd, so the SIMD path splits it into 0.33700 and 0.25000.
+#define FIX_R_Y 19595
+#define FIX_G_Y 38470
+#define FIX_B_Y 7471
+#define FIX_G_Y_LO 22086
+#define FIX_G_Y_HI 16384
+#define FIX_R_CB -11059
+#define FIX_G_CB -21709
+#define FIX_G_CR -27439
+#define FIX_B_CR -5329
+#define FIX_CHROMA ((128 << 16) + FIX_HALF - 1)
+
+/// @brief The number of pixels the scalar path upsamples at once.
+#define COLOR_CHUNK 64
+
+/// @brief The color_channels function finds the number of samples in each
+///        output pixel of a color space.
+/// @param space The color space.
+/// @return 1 for gray, 3 for everything else, which is converted to RGB.
+unsigned int color_channels(COLOR_SPACE space) {
+    return space == COLOR_GRAY ? 1 : 3;
+}
+
+/// @brief The color_planes function finds the number of components a color
+///        space is stored in.
+/// @param space The color space.
+/// @return The number of components.
+unsigned int color_planes(COLOR_SPACE space) {
+    if(space == COLOR_GRAY)
+        return 1;
+    return space == COLOR_CMYK || space == COLOR_YCCK ? 4 : 3;
+}
+
+/// @brief The clamp_sample function limits a sample to the 8-bit range.
+/// @param value The sample.
+/// @return The limited sample.
+static inline unsigned char clamp_sample(int value) {
+    return (unsigned char) (value < 0 ? 0 : value > 255 ? 255 : value);
+}
+
+/// @brief The mul255 function scales one sample by another as a fraction of
+///        255, rounded to nearest.
+/// @param a The first sample.
+/// @param b The second sample.
+/// @return a * b / 255, rounded.
+static inline unsigned char mul255(unsigned int a, unsigned int b) {
+    unsigned int t = a * b + 128;
+    return (unsigned char) ((t + (t >> 8)) >> 8);
+}
+
+/// @brief The upsample_scalar function upsamples part of a row of one
+///        component to full resolution.
+/// @param plane The component.
+/// @param x The first output pixel.
+/// @param count The number of output pixels.
+/// @param out Where to store the samples.
+static void upsample_scalar(const COLOR_PLANE* plane, unsigned int x, unsigned int count,
+                            unsigned char* out) {
+    const unsigned char* near = plane->near;
+    const unsigned char* far = plane->far;
+
+    for(unsigned int i = 0; i < count; i++) {
+        unsigned int px = x + i;
+        if(plane->h == 1) {
+            out[i] = plane->blend ? (unsigned char) ((3 * near[px] + far[px] +
+                                                        (plane->upper ? 1 : 2)) >> 2) : near[px];
+            continue;
+        }
+
+        // each sample covers two pixels, and each pixel leans toward its nearest neighbour
+        const unsigned char* n = near + px / 2;
+        const unsigned char* f = far + px / 2;
+        int side = px % 2 == 0 ? -1 : 1;
+        if(!plane->fancy)
+            out[i] = n[0];
+        else if(!plane->blend)
+            out[i] = (unsigned char) ((3 * n[0] + n[side] + (px % 2 == 0 ? 1 : 2)) >> 2);
+        else {
+            int sum = 3 * n[0] + f[0];
+            int next = 3 * n[side] + f[side];
+            out[i] = (unsigned char) ((3 * sum + next + (px % 2 == 0 ? 8 : 7)) >> 4);
+        }
+    }
+}
+
+/// @brief The convert_scalar function converts part of a row one pixel at a
+///        time.
+/// @param row The row and its components.
+/// @param x The first output pixel.
+/// @param count The number of output pixels.
+/// @param out Where to store the first pixel.
+static void convert_scalar(const COLOR_ROW* row, unsigned int x, unsigned int count,
+                            unsigned char* out) {
+    unsigned char samples[4][COLOR_CHUNK];
+    unsigned int planes = color_planes(row->space);
+
+    while(count > 0) {
+        unsigned int n = count < COLOR_CHUNK ? count : COLOR_CHUNK;
+        for(unsigned int p = 0; p < planes; p++)
+            upsample_scalar(row->planes + p, x, n, samples[p]);
+
+        for(unsigned int i = 0; i < n; i++) {
+            int y = samples[0][i];
+            if(row->space == COLOR_GRAY) {
+                *out++ = (unsigned char) y;
+                continue;
+            }
+            if(row->space == COLOR_RGB) {
+                *out++ = (unsigned char) y;
+                *out++ = samples[1][i];
+                *out++ = samples[2][i];
+                continue;
+            }
+            if(row->space == COLOR_CMYK) {
+                *out++ = mul255(samples[0][i], samples[3][i]);
+                *out++ = mul255(samples[1][i], samples[3][i]);
+                *out++ = mul255(samples[2][i], samples[3][i]);
+                continue;
+            }
+
+            int cb = samples[1][i] - 128;
+            int cr = samples[2][i] - 128;
+            unsigned char r = clamp_sample(y + cr + ((FIX_CR_R * cr + FIX_HALF) >> 16));
+            unsigned char g = clamp_sample(y - cr + ((FIX_CB_G * cb + FIX_CR_G * cr + FIX_HALF) >> 16));
+            unsigned char b = clamp_sample(y + 2 * cb + ((FIX_CB_B * cb + FIX_HALF) >> 16));
+            if(row->space == COLOR_YCCK) {
+                // the YCbCr holds inverted cyan, magenta and yellow
+                r = mul255(255 - r, samples[3][i]);
+                g = mul255(255 - g, samples[3][i]);
+                b = mul255(255 - b, samples[3][i]);
+            }
+            *out++ = r;
+            *out++ = g;
+            *out++ = b;
+        }
+        x += n;
+        count -= n;
+    }
+}
+
+#ifdef CPU_X86
+/// @brief The pair_sse2 function builds a multiplier pair for pmaddwd.
+/// @param a The multiplier of the first input.
+/// @param b The multiplier of the second input.
+/// @return The pair, repeated in every 32-bit lane.
+__attribute__((target("sse2")))
+static inline __m128i pair_sse2(int a, int b) {
+    return _mm_set1_epi32((int) (((uint32_t) (uint16_t) b << 16) | (uint16_t) a));
+}
+
+/// @brief The upsample_ssse3 function upsamples 16 pixels of one component
+///        to 16-bit samples.
+/// @param plane The component.
+/// @param x The first output pixel, a multiple of 16.
+/// @param lo Set to the first 8 samples.
+/// @param hi Set to the last 8 samples.
+__attribute__((target("ssse3")))
+static inline void upsample_ssse3(const COLOR_PLANE* plane, unsigned int x, __m128i* lo,
+                                    __m128i* hi) {
+    const __m128i zero = _mm_setzero_si128();
+
+    if(plane->h == 1) {
+        __m128i near = _mm_loadu_si128((const __m128i*) (plane->near + x));
+        *lo = _mm_unpacklo_epi8(near, zero);
+        *hi = _mm_unpackhi_epi8(near, zero);
+        if(plane->blend) {
+            __m128i far = _mm_loadu_si128((const __m128i*) (plane->far + x));
+            __m128i bias = _mm_set1_epi16(plane->upper ? 1 : 2);
+            *lo = _mm_add_epi16(_mm_add_epi16(*lo, _mm_add_epi16(*lo, *lo)),
+                                _mm_add_epi16(_mm_unpacklo_epi8(far, zero), bias));
+            *hi = _mm_add_epi16(_mm_add_epi16(*hi, _mm_add_epi16(*hi, *hi)),
+                                _mm_add_epi16(_mm_unpackhi_epi8(far, zero), bias));
+            *lo = _mm_srli_epi16(*lo, 2);
+            *hi = _mm_srli_epi16(*hi, 2);
+        }
+        return;
+    }
+
+    // 8 samples cover the 16 pixels
+    const unsigned char* near = plane->near + x / 2;
+    if(!plane->fancy) {
+        __m128i twice = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*) near),
+                                            _mm_loadl_epi64((const __m128i*) near));
+        *lo = _mm_unpacklo_epi8(twice, zero);
+        *hi = _mm_unpackhi_epi8(twice, zero);
+        return;
+    }
+    __m128i prev = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*) (near - 1)), zero);
+    __m128i cur = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*) near), zero);
+    __m128i next = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*) (near + 1)), zero);
+    __m128i round_even = _mm_set1_epi16(1);
+    __m128i round_odd = _mm_set1_epi16(2);
+    int shift = 2;
+
+    // blending first sums each column 3 to 1, then filters the sums
+    if(plane->blend) {
+        const unsigned char* far = plane->far + x / 2;
+        prev = _mm_add_epi16(_mm_add_epi16(prev, _mm_add_epi16(prev, prev)),
+                    _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*) (far - 1)), zero));
+        cur = _mm_add_epi16(_mm_add_epi16(cur, _mm_add_epi16(cur, cur)),
+                    _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*) far), zero));
+        next = _mm_add_epi16(_mm_add_epi16(next, _mm_add_epi16(next, next)),
+                    _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*) (far + 1)), zero));
+        round_even = _mm_set1_epi16(8);
+        round_odd = _mm_set1_epi16(7);
+        shift = 4;
+    }
+    __m128i three = _mm_add_epi16(cur, _mm_add_epi16(cur, cur));
+    __m128i even = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(three, prev), round_even), shift);
+    __m128i odd = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(three, next), round_odd), shift);
+    *lo = _mm_unpacklo_epi16(even, odd);
+    *hi = _mm_unpackhi_epi16(even, odd);
+}
+
+/// @brief The fixed_sse2 function finds the fractional part of a color
+///        equation for 8 pixels.
+/// @param lo The Cb and Cr pairs of the first 4 pixels.
+/// @param hi The Cb and Cr pairs of the last 4 pixels.
+/// @param k The multipliers from pair_sse2.
+/// @return The 16-bit results.
+__attribute__((target("sse2")))
+static inline __m128i fixed_sse2(__m128i lo, __m128i hi, __m128i k) {
+    const __m128i half = _mm_set1_epi32(FIX_HALF);
+    return _mm_packs_epi32(_mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(lo, k), half), 16),
+                            _mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(hi, k), half), 16));
+}
+
+/// @brief The ycc_rgb_sse2 function converts 8 pixels from YCbCr to RGB, not
+///        yet limited to the 8-bit range.
+/// @param y The luma samples, then the red samples.
+/// @param cb The blue chroma samples, then the green samples.
+/// @param cr The red chroma samples, then the blue samples.
+__attribute__((target("sse2")))
+static inline void ycc_rgb_sse2(__m128i* y, __m128i* cb, __m128i* cr) {
+    const __m128i center = _mm_set1_epi16(128);
+    __m128i b = _mm_sub_epi16(*cb, center);
+    __m128i r = _mm_sub_epi16(*cr, center);
+    __m128i lo = _mm_unpacklo_epi16(b, r);
+    __m128i hi = _mm_unpackhi_epi16(b, r);
+
+    *cb = _mm_add_epi16(_mm_sub_epi16(*y, r), fixed_sse2(lo, hi, pair_sse2(FIX_CB_G, FIX_CR_G)));
+    *cr = _mm_add_epi16(_mm_add_epi16(*y, _mm_add_epi16(b, b)), fixed_sse2(lo, hi, pair_sse2(FIX_CB_B, 0)));
+    *y = _mm_add_epi16(_mm_add_epi16(*y, r), fixed_sse2(lo, hi, pair_sse2(0, FIX_CR_R)));
+}
+
+/// @brief The mul255_sse2 function scales 8 samples by 8 others as a fraction
+///        of 255, rounded to nearest.
+/// @param a The first samples.
+/// @param b The second samples.
+/// @return a * b / 255, rounded.
+__attribute__((target("sse2")))
+static inline __m128i mul255_sse2(__m128i a, __m128i b) {
+    __m128i t = _mm_add_epi16(_mm_mullo_epi16(a, b), _mm_set1_epi16(128));
+    return _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+}
+
+/// @brief The store_rgb_ssse3 function interleaves 16 red, green and blue
+///        samples into 48 bytes.
+/// @param out Where to store the pixels.
+/// @param r The red samples.
+/// @param g The green samples.
+/// @param b The blue samples.
+__attribute__((target("ssse3")))
+static inline void store_rgb_ssse3(unsigned char* out, __m128i r, __m128i g, __m128i b) {
+    const __m128i r0 = _mm_setr_epi8(0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1, -1, 5);
+    const __m128i g0 = _mm_setr_epi8(-1, 0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1, -1);
+    const __m128i b0 = _mm_setr_epi8(-1, -1, 0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1);
+    const __m128i r1 = _mm_setr_epi8(-1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1, 10, -1);
+    const __m128i g1 = _mm_setr_epi8(5, -1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1, 10);
+    const __m128i b1 = _mm_setr_epi8(-1, 5, -1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1);
+    const __m128i r2 = _mm_setr_epi8(-1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15, -1, -1);
+    const __m128i g2 = _mm_setr_epi8(-1, -1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15, -1);
+    const __m128i b2 = _mm_setr_epi8(10, -1, -1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15);
+
+    _mm_storeu_si128((__m128i*) out, _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(r, r0),
+                        _mm_shuffle_epi8(g, g0)), _mm_shuffle_epi8(b, b0)));
+    _mm_storeu_si128((__m128i*) (out + 16), _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(r, r1),
+                        _mm_shuffle_epi8(g, g1)), _mm_shuffle_epi8(b, b1)));
+    _mm_storeu_si128((__m128i*) (out + 32), _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(r, r2),
+                        _mm_shuffle_epi8(g, g2)), _mm_shuffle_epi8(b, b2)));
+}
+
+/// @brief The convert_ssse3 function upsamples and converts a row 16 pixels
+///        at a time, leaving the pixels past the last whole 16.
+/// @param row The row and its components.
+/// @param width The number of pixels in the row.
+/// @param out Where to store the first pixel.
+/// @return The number of pixels converted.
+__attribute__((target("ssse3")))
+static unsigned int convert_ssse3(const COLOR_ROW* row, unsigned int width, unsigned char* out) {
+    unsigned int planes = color_planes(row->space);
+    unsigned int channels = color_channels(row->space);
+    unsigned int x = 0;
+
+    for(; x + 16 <= width; x += 16) {
+        __m128i lo[4], hi[4];
+        for(unsigned int p = 0; p < planes; p++)
+            upsample_ssse3(row->planes + p, x, lo + p, hi + p);
+
+        if(row->space == COLOR_GRAY) {
+            _mm_storeu_si128((__m128i*) (out + x), _mm_packus_epi16(lo[0], hi[0]));
+            continue;
+        }
+        if(row->space == COLOR_YCBCR || row->space == COLOR_YCCK) {
+            ycc_rgb_sse2(lo, lo + 1, lo + 2);
+            ycc_rgb_sse2(hi, hi + 1, hi + 2);
+        }
+        if(row->space == COLOR_YCCK) {
+            // limit to 8 bits before inverting
+            const __m128i max = _mm_set1_epi16(255);
+            for(int c = 0; c < 3; c++) {
+                lo[c] = _mm_sub_epi16(max, _mm_min_epi16(_mm_max_epi16(lo[c], _mm_setzero_si128()), max));
+                hi[c] = _mm_sub_epi16(max, _mm_min_epi16(_mm_max_epi16(hi[c], _mm_setzero_si128()), max));
+            }
+        }
+        if(row->space == COLOR_CMYK || row->space == COLOR_YCCK) {
+            for(int c = 0; c < 3; c++) {
+                lo[c] = mul255_sse2(lo[c], lo[3]);
+                hi[c] = mul255_sse2(hi[c], hi[3]);
+            }
+        }
+        store_rgb_ssse3(out + (size_t) x * channels, _mm_packus_epi16(lo[0], hi[0]),
+                        _mm_packus_epi16(lo[1], hi[1]), _mm_packus_epi16(lo[2], hi[2]));
+    }
+
+    return x;
+}
+#endif
+
+/// @brief The color_convert_row_isa function upsamples the components of a
+///        row of output and converts them to RGB, or gray for one component,
+///        without going above the given instruction set.
+/// @param row The row and its components.
+/// @param width The number of pixels in the row.
+/// @param out Where to store the pixels, color_channels samples each.
+/// @param isa The highest instruction set to use.
+void color_convert_row_isa(const COLOR_ROW* row, unsigned int width, unsigned char* out,
+                            COLOR_ISA isa) {
+    unsigned int x = 0;
+#ifdef CPU_X86
+    if(isa >= COLOR_SSSE3 && cpu_has_ssse3())
+        x = convert_ssse3(row, width, out);
+#else
+    (void) isa;
+#endif
+    convert_scalar(row, x, width - x, out + (size_t) x * color_channels(row->space));
+}
+
+/// @brief The color_convert_row function upsamples the components of a row
+///        of output and converts them with the fastest kernels the CPU
+///        supports.
+/// @param row The row and its components.
+/// @param width The number of pixels in the row.
+/// @param out Where to store the pixels, color_channels samples each.
+void color_convert_row(const COLOR_ROW* row, unsigned int width, unsigned char* out) {
+    color_convert_row_isa(row, width, out, COLOR_SSSE3);
+}
+
+/// @brief The ycc_scalar function converts RGB pixels to YCbCr one at a time.
+/// @param in The first pixel.
+/// @param channels The samples in each pixel, 3 for RGB or 4 for RGBA.
+/// @param count The number of pixels.
+/// @param y Where to store the luma samples.
+/// @param cb Where to store the blue chroma samples.
+/// @param cr Where to store the red chroma samples.
+static void ycc_scalar(const unsigned char* in, unsigned int channels, unsigned int count,
+                        unsigned char* y, unsigned char* cb, unsigned char* cr) {
+    for(unsigned int i = 0; i < count; i++, in += channels) {
+        int r = in[0];
+        int g = in[1];
+        int b = in[2];
+        y[i] = (unsigned char) ((FIX_R_Y * r + FIX_G_Y * g + FIX_B_Y * b + FIX_HALF) >> 16);
+        cb[i] = (unsigned char) ((FIX_R_CB * r + FIX_G_CB * g + (b << 15) + FIX_CHROMA) >> 16);
+        cr[i] = (unsigned char) (((r << 15) + FIX_G_CR * g + FIX_B_CR * b + FIX_CHROMA) >> 16);
+    }
+}
+
+/// @brief The downsample_scalar function averages each pair of samples, or
+///        each 2x2 square of samples, one output sample at a time. The
+///        rounding alternates between columns so that it does not drift, as
+///        libjpeg's does.
+/// @param top The upper row of samples.
+/// @param bottom The lower row of samples, or NULL to average pairs.
+/// @param x The first output sample.
+/// @param count The number of output samples.
+/// @param out Where to store the output samples.
+static void downsample_scalar(const unsigned char* top, const unsigned char* bottom,
+                                unsigned int x, unsigned int count, unsigned char* out) {
+    for(unsigned int i = x; i < x + count; i++) {
+        if(bottom == NULL)
+            out[i] = (unsigned char) ((top[2 * i] + top[2 * i + 1] + (i & 1)) >> 1);
+        else
+            out[i] = (unsigned char) ((top[2 * i] + top[2 * i + 1] + bottom[2 * i] +
+                                        bottom[2 * i + 1] + 1 + (i & 1)) >> 2);
+    }
+}
+
+#ifdef CPU_X86
+/// @brief The ycc_half_sse2 function converts 8 pixels from RGB to YCbCr, not
+///        yet narrowed to 8 bits.
+/// @param r The red samples, then the luma samples.
+/// @param g The green samples, then the blue chroma samples.
+/// @param b The blue samples, then the red chroma samples.
+__attribute__((target("sse2")))
+static inline void ycc_half_sse2(__m128i* r, __m128i* g, __m128i* b) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i half = _mm_set1_epi32(FIX_HALF);
+    const __m128i chroma = _mm_set1_epi32(FIX_CHROMA);
+    __m128i rg_lo = _mm_unpacklo_epi16(*r, *g), rg_hi = _mm_unpackhi_epi16(*r, *g);
+    __m128i bg_lo = _mm_unpacklo_epi16(*b, *g), bg_hi = _mm_unpackhi_epi16(*b, *g);
+    __m128i gb_lo = _mm_unpacklo_epi16(*g, *b), gb_hi = _mm_unpackhi_epi16(*g, *b);
+
+    // a sample in the high half of each lane, shifted down one, is the sample times 0.5
+    __m128i r_lo = _mm_srli_epi32(_mm_unpacklo_epi16(zero, *r), 1);
+    __m128i r_hi = _mm_srli_epi32(_mm_unpackhi_epi16(zero, *r), 1);
+    __m128i b_lo = _mm_srli_epi32(_mm_unpacklo_epi16(zero, *b), 1);
+    __m128i b_hi = _mm_srli_epi32(_mm_unpackhi_epi16(zero, *b), 1);
+
+    __m128i k = pair_sse2(FIX_R_Y, FIX_G_Y_LO);
+    __m128i kb = pair_sse2(FIX_B_Y, FIX_G_Y_HI);
+    __m128i y_lo = _mm_add_epi32(_mm_add_epi32(_mm_madd_epi16(rg_lo, k), _mm_madd_epi16(bg_lo, kb)), half);
+    __m128i y_hi = _mm_add_epi32(_mm_add_epi32(_mm_madd_epi16(rg_hi, k), _mm_madd_epi16(bg_hi, kb)), half);
+    k = pair_sse2(FIX_R_CB, FIX_G_CB);
+    __m128i cb_lo = _mm_add_epi32(_mm_add_epi32(_mm_madd_epi16(rg_lo, k), b_lo), chroma);
+    __m128i cb_hi = _mm_add_epi32(_mm_add_epi32(_mm_madd_epi16(rg_hi, k), b_hi), chroma);
+    k = pair_sse2(FIX_G_CR, FIX_B_CR);
+    __m128i cr_lo = _mm_add_epi32(_mm_add_epi32(_mm_madd_epi16(gb_lo, k), r_lo), chroma);
+    __m128i cr_hi = _mm_add_epi32(_mm_add_epi32(_mm_madd_epi16(gb_hi, k), r_hi), chroma);
+
+    *r = _mm_packs_epi32(_mm_srli_epi32(y_lo, 16), _mm_srli_epi32(y_hi, 16));
+    *g = _mm_packs_epi32(_mm_srli_epi32(cb_lo, 16), _mm_srli_epi32(cb_hi, 16));
+    *b = _mm_packs_epi32(_mm_srli_epi32(cr_lo, 16), _mm_srli_epi32(cr_hi, 16));
+}
+
+/// @brief The ycc_ssse3 function converts RGB pixels to YCbCr 16 at a time,
+///        leaving the pixels past the last whole 16.
+/// @param in The first pixel.
+/// @param channels The samples in each pixel, 3 for RGB or 4 for RGBA.
+/// @param width The number of pixels.
+/// @param y Where to store the luma samples.
+/// @param cb Where to store the blue chroma samples.
+/// @param cr Where to store the red chroma samples.
+/// @return The number of pixels converted.
+__attribute__((target("ssse3")))
+static unsigned int ycc_ssse3(const unsigned char* in, unsigned int channels, unsigned int width,
+                                unsigned char* y, unsigned char* cb, unsigned char* cr) {
+    const __m128i zero = _mm_setzero_si128();
+    unsigned int x = 0;
+
+    for(; x + 16 <= width; x += 16) {
+        const unsigned char* p = in + (size_t) x * channels;
+        __m128i r, g, b;
+        if(channels == 3) {
+            // gather each channel from the three loads its samples are spread over
+            __m128i p0 = _mm_loadu_si128((const __m128i*) p);
+            __m128i p1 = _mm_loadu_si128((const __m128i*) (p + 16));
+            __m128i p2 = _mm_loadu_si128((const __m128i*) (p + 32));
+            r = _mm_or_si128(_mm_or_si128(
+                _mm_shuffle_epi8(p0, _mm_setr_epi8(0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1)),
+                _mm_shuffle_epi8(p1, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14, -1, -1, -1, -1, -1))),
+                _mm_shuffle_epi8(p2, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 1, 4, 7, 10, 13)));
+            g = _mm_or_si128(_mm_or_si128(
+                _mm_shuffle_epi8(p0, _mm_setr_epi8(1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1)),
+                _mm_shuffle_epi8(p1, _mm_setr_epi8(-1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1))),
+                _mm_shuffle_epi8(p2, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14)));
+            b = _mm_or_si128(_mm_or_si128(
+                _mm_shuffle_epi8(p0, _mm_setr_epi8(2, 5, 8, 11, 14, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1)),
+                _mm_shuffle_epi8(p1, _mm_setr_epi8(-1, -1, -1, -1, -1, 1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1))),
+                _mm_shuffle_epi8(p2, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15)));
+        } else {
+            // group the channels of every four pixels, then gather the groups
+            const __m128i group = _mm_setr_epi8(0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15);
+            __m128i c0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*) p), group);
+            __m128i c1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*) (p + 16)), group);
+            __m128i c2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*) (p + 32)), group);
+            __m128i c3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*) (p + 48)), group);
+            __m128i t0 = _mm_unpacklo_epi32(c0, c1);
+            __m128i t1 = _mm_unpackhi_epi32(c0, c1);
+            __m128i t2 = _mm_unpacklo_epi32(c2, c3);
+            __m128i t3 = _mm_unpackhi_epi32(c2, c3);
+            r = _mm_unpacklo_epi64(t0, t2);
+            g = _mm_unpackhi_epi64(t0, t2);
+            b = _mm_unpacklo_epi64(t1, t3);
+        }
+
+        __m128i r_lo = _mm_unpacklo_epi8(r, zero), r_hi = _mm_unpackhi_epi8(r, zero);
+        __m128i g_lo = _mm_unpacklo_epi8(g, zero), g_hi = _mm_unpackhi_epi8(g, zero);
+        __m128i b_lo = _mm_unpacklo_epi8(b, zero), b_hi = _mm_unpackhi_epi8(b, zero);
+        ycc_half_sse2(&r_lo, &g_lo, &b_lo);
+        ycc_half_sse2(&r_hi, &g_hi, &b_hi);
+        _mm_storeu_si128((__m128i*) (y + x), _mm_packus_epi16(r_lo, r_hi));
+        _mm_storeu_si128((__m128i*) (cb + x), _mm_packus_epi16(g_lo, g_hi));
+        _mm_storeu_si128((__m128i*) (cr + x), _mm_packus_epi16(b_lo, b_hi));
+    }
+
+    return x;
+}
+
+/// @brief The downsample_ssse3 function averages samples 16 output samples
+///        at a time, leaving the samples past the last whole 16.
+/// @param top The upper row of samples.
+/// @param bottom The lower row of samples, or NULL to average pairs.
+/// @param width The number of output samples.
+/// @param out Where to store the output samples.
+/// @return The number of output samples stored.
+__attribute__((target("ssse3")))
+static unsigned int downsample_ssse3(const unsigned char* top, const unsigned char* bottom,
+                                        unsigned int width, unsigned char* out) {
+    const __m128i ones = _mm_set1_epi8(1);
+    __m128i bias = bottom != NULL ? _mm_set1_epi32(0x00020001) : _mm_set1_epi32(0x00010000);
+    int shift = bottom != NULL ? 2 : 1;
+    unsigned int x = 0;
+
+    for(; x + 16 <= width; x += 16) {
+        // multiplying by ones and adding neighbours sums each pair
+        __m128i lo = _mm_maddubs_epi16(_mm_loadu_si128((const __m128i*) (top + 2 * x)), ones);
+        __m128i hi = _mm_maddubs_epi16(_mm_loadu_si128((const __m128i*) (top + 2 * x + 16)), ones);
+        if(bottom != NULL) {
+            lo = _mm_add_epi16(lo, _mm_maddubs_epi16(
+                                    _mm_loadu_si128((const __m128i*) (bottom + 2 * x)), ones));
+            hi = _mm_add_epi16(hi, _mm_maddubs_epi16(
+                                    _mm_loadu_si128((const __m128i*) (bottom + 2 * x + 16)), ones));
+        }
+        lo = _mm_srli_epi16(_mm_add_epi16(lo, bias), shift);
+        hi = _mm_srli_epi16(_mm_add_epi16(hi, bias), shift);
+        _mm_storeu_si128((__m128i*) (out + x), _mm_packus_epi16(lo, hi));
+    }
+
+    return x;
+}
+#endif
+
+/// @brief The color_ycc_row_isa function converts a row of RGB pixels to
+///        YCbCr planes, without going above the given instruction set.
+/// @param in The first pixel.
+/// @param channels The samples in each pixel, 3 for RGB or 4 for RGBA, whose
+///        alpha is ignored.
+/// @param width The number of pixels.
+/// @param y Where to store the luma samples.
+/// @param cb Where to store the blue chroma samples.
+/// @param cr Where to store the red chroma samples.
+/// @param isa The highest instruction set to use.
+void color_ycc_row_isa(const unsigned char* in, unsigned int channels, unsigned int width,
+                        unsigned char* y, unsigned char* cb, unsigned char* cr, COLOR_ISA isa) {
+    unsigned int x = 0;
+#ifdef CPU_X86
+    if(isa >= COLOR_SSSE3 && cpu_has_ssse3())
+        x = ycc_ssse3(in, channels, width, y, cb, cr);
+#else
+    (void) isa;
+#endif
+    ycc_scalar(in + (size_t) x * channels, channels, width - x, y + x, cb + x, cr + x);
+}
+
+/// @brief The color_ycc_row function converts a row of RGB pixels to YCbCr
+///        planes with the fastest kernels the CPU supports.
+/// @param in The first pixel.
+/// @param channels The samples in each pixel, 3 for RGB or 4 for RGBA, whose
+///        alpha is ignored.
+/// @param width The number of pixels.
+/// @param y Where to store the luma samples.
+/// @param cb Where to store the blue chroma samples.
+/// @param cr Where to store the red chroma samples.
+void color_ycc_row(const unsigned char* in, unsigned int channels, unsigned int width,
+                    unsigned char* y, unsigned char* cb, unsigned char* cr) {
+    color_ycc_row_isa(in, channels, width, y, cb, cr, COLOR_SSSE3);
+}
+
+/// @brief The color_downsample_row_isa function halves the horizontal, and
+///        optionally the vertical, resolution of a row of samples, without
+///        going above the given instruction set.
+/// @param top The upper row of samples, 2 * width long.
+/// @param bottom The lower row of samples, or NULL to halve only the
+///        horizontal resolution.
+/// @param width The number of output samples.
+/// @param out Where to store the output samples.
+/// @param isa The highest instruction set to use.
+void color_downsample_row_isa(const unsigned char* top, const unsigned char* bottom,
+                                unsigned int width, unsigned char* out, COLOR_ISA isa) {
+    unsigned int x = 0;
+#ifdef CPU_X86
+    if(isa >= COLOR_SSSE3 && cpu_has_ssse3())
+        x = downsample_ssse3(top, bottom, width, out);
+#else
+    (void) isa;
+#endif
+    downsample_scalar(top, bottom, x, width - x, out);
+}
+
+/// @brief The color_downsample_row function halves the horizontal, and
+///        optionally the vertical, resolution of a row of samples with the
+///        fastest kernels the CPU supports.
+/// @param top The upper row of samples, 2 * width long.
+/// @param bottom The lower row of samples, or NULL to halve only the
+///        horizontal resolution.
+/// @param width The number of output samples.
+/// @param out Where to store the output samples.
+void color_downsample_row(const unsigned char* top, const unsigned char* bottom,
+                            unsigned int width, unsigned char* out) {
+    color_downsample_row_isa(top, bottom, width, out, COLOR_SSSE3);
+}
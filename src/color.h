@@ -0,0 +1,70 @@
+///
+/// @file color.h
+/// @brief JPEG chroma resampling and color conversion header
+/// @author Sam Cordry
+
+#ifndef COLOR_H
+#define COLOR_H
+
+// include needed system libraries
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+/// @brief Color spaces a JPEG's components can be stored in
+typedef enum {
+    COLOR_GRAY, ///< one luma component
+    COLOR_RGB, ///< red, green and blue components
+    COLOR_YCBCR, ///< luma and two chroma components
+    COLOR_CMYK, ///< cyan, magenta, yellow and black, inverted as Adobe stores them
+    COLOR_YCCK ///< inverted CMYK with the cyan, magenta and yellow stored as YCbCr
+} COLOR_SPACE;
+
+/// @brief Ways subsampled components can be upsampled
+typedef enum {
+    COLOR_UPSAMPLE_FANCY, ///< triangle filter between sample centers, as libjpeg does
+    COLOR_UPSAMPLE_NEAREST ///< every sample repeated
+} COLOR_UPSAMPLE;
+
+/// @brief Instruction set levels the conversion kernels can be limited to
+typedef enum {
+    COLOR_SCALAR,
+    COLOR_SSSE3
+} COLOR_ISA;
+
+/// @brief One component's samples for a row of output. The rows read must
+///        have a sample before their first and after their last that repeat
+///        the samples at each end.
+typedef struct {
+    const unsigned char* near; ///< the component row the output row falls in
+    const unsigned char* far; ///< the next component row on the output row's side, when blending
+    unsigned char h; ///< horizontal upsampling factor, 1 or 2
+    bool fancy; ///< whether doubled samples are filtered rather than repeated
+    bool blend; ///< whether near and far are blended 3 to 1 to double vertically
+    bool upper; ///< whether the output row is the upper of the two near is blended into
+} COLOR_PLANE;
+
+/// @brief A row of output and the components it is converted from
+typedef struct {
+    COLOR_SPACE space; ///< color space of the components
+    COLOR_PLANE planes[4]; ///< each component, in frame order
+} COLOR_ROW;
+
+// conversion functions
+unsigned int color_channels(COLOR_SPACE space);
+unsigned int color_planes(COLOR_SPACE space);
+void color_convert_row_isa(const COLOR_ROW* row, unsigned int width, unsigned char* out,
+                            COLOR_ISA isa);
+void color_convert_row(const COLOR_ROW* row, unsigned int width, unsigned char* out);
+void color_ycc_row_isa(const unsigned char* in, unsigned int channels, unsigned int width,
+                        unsigned char* y, unsigned char* cb, unsigned char* cr, COLOR_ISA isa);
+void color_ycc_row(const unsigned char* in, unsigned int channels, unsigned int width,
+                    unsigned char* y, unsigned char* cb, unsigned char* cr);
+void color_downsample_row_isa(const unsigned char* top, const unsigned char* bottom,
+                                unsigned int width, unsigned char* out, COLOR_ISA isa);
+void color_downsample_row(const unsigned char* top, const unsigned char* bottom,
+                            unsigned int width, unsigned char* out);
+
+#endif
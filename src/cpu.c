@@ -0,0 +1,57 @@
+///
+/// @file cpu.c
+/// @brief CPU feature detection implementation
+/// @author Sam Cordry
+
+#include "cpu.h"
+
+/// @brief The cpu_has_sse2 function checks if the CPU supports SSE2.
+/// @return True if SSE2 is supported, false otherwise.
+bool cpu_has_sse2(void) {
+#ifdef CPU_X86
+    return __builtin_cpu_supports("sse2");
+#else
+    return false;
+#endif
+}
+
+/// @brief The cpu_has_ssse3 function checks if the CPU supports SSSE3.
+/// @return True if SSSE3 is supported, false otherwise.
+bool cpu_has_ssse3(void) {
+#ifdef CPU_X86
+    return __builtin_cpu_supports("ssse3");
+#else
+    return false;
+#endif
+}
+
+/// @brief The cpu_has_sse41 function checks if the CPU supports SSE4.1.
+/// @return True if SSE4.1 is supported, false otherwise.
+bool cpu_has_sse41(void) {
+#ifdef CPU_X86
+    return __builtin_cpu_supports("sse4.1");
+#else
+    return false;
+#endif
+}
+
+/// @brief The cpu_has_avx2 function checks if the CPU supports AVX2.
+/// @return True if AVX2 is supported, false otherwise.
+bool cpu_has_avx2(void) {
+#ifdef CPU_X86
+    return __builtin_cpu_supports("avx2");
+#else
+    return false;
+#endif
+}
+
+/// @brief The cpu_has_pclmul function checks if the CPU supports carry-less
+///        multiplication (PCLMULQDQ).
+/// @return True if PCLMULQDQ is supported, false otherwise.
+bool cpu_has_pclmul(void) {
+#ifdef CPU_X86
+    return __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1");
+#else
+    return false;
+#endif
+}
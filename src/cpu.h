@@ -0,0 +1,23 @@
+///
+/// @file cpu.h
+/// @brief CPU feature detection header
+/// @author Sam Cordry
+
+#ifndef CPU_H
+#define CPU_H
+
+#include <stdbool.h>
+
+// define CPU_X86 when x86 intrinsics and runtime detection are available
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CPU_X86 1
+#endif
+
+// feature checker functions
+bool cpu_has_sse2(void);
+bool cpu_has_ssse3(void);
+bool cpu_has_sse41(void);
+bool cpu_has_avx2(void);
+bool cpu_has_pclmul(void);
+
+#endif
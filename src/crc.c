@@ -3,42 +3,219 @@
 /// @brief CRC implementation
 /// @author PNG Specification
 
+#include <stdint.h>
+
 #include "crc.h"
+#include "crc_table.h"
+#include "cpu.h"
+
+#ifdef CPU_X86
+#include <immintrin.h>
+#endif
+
+/// @brief The minimum length for which carry-less folding beats slicing-by-8.
+#define CRC_PCLMUL_MIN 64
 
-// table to store already calculated CRC codes
-unsigned long crc_table[256];
+/// @brief The crc_update_bytes function is the reference byte-at-a-time loop.
+/// @param crc The running CRC register.
+/// @param buf The data to add to the CRC.
+/// @param len The length of the data.
+/// @return The updated CRC register.
+unsigned long crc_update_bytes(unsigned long crc, const unsigned char* buf, size_t len) {
+    uint32_t c = (uint32_t) crc;
 
-// tracks whether the table has been computed
-bool crc_table_computed = false;
+    for(size_t n = 0; n < len; n++)
+        c = crc_table[0][(c ^ buf[n]) & 0xff] ^ (c >> 8);
+
+    return c;
+}
+
+/// @brief The crc_update_slice8 function processes eight bytes per step using
+///        the slicing-by-8 tables.
+/// @param crc The running CRC register.
+/// @param buf The data to add to the CRC.
+/// @param len The length of the data.
+/// @return The updated CRC register.
+unsigned long crc_update_slice8(unsigned long crc, const unsigned char* buf, size_t len) {
+    uint32_t c = (uint32_t) crc;
+
+    // fold eight bytes at a time, assembled little-endian so any host works
+    while(len >= 8) {
+        uint32_t lo = c ^ ((uint32_t) buf[0] | ((uint32_t) buf[1] << 8) |
+                            ((uint32_t) buf[2] << 16) | ((uint32_t) buf[3] << 24));
+        uint32_t hi = (uint32_t) buf[4] | ((uint32_t) buf[5] << 8) |
+                            ((uint32_t) buf[6] << 16) | ((uint32_t) buf[7] << 24);
+        c = crc_table[7][lo & 0xff] ^ crc_table[6][(lo >> 8) & 0xff] ^
+            crc_table[5][(lo >> 16) & 0xff] ^ crc_table[4][lo >> 24] ^
+            crc_table[3][hi & 0xff] ^ crc_table[2][(hi >> 8) & 0xff] ^
+            crc_table[1][(hi >> 16) & 0xff] ^ crc_table[0][hi >> 24];
+        buf += 8;
+        len -= 8;
+    }
 
-void make_crc_table(void) {
-    unsigned long c;
-    int n, k;
+    return crc_update_bytes(c, buf, len);
+}
+
+#ifdef CPU_X86
+/// @brief The crc_fold_pclmul function folds a multiple of 16 bytes (at least
+///        64) into the CRC register with carry-less multiplication.
+/// @param crc The running CRC register.
+/// @param buf The data to add to the CRC.
+/// @param len The length of the data, a multiple of 16 and at least 64.
+/// @return The updated CRC register.
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t crc_fold_pclmul(uint32_t crc, const unsigned char* buf, size_t len) {
+    // folding constants for the reflected PNG polynomial
+    const __m128i k1k2 = _mm_set_epi64x(0x01c6e41596LL, 0x0154442bd4LL);
+    const __m128i k3k4 = _mm_set_epi64x(0x00ccaa009eLL, 0x01751997d0LL);
+    const __m128i k5k0 = _mm_set_epi64x(0x0000000000LL, 0x0163cd6124LL);
+    const __m128i poly = _mm_set_epi64x(0x01f7011641LL, 0x01db710641LL);
+    const __m128i mask = _mm_setr_epi32(~0, 0, ~0, 0);
+    __m128i x1, x2, x3, x4, x5, x6, x7, x8;
+
+    // load the first 64 bytes and mix in the running register
+    x1 = _mm_loadu_si128((const __m128i*) (buf + 0x00));
+    x2 = _mm_loadu_si128((const __m128i*) (buf + 0x10));
+    x3 = _mm_loadu_si128((const __m128i*) (buf + 0x20));
+    x4 = _mm_loadu_si128((const __m128i*) (buf + 0x30));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int) crc));
+    buf += 64;
+    len -= 64;
+
+    // fold four lanes of 128 bits forward by 512 bits per step
+    while(len >= 64) {
+        x5 = _mm_clmulepi64_si128(x1, k1k2, 0x00);
+        x6 = _mm_clmulepi64_si128(x2, k1k2, 0x00);
+        x7 = _mm_clmulepi64_si128(x3, k1k2, 0x00);
+        x8 = _mm_clmulepi64_si128(x4, k1k2, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, k1k2, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, k1k2, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, k1k2, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, k1k2, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128((const __m128i*) (buf + 0x00)));
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128((const __m128i*) (buf + 0x10)));
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128((const __m128i*) (buf + 0x20)));
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128((const __m128i*) (buf + 0x30)));
+        buf += 64;
+        len -= 64;
+    }
+
+    // fold the four lanes into one
+    x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+    x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+    x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+    // fold any remaining 128-bit blocks
+    while(len >= 16) {
+        x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128((const __m128i*) buf));
+        buf += 16;
+        len -= 16;
+    }
 
-    for(n = 0; n < 256; n++) {
-        c = (unsigned long) n;
-        for(k = 0; k < 8; k++) {
-            if(c & 1)
-                c = 0xedb88320L ^ (c >> 1);
-            else
-                c = c >> 1;
+    // fold 128 bits down to 64 bits
+    x2 = _mm_clmulepi64_si128(x1, k3k4, 0x10);
+    x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, mask);
+    x1 = _mm_clmulepi64_si128(x1, k5k0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    // Barrett reduction down to 32 bits
+    x2 = _mm_and_si128(x1, mask);
+    x2 = _mm_clmulepi64_si128(x2, poly, 0x10);
+    x2 = _mm_and_si128(x2, mask);
+    x2 = _mm_clmulepi64_si128(x2, poly, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    return (uint32_t) _mm_extract_epi32(x1, 1);
+}
+#endif
+
+/// @brief The crc_update_pclmul function folds the data with PCLMULQDQ and
+///        finishes the unaligned tail with slicing-by-8.
+/// @param crc The running CRC register.
+/// @param buf The data to add to the CRC.
+/// @param len The length of the data.
+/// @return The updated CRC register.
+unsigned long crc_update_pclmul(unsigned long crc, const unsigned char* buf, size_t len) {
+#ifdef CPU_X86
+    if(len >= CRC_PCLMUL_MIN && cpu_has_pclmul()) {
+        size_t chunk = len & ~(size_t) 15;
+        crc = crc_fold_pclmul((uint32_t) crc, buf, chunk);
+        buf += chunk;
+        len -= chunk;
+    }
+#endif
+    return crc_update_slice8(crc, buf, len);
+}
+
+/// @brief The crc_update function picks the fastest available path.
+/// @param crc The running CRC register.
+/// @param buf The data to add to the CRC.
+/// @param len The length of the data.
+/// @return The updated CRC register.
+unsigned long crc_update(unsigned long crc, const unsigned char* buf, size_t len) {
+    if(len >= CRC_PCLMUL_MIN)
+        return crc_update_pclmul(crc, buf, len);
+    if(len >= 8)
+        return crc_update_slice8(crc, buf, len);
+    return crc_update_bytes(crc, buf, len);
+}
+
+/// @brief The crc_multiply function multiplies two polynomials modulo the CRC
+///        polynomial, both in reflected bit order.
+/// @param a The first polynomial.
+/// @param b The second polynomial.
+/// @return The product modulo the CRC polynomial.
+static uint32_t crc_multiply(uint32_t a, uint32_t b) {
+    uint32_t m = (uint32_t) 1 << 31;
+    uint32_t p = 0;
+
+    while(m != 0) {
+        if(a & m) {
+            p ^= b;
+            if((a & (m - 1)) == 0)
+                break;
         }
-        crc_table[n] = c;
+        m >>= 1;
+        b = (b & 1) ? (b >> 1) ^ 0xedb88320 : b >> 1;
+    }
+
+    return p;
+}
+
+/// @brief The crc_combine function computes the CRC of two adjacent ranges
+///        from their separate CRCs, without touching the data again.
+/// @param crc1 The finished CRC of the first range.
+/// @param crc2 The finished CRC of the second range.
+/// @param len2 The length of the second range.
+/// @return The finished CRC of both ranges back to back.
+unsigned long crc_combine(unsigned long crc1, unsigned long crc2, size_t len2) {
+    // build x^(8 * len2) from the table of repeated squares
+    uint32_t shift = (uint32_t) 1 << 31;
+    unsigned int k = 3;
+    while(len2 != 0) {
+        if(len2 & 1)
+            shift = crc_multiply(crc_x2n_table[k & 31], shift);
+        len2 >>= 1;
+        k++;
     }
-    crc_table_computed = true;
+
+    return crc_multiply(shift, (uint32_t) crc1) ^ (uint32_t) crc2;
 }
 
 unsigned long update_crc(unsigned long crc, unsigned char* buf, int len) {
-    unsigned long c = crc;
-    int n;
-
-    if(!crc_table_computed)
-        make_crc_table();
-    
-    for(n = 0; n < len; n++)
-        c = crc_table[(c ^ buf[n]) & 0xff] ^ (c >> 8);
-    
-    return c;
+    if(len <= 0)
+        return crc;
+    return crc_update(crc, buf, (size_t) len);
 }
 
 unsigned long crc(unsigned char* buf, int len) {
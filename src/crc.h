@@ -7,10 +7,17 @@
 #define CRC_H
 
 #include <stdbool.h>
+#include <stddef.h>
 
 // CRC functions
-void make_crc_table(void);
 unsigned long update_crc(unsigned long crc, unsigned char* buf, int len);
 unsigned long crc(unsigned char* buf, int len);
 
+// CRC engine paths, all operating on the raw (non-inverted) register
+unsigned long crc_update_bytes(unsigned long crc, const unsigned char* buf, size_t len);
+unsigned long crc_update_slice8(unsigned long crc, const unsigned char* buf, size_t len);
+unsigned long crc_update_pclmul(unsigned long crc, const unsigned char* buf, size_t len);
+unsigned long crc_update(unsigned long crc, const unsigned char* buf, size_t len);
+unsigned long crc_combine(unsigned long crc1, unsigned long crc2, size_t len2);
+
 #endif
@@ -0,0 +1,987 @@
+///
+/// @file dct.c
+/// @brief JPEG forward and inverse DCT and quantization implementation
+/// @author Sam Cordry
+
+#include "dct.h"
+#include "cpu.h"
+
+#ifdef CPU_X86
+#include <immintrin.h>
+#endif
+
+// Both transforms are the Loeffler, Ligtenberg and Moschytz factorization with
+// 13-bit fixed-point constants, as in the IJG accurate integer DCTs. The first
+// pass keeps 2 extra bits of precision, and the second pass removes them. The
+// IDCT also removes the 8x scale of the two passes, while the forward DCT
+// leaves it for quantization to divide out.
+#define CONST_BITS 13
+#define PASS1_BITS 2
+
+#define FIX_0_298631336 2446
+#define FIX_0_390180644 3196
+#define FIX_0_541196100 4433
+#define FIX_0_765366865 6270
+#define FIX_0_899976223 7373
+#define FIX_1_175875602 9633
+#define FIX_1_501321110 12299
+#define FIX_1_847759065 15137
+#define FIX_1_961570560 16069
+#define FIX_2_053119869 16819
+#define FIX_2_562915447 20995
+#define FIX_3_072711026 25172
+
+/// @brief The dct_prepare_quant function turns a quantization table into the
+///        multipliers the IDCT kernels dequantize with.
+/// @param quant The quantization table in natural order.
+/// @param table The 64 multipliers to fill.
+void dct_prepare_quant(const uint16_t* quant, int16_t* table) {
+    for(int i = 0; i < 64; i++)
+        table[i] = (int16_t) (quant[i] > INT16_MAX ? INT16_MAX : quant[i]);
+}
+
+/// @brief The dct_prepare_divisors function finds the reciprocals that
+///        quantize forward DCT results, which still carry the 8x scale of
+///        the transform, as libjpeg-turbo does.
+/// @param quant The quantization table in natural order, with entries from 1
+///        to 255.
+/// @param div The reciprocals to fill.
+void dct_prepare_divisors(const uint16_t* quant, DCT_DIVISORS* div) {
+    for(int i = 0; i < 64; i++) {
+        uint32_t divisor = (uint32_t) (quant[i] < 1 ? 1 : quant[i] > 255 ? 255 : quant[i]) * 8;
+        int bits = 0;
+        while((divisor >> (bits + 1)) != 0)
+            bits++;
+
+        // the reciprocal keeps 16 significant bits, rounded so that adding
+        // half the divisor still rounds every quotient to nearest
+        int shift = 16 + bits;
+        uint32_t recip = (1u << shift) / divisor;
+        uint32_t rest = (1u << shift) % divisor;
+        uint32_t corr = divisor / 2;
+        if(rest == 0) {
+            recip >>= 1;
+            shift--;
+        } else if(rest <= divisor / 2)
+            corr++;
+        else
+            recip++;
+        div->recip[i] = (uint16_t) recip;
+        div->corr[i] = (uint16_t) corr;
+        div->scale[i] = (uint16_t) (1u << (32 - shift));
+    }
+}
+
+/// @brief The clamp_sample function limits a sample to the 8-bit range.
+/// @param value The sample.
+/// @return The limited sample.
+static inline unsigned char clamp_sample(int value) {
+    return (unsigned char) (value < 0 ? 0 : value > 255 ? 255 : value);
+}
+
+/// @brief The clamp_int16 function limits a first pass result to 16 bits, so
+///        that corrupt coefficients cannot overflow the second pass.
+/// @param value The result.
+/// @return The limited result.
+static inline int clamp_int16(int value) {
+    return value < INT16_MIN ? INT16_MIN : value > INT16_MAX ? INT16_MAX : value;
+}
+
+/// @brief The idct_dc function fills a block whose only nonzero coefficient
+///        is the DC, which the full transform would spread evenly.
+/// @param coeffs The coefficients of the block.
+/// @param quant The dequantization multipliers.
+/// @param out The top left sample of the block.
+/// @param stride The distance between rows of samples.
+static void idct_dc(const int16_t* coeffs, const int16_t* quant, unsigned char* out,
+                    size_t stride) {
+    int dc = coeffs[0] * quant[0];
+    unsigned char value = clamp_sample(((dc + 4) >> 3) + 128);
+
+    for(int y = 0; y < 8; y++)
+        memset(out + y * stride, value, 8);
+}
+
+/// @brief The idct_scalar function dequantizes and transforms one block a
+///        column and then a row at a time.
+/// @param coeffs The coefficients of the block.
+/// @param quant The dequantization multipliers.
+/// @param out The top left sample of the block.
+/// @param stride The distance between rows of samples.
+static void idct_scalar(const int16_t* coeffs, const int16_t* quant, unsigned char* out,
+                        size_t stride) {
+    int work[64];
+
+    // transform the columns, keeping PASS1_BITS of extra precision
+    for(int pass = 0; pass < 2; pass++) {
+        for(int i = 0; i < 8; i++) {
+            int in[8];
+            if(pass == 0) {
+                // dequantize in 16 bits, as the vector kernels do
+                for(int k = 0; k < 8; k++)
+                    in[k] = (int16_t) (coeffs[k * 8 + i] * quant[k * 8 + i]);
+            } else {
+                for(int k = 0; k < 8; k++)
+                    in[k] = work[i * 8 + k];
+            }
+
+            // a column with no AC coefficients is flat
+            if(pass == 0 && !(in[1] | in[2] | in[3] | in[4] | in[5] | in[6] | in[7])) {
+                for(int k = 0; k < 8; k++)
+                    work[k * 8 + i] = clamp_int16(in[0] * (1 << PASS1_BITS));
+                continue;
+            }
+
+            // even part
+            int z1 = (in[2] + in[6]) * FIX_0_541196100;
+            int tmp2 = z1 - in[6] * FIX_1_847759065;
+            int tmp3 = z1 + in[2] * FIX_0_765366865;
+            int tmp0 = (in[0] + in[4]) * (1 << CONST_BITS);
+            int tmp1 = (in[0] - in[4]) * (1 << CONST_BITS);
+            int tmp10 = tmp0 + tmp3;
+            int tmp13 = tmp0 - tmp3;
+            int tmp11 = tmp1 + tmp2;
+            int tmp12 = tmp1 - tmp2;
+
+            // odd part
+            tmp0 = in[7];
+            tmp1 = in[5];
+            tmp2 = in[3];
+            tmp3 = in[1];
+            z1 = tmp0 + tmp3;
+            int z2 = tmp1 + tmp2;
+            int z3 = tmp0 + tmp2;
+            int z4 = tmp1 + tmp3;
+            int z5 = (z3 + z4) * FIX_1_175875602;
+            tmp0 *= FIX_0_298631336;
+            tmp1 *= FIX_2_053119869;
+            tmp2 *= FIX_3_072711026;
+            tmp3 *= FIX_1_501321110;
+            z1 *= -FIX_0_899976223;
+            z2 *= -FIX_2_562915447;
+            z3 = z3 * -FIX_1_961570560 + z5;
+            z4 = z4 * -FIX_0_390180644 + z5;
+            tmp0 += z1 + z3;
+            tmp1 += z2 + z4;
+            tmp2 += z2 + z3;
+            tmp3 += z1 + z4;
+
+            // the first pass writes columns, the second writes centered samples
+            int result[8] = {
+                tmp10 + tmp3, tmp11 + tmp2, tmp12 + tmp1, tmp13 + tmp0,
+                tmp13 - tmp0, tmp12 - tmp1, tmp11 - tmp2, tmp10 - tmp3
+            };
+            if(pass == 0) {
+                int shift = CONST_BITS - PASS1_BITS;
+                for(int k = 0; k < 8; k++)
+                    work[k * 8 + i] = clamp_int16((result[k] + (1 << (shift - 1))) >> shift);
+            } else {
+                int shift = CONST_BITS + PASS1_BITS + 3;
+                for(int k = 0; k < 8; k++)
+                    out[i * stride + k] = clamp_sample(((result[k] + (1 << (shift - 1))) >> shift) + 128);
+            }
+        }
+    }
+}
+
+/// @brief The fdct_scalar function transforms one block of samples a row and
+///        then a column at a time and quantizes the results.
+/// @param in The top left sample of the block.
+/// @param stride The distance between rows of samples.
+/// @param div The quantization reciprocals.
+/// @param out The 64 quantized coefficients, in natural order.
+static void fdct_scalar(const unsigned char* in, size_t stride, const DCT_DIVISORS* div,
+                        int16_t* out) {
+    int work[64];
+
+    // center the samples
+    for(int y = 0; y < 8; y++)
+        for(int x = 0; x < 8; x++)
+            work[y * 8 + x] = in[y * stride + x] - 128;
+
+    // transform the rows, keeping PASS1_BITS of extra precision, then the columns
+    for(int pass = 0; pass < 2; pass++) {
+        for(int i = 0; i < 8; i++) {
+            int* d = pass == 0 ? work + i * 8 : work + i;
+            int step = pass == 0 ? 1 : 8;
+            int tmp0 = d[0] + d[7 * step];
+            int tmp7 = d[0] - d[7 * step];
+            int tmp1 = d[step] + d[6 * step];
+            int tmp6 = d[step] - d[6 * step];
+            int tmp2 = d[2 * step] + d[5 * step];
+            int tmp5 = d[2 * step] - d[5 * step];
+            int tmp3 = d[3 * step] + d[4 * step];
+            int tmp4 = d[3 * step] - d[4 * step];
+
+            // even part
+            int tmp10 = tmp0 + tmp3;
+            int tmp13 = tmp0 - tmp3;
+            int tmp11 = tmp1 + tmp2;
+            int tmp12 = tmp1 - tmp2;
+            int shift = pass == 0 ? CONST_BITS - PASS1_BITS : CONST_BITS + PASS1_BITS;
+            int round = 1 << (shift - 1);
+            if(pass == 0) {
+                d[0] = (tmp10 + tmp11) * (1 << PASS1_BITS);
+                d[4 * step] = (tmp10 - tmp11) * (1 << PASS1_BITS);
+            } else {
+                d[0] = (tmp10 + tmp11 + (1 << (PASS1_BITS - 1))) >> PASS1_BITS;
+                d[4 * step] = (tmp10 - tmp11 + (1 << (PASS1_BITS - 1))) >> PASS1_BITS;
+            }
+            int z1 = (tmp12 + tmp13) * FIX_0_541196100;
+            d[2 * step] = (z1 + tmp13 * FIX_0_765366865 + round) >> shift;
+            d[6 * step] = (z1 - tmp12 * FIX_1_847759065 + round) >> shift;
+
+            // odd part
+            z1 = tmp4 + tmp7;
+            int z2 = tmp5 + tmp6;
+            int z3 = tmp4 + tmp6;
+            int z4 = tmp5 + tmp7;
+            int z5 = (z3 + z4) * FIX_1_175875602;
+            tmp4 *= FIX_0_298631336;
+            tmp5 *= FIX_2_053119869;
+            tmp6 *= FIX_3_072711026;
+            tmp7 *= FIX_1_501321110;
+            z1 *= -FIX_0_899976223;
+            z2 *= -FIX_2_562915447;
+            z3 = z3 * -FIX_1_961570560 + z5;
+            z4 = z4 * -FIX_0_390180644 + z5;
+            d[7 * step] = (tmp4 + z1 + z3 + round) >> shift;
+            d[5 * step] = (tmp5 + z2 + z4 + round) >> shift;
+            d[3 * step] = (tmp6 + z2 + z3 + round) >> shift;
+            d[step] = (tmp7 + z1 + z4 + round) >> shift;
+        }
+    }
+
+    // divide by the quantization step, rounding to nearest
+    for(int i = 0; i < 64; i++) {
+        int value = work[i];
+        uint32_t magnitude = (uint32_t) (value < 0 ? -value : value) + div->corr[i];
+        magnitude = (((magnitude * div->recip[i]) >> 16) * div->scale[i]) >> 16;
+        out[i] = (int16_t) (value < 0 ? -(int) magnitude : (int) magnitude);
+    }
+}
+
+#ifdef CPU_X86
+/// @brief The pair_sse2 function builds the multiplier pair for rotate_sse2.
+/// @param a The multiplier of the first input.
+/// @param b The multiplier of the second input.
+/// @return The pair, repeated in every 32-bit lane.
+__attribute__((target("sse2")))
+static inline __m128i pair_sse2(int a, int b) {
+    return _mm_set1_epi32((int) (((uint32_t) (uint16_t) b << 16) | (uint16_t) a));
+}
+
+/// @brief The rotate_sse2 function finds a * ka + b * kb in 32 bits for eight
+///        lanes with one multiply-add per half.
+/// @param a The first input.
+/// @param b The second input.
+/// @param k The multipliers from pair_sse2.
+/// @param lo Set to the results of the low four lanes.
+/// @param hi Set to the results of the high four lanes.
+__attribute__((target("sse2")))
+static inline void rotate_sse2(__m128i a, __m128i b, __m128i k, __m128i* lo, __m128i* hi) {
+    *lo = _mm_madd_epi16(_mm_unpacklo_epi16(a, b), k);
+    *hi = _mm_madd_epi16(_mm_unpackhi_epi16(a, b), k);
+}
+
+/// @brief The idct_1d_sse2 function transforms eight columns at once, each
+///        register holding one row, and descales the results back to 16 bits.
+/// @param x The eight rows, replaced with the results.
+/// @param shift The number of bits to descale by.
+/// @param round The rounding and centering bias added before descaling.
+__attribute__((target("sse2")))
+static inline void idct_1d_sse2(__m128i* x, int shift, __m128i round) {
+    const __m128i zero = _mm_setzero_si128();
+    __m128i x4 = x[4];
+    __m128i x5 = x[5];
+    __m128i x6 = x[6];
+    __m128i x7 = x[7];
+    __m128i t0l, t0h, t1l, t1h, t2l, t2h, t3l, t3h;
+
+    // even part
+    rotate_sse2(x[2], x6, pair_sse2(FIX_0_541196100 + FIX_0_765366865, FIX_0_541196100),
+                &t3l, &t3h);
+    rotate_sse2(x[2], x6, pair_sse2(FIX_0_541196100, FIX_0_541196100 - FIX_1_847759065),
+                &t2l, &t2h);
+    __m128i sum = _mm_add_epi16(x[0], x4);
+    __m128i diff = _mm_sub_epi16(x[0], x4);
+    t0l = _mm_srai_epi32(_mm_unpacklo_epi16(zero, sum), 16 - CONST_BITS);
+    t0h = _mm_srai_epi32(_mm_unpackhi_epi16(zero, sum), 16 - CONST_BITS);
+    t1l = _mm_srai_epi32(_mm_unpacklo_epi16(zero, diff), 16 - CONST_BITS);
+    t1h = _mm_srai_epi32(_mm_unpackhi_epi16(zero, diff), 16 - CONST_BITS);
+    __m128i t10l = _mm_add_epi32(t0l, t3l), t10h = _mm_add_epi32(t0h, t3h);
+    __m128i t13l = _mm_sub_epi32(t0l, t3l), t13h = _mm_sub_epi32(t0h, t3h);
+    __m128i t11l = _mm_add_epi32(t1l, t2l), t11h = _mm_add_epi32(t1h, t2h);
+    __m128i t12l = _mm_sub_epi32(t1l, t2l), t12h = _mm_sub_epi32(t1h, t2h);
+
+    // odd part, with each product of a sum folded into the multipliers
+    __m128i z3l, z3h, z4l, z4h;
+    __m128i z3 = _mm_add_epi16(x7, x[3]);
+    __m128i z4 = _mm_add_epi16(x5, x[1]);
+    rotate_sse2(z3, z4, pair_sse2(FIX_1_175875602 - FIX_1_961570560, FIX_1_175875602),
+                &z3l, &z3h);
+    rotate_sse2(z3, z4, pair_sse2(FIX_1_175875602, FIX_1_175875602 - FIX_0_390180644),
+                &z4l, &z4h);
+    rotate_sse2(x7, x[1], pair_sse2(FIX_0_298631336 - FIX_0_899976223, -FIX_0_899976223),
+                &t0l, &t0h);
+    rotate_sse2(x7, x[1], pair_sse2(-FIX_0_899976223, FIX_1_501321110 - FIX_0_899976223),
+                &t3l, &t3h);
+    rotate_sse2(x5, x[3], pair_sse2(FIX_2_053119869 - FIX_2_562915447, -FIX_2_562915447),
+                &t1l, &t1h);
+    rotate_sse2(x5, x[3], pair_sse2(-FIX_2_562915447, FIX_3_072711026 - FIX_2_562915447),
+                &t2l, &t2h);
+    t0l = _mm_add_epi32(t0l, z3l);
+    t0h = _mm_add_epi32(t0h, z3h);
+    t3l = _mm_add_epi32(t3l, z4l);
+    t3h = _mm_add_epi32(t3h, z4h);
+    t1l = _mm_add_epi32(t1l, z4l);
+    t1h = _mm_add_epi32(t1h, z4h);
+    t2l = _mm_add_epi32(t2l, z3l);
+    t2h = _mm_add_epi32(t2h, z3h);
+
+    // combine the two parts, then round and narrow back to 16 bits
+#define DESCALE_SSE2(l, h) _mm_packs_epi32(\
+        _mm_srai_epi32(_mm_add_epi32(l, round), shift),\
+        _mm_srai_epi32(_mm_add_epi32(h, round), shift))
+    x[0] = DESCALE_SSE2(_mm_add_epi32(t10l, t3l), _mm_add_epi32(t10h, t3h));
+    x[7] = DESCALE_SSE2(_mm_sub_epi32(t10l, t3l), _mm_sub_epi32(t10h, t3h));
+    x[1] = DESCALE_SSE2(_mm_add_epi32(t11l, t2l), _mm_add_epi32(t11h, t2h));
+    x[6] = DESCALE_SSE2(_mm_sub_epi32(t11l, t2l), _mm_sub_epi32(t11h, t2h));
+    x[2] = DESCALE_SSE2(_mm_add_epi32(t12l, t1l), _mm_add_epi32(t12h, t1h));
+    x[5] = DESCALE_SSE2(_mm_sub_epi32(t12l, t1l), _mm_sub_epi32(t12h, t1h));
+    x[3] = DESCALE_SSE2(_mm_add_epi32(t13l, t0l), _mm_add_epi32(t13h, t0h));
+    x[4] = DESCALE_SSE2(_mm_sub_epi32(t13l, t0l), _mm_sub_epi32(t13h, t0h));
+#undef DESCALE_SSE2
+}
+
+/// @brief The transpose_sse2 function transposes an 8x8 block of 16-bit
+///        values held one row per register.
+/// @param x The eight rows, replaced with the eight columns.
+__attribute__((target("sse2")))
+static inline void transpose_sse2(__m128i* x) {
+    __m128i a0 = _mm_unpacklo_epi16(x[0], x[1]);
+    __m128i a1 = _mm_unpackhi_epi16(x[0], x[1]);
+    __m128i a2 = _mm_unpacklo_epi16(x[2], x[3]);
+    __m128i a3 = _mm_unpackhi_epi16(x[2], x[3]);
+    __m128i a4 = _mm_unpacklo_epi16(x[4], x[5]);
+    __m128i a5 = _mm_unpackhi_epi16(x[4], x[5]);
+    __m128i a6 = _mm_unpacklo_epi16(x[6], x[7]);
+    __m128i a7 = _mm_unpackhi_epi16(x[6], x[7]);
+    __m128i b0 = _mm_unpacklo_epi32(a0, a2);
+    __m128i b1 = _mm_unpackhi_epi32(a0, a2);
+    __m128i b2 = _mm_unpacklo_epi32(a1, a3);
+    __m128i b3 = _mm_unpackhi_epi32(a1, a3);
+    __m128i b4 = _mm_unpacklo_epi32(a4, a6);
+    __m128i b5 = _mm_unpackhi_epi32(a4, a6);
+    __m128i b6 = _mm_unpacklo_epi32(a5, a7);
+    __m128i b7 = _mm_unpackhi_epi32(a5, a7);
+    x[0] = _mm_unpacklo_epi64(b0, b4);
+    x[1] = _mm_unpackhi_epi64(b0, b4);
+    x[2] = _mm_unpacklo_epi64(b1, b5);
+    x[3] = _mm_unpackhi_epi64(b1, b5);
+    x[4] = _mm_unpacklo_epi64(b2, b6);
+    x[5] = _mm_unpackhi_epi64(b2, b6);
+    x[6] = _mm_unpacklo_epi64(b3, b7);
+    x[7] = _mm_unpackhi_epi64(b3, b7);
+}
+
+/// @brief The idct_full_sse2 function dequantizes and transforms a block
+///        with coefficients anywhere in it, every column of a pass at once.
+/// @param coeffs The coefficients of the block.
+/// @param quant The dequantization multipliers.
+/// @param out The top left sample of the block.
+/// @param stride The distance between rows of samples.
+__attribute__((target("sse2")))
+static void idct_full_sse2(const int16_t* coeffs, const int16_t* quant, unsigned char* out,
+                            size_t stride) {
+    __m128i x[8];
+
+    // dequantize each row
+    for(int i = 0; i < 8; i++)
+        x[i] = _mm_mullo_epi16(_mm_loadu_si128((const __m128i*) (coeffs + i * 8)),
+                                _mm_loadu_si128((const __m128i*) (quant + i * 8)));
+
+    // columns, then rows, with the +128 centering folded into the rounding
+    idct_1d_sse2(x, CONST_BITS - PASS1_BITS, _mm_set1_epi32(1 << (CONST_BITS - PASS1_BITS - 1)));
+    transpose_sse2(x);
+    idct_1d_sse2(x, CONST_BITS + PASS1_BITS + 3,
+                    _mm_set1_epi32((1 << (CONST_BITS + PASS1_BITS + 2)) +
+                                    (128 << (CONST_BITS + PASS1_BITS + 3))));
+    transpose_sse2(x);
+
+    // saturate to 8 bits, two rows at a time
+    for(int i = 0; i < 8; i += 2) {
+        __m128i rows = _mm_packus_epi16(x[i], x[i + 1]);
+        _mm_storel_epi64((__m128i*) (out + i * stride), rows);
+        _mm_storel_epi64((__m128i*) (out + (i + 1) * stride), _mm_unpackhi_epi64(rows, rows));
+    }
+}
+
+/// @brief The idct_4_sse2 function transforms four lanes of a pass whose
+///        last four inputs are zero. With those gone, every output of the
+///        even and odd parts is a single multiply-add of two inputs.
+/// @param even Inputs 0 and 2, interleaved.
+/// @param odd Inputs 1 and 3, interleaved.
+/// @param shift The number of bits to descale by.
+/// @param round The rounding and centering bias added before descaling.
+/// @param y Set to the eight descaled results, in 32 bits.
+__attribute__((target("sse2")))
+static inline void idct_4_sse2(__m128i even, __m128i odd, int shift, __m128i round, __m128i* y) {
+    __m128i t10 = _mm_madd_epi16(even,
+                    pair_sse2(1 << CONST_BITS, FIX_0_541196100 + FIX_0_765366865));
+    __m128i t13 = _mm_madd_epi16(even,
+                    pair_sse2(1 << CONST_BITS, -FIX_0_541196100 - FIX_0_765366865));
+    __m128i t11 = _mm_madd_epi16(even, pair_sse2(1 << CONST_BITS, FIX_0_541196100));
+    __m128i t12 = _mm_madd_epi16(even, pair_sse2(1 << CONST_BITS, -FIX_0_541196100));
+    __m128i t0 = _mm_madd_epi16(odd, pair_sse2(FIX_1_175875602 - FIX_0_899976223,
+                                                FIX_1_175875602 - FIX_1_961570560));
+    __m128i t1 = _mm_madd_epi16(odd, pair_sse2(FIX_1_175875602 - FIX_0_390180644,
+                                                FIX_1_175875602 - FIX_2_562915447));
+    __m128i t2 = _mm_madd_epi16(odd, pair_sse2(FIX_1_175875602,
+                                                FIX_3_072711026 - FIX_2_562915447 +
+                                                FIX_1_175875602 - FIX_1_961570560));
+    __m128i t3 = _mm_madd_epi16(odd, pair_sse2(FIX_1_501321110 - FIX_0_899976223 +
+                                                FIX_1_175875602 - FIX_0_390180644,
+                                                FIX_1_175875602));
+
+    // combine the two parts, then round
+#define DESCALE_SSE2(v) _mm_srai_epi32(_mm_add_epi32(v, round), shift)
+    y[0] = DESCALE_SSE2(_mm_add_epi32(t10, t3));
+    y[7] = DESCALE_SSE2(_mm_sub_epi32(t10, t3));
+    y[1] = DESCALE_SSE2(_mm_add_epi32(t11, t2));
+    y[6] = DESCALE_SSE2(_mm_sub_epi32(t11, t2));
+    y[2] = DESCALE_SSE2(_mm_add_epi32(t12, t1));
+    y[5] = DESCALE_SSE2(_mm_sub_epi32(t12, t1));
+    y[3] = DESCALE_SSE2(_mm_add_epi32(t13, t0));
+    y[4] = DESCALE_SSE2(_mm_sub_epi32(t13, t0));
+#undef DESCALE_SSE2
+}
+
+/// @brief The idct_sparse_sse2 function transforms a block whose nonzero
+///        coefficients are all in its top left 4x4 corner. The first pass
+///        only needs its four nonzero columns, and the second only its four
+///        nonzero inputs.
+/// @param coeffs The coefficients of the block.
+/// @param quant The dequantization multipliers.
+/// @param out The top left sample of the block.
+/// @param stride The distance between rows of samples.
+__attribute__((target("sse2")))
+static void idct_sparse_sse2(const int16_t* coeffs, const int16_t* quant, unsigned char* out,
+                                size_t stride) {
+    __m128i x[8], y[8], z[8];
+
+    // dequantize the four nonzero rows
+    for(int i = 0; i < 4; i++)
+        x[i] = _mm_mullo_epi16(_mm_loadl_epi64((const __m128i*) (coeffs + i * 8)),
+                                _mm_loadl_epi64((const __m128i*) (quant + i * 8)));
+
+    // columns 0 to 3, narrowed back to 16 bits two rows to a register
+    idct_4_sse2(_mm_unpacklo_epi16(x[0], x[2]), _mm_unpacklo_epi16(x[1], x[3]),
+                CONST_BITS - PASS1_BITS, _mm_set1_epi32(1 << (CONST_BITS - PASS1_BITS - 1)), y);
+    __m128i r01 = _mm_packs_epi32(y[0], y[1]);
+    __m128i r23 = _mm_packs_epi32(y[2], y[3]);
+    __m128i r45 = _mm_packs_epi32(y[4], y[5]);
+    __m128i r67 = _mm_packs_epi32(y[6], y[7]);
+
+    // transpose the 8x4 result into four columns of eight
+    __m128i a0 = _mm_unpacklo_epi16(r01, r23);
+    __m128i a1 = _mm_unpackhi_epi16(r01, r23);
+    __m128i a2 = _mm_unpacklo_epi16(r45, r67);
+    __m128i a3 = _mm_unpackhi_epi16(r45, r67);
+    __m128i b0 = _mm_unpacklo_epi16(a0, a1);
+    __m128i b1 = _mm_unpackhi_epi16(a0, a1);
+    __m128i b2 = _mm_unpacklo_epi16(a2, a3);
+    __m128i b3 = _mm_unpackhi_epi16(a2, a3);
+    __m128i c0 = _mm_unpacklo_epi64(b0, b2);
+    __m128i c1 = _mm_unpackhi_epi64(b0, b2);
+    __m128i c2 = _mm_unpacklo_epi64(b1, b3);
+    __m128i c3 = _mm_unpackhi_epi64(b1, b3);
+
+    // rows, with the +128 centering folded into the rounding
+    __m128i round = _mm_set1_epi32((1 << (CONST_BITS + PASS1_BITS + 2)) +
+                                    (128 << (CONST_BITS + PASS1_BITS + 3)));
+    idct_4_sse2(_mm_unpacklo_epi16(c0, c2), _mm_unpacklo_epi16(c1, c3),
+                CONST_BITS + PASS1_BITS + 3, round, y);
+    idct_4_sse2(_mm_unpackhi_epi16(c0, c2), _mm_unpackhi_epi16(c1, c3),
+                CONST_BITS + PASS1_BITS + 3, round, z);
+    for(int i = 0; i < 8; i++)
+        x[i] = _mm_packs_epi32(y[i], z[i]);
+    transpose_sse2(x);
+
+    // saturate to 8 bits, two rows at a time
+    for(int i = 0; i < 8; i += 2) {
+        __m128i rows = _mm_packus_epi16(x[i], x[i + 1]);
+        _mm_storel_epi64((__m128i*) (out + i * stride), rows);
+        _mm_storel_epi64((__m128i*) (out + (i + 1) * stride), _mm_unpackhi_epi64(rows, rows));
+    }
+}
+
+/// @brief The fdct_1d_sse2 function transforms eight rows or columns at
+///        once, each register holding one input of all eight.
+/// @param x The eight inputs, replaced with the results.
+/// @param first True for the first pass, which scales up the even results
+///        rather than descaling them.
+__attribute__((target("sse2")))
+static inline void fdct_1d_sse2(__m128i* x, bool first) {
+    int shift = first ? CONST_BITS - PASS1_BITS : CONST_BITS + PASS1_BITS;
+    __m128i round = _mm_set1_epi32(1 << (shift - 1));
+    __m128i tmp0 = _mm_add_epi16(x[0], x[7]);
+    __m128i tmp7 = _mm_sub_epi16(x[0], x[7]);
+    __m128i tmp1 = _mm_add_epi16(x[1], x[6]);
+    __m128i tmp6 = _mm_sub_epi16(x[1], x[6]);
+    __m128i tmp2 = _mm_add_epi16(x[2], x[5]);
+    __m128i tmp5 = _mm_sub_epi16(x[2], x[5]);
+    __m128i tmp3 = _mm_add_epi16(x[3], x[4]);
+    __m128i tmp4 = _mm_sub_epi16(x[3], x[4]);
+    __m128i lo, hi, zl, zh;
+
+    // even part
+    __m128i tmp10 = _mm_add_epi16(tmp0, tmp3);
+    __m128i tmp13 = _mm_sub_epi16(tmp0, tmp3);
+    __m128i tmp11 = _mm_add_epi16(tmp1, tmp2);
+    __m128i tmp12 = _mm_sub_epi16(tmp1, tmp2);
+    if(first) {
+        x[0] = _mm_slli_epi16(_mm_add_epi16(tmp10, tmp11), PASS1_BITS);
+        x[4] = _mm_slli_epi16(_mm_sub_epi16(tmp10, tmp11), PASS1_BITS);
+    } else {
+        __m128i half = _mm_set1_epi16(1 << (PASS1_BITS - 1));
+        x[0] = _mm_srai_epi16(_mm_add_epi16(_mm_add_epi16(tmp10, tmp11), half), PASS1_BITS);
+        x[4] = _mm_srai_epi16(_mm_add_epi16(_mm_sub_epi16(tmp10, tmp11), half), PASS1_BITS);
+    }
+#define DESCALE_SSE2(l, h) _mm_packs_epi32(\
+        _mm_srai_epi32(_mm_add_epi32(l, round), shift),\
+        _mm_srai_epi32(_mm_add_epi32(h, round), shift))
+    rotate_sse2(tmp13, tmp12, pair_sse2(FIX_0_541196100 + FIX_0_765366865, FIX_0_541196100),
+                &lo, &hi);
+    x[2] = DESCALE_SSE2(lo, hi);
+    rotate_sse2(tmp13, tmp12, pair_sse2(FIX_0_541196100, FIX_0_541196100 - FIX_1_847759065),
+                &lo, &hi);
+    x[6] = DESCALE_SSE2(lo, hi);
+
+    // odd part, with each product of a sum folded into the multipliers
+    __m128i z3l, z3h, z4l, z4h;
+    __m128i z3 = _mm_add_epi16(tmp4, tmp6);
+    __m128i z4 = _mm_add_epi16(tmp5, tmp7);
+    rotate_sse2(z3, z4, pair_sse2(FIX_1_175875602 - FIX_1_961570560, FIX_1_175875602),
+                &z3l, &z3h);
+    rotate_sse2(z3, z4, pair_sse2(FIX_1_175875602, FIX_1_175875602 - FIX_0_390180644),
+                &z4l, &z4h);
+    rotate_sse2(tmp4, tmp7, pair_sse2(FIX_0_298631336 - FIX_0_899976223, -FIX_0_899976223),
+                &lo, &hi);
+    x[7] = DESCALE_SSE2(_mm_add_epi32(lo, z3l), _mm_add_epi32(hi, z3h));
+    rotate_sse2(tmp4, tmp7, pair_sse2(-FIX_0_899976223, FIX_1_501321110 - FIX_0_899976223),
+                &lo, &hi);
+    x[1] = DESCALE_SSE2(_mm_add_epi32(lo, z4l), _mm_add_epi32(hi, z4h));
+    rotate_sse2(tmp5, tmp6, pair_sse2(FIX_2_053119869 - FIX_2_562915447, -FIX_2_562915447),
+                &zl, &zh);
+    x[5] = DESCALE_SSE2(_mm_add_epi32(zl, z4l), _mm_add_epi32(zh, z4h));
+    rotate_sse2(tmp5, tmp6, pair_sse2(-FIX_2_562915447, FIX_3_072711026 - FIX_2_562915447),
+                &zl, &zh);
+    x[3] = DESCALE_SSE2(_mm_add_epi32(zl, z3l), _mm_add_epi32(zh, z3h));
+#undef DESCALE_SSE2
+}
+
+/// @brief The quantize_sse2 function divides eight forward DCT results by
+///        their quantization steps, rounding to nearest.
+/// @param x The results.
+/// @param div The quantization reciprocals.
+/// @param i The index of the first result.
+/// @return The quantized coefficients.
+__attribute__((target("sse2")))
+static inline __m128i quantize_sse2(__m128i x, const DCT_DIVISORS* div, int i) {
+    __m128i sign = _mm_srai_epi16(x, 15);
+    __m128i magnitude = _mm_sub_epi16(_mm_xor_si128(x, sign), sign);
+    magnitude = _mm_add_epi16(magnitude, _mm_loadu_si128((const __m128i*) (div->corr + i)));
+    magnitude = _mm_mulhi_epu16(magnitude, _mm_loadu_si128((const __m128i*) (div->recip + i)));
+    magnitude = _mm_mulhi_epu16(magnitude, _mm_loadu_si128((const __m128i*) (div->scale + i)));
+    return _mm_sub_epi16(_mm_xor_si128(magnitude, sign), sign);
+}
+
+/// @brief The fdct_sse2 function transforms and quantizes one block, every
+///        row of a pass at once.
+/// @param in The top left sample of the block.
+/// @param stride The distance between rows of samples.
+/// @param div The quantization reciprocals.
+/// @param out The 64 quantized coefficients, in natural order.
+__attribute__((target("sse2")))
+static void fdct_sse2(const unsigned char* in, size_t stride, const DCT_DIVISORS* div,
+                        int16_t* out) {
+    const __m128i center = _mm_set1_epi16(128);
+    __m128i x[8];
+
+    // center each row of samples
+    for(int i = 0; i < 8; i++)
+        x[i] = _mm_sub_epi16(_mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*) (in + i * stride)),
+                                                _mm_setzero_si128()), center);
+
+    // rows, then columns, which leaves the coefficients in natural order
+    transpose_sse2(x);
+    fdct_1d_sse2(x, true);
+    transpose_sse2(x);
+    fdct_1d_sse2(x, false);
+
+    for(int i = 0; i < 8; i++)
+        _mm_storeu_si128((__m128i*) (out + i * 8), quantize_sse2(x[i], div, i * 8));
+}
+
+/// @brief The pair_avx2 function builds the multiplier pair for rotate_avx2.
+/// @param a The multiplier of the first input.
+/// @param b The multiplier of the second input.
+/// @return The pair, repeated in every 32-bit lane.
+__attribute__((target("avx2")))
+static inline __m256i pair_avx2(int a, int b) {
+    return _mm256_set1_epi32((int) (((uint32_t) (uint16_t) b << 16) | (uint16_t) a));
+}
+
+/// @brief The rotate_avx2 function finds a * ka + b * kb in 32 bits for
+///        sixteen lanes with one multiply-add per half.
+/// @param a The first input.
+/// @param b The second input.
+/// @param k The multipliers from pair_avx2.
+/// @param lo Set to the results of the low four lanes of each block.
+/// @param hi Set to the results of the high four lanes of each block.
+__attribute__((target("avx2")))
+static inline void rotate_avx2(__m256i a, __m256i b, __m256i k, __m256i* lo, __m256i* hi) {
+    *lo = _mm256_madd_epi16(_mm256_unpacklo_epi16(a, b), k);
+    *hi = _mm256_madd_epi16(_mm256_unpackhi_epi16(a, b), k);
+}
+
+/// @brief The idct_1d_avx2 function is idct_1d_sse2 for two blocks at once,
+///        one in each 128-bit lane.
+/// @param x The eight rows of both blocks, replaced with the results.
+/// @param shift The number of bits to descale by.
+/// @param round The rounding and centering bias added before descaling.
+__attribute__((target("avx2")))
+static inline void idct_1d_avx2(__m256i* x, int shift, __m256i round) {
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i t0l, t0h, t1l, t1h, t2l, t2h, t3l, t3h;
+
+    // even part
+    rotate_avx2(x[2], x[6], pair_avx2(FIX_0_541196100 + FIX_0_765366865, FIX_0_541196100),
+                &t3l, &t3h);
+    rotate_avx2(x[2], x[6], pair_avx2(FIX_0_541196100, FIX_0_541196100 - FIX_1_847759065),
+                &t2l, &t2h);
+    __m256i sum = _mm256_add_epi16(x[0], x[4]);
+    __m256i diff = _mm256_sub_epi16(x[0], x[4]);
+    t0l = _mm256_srai_epi32(_mm256_unpacklo_epi16(zero, sum), 16 - CONST_BITS);
+    t0h = _mm256_srai_epi32(_mm256_unpackhi_epi16(zero, sum), 16 - CONST_BITS);
+    t1l = _mm256_srai_epi32(_mm256_unpacklo_epi16(zero, diff), 16 - CONST_BITS);
+    t1h = _mm256_srai_epi32(_mm256_unpackhi_epi16(zero, diff), 16 - CONST_BITS);
+    __m256i t10l = _mm256_add_epi32(t0l, t3l), t10h = _mm256_add_epi32(t0h, t3h);
+    __m256i t13l = _mm256_sub_epi32(t0l, t3l), t13h = _mm256_sub_epi32(t0h, t3h);
+    __m256i t11l = _mm256_add_epi32(t1l, t2l), t11h = _mm256_add_epi32(t1h, t2h);
+    __m256i t12l = _mm256_sub_epi32(t1l, t2l), t12h = _mm256_sub_epi32(t1h, t2h);
+
+    // odd part
+    __m256i z3l, z3h, z4l, z4h;
+    __m256i z3 = _mm256_add_epi16(x[7], x[3]);
+    __m256i z4 = _mm256_add_epi16(x[5], x[1]);
+    rotate_avx2(z3, z4, pair_avx2(FIX_1_175875602 - FIX_1_961570560, FIX_1_175875602),
+                &z3l, &z3h);
+    rotate_avx2(z3, z4, pair_avx2(FIX_1_175875602, FIX_1_175875602 - FIX_0_390180644),
+                &z4l, &z4h);
+    rotate_avx2(x[7], x[1], pair_avx2(FIX_0_298631336 - FIX_0_899976223, -FIX_0_899976223),
+                &t0l, &t0h);
+    rotate_avx2(x[7], x[1], pair_avx2(-FIX_0_899976223, FIX_1_501321110 - FIX_0_899976223),
+                &t3l, &t3h);
+    rotate_avx2(x[5], x[3], pair_avx2(FIX_2_053119869 - FIX_2_562915447, -FIX_2_562915447),
+                &t1l, &t1h);
+    rotate_avx2(x[5], x[3], pair_avx2(-FIX_2_562915447, FIX_3_072711026 - FIX_2_562915447),
+                &t2l, &t2h);
+    t0l = _mm256_add_epi32(t0l, z3l);
+    t0h = _mm256_add_epi32(t0h, z3h);
+    t3l = _mm256_add_epi32(t3l, z4l);
+    t3h = _mm256_add_epi32(t3h, z4h);
+    t1l = _mm256_add_epi32(t1l, z4l);
+    t1h = _mm256_add_epi32(t1h, z4h);
+    t2l = _mm256_add_epi32(t2l, z3l);
+    t2h = _mm256_add_epi32(t2h, z3h);
+
+    // combine the two parts, then round and narrow back to 16 bits
+#define DESCALE_AVX2(l, h) _mm256_packs_epi32(\
+        _mm256_srai_epi32(_mm256_add_epi32(l, round), shift),\
+        _mm256_srai_epi32(_mm256_add_epi32(h, round), shift))
+    x[0] = DESCALE_AVX2(_mm256_add_epi32(t10l, t3l), _mm256_add_epi32(t10h, t3h));
+    x[7] = DESCALE_AVX2(_mm256_sub_epi32(t10l, t3l), _mm256_sub_epi32(t10h, t3h));
+    x[1] = DESCALE_AVX2(_mm256_add_epi32(t11l, t2l), _mm256_add_epi32(t11h, t2h));
+    x[6] = DESCALE_AVX2(_mm256_sub_epi32(t11l, t2l), _mm256_sub_epi32(t11h, t2h));
+    x[2] = DESCALE_AVX2(_mm256_add_epi32(t12l, t1l), _mm256_add_epi32(t12h, t1h));
+    x[5] = DESCALE_AVX2(_mm256_sub_epi32(t12l, t1l), _mm256_sub_epi32(t12h, t1h));
+    x[3] = DESCALE_AVX2(_mm256_add_epi32(t13l, t0l), _mm256_add_epi32(t13h, t0h));
+    x[4] = DESCALE_AVX2(_mm256_sub_epi32(t13l, t0l), _mm256_sub_epi32(t13h, t0h));
+#undef DESCALE_AVX2
+}
+
+/// @brief The transpose_avx2 function transposes the 8x8 block in each
+///        128-bit lane.
+/// @param x The eight rows of both blocks, replaced with their columns.
+__attribute__((target("avx2")))
+static inline void transpose_avx2(__m256i* x) {
+    __m256i a0 = _mm256_unpacklo_epi16(x[0], x[1]);
+    __m256i a1 = _mm256_unpackhi_epi16(x[0], x[1]);
+    __m256i a2 = _mm256_unpacklo_epi16(x[2], x[3]);
+    __m256i a3 = _mm256_unpackhi_epi16(x[2], x[3]);
+    __m256i a4 = _mm256_unpacklo_epi16(x[4], x[5]);
+    __m256i a5 = _mm256_unpackhi_epi16(x[4], x[5]);
+    __m256i a6 = _mm256_unpacklo_epi16(x[6], x[7]);
+    __m256i a7 = _mm256_unpackhi_epi16(x[6], x[7]);
+    __m256i b0 = _mm256_unpacklo_epi32(a0, a2);
+    __m256i b1 = _mm256_unpackhi_epi32(a0, a2);
+    __m256i b2 = _mm256_unpacklo_epi32(a1, a3);
+    __m256i b3 = _mm256_unpackhi_epi32(a1, a3);
+    __m256i b4 = _mm256_unpacklo_epi32(a4, a6);
+    __m256i b5 = _mm256_unpackhi_epi32(a4, a6);
+    __m256i b6 = _mm256_unpacklo_epi32(a5, a7);
+    __m256i b7 = _mm256_unpackhi_epi32(a5, a7);
+    x[0] = _mm256_unpacklo_epi64(b0, b4);
+    x[1] = _mm256_unpackhi_epi64(b0, b4);
+    x[2] = _mm256_unpacklo_epi64(b1, b5);
+    x[3] = _mm256_unpackhi_epi64(b1, b5);
+    x[4] = _mm256_unpacklo_epi64(b2, b6);
+    x[5] = _mm256_unpackhi_epi64(b2, b6);
+    x[6] = _mm256_unpacklo_epi64(b3, b7);
+    x[7] = _mm256_unpackhi_epi64(b3, b7);
+}
+
+/// @brief The idct_pair_avx2 function dequantizes and transforms two blocks
+///        that sit side by side, one in each 128-bit lane.
+/// @param coeffs The coefficients of the left block, followed by the right.
+/// @param quant The dequantization multipliers.
+/// @param out The top left sample of the left block.
+/// @param stride The distance between rows of samples.
+__attribute__((target("avx2")))
+static void idct_pair_avx2(const int16_t* coeffs, const int16_t* quant, unsigned char* out,
+                            size_t stride) {
+    __m256i x[8];
+
+    // dequantize each row of both blocks
+    for(int i = 0; i < 8; i++) {
+        __m256i q = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*) (quant + i * 8)));
+        __m256i c = _mm256_inserti128_si256(
+                        _mm256_castsi128_si256(_mm_loadu_si128((const __m128i*) (coeffs + i * 8))),
+                        _mm_loadu_si128((const __m128i*) (coeffs + 64 + i * 8)), 1);
+        x[i] = _mm256_mullo_epi16(c, q);
+    }
+
+    // columns, then rows, with the +128 centering folded into the rounding
+    idct_1d_avx2(x, CONST_BITS - PASS1_BITS,
+                    _mm256_set1_epi32(1 << (CONST_BITS - PASS1_BITS - 1)));
+    transpose_avx2(x);
+    idct_1d_avx2(x, CONST_BITS + PASS1_BITS + 3,
+                    _mm256_set1_epi32((1 << (CONST_BITS + PASS1_BITS + 2)) +
+                                        (128 << (CONST_BITS + PASS1_BITS + 3))));
+    transpose_avx2(x);
+
+    // saturate to 8 bits and put each row of the left block beside the right's
+    for(int i = 0; i < 8; i += 2) {
+        __m256i rows = _mm256_permute4x64_epi64(_mm256_packus_epi16(x[i], x[i + 1]), 0xD8);
+        _mm_storeu_si128((__m128i*) (out + i * stride), _mm256_castsi256_si128(rows));
+        _mm_storeu_si128((__m128i*) (out + (i + 1) * stride), _mm256_extracti128_si256(rows, 1));
+    }
+}
+/// @brief The fdct_1d_avx2 function is fdct_1d_sse2 for two blocks at once,
+///        one in each 128-bit lane.
+/// @param x The eight inputs of both blocks, replaced with the results.
+/// @param first True for the first pass, which scales up the even results
+///        rather than descaling them.
+__attribute__((target("avx2")))
+static inline void fdct_1d_avx2(__m256i* x, bool first) {
+    int shift = first ? CONST_BITS - PASS1_BITS : CONST_BITS + PASS1_BITS;
+    __m256i round = _mm256_set1_epi32(1 << (shift - 1));
+    __m256i tmp0 = _mm256_add_epi16(x[0], x[7]);
+    __m256i tmp7 = _mm256_sub_epi16(x[0], x[7]);
+    __m256i tmp1 = _mm256_add_epi16(x[1], x[6]);
+    __m256i tmp6 = _mm256_sub_epi16(x[1], x[6]);
+    __m256i tmp2 = _mm256_add_epi16(x[2], x[5]);
+    __m256i tmp5 = _mm256_sub_epi16(x[2], x[5]);
+    __m256i tmp3 = _mm256_add_epi16(x[3], x[4]);
+    __m256i tmp4 = _mm256_sub_epi16(x[3], x[4]);
+    __m256i lo, hi, zl, zh;
+
+    // even part
+    __m256i tmp10 = _mm256_add_epi16(tmp0, tmp3);
+    __m256i tmp13 = _mm256_sub_epi16(tmp0, tmp3);
+    __m256i tmp11 = _mm256_add_epi16(tmp1, tmp2);
+    __m256i tmp12 = _mm256_sub_epi16(tmp1, tmp2);
+    if(first) {
+        x[0] = _mm256_slli_epi16(_mm256_add_epi16(tmp10, tmp11), PASS1_BITS);
+        x[4] = _mm256_slli_epi16(_mm256_sub_epi16(tmp10, tmp11), PASS1_BITS);
+    } else {
+        __m256i half = _mm256_set1_epi16(1 << (PASS1_BITS - 1));
+        x[0] = _mm256_srai_epi16(_mm256_add_epi16(_mm256_add_epi16(tmp10, tmp11), half),
+                                    PASS1_BITS);
+        x[4] = _mm256_srai_epi16(_mm256_add_epi16(_mm256_sub_epi16(tmp10, tmp11), half),
+                                    PASS1_BITS);
+    }
+#define DESCALE_AVX2(l, h) _mm256_packs_epi32(\
+        _mm256_srai_epi32(_mm256_add_epi32(l, round), shift),\
+        _mm256_srai_epi32(_mm256_add_epi32(h, round), shift))
+    rotate_avx2(tmp13, tmp12, pair_avx2(FIX_0_541196100 + FIX_0_765366865, FIX_0_541196100),
+                &lo, &hi);
+    x[2] = DESCALE_AVX2(lo, hi);
+    rotate_avx2(tmp13, tmp12, pair_avx2(FIX_0_541196100, FIX_0_541196100 - FIX_1_847759065),
+                &lo, &hi);
+    x[6] = DESCALE_AVX2(lo, hi);
+
+    // odd part
+    __m256i z3l, z3h, z4l, z4h;
+    __m256i z3 = _mm256_add_epi16(tmp4, tmp6);
+    __m256i z4 = _mm256_add_epi16(tmp5, tmp7);
+    rotate_avx2(z3, z4, pair_avx2(FIX_1_175875602 - FIX_1_961570560, FIX_1_175875602),
+                &z3l, &z3h);
+    rotate_avx2(z3, z4, pair_avx2(FIX_1_175875602, FIX_1_175875602 - FIX_0_390180644),
+                &z4l, &z4h);
+    rotate_avx2(tmp4, tmp7, pair_avx2(FIX_0_298631336 - FIX_0_899976223, -FIX_0_899976223),
+                &lo, &hi);
+    x[7] = DESCALE_AVX2(_mm256_add_epi32(lo, z3l), _mm256_add_epi32(hi, z3h));
+    rotate_avx2(tmp4, tmp7, pair_avx2(-FIX_0_899976223, FIX_1_501321110 - FIX_0_899976223),
+                &lo, &hi);
+    x[1] = DESCALE_AVX2(_mm256_add_epi32(lo, z4l), _mm256_add_epi32(hi, z4h));
+    rotate_avx2(tmp5, tmp6, pair_avx2(FIX_2_053119869 - FIX_2_562915447, -FIX_2_562915447),
+                &zl, &zh);
+    x[5] = DESCALE_AVX2(_mm256_add_epi32(zl, z4l), _mm256_add_epi32(zh, z4h));
+    rotate_avx2(tmp5, tmp6, pair_avx2(-FIX_2_562915447, FIX_3_072711026 - FIX_2_562915447),
+                &zl, &zh);
+    x[3] = DESCALE_AVX2(_mm256_add_epi32(zl, z3l), _mm256_add_epi32(zh, z3h));
+#undef DESCALE_AVX2
+}
+
+/// @brief The fdct_pair_avx2 function transforms and quantizes two blocks
+///        that sit side by side, one in each 128-bit lane.
+/// @param in The top left sample of the left block.
+/// @param stride The distance between rows of samples.
+/// @param div The quantization reciprocals.
+/// @param out The 64 quantized coefficients of the left block, followed by
+///        the right's.
+__attribute__((target("avx2")))
+static void fdct_pair_avx2(const unsigned char* in, size_t stride, const DCT_DIVISORS* div,
+                            int16_t* out) {
+    const __m256i center = _mm256_set1_epi16(128);
+    __m256i x[8];
+
+    // a row of 16 samples widens to a row of each block
+    for(int i = 0; i < 8; i++)
+        x[i] = _mm256_sub_epi16(_mm256_cvtepu8_epi16(
+                                    _mm_loadu_si128((const __m128i*) (in + i * stride))), center);
+
+    transpose_avx2(x);
+    fdct_1d_avx2(x, true);
+    transpose_avx2(x);
+    fdct_1d_avx2(x, false);
+
+    // quantize both halves with the same reciprocals
+    for(int i = 0; i < 8; i++) {
+        __m256i sign = _mm256_srai_epi16(x[i], 15);
+        __m256i magnitude = _mm256_sub_epi16(_mm256_xor_si256(x[i], sign), sign);
+        magnitude = _mm256_add_epi16(magnitude, _mm256_broadcastsi128_si256(
+                                        _mm_loadu_si128((const __m128i*) (div->corr + i * 8))));
+        magnitude = _mm256_mulhi_epu16(magnitude, _mm256_broadcastsi128_si256(
+                                        _mm_loadu_si128((const __m128i*) (div->recip + i * 8))));
+        magnitude = _mm256_mulhi_epu16(magnitude, _mm256_broadcastsi128_si256(
+                                        _mm_loadu_si128((const __m128i*) (div->scale + i * 8))));
+        __m256i q = _mm256_sub_epi16(_mm256_xor_si256(magnitude, sign), sign);
+        _mm_storeu_si128((__m128i*) (out + i * 8), _mm256_castsi256_si128(q));
+        _mm_storeu_si128((__m128i*) (out + 64 + i * 8), _mm256_extracti128_si256(q, 1));
+    }
+}
+#endif
+
+/// @brief The dct_idct_row_isa function dequantizes and transforms a row of
+///        blocks that sit side by side, without going above the given
+///        instruction set. Each block takes the cheapest path its last
+///        nonzero coefficient allows.
+/// @param coeffs The coefficients of the blocks, 64 per block in natural order.
+/// @param last One past the zigzag index of each block's last nonzero coefficient.
+/// @param count The number of blocks.
+/// @param quant The dequantization multipliers from dct_prepare_quant.
+/// @param out The top left sample of the first block.
+/// @param stride The distance between rows of samples.
+/// @param isa The highest instruction set to use.
+void dct_idct_row_isa(const int16_t* coeffs, const unsigned char* last, unsigned int count,
+                        const int16_t* quant, unsigned char* out, size_t stride, DCT_ISA isa) {
+    bool sse2 = false;
+    bool avx2 = false;
+#ifdef CPU_X86
+    sse2 = isa >= DCT_SSE2 && cpu_has_sse2();
+    avx2 = isa >= DCT_AVX2 && cpu_has_avx2();
+#else
+    (void) isa;
+#endif
+
+    for(unsigned int i = 0; i < count; i++) {
+        const int16_t* block = coeffs + (size_t) i * 64;
+        unsigned char* dest = out + (size_t) i * 8;
+
+        if(last[i] <= 1) {
+            idct_dc(block, quant, dest, stride);
+            continue;
+        }
+#ifdef CPU_X86
+        // two neighbours share the wide kernel, which beats even the sparse one
+        if(avx2 && i + 1 < count && last[i + 1] > 1) {
+            idct_pair_avx2(block, quant, dest, stride);
+            i++;
+            continue;
+        }
+        if(sse2) {
+            if(last[i] <= DCT_SPARSE_LAST)
+                idct_sparse_sse2(block, quant, dest, stride);
+            else
+                idct_full_sse2(block, quant, dest, stride);
+            continue;
+        }
+#endif
+        idct_scalar(block, quant, dest, stride);
+    }
+}
+
+/// @brief The dct_idct_row function dequantizes and transforms a row of
+///        blocks with the fastest kernels the CPU supports.
+/// @param coeffs The coefficients of the blocks, 64 per block in natural order.
+/// @param last One past the zigzag index of each block's last nonzero coefficient.
+/// @param count The number of blocks.
+/// @param quant The dequantization multipliers from dct_prepare_quant.
+/// @param out The top left sample of the first block.
+/// @param stride The distance between rows of samples.
+void dct_idct_row(const int16_t* coeffs, const unsigned char* last, unsigned int count,
+                    const int16_t* quant, unsigned char* out, size_t stride) {
+    dct_idct_row_isa(coeffs, last, count, quant, out, stride, DCT_AVX2);
+}
+
+/// @brief The dct_fdct_row_isa function transforms and quantizes a row of
+///        blocks that sit side by side, without going above the given
+///        instruction set.
+/// @param in The top left sample of the first block.
+/// @param stride The distance between rows of samples.
+/// @param count The number of blocks.
+/// @param div The quantization reciprocals from dct_prepare_divisors.
+/// @param out The coefficients of the blocks, 64 per block in natural order.
+/// @param isa The highest instruction set to use.
+void dct_fdct_row_isa(const unsigned char* in, size_t stride, unsigned int count,
+                        const DCT_DIVISORS* div, int16_t* out, DCT_ISA isa) {
+    unsigned int i = 0;
+#ifdef CPU_X86
+    if(isa >= DCT_AVX2 && cpu_has_avx2())
+        for(; i + 2 <= count; i += 2)
+            fdct_pair_avx2(in + (size_t) i * 8, stride, div, out + (size_t) i * 64);
+    if(isa >= DCT_SSE2 && cpu_has_sse2())
+        for(; i < count; i++)
+            fdct_sse2(in + (size_t) i * 8, stride, div, out + (size_t) i * 64);
+#else
+    (void) isa;
+#endif
+    for(; i < count; i++)
+        fdct_scalar(in + (size_t) i * 8, stride, div, out + (size_t) i * 64);
+}
+
+/// @brief The dct_fdct_row function transforms and quantizes a row of blocks
+///        with the fastest kernels the CPU supports.
+/// @param in The top left sample of the first block.
+/// @param stride The distance between rows of samples.
+/// @param count The number of blocks.
+/// @param div The quantization reciprocals from dct_prepare_divisors.
+/// @param out The coefficients of the blocks, 64 per block in natural order.
+void dct_fdct_row(const unsigned char* in, size_t stride, unsigned int count,
+                    const DCT_DIVISORS* div, int16_t* out) {
+    dct_fdct_row_isa(in, stride, count, div, out, DCT_AVX2);
+}
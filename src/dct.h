@@ -0,0 +1,49 @@
+///
+/// @file dct.h
+/// @brief JPEG forward and inverse DCT and quantization header
+/// @author Sam Cordry
+
+#ifndef DCT_H
+#define DCT_H
+
+// include needed system libraries
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+/// @brief Blocks whose coefficients all come before this zigzag index only
+///        have nonzero values in their top left 4x4 corner.
+#define DCT_SPARSE_LAST 10
+
+/// @brief Fixed-point reciprocals that divide forward DCT results by their
+///        quantization table entries with rounding, without a division
+typedef struct {
+    uint16_t recip[64]; ///< reciprocal of each divisor, scaled up to 16 bits
+    uint16_t corr[64]; ///< rounding added before multiplying by the reciprocal
+    uint16_t scale[64]; ///< multiplier that takes out the rest of the reciprocal's scale
+} DCT_DIVISORS;
+
+/// @brief Instruction set levels the DCT kernels can be limited to
+typedef enum {
+    DCT_SCALAR,
+    DCT_SSE2,
+    DCT_AVX2
+} DCT_ISA;
+
+// table functions
+void dct_prepare_quant(const uint16_t* quant, int16_t* table);
+void dct_prepare_divisors(const uint16_t* quant, DCT_DIVISORS* div);
+
+// transform functions
+void dct_idct_row_isa(const int16_t* coeffs, const unsigned char* last, unsigned int count,
+                        const int16_t* quant, unsigned char* out, size_t stride, DCT_ISA isa);
+void dct_idct_row(const int16_t* coeffs, const unsigned char* last, unsigned int count,
+                    const int16_t* quant, unsigned char* out, size_t stride);
+void dct_fdct_row_isa(const unsigned char* in, size_t stride, unsigned int count,
+                        const DCT_DIVISORS* div, int16_t* out, DCT_ISA isa);
+void dct_fdct_row(const unsigned char* in, size_t stride, unsigned int count,
+                    const DCT_DIVISORS* div, int16_t* out);
+
+#endif
@@ -0,0 +1,1070 @@
+///
+/// @file deflate.c
+/// @brief DEFLATE and zlib encoder implementation
+/// @author Sam Cordry
+
+#include "deflate.h"
+#include "adler.h"
+#include "cpu.h"
+
+#ifdef CPU_X86
+#include <immintrin.h>
+#endif
+
+/// @brief The MEM_CHECK macro checks if the given pointer is NULL.
+#define MEM_CHECK(ptr) if(ptr == NULL) { printf("Unable to allocate memory");\
+                                            return false; }
+
+/// @brief The farthest a three byte match may reach and still beat literals.
+#define DEFLATE_TOO_FAR 4096
+
+/// @brief The shortest and longest matches DEFLATE can express.
+#define DEFLATE_MIN_MATCH 3
+#define DEFLATE_MAX_MATCH 258
+
+/// @brief The largest stored block.
+#define DEFLATE_MAX_STORED 65535
+
+// base values and extra bits of the length symbols 257 to 285
+static const uint16_t length_base[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+static const uint8_t length_extra[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+
+// base values and extra bits of the distance symbols 0 to 29
+static const uint16_t dist_base[30] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
+};
+static const uint8_t dist_extra[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+
+// order the code length code lengths are stored in
+static const uint8_t codelen_order[19] = {
+    16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15
+};
+
+// match finder settings by level: good, lazy, nice, chain, lazy matching.
+// level 1 probes a single candidate, the greedy levels index the inside of a
+// match only when it is no longer than the lazy length, and the lazy levels
+// trade longer chains for a better ratio
+static const DEFLATE_CONFIG configs[DEFLATE_MAX_LEVEL + 1] = {
+    { 0, 0, 0, 0, false },
+    { 4, 4, 8, 1, false },
+    { 4, 5, 16, 8, false },
+    { 4, 6, 32, 32, false },
+    { 4, 4, 16, 16, true },
+    { 8, 16, 32, 32, true },
+    { 8, 16, 128, 128, true },
+    { 8, 32, 128, 256, true },
+    { 32, 128, 258, 1024, true },
+    { 32, 258, 258, 4096, true }
+};
+
+/// @brief Symbol and weight pair sorted when building a Huffman code
+typedef struct {
+    uint32_t freq;
+    uint16_t sym;
+} HUFF_SYMBOL;
+
+/// @brief The deflate_buffer_init function sets up an empty buffer.
+/// @param buffer The buffer to set up.
+void deflate_buffer_init(DEFLATE_BUFFER* buffer) {
+    buffer->data = NULL;
+    buffer->length = 0;
+    buffer->capacity = 0;
+    buffer->bits = 0;
+    buffer->count = 0;
+    buffer->error = false;
+}
+
+/// @brief The deflate_buffer_free function frees a buffer's data.
+/// @param buffer The buffer to free.
+void deflate_buffer_free(DEFLATE_BUFFER* buffer) {
+    free(buffer->data);
+    deflate_buffer_init(buffer);
+}
+
+/// @brief The deflate_buffer_reset function empties a buffer but keeps its
+///        memory for reuse.
+/// @param buffer The buffer to empty.
+void deflate_buffer_reset(DEFLATE_BUFFER* buffer) {
+    buffer->length = 0;
+    buffer->bits = 0;
+    buffer->count = 0;
+    buffer->error = false;
+}
+
+/// @brief The reserve function makes room for more bytes in a buffer, so the
+///        bit writer itself never has to check. Once it fails, the buffer is
+///        flagged and it fails every time after, so nothing more is written.
+/// @param buffer The buffer to grow.
+/// @param extra The number of bytes that will be added.
+/// @return True if there is room, false if memory ran out.
+static bool reserve(DEFLATE_BUFFER* buffer, size_t extra) {
+    if(buffer->error)
+        return false;
+
+    // leave room for the pending bits too
+    size_t needed = buffer->length + extra + 16;
+    if(needed <= buffer->capacity)
+        return true;
+
+    size_t capacity = buffer->capacity > 0 ? buffer->capacity : 4096;
+    while(capacity < needed)
+        capacity *= 2;
+    unsigned char* data = realloc(buffer->data, capacity);
+    if(data == NULL) {
+        printf("Unable to allocate memory");
+        buffer->error = true;
+        return false;
+    }
+    buffer->data = data;
+    buffer->capacity = capacity;
+    return true;
+}
+
+/// @brief The put_bits function appends bits, least significant first.
+/// @param buffer The buffer to append to.
+/// @param value The bits to append.
+/// @param n The number of bits, at most 32.
+static inline void put_bits(DEFLATE_BUFFER* buffer, uint32_t value, unsigned int n) {
+    buffer->bits |= (uint64_t) value << buffer->count;
+    buffer->count += n;
+    if(buffer->count >= 32) {
+        for(int i = 0; i < 4; i++)
+            buffer->data[buffer->length++] = (unsigned char) (buffer->bits >> (8 * i));
+        buffer->bits >>= 32;
+        buffer->count -= 32;
+    }
+}
+
+/// @brief The align_bits function pads the pending bits out to a whole byte
+///        and writes them.
+/// @param buffer The buffer to align.
+static void align_bits(DEFLATE_BUFFER* buffer) {
+    while(buffer->count > 0) {
+        buffer->data[buffer->length++] = (unsigned char) buffer->bits;
+        buffer->bits >>= 8;
+        buffer->count = buffer->count > 8 ? buffer->count - 8 : 0;
+    }
+    buffer->bits = 0;
+}
+
+/// @brief The put_bytes function appends bytes to an aligned buffer.
+/// @param buffer The buffer to append to.
+/// @param data The bytes to append.
+/// @param length The number of bytes.
+static void put_bytes(DEFLATE_BUFFER* buffer, const unsigned char* data, size_t length) {
+    if(!reserve(buffer, length))
+        return;
+    if(length > 0)
+        memcpy(buffer->data + buffer->length, data, length);
+    buffer->length += length;
+}
+
+/// @brief The reverse_bits function reverses a Huffman code, since DEFLATE
+///        sends codes most significant bit first into an LSB-first stream.
+/// @param code The code to reverse.
+/// @param length The number of bits in the code.
+/// @return The reversed code.
+static uint16_t reverse_bits(unsigned int code, unsigned int length) {
+    unsigned int reversed = 0;
+    for(unsigned int i = 0; i < length; i++) {
+        reversed = (reversed << 1) | (code & 1);
+        code >>= 1;
+    }
+    return (uint16_t) reversed;
+}
+
+/// @brief The compare_symbols function orders symbols by weight, then index.
+/// @param a The first symbol.
+/// @param b The second symbol.
+/// @return Negative, zero or positive as for qsort.
+static int compare_symbols(const void* a, const void* b) {
+    const HUFF_SYMBOL* x = a;
+    const HUFF_SYMBOL* y = b;
+    if(x->freq != y->freq)
+        return x->freq < y->freq ? -1 : 1;
+    return (int) x->sym - (int) y->sym;
+}
+
+/// @brief The minimum_redundancy function turns weights sorted in ascending
+///        order into optimal code lengths in place (Moffat and Katajainen).
+/// @param a The sorted weights, replaced by their code lengths.
+/// @param n The number of weights, at least 2.
+static void minimum_redundancy(uint32_t* a, int n) {
+    int root, leaf, next, avail, used, depth;
+
+    // first pass: combine the two smallest nodes until one tree is left
+    a[0] += a[1];
+    root = 0;
+    leaf = 2;
+    for(next = 1; next < n - 1; next++) {
+        if(leaf >= n || a[root] < a[leaf]) {
+            a[next] = a[root];
+            a[root++] = (uint32_t) next;
+        } else {
+            a[next] = a[leaf++];
+        }
+        if(leaf >= n || (root < next && a[root] < a[leaf])) {
+            a[next] += a[root];
+            a[root++] = (uint32_t) next;
+        } else {
+            a[next] += a[leaf++];
+        }
+    }
+
+    // second pass: turn parent pointers into internal node depths
+    a[n - 2] = 0;
+    for(next = n - 3; next >= 0; next--)
+        a[next] = a[a[next]] + 1;
+
+    // third pass: turn internal node depths into leaf depths
+    avail = 1;
+    used = 0;
+    depth = 0;
+    root = n - 2;
+    next = n - 1;
+    while(avail > 0) {
+        while(root >= 0 && (int) a[root] == depth) {
+            used++;
+            root--;
+        }
+        while(avail > used) {
+            a[next--] = (uint32_t) depth;
+            avail--;
+        }
+        avail = 2 * used;
+        depth++;
+        used = 0;
+    }
+}
+
+/// @brief The build_lengths function finds length-limited Huffman code
+///        lengths for a set of symbol counts.
+/// @param freq The count of each symbol.
+/// @param n The number of symbols.
+/// @param limit The longest allowed code.
+/// @param lengths Where to store the code length of each symbol.
+static void build_lengths(const uint32_t* freq, unsigned int n, unsigned int limit, uint8_t* lengths) {
+    HUFF_SYMBOL symbols[286];
+    uint32_t depth[286];
+    unsigned int count[16] = { 0 };
+    unsigned int used = 0;
+    unsigned int i;
+
+    memset(lengths, 0, n);
+    for(i = 0; i < n; i++) {
+        if(freq[i] > 0) {
+            symbols[used].freq = freq[i];
+            symbols[used].sym = (uint16_t) i;
+            used++;
+        }
+    }
+
+    // a lone symbol still needs a one bit code, paired with a dummy to keep
+    // the code complete
+    if(used == 0)
+        return;
+    if(used == 1) {
+        lengths[symbols[0].sym] = 1;
+        lengths[symbols[0].sym == 0 ? 1 : 0] = 1;
+        return;
+    }
+
+    qsort(symbols, used, sizeof(HUFF_SYMBOL), compare_symbols);
+    for(i = 0; i < used; i++)
+        depth[i] = symbols[i].freq;
+    minimum_redundancy(depth, (int) used);
+
+    // clamp long codes, then lengthen short ones until the code fits again
+    for(i = 0; i < used; i++)
+        count[depth[i] > limit ? limit : depth[i]]++;
+    uint32_t total = 0;
+    for(i = 1; i <= limit; i++)
+        total += count[i] << (limit - i);
+    while(total > (1u << limit)) {
+        count[limit]--;
+        for(unsigned int j = limit - 1; j > 0; j--) {
+            if(count[j] > 0) {
+                count[j]--;
+                count[j + 1] += 2;
+                break;
+            }
+        }
+        total--;
+    }
+
+    // hand out the lengths, longest to the rarest symbols
+    unsigned int k = 0;
+    for(unsigned int length = limit; length > 0; length--)
+        for(unsigned int j = 0; j < count[length]; j++)
+            lengths[symbols[k++].sym] = (uint8_t) length;
+}
+
+/// @brief The build_codes function assigns canonical codes to code lengths,
+///        already reversed for the bit writer.
+/// @param lengths The code length of each symbol.
+/// @param n The number of symbols.
+/// @param codes Where to store the code of each symbol.
+static void build_codes(const uint8_t* lengths, unsigned int n, uint16_t* codes) {
+    unsigned int count[16] = { 0 };
+    unsigned int next[16];
+    unsigned int i;
+
+    for(i = 0; i < n; i++)
+        count[lengths[i]]++;
+    count[0] = 0;
+
+    unsigned int code = 0;
+    for(i = 1; i < 16; i++) {
+        code = (code + count[i - 1]) << 1;
+        next[i] = code;
+    }
+
+    for(i = 0; i < n; i++)
+        codes[i] = lengths[i] > 0 ? reverse_bits(next[lengths[i]]++, lengths[i]) : 0;
+}
+
+/// @brief The state_tables function sets up the symbol lookup tables.
+/// @param state The state to set up.
+static void state_tables(DEFLATE_STATE* state) {
+    int sym, i;
+
+    for(sym = 0; sym < 29; sym++)
+        for(i = 0; i < (1 << length_extra[sym]) && length_base[sym] - 3 + i < 256; i++)
+            state->length_symbol[length_base[sym] - 3 + i] = (uint8_t) sym;
+
+    // distances up to 256 are looked up directly, farther ones by (d - 1) >> 7
+    for(sym = 0; sym < 30; sym++) {
+        for(i = 0; i < (1 << dist_extra[sym]); i++) {
+            int d = dist_base[sym] + i - 1;
+            if(d < 256)
+                state->dist_symbol[d] = (uint8_t) sym;
+            else
+                state->dist_symbol[256 + (d >> 7)] = (uint8_t) sym;
+        }
+    }
+}
+
+/// @brief The dist_to_symbol function finds the symbol of a distance.
+/// @param state The state holding the lookup table.
+/// @param dist The distance, from 1 to 32768.
+/// @return The distance symbol.
+static inline unsigned int dist_to_symbol(const DEFLATE_STATE* state, unsigned int dist) {
+    dist--;
+    return dist < 256 ? state->dist_symbol[dist] : state->dist_symbol[256 + (dist >> 7)];
+}
+
+/// @brief The encode_lengths function run-length codes the literal/length and
+///        distance code lengths with symbols 16, 17 and 18.
+/// @param lengths The concatenated code lengths.
+/// @param n The number of code lengths.
+/// @param symbols Where to store each code length symbol.
+/// @param extras Where to store each symbol's repeat count.
+/// @param freq Where to count the code length symbols.
+/// @return The number of code length symbols.
+static unsigned int encode_lengths(const uint8_t* lengths, unsigned int n, uint8_t* symbols,
+                                    uint8_t* extras, uint32_t* freq) {
+    unsigned int num = 0;
+    unsigned int i = 0;
+
+    while(i < n) {
+        uint8_t length = lengths[i];
+        unsigned int run = 1;
+        while(i + run < n && lengths[i + run] == length)
+            run++;
+        i += run;
+
+        if(length == 0) {
+            // runs of zeros: 18 covers 11 to 138, 17 covers 3 to 10
+            while(run >= 11) {
+                unsigned int r = run > 138 ? 138 : run;
+                symbols[num] = 18;
+                extras[num++] = (uint8_t) (r - 11);
+                run -= r;
+            }
+            if(run >= 3) {
+                symbols[num] = 17;
+                extras[num++] = (uint8_t) (run - 3);
+                run = 0;
+            }
+        } else {
+            // other lengths are sent once, then repeated 3 to 6 at a time by 16
+            symbols[num] = length;
+            extras[num++] = 0;
+            run--;
+            while(run >= 3) {
+                unsigned int r = run > 6 ? 6 : run;
+                symbols[num] = 16;
+                extras[num++] = (uint8_t) (r - 3);
+                run -= r;
+            }
+        }
+
+        // anything too short to repeat is sent as it is
+        while(run > 0) {
+            symbols[num] = length;
+            extras[num++] = 0;
+            run--;
+        }
+    }
+
+    for(i = 0; i < num; i++)
+        freq[symbols[i]]++;
+    return num;
+}
+
+/// @brief The write_stored function writes input as stored blocks.
+/// @param out The buffer to write to.
+/// @param data The input.
+/// @param length The length of the input.
+/// @param last Whether the final block ends the stream.
+static void write_stored(DEFLATE_BUFFER* out, const unsigned char* data, size_t length, bool last) {
+    do {
+        size_t piece = length > DEFLATE_MAX_STORED ? DEFLATE_MAX_STORED : length;
+        length -= piece;
+
+        if(!reserve(out, piece + 8))
+            return;
+        put_bits(out, last && length == 0 ? 1 : 0, 1);
+        put_bits(out, 0, 2);
+        align_bits(out);
+        out->data[out->length++] = (unsigned char) piece;
+        out->data[out->length++] = (unsigned char) (piece >> 8);
+        out->data[out->length++] = (unsigned char) ~piece;
+        out->data[out->length++] = (unsigned char) (~piece >> 8);
+        put_bytes(out, data, piece);
+        data += piece;
+    } while(length > 0);
+}
+
+/// @brief The flush_block function writes the collected tokens as one block,
+///        as dynamic Huffman or stored, whichever is smaller.
+/// @param state The compressor state.
+/// @param data The input the tokens cover.
+/// @param length The length of that input.
+/// @param last Whether the block ends the stream.
+static void flush_block(DEFLATE_STATE* state, const unsigned char* data, size_t length, bool last) {
+    DEFLATE_BUFFER* out = state->out;
+    uint8_t litlen_lengths[286];
+    uint8_t dist_lengths[30];
+    uint16_t litlen_codes[286];
+    uint16_t dist_codes[30];
+    uint8_t all_lengths[286 + 30];
+    uint8_t cl_symbols[286 + 30];
+    uint8_t cl_extras[286 + 30];
+    uint32_t cl_freq[19] = { 0 };
+    uint8_t cl_lengths[19];
+    uint16_t cl_codes[19];
+    unsigned int i;
+
+    // build the codes, with the end of block symbol and at least one distance
+    state->litlen_freq[256] = 1;
+    build_lengths(state->litlen_freq, 286, 15, litlen_lengths);
+    build_lengths(state->dist_freq, 30, 15, dist_lengths);
+    bool any_dist = false;
+    for(i = 0; i < 30; i++)
+        any_dist = any_dist || dist_lengths[i] > 0;
+    if(!any_dist)
+        dist_lengths[0] = 1;
+
+    // trim the unused tail of each code
+    unsigned int hlit = 286;
+    while(hlit > 257 && litlen_lengths[hlit - 1] == 0)
+        hlit--;
+    unsigned int hdist = 30;
+    while(hdist > 1 && dist_lengths[hdist - 1] == 0)
+        hdist--;
+
+    // build the code length code
+    memcpy(all_lengths, litlen_lengths, hlit);
+    memcpy(all_lengths + hlit, dist_lengths, hdist);
+    unsigned int num_cl = encode_lengths(all_lengths, hlit + hdist, cl_symbols, cl_extras, cl_freq);
+    build_lengths(cl_freq, 19, 7, cl_lengths);
+    unsigned int hclen = 19;
+    while(hclen > 4 && cl_lengths[codelen_order[hclen - 1]] == 0)
+        hclen--;
+
+    // size the block both ways
+    size_t dynamic_bits = 3 + 5 + 5 + 4 + 3 * hclen + state->extra_bits;
+    for(i = 0; i < 19; i++)
+        dynamic_bits += (size_t) cl_freq[i] * cl_lengths[i];
+    dynamic_bits += 2 * cl_freq[16] + 3 * cl_freq[17] + 7 * cl_freq[18];
+    for(i = 0; i < 286; i++)
+        dynamic_bits += (size_t) state->litlen_freq[i] * litlen_lengths[i];
+    for(i = 0; i < 30; i++)
+        dynamic_bits += (size_t) state->dist_freq[i] * dist_lengths[i];
+    size_t stored_bits = (length / DEFLATE_MAX_STORED + 1) * (3 + 7 + 32) + 8 * length;
+
+    if(stored_bits < dynamic_bits) {
+        write_stored(out, data, length, last);
+    } else if(reserve(out, dynamic_bits / 8 + 16)) {
+        build_codes(litlen_lengths, 286, litlen_codes);
+        build_codes(dist_lengths, 30, dist_codes);
+        build_codes(cl_lengths, 19, cl_codes);
+
+        // block header and the code lengths
+        put_bits(out, last ? 1 : 0, 1);
+        put_bits(out, 2, 2);
+        put_bits(out, hlit - 257, 5);
+        put_bits(out, hdist - 1, 5);
+        put_bits(out, hclen - 4, 4);
+        for(i = 0; i < hclen; i++)
+            put_bits(out, cl_lengths[codelen_order[i]], 3);
+        for(i = 0; i < num_cl; i++) {
+            uint8_t sym = cl_symbols[i];
+            put_bits(out, cl_codes[sym], cl_lengths[sym]);
+            if(sym == 16)
+                put_bits(out, cl_extras[i], 2);
+            else if(sym == 17)
+                put_bits(out, cl_extras[i], 3);
+            else if(sym == 18)
+                put_bits(out, cl_extras[i], 7);
+        }
+
+        // the symbols themselves
+        for(size_t t = 0; t < state->num_tokens; t++) {
+            unsigned int dist = state->dist[t];
+            if(dist == 0) {
+                unsigned int lit = state->lit[t];
+                put_bits(out, litlen_codes[lit], litlen_lengths[lit]);
+                continue;
+            }
+
+            unsigned int len = state->lit[t];
+            unsigned int lsym = state->length_symbol[len - 3];
+            put_bits(out, litlen_codes[257 + lsym], litlen_lengths[257 + lsym]);
+            put_bits(out, len - length_base[lsym], length_extra[lsym]);
+            unsigned int dsym = dist_to_symbol(state, dist);
+            put_bits(out, dist_codes[dsym], dist_lengths[dsym]);
+            put_bits(out, dist - dist_base[dsym], dist_extra[dsym]);
+        }
+        put_bits(out, litlen_codes[256], litlen_lengths[256]);
+    }
+
+    // start the next block afresh
+    state->num_tokens = 0;
+    state->extra_bits = 0;
+    memset(state->litlen_freq, 0, sizeof(state->litlen_freq));
+    memset(state->dist_freq, 0, sizeof(state->dist_freq));
+}
+
+/// @brief The hash3 function hashes the three bytes at a position.
+/// @param p The position.
+/// @return The hash.
+static inline uint32_t hash3(const unsigned char* p) {
+    uint32_t v = ((uint32_t) p[0] << 16) | ((uint32_t) p[1] << 8) | p[2];
+    return (v * 2654435761u) >> (32 - DEFLATE_HASH_BITS);
+}
+
+/// @brief The match_length_scalar function counts how many bytes two
+///        positions have in common, eight bytes at a time where possible.
+/// @param a The earlier position.
+/// @param b The current position.
+/// @param max The most bytes to compare.
+/// @return The length of the match.
+static size_t match_length_scalar(const unsigned char* a, const unsigned char* b, size_t max) {
+    size_t len = 0;
+
+#if defined(__GNUC__) && defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    while(len + 8 <= max) {
+        uint64_t x, y;
+        memcpy(&x, a + len, 8);
+        memcpy(&y, b + len, 8);
+        if(x != y)
+            return len + ((size_t) __builtin_ctzll(x ^ y) >> 3);
+        len += 8;
+    }
+#endif
+    while(len < max && a[len] == b[len])
+        len++;
+    return len;
+}
+
+#ifdef CPU_X86
+/// @brief The match_length_sse2 function counts how many bytes two positions
+///        have in common, 16 bytes per compare.
+/// @param a The earlier position.
+/// @param b The current position.
+/// @param max The most bytes to compare.
+/// @return The length of the match.
+__attribute__((target("sse2")))
+static size_t match_length_sse2(const unsigned char* a, const unsigned char* b, size_t max) {
+    size_t len = 0;
+
+    while(len + 16 <= max) {
+        __m128i x = _mm_loadu_si128((const __m128i*) (a + len));
+        __m128i y = _mm_loadu_si128((const __m128i*) (b + len));
+        unsigned int differ = (unsigned int) _mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) ^ 0xffffu;
+        if(differ != 0)
+            return len + (size_t) __builtin_ctz(differ);
+        len += 16;
+    }
+    return len + match_length_scalar(a + len, b + len, max - len);
+}
+
+/// @brief The match_length_avx2 function counts how many bytes two positions
+///        have in common, 32 bytes per compare.
+/// @param a The earlier position.
+/// @param b The current position.
+/// @param max The most bytes to compare.
+/// @return The length of the match.
+__attribute__((target("avx2")))
+static size_t match_length_avx2(const unsigned char* a, const unsigned char* b, size_t max) {
+    size_t len = 0;
+
+    while(len + 32 <= max) {
+        __m256i x = _mm256_loadu_si256((const __m256i*) (a + len));
+        __m256i y = _mm256_loadu_si256((const __m256i*) (b + len));
+        unsigned int differ = ~(unsigned int) _mm256_movemask_epi8(_mm256_cmpeq_epi8(x, y));
+        if(differ != 0)
+            return len + (size_t) __builtin_ctz(differ);
+        len += 32;
+    }
+    return len + match_length_sse2(a + len, b + len, max - len);
+}
+#endif
+
+/// @brief The deflate_state_create function allocates a compressor that can
+///        be reused for any number of deflate_compress calls.
+/// @param level The compression level, from 0 (stored) to 9 (smallest).
+/// @return The new state, or NULL if memory ran out.
+DEFLATE_STATE* deflate_state_create(int level) {
+    DEFLATE_STATE* state = malloc(sizeof(DEFLATE_STATE));
+    MEM_CHECK(state);
+
+    if(level < 0 || level > DEFLATE_MAX_LEVEL)
+        level = DEFLATE_DEFAULT_LEVEL;
+    state->level = level;
+    state->config = configs[level];
+    state->prev = NULL;
+    state->prev_capacity = 0;
+    state_tables(state);
+
+    // pick the widest compare the CPU supports
+    state->match_length = match_length_scalar;
+#ifdef CPU_X86
+    if(cpu_has_avx2())
+        state->match_length = match_length_avx2;
+    else if(cpu_has_sse2())
+        state->match_length = match_length_sse2;
+#endif
+
+    return state;
+}
+
+/// @brief The deflate_state_free function frees a compressor.
+/// @param state The state to free.
+void deflate_state_free(DEFLATE_STATE* state) {
+    if(state == NULL)
+        return;
+    free(state->prev);
+    free(state);
+}
+
+/// @brief The insert function adds a position to the hash chains.
+/// @param state The compressor state.
+/// @param pos The position, counted from the state's base.
+/// @return The previous position with the same hash, or -1.
+static inline int32_t insert(DEFLATE_STATE* state, int32_t pos) {
+    uint32_t h = hash3(state->base + pos);
+    int32_t prev = state->head[h];
+    state->prev[pos] = prev;
+    state->head[h] = pos;
+    return prev;
+}
+
+/// @brief The flush_tokens function writes the tokens collected so far as a
+///        block and starts the next one where they end.
+/// @param state The compressor state.
+/// @param last Whether the block ends the stream.
+static void flush_tokens(DEFLATE_STATE* state, bool last) {
+    flush_block(state, state->base + state->block, (size_t) (state->emitted - state->block), last);
+    state->block = state->emitted;
+}
+
+/// @brief The emit_literal function adds a literal token.
+/// @param state The compressor state.
+/// @param lit The literal byte.
+static inline void emit_literal(DEFLATE_STATE* state, unsigned char lit) {
+    state->lit[state->num_tokens] = lit;
+    state->dist[state->num_tokens++] = 0;
+    state->litlen_freq[lit]++;
+    state->emitted++;
+    if(state->num_tokens == DEFLATE_BLOCK_TOKENS)
+        flush_tokens(state, state->last && state->emitted == state->limit);
+}
+
+/// @brief The emit_match function adds a match token.
+/// @param state The compressor state.
+/// @param len The length of the match.
+/// @param dist The distance back to the match.
+static inline void emit_match(DEFLATE_STATE* state, size_t len, size_t dist) {
+    unsigned int lsym = state->length_symbol[len - 3];
+    unsigned int dsym = dist_to_symbol(state, (unsigned int) dist);
+    state->lit[state->num_tokens] = (uint16_t) len;
+    state->dist[state->num_tokens++] = (uint16_t) dist;
+    state->litlen_freq[257 + lsym]++;
+    state->dist_freq[dsym]++;
+    state->extra_bits += length_extra[lsym] + dist_extra[dsym];
+    state->emitted += (int32_t) len;
+    if(state->num_tokens == DEFLATE_BLOCK_TOKENS)
+        flush_tokens(state, state->last && state->emitted == state->limit);
+}
+
+/// @brief The find_match function walks a hash chain for the longest match
+///        longer than the one already found.
+/// @param state The compressor state.
+/// @param pos The position to match.
+/// @param cand The first candidate on the chain.
+/// @param floor The length a match must beat.
+/// @param dist Where to store the distance of a longer match.
+/// @return The length of the longest match, or floor if none beat it.
+static inline size_t find_match(DEFLATE_STATE* state, int32_t pos, int32_t cand, size_t floor,
+                                    size_t* dist) {
+    size_t max = (size_t) (state->limit - pos);
+    if(max > DEFLATE_MAX_MATCH)
+        max = DEFLATE_MAX_MATCH;
+    if(floor >= max)
+        return floor;
+
+    // look less hard when there is already a good match
+    unsigned int chain = state->config.max_chain;
+    if(floor >= state->config.good_length)
+        chain = (chain >> 2) > 0 ? chain >> 2 : 1;
+    size_t nice = state->config.nice_length < max ? state->config.nice_length : max;
+
+    // walk the chain, checking the byte that would make a match longer first
+    const unsigned char* p = state->base + pos;
+    size_t best = floor;
+    while(cand >= 0 && pos - cand <= DEFLATE_WINDOW && chain-- > 0) {
+        const unsigned char* c = state->base + cand;
+        if(c[best] == p[best] && c[0] == p[0]) {
+            size_t len = state->match_length(c, p, max);
+            if(len > best) {
+                best = len;
+                *dist = (size_t) (pos - cand);
+                if(len >= nice)
+                    break;
+            }
+        }
+        cand = state->prev[cand];
+    }
+
+    // a short match far back costs more than the literals
+    if(best == DEFLATE_MIN_MATCH && *dist > DEFLATE_TOO_FAR)
+        return floor;
+    return best;
+}
+
+/// @brief The compress_greedy function takes the longest match at each
+///        position, for the fast levels.
+/// @param state The compressor state, primed with the dictionary.
+/// @param pos The first position to compress.
+static void compress_greedy(DEFLATE_STATE* state, int32_t pos) {
+    const int32_t limit = state->limit;
+
+    while(pos < limit) {
+        size_t len = DEFLATE_MIN_MATCH - 1;
+        size_t dist = 0;
+        if(limit - pos >= DEFLATE_MIN_MATCH)
+            len = find_match(state, pos, insert(state, pos), len, &dist);
+
+        if(len < DEFLATE_MIN_MATCH) {
+            emit_literal(state, state->base[pos]);
+            pos++;
+            continue;
+        }
+
+        // long matches are skipped over without indexing their insides
+        emit_match(state, len, dist);
+        if(len <= state->config.max_lazy)
+            for(int32_t i = 1; i < (int32_t) len; i++)
+                if(limit - (pos + i) >= DEFLATE_MIN_MATCH)
+                    insert(state, pos + i);
+        pos += (int32_t) len;
+    }
+}
+
+/// @brief The compress_lazy function holds each match back by one position
+///        and takes the next position's match instead when it is longer.
+/// @param state The compressor state, primed with the dictionary.
+/// @param pos The first position to compress.
+static void compress_lazy(DEFLATE_STATE* state, int32_t pos) {
+    const int32_t limit = state->limit;
+    size_t prev_len = DEFLATE_MIN_MATCH - 1;
+    size_t prev_dist = 0;
+    bool pending = false;
+
+    while(pos < limit) {
+        size_t len = DEFLATE_MIN_MATCH - 1;
+        size_t dist = 0;
+        if(limit - pos >= DEFLATE_MIN_MATCH) {
+            int32_t cand = insert(state, pos);
+            if(prev_len < state->config.max_lazy) {
+                size_t floor = pending && prev_len >= DEFLATE_MIN_MATCH ? prev_len : len;
+                size_t found = find_match(state, pos, cand, floor, &dist);
+                if(found > floor)
+                    len = found;
+            }
+        }
+
+        if(pending && prev_len >= DEFLATE_MIN_MATCH && len <= prev_len) {
+            // the held match wins: it started one position back
+            int32_t end = pos - 1 + (int32_t) prev_len;
+            emit_match(state, prev_len, prev_dist);
+            for(int32_t i = pos + 1; i < end; i++)
+                if(limit - i >= DEFLATE_MIN_MATCH)
+                    insert(state, i);
+            pos = end;
+            pending = false;
+            prev_len = DEFLATE_MIN_MATCH - 1;
+        } else {
+            // the held position goes out as a literal, this one is held instead
+            if(pending)
+                emit_literal(state, state->base[pos - 1]);
+            pending = true;
+            prev_len = len;
+            prev_dist = dist;
+            pos++;
+        }
+    }
+
+    if(pending)
+        emit_literal(state, state->base[pos - 1]);
+}
+
+/// @brief The deflate_compress function compresses part of the input as raw
+///        DEFLATE blocks, reusing a compressor's memory. Up to DEFLATE_WINDOW
+///        bytes before the start are used as a preset dictionary, so the
+///        piece continues the stream before it. A piece that does not end the
+///        stream finishes with an empty stored block, leaving the output byte
+///        aligned.
+/// @param state The compressor to use.
+/// @param data The whole input.
+/// @param start The offset of the first byte to compress.
+/// @param end The offset just past the last byte to compress.
+/// @param last Whether the piece ends the stream.
+/// @param out The buffer to append the compressed data to.
+/// @return True if the piece was compressed, false if memory ran out, which
+///         also flags the buffer.
+bool deflate_compress(DEFLATE_STATE* state, const unsigned char* data, size_t start, size_t end,
+                        bool last, DEFLATE_BUFFER* out) {
+    state->out = out;
+    state->last = last;
+    state->num_tokens = 0;
+    state->extra_bits = 0;
+    memset(state->litlen_freq, 0, sizeof(state->litlen_freq));
+    memset(state->dist_freq, 0, sizeof(state->dist_freq));
+
+    // positions are counted from the start of the dictionary
+    size_t dict = start > DEFLATE_WINDOW ? DEFLATE_WINDOW : start;
+    state->base = data + start - dict;
+    state->limit = (int32_t) (dict + (end - start));
+    state->block = (int32_t) dict;
+    state->emitted = (int32_t) dict;
+
+    if(state->level == 0) {
+        // stored only, nothing to match
+        write_stored(out, data + start, end - start, last);
+    } else {
+        // grow the chain links only when a bigger piece comes along
+        if(state->prev_capacity < (size_t) state->limit + 1) {
+            free(state->prev);
+            state->prev_capacity = (size_t) state->limit + 1;
+            state->prev = malloc(sizeof(int32_t) * state->prev_capacity);
+            if(state->prev == NULL) {
+                printf("Unable to allocate memory");
+                state->prev_capacity = 0;
+                out->error = true;
+                return false;
+            }
+        }
+        memset(state->head, 0xff, sizeof(state->head));
+
+        // prime the hash chains with the dictionary
+        int32_t pos;
+        for(pos = 0; pos < (int32_t) dict && state->limit - pos >= DEFLATE_MIN_MATCH; pos++)
+            insert(state, pos);
+
+        if(state->config.lazy)
+            compress_lazy(state, (int32_t) dict);
+        else
+            compress_greedy(state, (int32_t) dict);
+
+        // finish the last block
+        if(state->num_tokens > 0 || state->block == (int32_t) dict)
+            flush_tokens(state, last);
+    }
+
+    // byte align with an empty stored block
+    if(reserve(out, 8)) {
+        if(!last) {
+            put_bits(out, 0, 3);
+            align_bits(out);
+            put_bytes(out, (const unsigned char*) "\x00\x00\xff\xff", 4);
+        }
+        align_bits(out);
+    }
+
+    return !out->error;
+}
+
+/// @brief The deflate_raw function compresses part of the input with a
+///        compressor of its own. See deflate_compress.
+/// @param data The whole input.
+/// @param start The offset of the first byte to compress.
+/// @param end The offset just past the last byte to compress.
+/// @param last Whether the piece ends the stream.
+/// @param level The compression level, from 0 (stored) to 9 (smallest).
+/// @param out The buffer to append the compressed data to.
+/// @return True if the piece was compressed, false if memory ran out.
+bool deflate_raw(const unsigned char* data, size_t start, size_t end, bool last, int level,
+                    DEFLATE_BUFFER* out) {
+    DEFLATE_STATE* state = deflate_state_create(level);
+    if(state == NULL) {
+        out->error = true;
+        return false;
+    }
+    bool compressed = deflate_compress(state, data, start, end, last, out);
+    deflate_state_free(state);
+    return compressed;
+}
+
+/// @brief The piece_job function compresses and checksums one piece.
+/// @param arg The DEFLATE_PIECE to compress.
+static void piece_job(void* arg) {
+    DEFLATE_PIECE* piece = arg;
+    deflate_raw(piece->data, piece->start, piece->end, piece->last, piece->level, &piece->out);
+    piece->adler = adler_update(1, piece->data + piece->start, piece->end - piece->start);
+}
+
+/// @brief The deflate_parallel function splits the input into pieces of
+///        DEFLATE_CHUNK bytes and compresses them on a pool. Each piece is
+///        primed with the 32 KB before it, so the pieces join into a single
+///        DEFLATE stream, and their checksums are combined into one. The
+///        input can also be cut into segments that are not primed from the
+///        segment before, so that each can be decoded on its own, like a zlib
+///        full flush.
+/// @param data The input.
+/// @param length The length of the input.
+/// @param segment The length of each independent segment, or 0 for one.
+/// @param level The compression level, from 0 (stored) to 9 (smallest).
+/// @param pool The pool to compress on, or NULL to compress in this thread.
+/// @param stream Where to store the pieces and the combined Adler-32. It is
+///        freed with deflate_stream_free even when compressing fails.
+/// @return True if every piece was compressed, false if memory ran out.
+bool deflate_parallel(const unsigned char* data, size_t length, size_t segment, int level,
+                        POOL* pool, DEFLATE_STREAM* stream) {
+    if(segment == 0 || segment > length)
+        segment = length;
+
+    // count the pieces, a segment holding at least one even when empty
+    size_t num_pieces = 0;
+    size_t offset = 0;
+    do {
+        size_t size = length - offset < segment ? length - offset : segment;
+        num_pieces += size / DEFLATE_CHUNK + (size % DEFLATE_CHUNK != 0 || size == 0);
+        offset += size;
+    } while(offset < length);
+    stream->pieces = malloc(sizeof(DEFLATE_PIECE) * num_pieces);
+    stream->num_pieces = 0;
+    MEM_CHECK(stream->pieces);
+    stream->num_pieces = num_pieces;
+
+    size_t i = 0;
+    offset = 0;
+    do {
+        // pieces see their segment as the whole input, so nothing before it
+        // can be used as a dictionary
+        size_t size = length - offset < segment ? length - offset : segment;
+        size_t start = 0;
+        do {
+            DEFLATE_PIECE* piece = stream->pieces + i;
+            piece->data = data + offset;
+            piece->start = start;
+            piece->end = size - start > DEFLATE_CHUNK ? start + DEFLATE_CHUNK : size;
+            piece->last = i == num_pieces - 1;
+            piece->restart = start == 0;
+            piece->level = level;
+            deflate_buffer_init(&piece->out);
+            if(pool == NULL || !pool_submit(pool, piece_job, piece))
+                piece_job(piece);
+            start = piece->end;
+            i++;
+        } while(start < size);
+        offset += size;
+    } while(offset < length);
+    if(pool != NULL)
+        pool_wait(pool);
+
+    // stitch the checksums together in stream order
+    bool compressed = true;
+    stream->adler = 1;
+    for(size_t i = 0; i < num_pieces; i++) {
+        DEFLATE_PIECE* piece = stream->pieces + i;
+        stream->adler = adler_combine(stream->adler, piece->adler, piece->end - piece->start);
+        compressed = compressed && !piece->out.error;
+    }
+
+    return compressed;
+}
+
+/// @brief The deflate_stream_free function frees the pieces of a stream.
+/// @param stream The stream to free.
+void deflate_stream_free(DEFLATE_STREAM* stream) {
+    for(size_t i = 0; i < stream->num_pieces; i++)
+        deflate_buffer_free(&stream->pieces[i].out);
+    free(stream->pieces);
+    stream->pieces = NULL;
+    stream->num_pieces = 0;
+}
+
+/// @brief The deflate_zlib_header function fills in the two byte zlib header
+///        for a 32 KB window, flagging how hard the compressor tried.
+/// @param level The compression level.
+/// @param header Where to store the header.
+void deflate_zlib_header(int level, unsigned char header[2]) {
+    unsigned int flevel = level <= 1 ? 0 : level <= 5 ? 1 : level == 6 ? 2 : 3;
+    header[0] = 0x78;
+    header[1] = (unsigned char) (flevel << 6);
+    header[1] |= (unsigned char) (31 - (header[0] * 256 + header[1]) % 31);
+}
+
+/// @brief The deflate_zlib function compresses the input into one complete
+///        zlib stream.
+/// @param data The input.
+/// @param length The length of the input.
+/// @param level The compression level, from 0 (stored) to 9 (smallest).
+/// @param pool The pool to compress on, or NULL to compress in this thread.
+/// @param out The buffer to append the stream to.
+/// @return True if the stream was compressed, false if memory ran out.
+bool deflate_zlib(const unsigned char* data, size_t length, int level, POOL* pool,
+                    DEFLATE_BUFFER* out) {
+    DEFLATE_STREAM stream;
+    unsigned char header[2];
+    unsigned char trailer[4];
+
+    if(!deflate_parallel(data, length, 0, level, pool, &stream)) {
+        deflate_stream_free(&stream);
+        return false;
+    }
+    deflate_zlib_header(level, header);
+    put_bytes(out, header, 2);
+    for(size_t i = 0; i < stream.num_pieces; i++)
+        put_bytes(out, stream.pieces[i].out.data, stream.pieces[i].out.length);
+    for(int i = 0; i < 4; i++)
+        trailer[i] = (unsigned char) (stream.adler >> (8 * (3 - i)));
+    put_bytes(out, trailer, 4);
+
+    deflate_stream_free(&stream);
+    return !out->error;
+}
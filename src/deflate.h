@@ -0,0 +1,121 @@
+///
+/// @file deflate.h
+/// @brief DEFLATE and zlib encoder header
+/// @author Sam Cordry
+
+#ifndef DEFLATE_H
+#define DEFLATE_H
+
+// include needed system libraries
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "pool.h"
+
+/// @brief The size of the sliding window, and of the preset dictionary each
+///        block is primed with.
+#define DEFLATE_WINDOW 32768
+
+/// @brief The amount of input compressed by each job of a parallel stream.
+#define DEFLATE_CHUNK (1 << 18)
+
+/// @brief The number of bits in a match finder hash.
+#define DEFLATE_HASH_BITS 15
+
+/// @brief The number of symbols collected before a Huffman block is written.
+#define DEFLATE_BLOCK_TOKENS (1 << 15)
+
+/// @brief The level used when none is given, and the highest level.
+#define DEFLATE_DEFAULT_LEVEL 6
+#define DEFLATE_MAX_LEVEL 9
+
+/// @brief Growable output buffer with a bit writer on the end
+typedef struct {
+    unsigned char* data; ///< bytes written so far
+    size_t length; ///< number of whole bytes written
+    size_t capacity; ///< allocated size of data
+    uint64_t bits; ///< pending bits, least significant first
+    unsigned int count; ///< number of pending bits
+    bool error; ///< set once compressing into the buffer has failed, nothing more is written
+} DEFLATE_BUFFER;
+
+/// @brief How hard the match finder tries at one compression level
+typedef struct {
+    unsigned int good_length; ///< match length past which chains are cut to a quarter
+    unsigned int max_lazy; ///< match length past which no better match is looked for
+    unsigned int nice_length; ///< match length that stops a chain walk
+    unsigned int max_chain; ///< most candidates checked per position
+    bool lazy; ///< whether each match waits to see if the next position does better
+} DEFLATE_CONFIG;
+
+/// @brief Counts how many bytes two positions have in common
+typedef size_t (*DEFLATE_MATCH_FUNC)(const unsigned char* a, const unsigned char* b, size_t max);
+
+/// @brief Compressor state, reusable across any number of pieces
+typedef struct {
+    int level; ///< compression level
+    DEFLATE_CONFIG config; ///< match finder settings for the level
+    DEFLATE_MATCH_FUNC match_length; ///< widest match compare the CPU supports
+    const unsigned char* base; ///< start of the dictionary, positions count from here
+    int32_t limit; ///< position just past the end of the piece
+    int32_t block; ///< position the current block starts at
+    int32_t emitted; ///< position just past the last token
+    bool last; ///< whether the piece ends the stream
+    int32_t head[1 << DEFLATE_HASH_BITS]; ///< most recent position with each hash
+    int32_t* prev; ///< previous position with the same hash, per position
+    size_t prev_capacity; ///< number of positions prev has room for
+    uint8_t length_symbol[256]; ///< length symbol minus 257, by length minus 3
+    uint8_t dist_symbol[512]; ///< distance symbol, see dist_to_symbol
+    uint16_t lit[DEFLATE_BLOCK_TOKENS]; ///< literal byte or match length
+    uint16_t dist[DEFLATE_BLOCK_TOKENS]; ///< match distance, 0 for a literal
+    size_t num_tokens; ///< number of tokens in the current block
+    uint32_t litlen_freq[286]; ///< literal/length symbol counts
+    uint32_t dist_freq[30]; ///< distance symbol counts
+    size_t extra_bits; ///< extra bits needed by the current block's matches
+    DEFLATE_BUFFER* out; ///< where the compressed data goes
+} DEFLATE_STATE;
+
+/// @brief One independently compressed piece of a parallel stream
+typedef struct {
+    const unsigned char* data; ///< whole input, so the dictionary can be read
+    size_t start; ///< offset of the first byte of the piece
+    size_t end; ///< offset just past the last byte of the piece
+    bool last; ///< whether the piece ends the stream
+    bool restart; ///< whether the piece starts a segment with no dictionary
+    int level; ///< compression level
+    DEFLATE_BUFFER out; ///< compressed piece, ending on a byte boundary
+    unsigned long adler; ///< Adler-32 of the piece's input
+} DEFLATE_PIECE;
+
+/// @brief A zlib stream compressed as independent pieces, ready to be stitched
+typedef struct {
+    DEFLATE_PIECE* pieces; ///< pieces in stream order
+    size_t num_pieces; ///< number of pieces
+    unsigned long adler; ///< Adler-32 of the whole input
+} DEFLATE_STREAM;
+
+// buffer functions
+void deflate_buffer_init(DEFLATE_BUFFER* buffer);
+void deflate_buffer_reset(DEFLATE_BUFFER* buffer);
+void deflate_buffer_free(DEFLATE_BUFFER* buffer);
+
+// compressor functions
+DEFLATE_STATE* deflate_state_create(int level);
+void deflate_state_free(DEFLATE_STATE* state);
+
+// deflate functions
+bool deflate_compress(DEFLATE_STATE* state, const unsigned char* data, size_t start, size_t end,
+                        bool last, DEFLATE_BUFFER* out);
+bool deflate_raw(const unsigned char* data, size_t start, size_t end, bool last, int level,
+                    DEFLATE_BUFFER* out);
+bool deflate_parallel(const unsigned char* data, size_t length, size_t segment, int level,
+                        POOL* pool, DEFLATE_STREAM* stream);
+void deflate_stream_free(DEFLATE_STREAM* stream);
+void deflate_zlib_header(int level, unsigned char header[2]);
+bool deflate_zlib(const unsigned char* data, size_t length, int level, POOL* pool,
+                    DEFLATE_BUFFER* out);
+
+#endif
@@ -1,17 +1,23 @@
 ///
-/// @file fcc.c
+/// @file ffc.c
 /// @brief The main file for the File Format Converter (FFC) program.
 /// @author Sam Cordry
 
+// clock_gettime is POSIX
+#define _POSIX_C_SOURCE 200809L
+
 // include needed system headers
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <time.h>
 
 // include the headers for the supported file formats
 #include "png.h"
+#include "apng.h"
 #include "jpeg.h"
+#include "deflate.h"
 
 /// @brief The is_valid_ext function checks if the given extension can be used.
 /// @param extension The extension to check.
@@ -23,13 +29,13 @@ bool is_valid_ext(char* extension) {
 
 /// @brief The find_extension function finds the index of the extension.
 /// @param filename The filename to search for an extension in.
-/// @return The index of the extension.
+/// @return The index of the extension, 0 if there is none.
 int find_extension(char* filename) {
-    for(size_t i = strlen(filename) - 1; i >= 0; i--)
-        if(filename[i] == '.')
-            return i + 1;
-    
-    return 0;
+    char* dot = strrchr(filename, '.');
+    if(dot == NULL)
+        return 0;
+
+    return (int) (dot - filename) + 1;
 }
 
 /// @brief The is_option function checks if the given argument is an option.
@@ -37,7 +43,371 @@ int find_extension(char* filename) {
 /// @return True if the argument is an option, false otherwise.
 bool is_option(char* arg) {
     return strcmp(arg, "-o") == 0 || strcmp(arg, "--overwrite") == 0 ||
-        strcmp(arg, "-v") == 0 || strcmp(arg, "--verbose") == 0;
+        strcmp(arg, "-v") == 0 || strcmp(arg, "--verbose") == 0 ||
+        strcmp(arg, "-b") == 0 || strcmp(arg, "--benchmark") == 0 ||
+        strcmp(arg, "-f") == 0 || strcmp(arg, "--filter") == 0 ||
+        strcmp(arg, "-l") == 0 || strcmp(arg, "--level") == 0 ||
+        strcmp(arg, "-i") == 0 || strcmp(arg, "--index") == 0 ||
+        strcmp(arg, "-q") == 0 || strcmp(arg, "--quality") == 0 ||
+        strcmp(arg, "-r") == 0 || strcmp(arg, "--restart") == 0 ||
+        strcmp(arg, "-t") == 0 || strcmp(arg, "--tables") == 0 ||
+        strcmp(arg, "-p") == 0 || strcmp(arg, "--progressive") == 0;
+}
+
+/// @brief The names of the PNG filter strategies, in the order the benchmark
+///        runs them. The first five are fixed filter types.
+static const char* filter_names[] = { "none", "sub", "up", "average", "paeth", "minsum", "brute" };
+
+/// @brief The parse_filter function turns a filter strategy name into PNG
+///        encoding options.
+/// @param name The name of the strategy.
+/// @param options Where to store the options.
+/// @return True if the name is a known strategy, false otherwise.
+bool parse_filter(const char* name, PNG_ENCODE_OPTIONS* options) {
+    for(int i = 0; i < 7; i++) {
+        if(strcmp(name, filter_names[i]) != 0)
+            continue;
+        options->filter = i < 5 ? (unsigned char) i : FILTER_NONE;
+        if(i < 5)
+            options->strategy = FILTER_STRATEGY_FIXED;
+        else if(i == 5)
+            options->strategy = FILTER_STRATEGY_MINSUM;
+        else
+            options->strategy = FILTER_STRATEGY_BRUTE;
+        return true;
+    }
+
+    return false;
+}
+
+/// @brief The parse_level function turns a compression level argument into
+///        PNG encoding options.
+/// @param arg The level, a single digit.
+/// @param options Where to store the options.
+/// @return True if the level is valid, false otherwise.
+bool parse_level(const char* arg, PNG_ENCODE_OPTIONS* options) {
+    if(strlen(arg) != 1 || arg[0] < '0' || arg[0] > '0' + DEFLATE_MAX_LEVEL)
+        return false;
+    options->level = arg[0] - '0';
+    return true;
+}
+
+/// @brief The parse_index function turns a row count argument into PNG
+///        encoding options, indexing a full flush point every so many rows.
+/// @param arg The number of rows, a positive integer.
+/// @param options Where to store the options.
+/// @return True if the row count is valid, false otherwise.
+bool parse_index(const char* arg, PNG_ENCODE_OPTIONS* options) {
+    char* end;
+    unsigned long rows = strtoul(arg, &end, 10);
+    if(*arg == '\0' || *arg == '-' || *end != '\0' || rows == 0 || rows > 0x7FFFFFFF)
+        return false;
+    options->index_rows = (unsigned int) rows;
+    return true;
+}
+
+/// @brief The parse_quality function turns a quality argument into JPEG
+///        encoding options.
+/// @param arg The quality, from 1 to 100.
+/// @param options Where to store the options.
+/// @return True if the quality is valid, false otherwise.
+bool parse_quality(const char* arg, JPEG_ENCODE_OPTIONS* options) {
+    char* end;
+    long quality = strtol(arg, &end, 10);
+    if(*arg == '\0' || *end != '\0' || quality < 1 || quality > 100)
+        return false;
+    options->quality = (int) quality;
+    return true;
+}
+
+/// @brief The parse_restart function turns a row count argument into JPEG
+///        encoding options, with a restart marker every so many MCU rows.
+/// @param arg The number of MCU rows, a positive integer.
+/// @param options Where to store the options.
+/// @return True if the row count is valid, false otherwise.
+bool parse_restart(const char* arg, JPEG_ENCODE_OPTIONS* options) {
+    char* end;
+    unsigned long rows = strtoul(arg, &end, 10);
+    if(*arg == '\0' || *arg == '-' || *end != '\0' || rows == 0 || rows > 65535)
+        return false;
+    options->restart_rows = (unsigned int) rows;
+    return true;
+}
+
+/// @brief The jpeg_to_png function decodes a JPEG to pixels and writes them
+///        as an 8-bit gray or RGB PNG.
+/// @param jpeg The JPEG to decode.
+/// @param options How to encode the PNG.
+/// @param file The file to write to.
+/// @return True if the file was written, false otherwise.
+bool jpeg_to_png(JPEG* jpeg, const PNG_ENCODE_OPTIONS* options, FILE* file) {
+    unsigned int width, height, channels;
+    unsigned char* pixels = jpeg_decode(jpeg, NULL, &width, &height, &channels);
+    if(pixels == NULL)
+        return false;
+
+    // describe the pixels with a header of their own
+    PNG* png = png_create();
+    IHDR* ihdr = calloc(1, sizeof(IHDR));
+    bool written = false;
+    if(png != NULL && ihdr != NULL) {
+        ihdr->width = width;
+        ihdr->height = height;
+        ihdr->bit_depth = 8;
+        ihdr->color_type = channels == 1 ? 0 : 2;
+        png->ihdr = ihdr;
+        ihdr = NULL;
+        written = png_encode(png, pixels, options, file);
+    }
+    free(ihdr);
+    png_free(png);
+    free(pixels);
+
+    return written;
+}
+
+/// @brief The png_pixels function decodes a PNG to pixels a JPEG can be
+///        encoded from, gray if the PNG is gray and RGBA otherwise.
+/// @param png The PNG to decode.
+/// @param channels Set to the samples in each pixel, 1 or 4.
+/// @return The pixels, or NULL on failure. The caller frees them.
+unsigned char* png_pixels(PNG* png, unsigned int* channels) {
+    size_t length;
+    unsigned char* scanlines = png_decode(png, NULL, &length);
+    if(scanlines == NULL)
+        return NULL;
+    unsigned char* pixels = png_unpack(png, scanlines, PIXEL_RGBA8, &length);
+    free(scanlines);
+    if(pixels == NULL)
+        return NULL;
+
+    // gray images keep one sample per pixel
+    *channels = 4;
+    if(png->ihdr->color_type == 0 || png->ihdr->color_type == 4) {
+        for(size_t i = 0; i < (size_t) png->ihdr->width * png->ihdr->height; i++)
+            pixels[i] = pixels[4 * i];
+        *channels = 1;
+    }
+
+    return pixels;
+}
+
+/// @brief The png_to_jpeg function decodes a PNG to pixels and writes them as
+///        a JPEG, gray if the PNG is gray. Alpha is dropped.
+/// @param png The PNG to decode.
+/// @param options How to encode the JPEG.
+/// @param file The file to write to.
+/// @return True if the file was written, false otherwise.
+bool png_to_jpeg(PNG* png, const JPEG_ENCODE_OPTIONS* options, FILE* file) {
+    unsigned int channels;
+    unsigned char* pixels = png_pixels(png, &channels);
+    if(pixels == NULL)
+        return false;
+
+    JPEG* jpeg = jpeg_encode(pixels, png->ihdr->width, png->ihdr->height, channels, options);
+    free(pixels);
+    bool written = jpeg != NULL && jpeg_write(jpeg, file);
+    jpeg_free(jpeg);
+
+    return written;
+}
+
+/// @brief The BENCHMARK_SECONDS constant is how long a timed stage is repeated
+///        for, at least, before its fastest run is reported.
+#define BENCHMARK_SECONDS 0.5
+
+/// @brief The seconds_between function finds the time between two clock
+///        readings.
+/// @param start The earlier reading.
+/// @param end The later reading.
+/// @return The difference in seconds.
+double seconds_between(const struct timespec* start, const struct timespec* end) {
+    return (double) (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/// @brief The benchmark_inflate function decompresses the image data of a PNG
+///        repeatedly and reports the fastest run's throughput.
+/// @param png The PNG to decompress.
+/// @return True if the data decompressed, false otherwise.
+bool benchmark_inflate(PNG* png) {
+    size_t compressed = 0;
+    for(unsigned int i = 0; i < png->num_idat_chunks; i++)
+        compressed += png->idat[i].length;
+    size_t raw = png_raw_size(png->ihdr);
+    unsigned char* scanlines = malloc(raw);
+    if(scanlines == NULL)
+        return false;
+
+    // repeat until enough time has passed to trust the fastest run
+    double best = 0, total = 0;
+    for(int run = 0; run < 3 || total < BENCHMARK_SECONDS; run++) {
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        bool inflated = png_inflate(png, scanlines, raw);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        if(!inflated) {
+            free(scanlines);
+            return false;
+        }
+        double seconds = seconds_between(&start, &end);
+        best = run == 0 || seconds < best ? seconds : best;
+        total += seconds;
+    }
+    free(scanlines);
+
+    printf("%-10s %12s %12s %10s %10s\n", "stage", "bytes in", "bytes out", "seconds", "MB/s");
+    printf("%-10s %12zu %12zu %10.4f %10.1f\n\n", "inflate", compressed, raw, best,
+            raw / best / 1e6);
+
+    return true;
+}
+
+/// @brief The benchmark_jpeg_decode function entropy decodes the scans of a
+///        JPEG to coefficients, then decodes it all the way to pixels, each
+///        repeatedly, and reports the fastest run's throughput of
+///        entropy-coded data.
+/// @param jpeg The JPEG to decode.
+/// @return True if the JPEG decoded, false otherwise.
+bool benchmark_jpeg_decode(JPEG* jpeg) {
+    static const char* stage_names[] = { "huffman", "decode" };
+    size_t coded = 0;
+    for(int i = 0; i < jpeg->num_scans; i++)
+        coded += jpeg->scans[i].length - (size_t) jpeg->scans[i].header_length;
+
+    printf("%-10s %12s %12s %10s %10s\n", "stage", "bytes in", "bytes out", "seconds", "MB/s in");
+    for(int stage = 0; stage < 2; stage++) {
+        // repeat until enough time has passed to trust the fastest run
+        double best = 0, total = 0;
+        size_t out = 0;
+        for(int run = 0; run < 3 || total < BENCHMARK_SECONDS; run++) {
+            struct timespec start, end;
+            bool decoded;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            if(stage == 0) {
+                JPEG_IMAGE* image = jpeg_decode_coefficients(jpeg);
+                clock_gettime(CLOCK_MONOTONIC, &end);
+                decoded = image != NULL;
+                out = 0;
+                for(int c = 0; decoded && c < image->num_components; c++)
+                    out += (size_t) image->components[c].blocks_wide *
+                            image->components[c].blocks_high * 64 * sizeof(int16_t);
+                jpeg_image_free(image);
+            } else {
+                unsigned int width, height, channels;
+                unsigned char* pixels = jpeg_decode(jpeg, NULL, &width, &height, &channels);
+                clock_gettime(CLOCK_MONOTONIC, &end);
+                decoded = pixels != NULL;
+                out = (size_t) width * height * channels;
+                free(pixels);
+            }
+            if(!decoded)
+                return false;
+            double seconds = seconds_between(&start, &end);
+            best = run == 0 || seconds < best ? seconds : best;
+            total += seconds;
+        }
+        printf("%-10s %12zu %12zu %10.4f %10.1f\n", stage_names[stage], coded, out, best,
+                coded / best / 1e6);
+    }
+
+    return true;
+}
+
+/// @brief The benchmark_filters function re-encodes a PNG with every filter
+///        strategy and reports the size of each against the time it took.
+/// @param png The PNG to re-encode.
+/// @param filename The name of the original file, to compare sizes with.
+/// @param level The compression level to encode at.
+/// @return True if every strategy encoded, false otherwise.
+bool benchmark_filters(PNG* png, const char* filename, int level) {
+    // find the size of the original file
+    FILE* original = fopen(filename, "rb");
+    if(original == NULL || fseek(original, 0, SEEK_END) != 0) {
+        if(original != NULL)
+            fclose(original);
+        return false;
+    }
+    long original_size = ftell(original);
+    fclose(original);
+
+    printf("%-10s %12s %12s %10s\n", "filter", "bytes", "saved", "seconds");
+    for(int i = 0; i < 7; i++) {
+        PNG_ENCODE_OPTIONS options;
+        parse_filter(filter_names[i], &options);
+        options.level = level;
+        options.index_rows = 0;
+
+        // encode to a scratch file and time it
+        FILE* scratch = tmpfile();
+        if(scratch == NULL)
+            return false;
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        bool encoded = png_reencode(png, &options, scratch);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        long size = ftell(scratch);
+        fclose(scratch);
+        if(!encoded)
+            return false;
+
+        double seconds = seconds_between(&start, &end);
+        printf("%-10s %12ld %12ld %10.3f\n", filter_names[i], size, original_size - size, seconds);
+    }
+
+    return true;
+}
+
+/// @brief The benchmark_jpeg function encodes a PNG as a baseline JPEG, as a
+///        baseline JPEG with optimized tables, and as a progressive JPEG, and
+///        reports the size of each against the time it took.
+/// @param png The PNG to encode.
+/// @param options The quality, subsampling and restart interval to encode at.
+/// @return True if every mode encoded, false otherwise.
+bool benchmark_jpeg(PNG* png, const JPEG_ENCODE_OPTIONS* options) {
+    static const char* mode_names[] = { "baseline", "optimized", "progressive" };
+    unsigned int channels;
+    unsigned char* pixels = png_pixels(png, &channels);
+    if(pixels == NULL)
+        return false;
+
+    long baseline_size = 0;
+    printf("%-12s %12s %12s %10s\n", "mode", "bytes", "saved", "seconds");
+    for(int i = 0; i < 3; i++) {
+        JPEG_ENCODE_OPTIONS mode = *options;
+        mode.progressive = i == 2;
+
+        // encode to a scratch file and time it, optimizing the baseline's tables after
+        FILE* scratch = tmpfile();
+        if(scratch == NULL) {
+            free(pixels);
+            return false;
+        }
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        JPEG* jpeg = jpeg_encode(pixels, png->ihdr->width, png->ihdr->height, channels, &mode);
+        if(jpeg != NULL && i == 1) {
+            JPEG* optimized = jpeg_optimize(jpeg);
+            jpeg_free(jpeg);
+            jpeg = optimized;
+        }
+        bool encoded = jpeg != NULL && jpeg_write(jpeg, scratch);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        long size = ftell(scratch);
+        fclose(scratch);
+        jpeg_free(jpeg);
+        if(!encoded) {
+            free(pixels);
+            return false;
+        }
+
+        if(i == 0)
+            baseline_size = size;
+        double seconds = seconds_between(&start, &end);
+        printf("%-12s %12ld %12ld %10.3f\n", mode_names[i], size, baseline_size - size, seconds);
+    }
+    free(pixels);
+
+    return true;
 }
 
 /// @brief The main function for the File Format Converter (FFC) program.
@@ -46,24 +416,49 @@ bool is_option(char* arg) {
 /// @return The exit status of the program.
 int main(int argc, char** argv) {
     // print usage statement if too many arguments are provided
-    if(argc > 5) {
-        printf("Usage: fcc [-o/--overwrite] [-v/--verbose] [filename]\n");
+    if(argc > 17) {
+        printf("Usage: ffc [-o/--overwrite] [-v/--verbose] [-f/--filter strategy] [-l/--level 0-9] [-i/--index rows] [-q/--quality 1-100] [-r/--restart rows] [-t/--tables] [-p/--progressive] [-b/--benchmark] [filename]\n");
         return EXIT_FAILURE;
     }
 
     // print help statement if requested
     if(strcmp(argv[argc - 1], "--help") == 0 || strcmp(argv[argc - 1], "-h") == 0) {
-        printf("Command: fcc\n");
-        printf("Usage: fcc [-o/--overwrite] [-v/--verbose] [filename]\n");
+        printf("Command: ffc\n");
+        printf("Usage: ffc [-o/--overwrite] [-v/--verbose] [-f/--filter strategy] [-l/--level 0-9] [-i/--index rows] [-q/--quality 1-100] [-r/--restart rows] [-t/--tables] [-p/--progressive] [-b/--benchmark] [filename]\n");
         printf("Options:\n");
         printf("\t-o, --overwrite\t\tAutomatically overwrite converted file (if one exists already).\n");
         printf("\t-v, --verbose\t\tPrint additional information.\n");
+        printf("\t-f, --filter\t\tRe-encode PNG output choosing row filters by none, sub, up, average,\n");
+        printf("\t\t\t\tpaeth, minsum or brute.\n");
+        printf("\t-l, --level\t\tRe-encode PNG output at a compression level from 0 (stored) to 9\n");
+        printf("\t\t\t\t(smallest), 6 by default.\n");
+        printf("\t-i, --index\t\tRe-encode PNG output with a full flush point every given number of\n");
+        printf("\t\t\t\trows, indexed so that readers can decode it in parallel.\n");
+        printf("\t-q, --quality\t\tEncode JPEG output from a PNG at a quality from 1 to 100, 75 by\n");
+        printf("\t\t\t\tdefault.\n");
+        printf("\t-r, --restart\t\tEncode JPEG output from a PNG with a restart marker every given\n");
+        printf("\t\t\t\tnumber of MCU rows, coding the rows between them in parallel.\n");
+        printf("\t-t, --tables\t\tRewrite JPEG output from a JPEG with optimal Huffman tables,\n");
+        printf("\t\t\t\twithout changing its pixels.\n");
+        printf("\t-p, --progressive\tEncode JPEG output from a PNG as a progressive JPEG, with\n");
+        printf("\t\t\t\toptimized Huffman tables for each scan.\n");
+        printf("\t-b, --benchmark\t\tTime decompressing a PNG, in MB/s of image data, and compare the\n");
+        printf("\t\t\t\tsize and encode time of every PNG filter strategy, or with -q, -r\n");
+        printf("\t\t\t\tor -p of baseline and progressive JPEG output. For a JPEG, time\n");
+        printf("\t\t\t\tHuffman decoding and full decoding, in MB/s of entropy-coded data.\n");
         return EXIT_SUCCESS;
     }
 
     // search the arguments for requested options
     bool overwrite = false;
     bool verbose = false;
+    bool benchmark = false;
+    bool reencode = false;
+    bool optimize = false;
+    PNG_ENCODE_OPTIONS options = { FILTER_STRATEGY_AUTO, FILTER_NONE, DEFLATE_DEFAULT_LEVEL, 0 };
+    bool jpeg_output = false;
+    JPEG_ENCODE_OPTIONS jpeg_options = { JPEG_DEFAULT_QUALITY, JPEG_SUBSAMPLE_420, 0, 0, false,
+                                            NULL, 0 };
     if(argc > 1) {
         for(int i = 1; i < argc - 1; i++) {
             if(strcmp(argv[i], "--overwrite") == 0 || strcmp(argv[i], "-o") == 0)
@@ -75,9 +470,42 @@ int main(int argc, char** argv) {
                 overwrite = true;
                 verbose = true;
             }
+            else if(strcmp(argv[i], "--benchmark") == 0 || strcmp(argv[i], "-b") == 0)
+                benchmark = true;
+            else if(strcmp(argv[i], "--tables") == 0 || strcmp(argv[i], "-t") == 0)
+                optimize = true;
+            else if(strcmp(argv[i], "--progressive") == 0 || strcmp(argv[i], "-p") == 0) {
+                jpeg_options.progressive = true;
+                jpeg_output = true;
+            }
+            else if((strcmp(argv[i], "--filter") == 0 || strcmp(argv[i], "-f") == 0) &&
+                                    i + 1 < argc - 1 && parse_filter(argv[i + 1], &options)) {
+                reencode = true;
+                i++;
+            }
+            else if((strcmp(argv[i], "--level") == 0 || strcmp(argv[i], "-l") == 0) &&
+                                    i + 1 < argc - 1 && parse_level(argv[i + 1], &options)) {
+                reencode = true;
+                i++;
+            }
+            else if((strcmp(argv[i], "--index") == 0 || strcmp(argv[i], "-i") == 0) &&
+                                    i + 1 < argc - 1 && parse_index(argv[i + 1], &options)) {
+                reencode = true;
+                i++;
+            }
+            else if((strcmp(argv[i], "--quality") == 0 || strcmp(argv[i], "-q") == 0) &&
+                                    i + 1 < argc - 1 && parse_quality(argv[i + 1], &jpeg_options)) {
+                jpeg_output = true;
+                i++;
+            }
+            else if((strcmp(argv[i], "--restart") == 0 || strcmp(argv[i], "-r") == 0) &&
+                                    i + 1 < argc - 1 && parse_restart(argv[i + 1], &jpeg_options)) {
+                jpeg_output = true;
+                i++;
+            }
             else {
                 printf("Error: Invalid argument provided.\n");
-                printf("Usage: fcc [-o/--overwrite] [-v/--verbose] [filename]\n");
+                printf("Usage: ffc [-o/--overwrite] [-v/--verbose] [-f/--filter strategy] [-l/--level 0-9] [-i/--index rows] [-q/--quality 1-100] [-r/--restart rows] [-t/--tables] [-p/--progressive] [-b/--benchmark] [filename]\n");
                 return EXIT_FAILURE;
             }
         }
@@ -88,6 +516,12 @@ int main(int argc, char** argv) {
         printf("Verbose mode enabled.\n");
         if(overwrite)
             printf("Overwrite mode enabled.\n");
+        if(reencode)
+            printf("PNG output will be re-encoded.\n");
+        if(optimize)
+            printf("JPEG output will have optimized Huffman tables.\n");
+        if(jpeg_options.progressive)
+            printf("JPEG output will be progressive.\n");
     }
 
     // create filename with default terminal width
@@ -115,13 +549,56 @@ int main(int argc, char** argv) {
         return EXIT_FAILURE;
     }
     
-    // open the file
-    FILE* start_file = fopen(filename, "r");
-    if(start_file == NULL) {
+    // open the file, mapping it into memory if possible
+    SOURCE start_source;
+    if(!source_open_file(&start_source, filename)) {
         printf("Error: Unable to open file.\n");
         return EXIT_FAILURE;
     }
 
+    // time decoding and compare the PNG filter strategies, or the JPEG modes,
+    // instead of converting, or time decoding a JPEG
+    if(benchmark && strcmp(extension, "png") != 0) {
+        if(jpeg_output) {
+            printf("Error: -q, -r and -p only apply to JPEG output from a PNG.\n");
+            return EXIT_FAILURE;
+        }
+        if(reencode) {
+            printf("Error: -f, -l and -i only apply to PNG output.\n");
+            return EXIT_FAILURE;
+        }
+        if(optimize) {
+            printf("Error: -t only applies to JPEG output from a JPEG.\n");
+            return EXIT_FAILURE;
+        }
+        JPEG* bench_jpeg = jpeg_create();
+        if(bench_jpeg == NULL || !jpeg_read(bench_jpeg, &start_source) ||
+                !benchmark_jpeg_decode(bench_jpeg)) {
+            printf("Error: Unable to benchmark JPEG file.\n");
+            return EXIT_FAILURE;
+        }
+        jpeg_free(bench_jpeg);
+        source_close(&start_source);
+        return EXIT_SUCCESS;
+    }
+    if(benchmark) {
+        if(optimize) {
+            printf("Error: -t only applies to JPEG output from a JPEG.\n");
+            return EXIT_FAILURE;
+        }
+        PNG* bench_png = png_create();
+        if(!png_read(bench_png, &start_source) ||
+                (jpeg_output ? !benchmark_jpeg(bench_png, &jpeg_options) :
+                    !benchmark_inflate(bench_png) ||
+                    !benchmark_filters(bench_png, filename, options.level))) {
+            printf("Error: Unable to benchmark PNG file.\n");
+            return EXIT_FAILURE;
+        }
+        png_free(bench_png);
+        source_close(&start_source);
+        return EXIT_SUCCESS;
+    }
+
     // prompt the user for the output file format
     char* end_extension = malloc(5);
     printf("What should the output file format be (png, jpeg, or jpg)? ");
@@ -133,6 +610,24 @@ int main(int argc, char** argv) {
         return EXIT_FAILURE;
     }
 
+    // the JPEG encoding options only apply when a PNG is encoded as a JPEG,
+    // since JPEG input is copied with its own coding
+    if(jpeg_output && (strcmp(extension, "png") != 0 || strcmp(end_extension, "png") == 0)) {
+        printf("Error: -q, -r and -p only apply to JPEG output from a PNG.\n");
+        return EXIT_FAILURE;
+    }
+
+    // the PNG encoding options only apply to PNG output, and optimizing the
+    // Huffman tables only to a JPEG copied as a JPEG
+    if(reencode && strcmp(end_extension, "png") != 0) {
+        printf("Error: -f, -l and -i only apply to PNG output.\n");
+        return EXIT_FAILURE;
+    }
+    if(optimize && (strcmp(extension, "png") == 0 || strcmp(end_extension, "png") == 0)) {
+        printf("Error: -t only applies to JPEG output from a JPEG.\n");
+        return EXIT_FAILURE;
+    }
+
     // prompt the user for the output filename
     char* end_filename = malloc(81);
     end_filename[0] = '\0';
@@ -147,22 +642,36 @@ int main(int argc, char** argv) {
         printf("Error: File already exists. Run again with -o or --overwrite to overwrite this file.\n");
         return EXIT_FAILURE;
     }
-    fclose(end_file);
+    if(end_file != NULL)
+        fclose(end_file);
+
+    // PNG to PNG passes stream chunk by chunk instead of loading the image,
+    // unless the image data is being re-encoded
+    if(strcmp(extension, "png") == 0 && strcmp(end_extension, "png") == 0 && !reencode) {
+        end_file = fopen(end_filename, "w");
+        if(!png_stream_copy(&start_source, end_file, 0, false)) {
+            printf("Error: Unable to copy PNG file.\n");
+            return EXIT_FAILURE;
+        }
+        source_close(&start_source);
+        fclose(end_file);
+        return EXIT_SUCCESS;
+    }
     
     // create pointers to structs for all supported file formats
-    PNG* png;
-    JPEG* jpeg;
+    PNG* png = NULL;
+    JPEG* jpeg = NULL;
 
     // read the file as the appropriate format
     if(strcmp(extension, "png") == 0) {
         png = png_create();
-        if(!png_read(png, start_file)) {
+        if(!png_read(png, &start_source)) {
             printf("Error: Unable to read PNG file.\n");
             return EXIT_FAILURE;
         }
     } else if(strcmp(extension, "jpeg") == 0 || strcmp(extension, "jpg") == 0) {
         jpeg = jpeg_create();
-        if(!jpeg_read(jpeg, start_file)) {
+        if(jpeg == NULL || !jpeg_read(jpeg, &start_source)) {
             printf("Error: Unable to read JPEG file.\n");
             return EXIT_FAILURE;
         }
@@ -171,22 +680,52 @@ int main(int argc, char** argv) {
     // write the file as the appropriate format
     if(strcmp(end_extension, "png") == 0) {
         end_file = fopen(end_filename, "w");
-        if(!png_write(png, end_file)) {
+
+        // JPEGs are decoded to pixels, and animations are re-encoded frame by
+        // frame to keep every frame
+        bool written;
+        if(strcmp(extension, "png") != 0)
+            written = jpeg_to_png(jpeg, &options, end_file);
+        else if(!reencode)
+            written = png_write(png, end_file);
+        else if(png->actl != NULL)
+            written = apng_reencode(png, &options, end_file);
+        else
+            written = png_reencode(png, &options, end_file);
+        if(!written) {
             printf("Error: Unable to write PNG file.\n");
             return EXIT_FAILURE;
         }
-        png_free(png);
+        if(strcmp(extension, "png") != 0)
+            jpeg_free(jpeg);
+        else
+            png_free(png);
     } else if(strcmp(end_extension, "jpeg") == 0 || strcmp(end_extension, "jpg") == 0) {
         end_file = fopen(end_filename, "w");
-        if(!jpeg_write(jpeg, end_file)) {
+
+        // PNGs are decoded to pixels and encoded, and JPEGs are copied,
+        // their scans coded again if the tables are optimized
+        bool written;
+        if(strcmp(extension, "png") == 0)
+            written = png_to_jpeg(png, &jpeg_options, end_file);
+        else if(optimize) {
+            JPEG* optimized = jpeg_optimize(jpeg);
+            written = optimized != NULL && jpeg_write(optimized, end_file);
+            jpeg_free(optimized);
+        } else
+            written = jpeg_write(jpeg, end_file);
+        if(!written) {
             printf("Error: Unable to write JPEG file.\n");
             return EXIT_FAILURE;
         }
-        jpeg_free(jpeg);
+        if(strcmp(extension, "png") == 0)
+            png_free(png);
+        else
+            jpeg_free(jpeg);
     }
 
     // close the files
-    fclose(start_file);
+    source_close(&start_source);
     fclose(end_file);
     
     return EXIT_SUCCESS;
@@ -0,0 +1,899 @@
+///
+/// @file filter.c
+/// @brief PNG scanline filter implementation
+/// @author Sam Cordry
+
+#include "filter.h"
+#include "cpu.h"
+#include "deflate.h"
+
+#ifdef CPU_X86
+#include <immintrin.h>
+#endif
+
+/// @brief The MEM_CHECK macro checks if the given pointer is NULL.
+#define MEM_CHECK(ptr) if(ptr == NULL) { printf("Unable to allocate memory");\
+                                            return false; }
+
+/// @brief The sub_scalar function undoes the Sub filter one byte at a time.
+/// @param row The row to unfilter.
+/// @param length The length of the row.
+/// @param bpp The bytes per pixel.
+static inline void sub_scalar(unsigned char* row, size_t length, unsigned int bpp) {
+    for(size_t i = bpp; i < length; i++)
+        row[i] += row[i - bpp];
+}
+
+/// @brief The up_scalar function undoes the Up filter one byte at a time.
+/// @param row The row to unfilter.
+/// @param prev The previous, already unfiltered, row.
+/// @param length The length of the row.
+static void up_scalar(unsigned char* row, const unsigned char* prev, size_t length) {
+    for(size_t i = 0; i < length; i++)
+        row[i] += prev[i];
+}
+
+/// @brief The average_scalar function undoes the Average filter one byte at
+///        a time.
+/// @param row The row to unfilter.
+/// @param prev The previous, already unfiltered, row.
+/// @param length The length of the row.
+/// @param bpp The bytes per pixel.
+static inline void average_scalar(unsigned char* row, const unsigned char* prev,
+                                    size_t length, unsigned int bpp) {
+    size_t i = 0;
+
+    // the first pixel has nothing to its left
+    for(; i < bpp && i < length; i++)
+        row[i] += prev[i] >> 1;
+    for(; i < length; i++)
+        row[i] += (row[i - bpp] + prev[i]) >> 1;
+}
+
+/// @brief The paeth_predict function picks whichever neighbour is closest to
+///        the linear estimate left + up - upper left.
+/// @param a The byte to the left.
+/// @param b The byte above.
+/// @param c The byte above and to the left.
+/// @return The predicted byte.
+static inline unsigned char paeth_predict(int a, int b, int c) {
+    int pa = abs(b - c);
+    int pb = abs(a - c);
+    int pc = abs(a + b - 2 * c);
+
+    // written as selects so random data does not cost a misprediction per byte
+    int nearest = pb <= pc ? b : c;
+    int closest = pb <= pc ? pb : pc;
+    return (unsigned char) (pa <= closest ? a : nearest);
+}
+
+/// @brief The paeth_scalar function undoes the Paeth filter one byte at a
+///        time.
+/// @param row The row to unfilter.
+/// @param prev The previous, already unfiltered, row.
+/// @param length The length of the row.
+/// @param bpp The bytes per pixel.
+static inline void paeth_scalar(unsigned char* row, const unsigned char* prev,
+                                    size_t length, unsigned int bpp) {
+    size_t i = 0;
+
+    // with no left neighbours the predictor is always the byte above
+    for(; i < bpp && i < length; i++)
+        row[i] += prev[i];
+    for(; i < length; i++)
+        row[i] += paeth_predict(row[i - bpp], prev[i], prev[i - bpp]);
+}
+
+// scalar kernels with the bytes per pixel fixed so each loop is specialised
+#define UNFILTER_SCALAR(n) \
+static void sub_scalar_##n(unsigned char* row, const unsigned char* prev, size_t length) { \
+    (void) prev; \
+    sub_scalar(row, length, n); \
+} \
+static void average_scalar_##n(unsigned char* row, const unsigned char* prev, size_t length) { \
+    average_scalar(row, prev, length, n); \
+} \
+static void paeth_scalar_##n(unsigned char* row, const unsigned char* prev, size_t length) { \
+    paeth_scalar(row, prev, length, n); \
+}
+
+UNFILTER_SCALAR(1)
+UNFILTER_SCALAR(2)
+UNFILTER_SCALAR(3)
+UNFILTER_SCALAR(4)
+UNFILTER_SCALAR(6)
+UNFILTER_SCALAR(8)
+
+static const UNFILTER_FUNC sub_scalar_table[9] = {
+    NULL, sub_scalar_1, sub_scalar_2, sub_scalar_3, sub_scalar_4, NULL, sub_scalar_6, NULL, sub_scalar_8
+};
+static const UNFILTER_FUNC average_scalar_table[9] = {
+    NULL, average_scalar_1, average_scalar_2, average_scalar_3, average_scalar_4,
+    NULL, average_scalar_6, NULL, average_scalar_8
+};
+static const UNFILTER_FUNC paeth_scalar_table[9] = {
+    NULL, paeth_scalar_1, paeth_scalar_2, paeth_scalar_3, paeth_scalar_4,
+    NULL, paeth_scalar_6, NULL, paeth_scalar_8
+};
+
+#ifdef CPU_X86
+/// @brief The load_pixel function loads one pixel into the low bytes of a
+///        vector. When the row has room it loads a whole 4 or 8 bytes, and
+///        the lanes past the pixel hold bytes of the next one.
+/// @param p The pixel to load.
+/// @param avail The number of bytes left in the row from p.
+/// @param bpp The bytes per pixel, from 3 to 8.
+/// @return The pixel in the low lanes of a vector.
+__attribute__((target("sse2")))
+static inline __m128i load_pixel(const unsigned char* p, size_t avail, unsigned int bpp) {
+    if(bpp <= 4) {
+        uint32_t v = 0;
+        if(avail >= 4)
+            memcpy(&v, p, 4);
+        else
+            memcpy(&v, p, bpp);
+        return _mm_cvtsi32_si128((int) v);
+    }
+
+    uint64_t v = 0;
+    if(avail >= 8)
+        memcpy(&v, p, 8);
+    else
+        memcpy(&v, p, bpp);
+    return _mm_loadl_epi64((const __m128i*) &v);
+}
+
+/// @brief The store_pixel function stores the low bytes of a vector as one
+///        pixel. When the row has room it stores a whole 4 or 8 bytes, so the
+///        next pixel must already have been loaded.
+/// @param p Where to store the pixel.
+/// @param avail The number of bytes left in the row from p.
+/// @param x The vector holding the pixel.
+/// @param bpp The bytes per pixel, from 3 to 8.
+__attribute__((target("sse2")))
+static inline void store_pixel(unsigned char* p, size_t avail, __m128i x, unsigned int bpp) {
+    if(bpp <= 4) {
+        uint32_t v = (uint32_t) _mm_cvtsi128_si32(x);
+        if(avail >= 4)
+            memcpy(p, &v, 4);
+        else
+            memcpy(p, &v, bpp);
+        return;
+    }
+
+    uint64_t v;
+    _mm_storel_epi64((__m128i*) &v, x);
+    if(avail >= 8)
+        memcpy(p, &v, 8);
+    else
+        memcpy(p, &v, bpp);
+}
+
+/// @brief The up_sse2 function undoes the Up filter 16 bytes at a time.
+/// @param row The row to unfilter.
+/// @param prev The previous, already unfiltered, row.
+/// @param length The length of the row.
+__attribute__((target("sse2")))
+static void up_sse2(unsigned char* row, const unsigned char* prev, size_t length) {
+    size_t i = 0;
+
+    for(; i + 16 <= length; i += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i*) (row + i));
+        __m128i b = _mm_loadu_si128((const __m128i*) (prev + i));
+        _mm_storeu_si128((__m128i*) (row + i), _mm_add_epi8(x, b));
+    }
+    up_scalar(row + i, prev + i, length - i);
+}
+
+/// @brief The up_avx2 function undoes the Up filter 32 bytes at a time.
+/// @param row The row to unfilter.
+/// @param prev The previous, already unfiltered, row.
+/// @param length The length of the row.
+__attribute__((target("avx2")))
+static void up_avx2(unsigned char* row, const unsigned char* prev, size_t length) {
+    size_t i = 0;
+
+    for(; i + 32 <= length; i += 32) {
+        __m256i x = _mm256_loadu_si256((const __m256i*) (row + i));
+        __m256i b = _mm256_loadu_si256((const __m256i*) (prev + i));
+        _mm256_storeu_si256((__m256i*) (row + i), _mm256_add_epi8(x, b));
+    }
+    up_sse2(row + i, prev + i, length - i);
+}
+
+// Sub is a prefix sum with stride n: each 16 bytes are scanned in log steps,
+// with the last pixel of the previous block carried into the low lanes first
+#define SUB_SSE2(n) \
+__attribute__((target("sse2"))) \
+static void sub_sse2_##n(unsigned char* row, const unsigned char* prev, size_t length) { \
+    __m128i carry = _mm_setzero_si128(); \
+    size_t i = 0; \
+    (void) prev; \
+    for(; i + 16 <= length; i += 16) { \
+        __m128i x = _mm_add_epi8(_mm_loadu_si128((const __m128i*) (row + i)), carry); \
+        x = _mm_add_epi8(x, _mm_slli_si128(x, n)); \
+        x = _mm_add_epi8(x, _mm_slli_si128(x, 2 * n)); \
+        if(4 * n < 16) \
+            x = _mm_add_epi8(x, _mm_slli_si128(x, 4 * n)); \
+        if(8 * n < 16) \
+            x = _mm_add_epi8(x, _mm_slli_si128(x, 8 * n)); \
+        _mm_storeu_si128((__m128i*) (row + i), x); \
+        carry = _mm_srli_si128(x, 16 - n); \
+    } \
+    for(i = i < n ? n : i; i < length; i++) \
+        row[i] += row[i - n]; \
+}
+
+// the SSSE3 version scans each block on its own and adds the carried pixel
+// broadcast across the block, keeping the serial chain to two instructions
+#define SUB_SSSE3(n) \
+__attribute__((target("ssse3"))) \
+static void sub_ssse3_##n(unsigned char* row, const unsigned char* prev, size_t length) { \
+    unsigned char index[16]; \
+    __m128i last = _mm_setzero_si128(); \
+    size_t i = 0; \
+    (void) prev; \
+    for(int j = 0; j < 16; j++) \
+        index[j] = (unsigned char) (16 - n + j % n); \
+    const __m128i broadcast = _mm_loadu_si128((const __m128i*) index); \
+    for(; i + 16 <= length; i += 16) { \
+        __m128i x = _mm_loadu_si128((const __m128i*) (row + i)); \
+        x = _mm_add_epi8(x, _mm_slli_si128(x, n)); \
+        x = _mm_add_epi8(x, _mm_slli_si128(x, 2 * n)); \
+        if(4 * n < 16) \
+            x = _mm_add_epi8(x, _mm_slli_si128(x, 4 * n)); \
+        if(8 * n < 16) \
+            x = _mm_add_epi8(x, _mm_slli_si128(x, 8 * n)); \
+        last = _mm_add_epi8(x, _mm_shuffle_epi8(last, broadcast)); \
+        _mm_storeu_si128((__m128i*) (row + i), last); \
+    } \
+    for(i = i < n ? n : i; i < length; i++) \
+        row[i] += row[i - n]; \
+}
+
+/// @brief The average_sse2 function undoes the Average filter one whole pixel
+///        per step.
+/// @param row The row to unfilter.
+/// @param prev The previous, already unfiltered, row.
+/// @param length The length of the row, a multiple of bpp.
+/// @param bpp The bytes per pixel, from 3 to 8.
+__attribute__((target("sse2")))
+static inline void average_sse2(unsigned char* row, const unsigned char* prev,
+                                    size_t length, unsigned int bpp) {
+    const __m128i one = _mm_set1_epi8(1);
+    __m128i a = _mm_setzero_si128();
+
+    __m128i x = length >= bpp ? load_pixel(row, length, bpp) : a;
+
+    for(size_t i = 0; i + bpp <= length; i += bpp) {
+        __m128i b = load_pixel(prev + i, length - i, bpp);
+
+        // pavgb rounds up, so take back the carry when a + b is odd
+        __m128i avg = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), one));
+        a = _mm_add_epi8(x, avg);
+
+        // read the next pixel before a wide store runs over it
+        if(i + 2 * bpp <= length)
+            x = load_pixel(row + i + bpp, length - i - bpp, bpp);
+        store_pixel(row + i, length - i, a, bpp);
+    }
+}
+
+/// @brief The abs_epi16 function finds the absolute value of signed 16-bit
+///        lanes with SSE2 only.
+/// @param x The lanes.
+/// @return The absolute values.
+__attribute__((target("sse2")))
+static inline __m128i abs_epi16(__m128i x) {
+    return _mm_max_epi16(x, _mm_sub_epi16(_mm_setzero_si128(), x));
+}
+
+/// @brief The paeth_select function picks the Paeth predictor for each lane
+///        from the three neighbours and their distances.
+/// @param a The bytes to the left, in 16-bit lanes.
+/// @param b The bytes above, in 16-bit lanes.
+/// @param c The bytes above and to the left, in 16-bit lanes.
+/// @param pa The distance |b - c|.
+/// @param pb The distance |a - c|.
+/// @param pc The distance |a + b - 2c|.
+/// @return The predicted bytes, in 16-bit lanes.
+__attribute__((target("sse2")))
+static inline __m128i paeth_select(__m128i a, __m128i b, __m128i c,
+                                    __m128i pa, __m128i pb, __m128i pc) {
+    // b unless c is strictly closer, then a unless that is strictly closer
+    __m128i use_c = _mm_cmpgt_epi16(pb, pc);
+    __m128i nearest = _mm_or_si128(_mm_and_si128(use_c, c), _mm_andnot_si128(use_c, b));
+    __m128i use_bc = _mm_cmpgt_epi16(pa, _mm_min_epi16(pb, pc));
+    return _mm_or_si128(_mm_and_si128(use_bc, nearest), _mm_andnot_si128(use_bc, a));
+}
+
+/// @brief The paeth_sse2 function undoes the Paeth filter one whole pixel per
+///        step, working in 16-bit lanes.
+/// @param row The row to unfilter.
+/// @param prev The previous, already unfiltered, row.
+/// @param length The length of the row, a multiple of bpp.
+/// @param bpp The bytes per pixel, from 3 to 8.
+__attribute__((target("sse2")))
+static inline void paeth_sse2(unsigned char* row, const unsigned char* prev,
+                                size_t length, unsigned int bpp) {
+    const __m128i zero = _mm_setzero_si128();
+    __m128i a = zero;
+    __m128i c = zero;
+
+    __m128i x = length >= bpp ? load_pixel(row, length, bpp) : zero;
+
+    for(size_t i = 0; i + bpp <= length; i += bpp) {
+        __m128i b = _mm_unpacklo_epi8(load_pixel(prev + i, length - i, bpp), zero);
+        __m128i pa = _mm_sub_epi16(b, c);
+        __m128i pb = _mm_sub_epi16(a, c);
+        __m128i pc = _mm_add_epi16(pa, pb);
+        __m128i pred = paeth_select(a, b, c, abs_epi16(pa), abs_epi16(pb), abs_epi16(pc));
+
+        __m128i out = _mm_add_epi8(x, _mm_packus_epi16(pred, pred));
+
+        // read the next pixel before a wide store runs over it
+        if(i + 2 * bpp <= length)
+            x = load_pixel(row + i + bpp, length - i - bpp, bpp);
+        store_pixel(row + i, length - i, out, bpp);
+        a = _mm_unpacklo_epi8(out, zero);
+        c = b;
+    }
+}
+
+/// @brief The paeth_ssse3 function is paeth_sse2 with the absolute values
+///        taken by pabsw.
+/// @param row The row to unfilter.
+/// @param prev The previous, already unfiltered, row.
+/// @param length The length of the row, a multiple of bpp.
+/// @param bpp The bytes per pixel, from 3 to 8.
+__attribute__((target("ssse3")))
+static inline void paeth_ssse3(unsigned char* row, const unsigned char* prev,
+                                size_t length, unsigned int bpp) {
+    const __m128i zero = _mm_setzero_si128();
+    __m128i a = zero;
+    __m128i c = zero;
+
+    __m128i x = length >= bpp ? load_pixel(row, length, bpp) : zero;
+
+    for(size_t i = 0; i + bpp <= length; i += bpp) {
+        __m128i b = _mm_unpacklo_epi8(load_pixel(prev + i, length - i, bpp), zero);
+        __m128i pa = _mm_sub_epi16(b, c);
+        __m128i pb = _mm_sub_epi16(a, c);
+        __m128i pc = _mm_add_epi16(pa, pb);
+        __m128i pred = paeth_select(a, b, c, _mm_abs_epi16(pa), _mm_abs_epi16(pb),
+                                    _mm_abs_epi16(pc));
+
+        __m128i out = _mm_add_epi8(x, _mm_packus_epi16(pred, pred));
+
+        // read the next pixel before a wide store runs over it
+        if(i + 2 * bpp <= length)
+            x = load_pixel(row + i + bpp, length - i - bpp, bpp);
+        store_pixel(row + i, length - i, out, bpp);
+        a = _mm_unpacklo_epi8(out, zero);
+        c = b;
+    }
+}
+
+#define UNFILTER_SIMD(n) \
+SUB_SSE2(n) \
+SUB_SSSE3(n) \
+__attribute__((target("sse2"))) \
+static void average_sse2_##n(unsigned char* row, const unsigned char* prev, size_t length) { \
+    average_sse2(row, prev, length, n); \
+} \
+__attribute__((target("sse2"))) \
+static void paeth_sse2_##n(unsigned char* row, const unsigned char* prev, size_t length) { \
+    paeth_sse2(row, prev, length, n); \
+} \
+__attribute__((target("ssse3"))) \
+static void paeth_ssse3_##n(unsigned char* row, const unsigned char* prev, size_t length) { \
+    paeth_ssse3(row, prev, length, n); \
+}
+
+// Average and Paeth depend on the byte one pixel back, so at 1 and 2 bytes per
+// pixel there is nothing to vectorise and the specialised scalar loops are used
+SUB_SSE2(1)
+SUB_SSE2(2)
+SUB_SSSE3(1)
+SUB_SSSE3(2)
+UNFILTER_SIMD(3)
+UNFILTER_SIMD(4)
+UNFILTER_SIMD(6)
+UNFILTER_SIMD(8)
+
+static const UNFILTER_FUNC sub_sse2_table[9] = {
+    NULL, sub_sse2_1, sub_sse2_2, sub_sse2_3, sub_sse2_4, NULL, sub_sse2_6, NULL, sub_sse2_8
+};
+static const UNFILTER_FUNC sub_ssse3_table[9] = {
+    NULL, sub_ssse3_1, sub_ssse3_2, sub_ssse3_3, sub_ssse3_4, NULL, sub_ssse3_6, NULL, sub_ssse3_8
+};
+static const UNFILTER_FUNC average_sse2_table[9] = {
+    NULL, average_scalar_1, average_scalar_2, average_sse2_3, average_sse2_4,
+    NULL, average_sse2_6, NULL, average_sse2_8
+};
+static const UNFILTER_FUNC paeth_sse2_table[9] = {
+    NULL, paeth_scalar_1, paeth_scalar_2, paeth_sse2_3, paeth_sse2_4,
+    NULL, paeth_sse2_6, NULL, paeth_sse2_8
+};
+static const UNFILTER_FUNC paeth_ssse3_table[9] = {
+    NULL, paeth_scalar_1, paeth_scalar_2, paeth_ssse3_3, paeth_ssse3_4,
+    NULL, paeth_ssse3_6, NULL, paeth_ssse3_8
+};
+#endif
+
+/// @brief The unfilter_init_isa function picks the fastest kernels for a
+///        pixel size without going above the given instruction set.
+/// @param unfilter The kernels to fill in.
+/// @param bpp The bytes per pixel: 1, 2, 3, 4, 6 or 8.
+/// @param isa The highest instruction set to use.
+/// @return True if the pixel size is supported, false otherwise.
+bool unfilter_init_isa(UNFILTER* unfilter, unsigned int bpp, UNFILTER_ISA isa) {
+    // check if the pixel size can come from a valid IHDR
+    if(bpp > 8 || sub_scalar_table[bpp] == NULL)
+        return false;
+
+    unfilter->bpp = bpp;
+    unfilter->sub = sub_scalar_table[bpp];
+    unfilter->up = up_scalar;
+    unfilter->average = average_scalar_table[bpp];
+    unfilter->paeth = paeth_scalar_table[bpp];
+
+#ifdef CPU_X86
+    if(isa >= UNFILTER_SSE2 && cpu_has_sse2()) {
+        unfilter->sub = sub_sse2_table[bpp];
+        unfilter->up = up_sse2;
+        unfilter->average = average_sse2_table[bpp];
+        unfilter->paeth = paeth_sse2_table[bpp];
+    }
+    if(isa >= UNFILTER_SSSE3 && cpu_has_ssse3()) {
+        unfilter->sub = sub_ssse3_table[bpp];
+        unfilter->paeth = paeth_ssse3_table[bpp];
+    }
+    if(isa >= UNFILTER_AVX2 && cpu_has_avx2())
+        unfilter->up = up_avx2;
+#else
+    (void) isa;
+#endif
+
+    return true;
+}
+
+/// @brief The unfilter_init function picks the fastest kernels the CPU
+///        supports for a pixel size.
+/// @param unfilter The kernels to fill in.
+/// @param bpp The bytes per pixel: 1, 2, 3, 4, 6 or 8.
+/// @return True if the pixel size is supported, false otherwise.
+bool unfilter_init(UNFILTER* unfilter, unsigned int bpp) {
+    return unfilter_init_isa(unfilter, bpp, UNFILTER_AVX2);
+}
+
+/// @brief The unfilter_row function undoes the filter on one row.
+/// @param unfilter The kernels to use.
+/// @param type The filter type byte of the row.
+/// @param row The row to unfilter, without its filter type byte.
+/// @param prev The previous, already unfiltered, row, or zeros for the first.
+/// @param length The length of the row.
+/// @return True if the filter type is valid, false otherwise.
+bool unfilter_row(const UNFILTER* unfilter, unsigned char type, unsigned char* row,
+                    const unsigned char* prev, size_t length) {
+    switch(type) {
+        case FILTER_NONE:
+            return true;
+        case FILTER_SUB:
+            unfilter->sub(row, prev, length);
+            return true;
+        case FILTER_UP:
+            unfilter->up(row, prev, length);
+            return true;
+        case FILTER_AVERAGE:
+            unfilter->average(row, prev, length);
+            return true;
+        case FILTER_PAETH:
+            unfilter->paeth(row, prev, length);
+            return true;
+        default:
+            printf("Invalid PNG: Unknown filter type %d\n", type);
+            return false;
+    }
+}
+
+/// @brief The unfilter_image function undoes the filters on every row of an
+///        image in place, leaving the filter type bytes where they are.
+/// @param scanlines The rows, each starting with its filter type byte.
+/// @param height The number of rows.
+/// @param row_bytes The length of a row without its filter type byte.
+/// @param bpp The bytes per pixel: 1, 2, 3, 4, 6 or 8.
+/// @return True if every row was unfiltered, false otherwise.
+bool unfilter_image(unsigned char* scanlines, unsigned int height, size_t row_bytes,
+                    unsigned int bpp) {
+    UNFILTER unfilter;
+    if(!unfilter_init(&unfilter, bpp))
+        return false;
+
+    // the row above the first one is all zeros
+    unsigned char* zeros = calloc(row_bytes + 1, 1);
+    MEM_CHECK(zeros);
+
+    const unsigned char* prev = zeros;
+    bool ok = true;
+    for(unsigned int y = 0; y < height && ok; y++) {
+        unsigned char* line = scanlines + (size_t) y * (row_bytes + 1);
+        ok = unfilter_row(&unfilter, line[0], line + 1, prev, row_bytes);
+        prev = line + 1;
+    }
+
+    free(zeros);
+    return ok;
+}
+
+/// @brief The filter_row function applies a filter to one row.
+/// @param type The filter type to apply.
+/// @param out Where to store the filtered row, without its filter type byte.
+/// @param row The row to filter.
+/// @param prev The previous row, or zeros for the first.
+/// @param length The length of the row.
+/// @param bpp The bytes per pixel.
+void filter_row(unsigned char type, unsigned char* out, const unsigned char* row,
+                    const unsigned char* prev, size_t length, unsigned int bpp) {
+    size_t i;
+
+    switch(type) {
+        case FILTER_SUB:
+            for(i = 0; i < length; i++)
+                out[i] = (unsigned char) (row[i] - (i >= bpp ? row[i - bpp] : 0));
+            break;
+        case FILTER_UP:
+            for(i = 0; i < length; i++)
+                out[i] = (unsigned char) (row[i] - prev[i]);
+            break;
+        case FILTER_AVERAGE:
+            for(i = 0; i < length; i++)
+                out[i] = (unsigned char) (row[i] - (((i >= bpp ? row[i - bpp] : 0) + prev[i]) >> 1));
+            break;
+        case FILTER_PAETH:
+            for(i = 0; i < length; i++) {
+                int a = i >= bpp ? row[i - bpp] : 0;
+                int c = i >= bpp ? prev[i - bpp] : 0;
+                out[i] = (unsigned char) (row[i] - paeth_predict(a, prev[i], c));
+            }
+            break;
+        default:
+            memcpy(out, row, length);
+            break;
+    }
+}
+
+/// @brief The byte_cost function weighs a filtered byte by its distance from
+///        zero when read as signed.
+/// @param r The filtered byte.
+/// @return The absolute value of the byte as a signed number.
+static inline unsigned int byte_cost(unsigned char r) {
+    return r < 128 ? r : 256u - r;
+}
+
+/// @brief The costs_scalar function adds up the cost of every filter type
+///        over part of a row.
+/// @param row The row, preceded by bpp zero bytes.
+/// @param prev The previous row, preceded by bpp zero bytes.
+/// @param from The offset to start at.
+/// @param length The length of the row.
+/// @param bpp The bytes per pixel.
+/// @param costs The running cost of each filter type.
+static void costs_scalar(const unsigned char* row, const unsigned char* prev, size_t from,
+                            size_t length, unsigned int bpp, uint64_t costs[5]) {
+    for(size_t i = from; i < length; i++) {
+        unsigned char x = row[i];
+        unsigned char a = row[i - bpp];
+        unsigned char b = prev[i];
+        unsigned char c = prev[i - bpp];
+        costs[FILTER_NONE] += byte_cost(x);
+        costs[FILTER_SUB] += byte_cost((unsigned char) (x - a));
+        costs[FILTER_UP] += byte_cost((unsigned char) (x - b));
+        costs[FILTER_AVERAGE] += byte_cost((unsigned char) (x - ((a + b) >> 1)));
+        costs[FILTER_PAETH] += byte_cost((unsigned char) (x - paeth_predict(a, b, c)));
+    }
+}
+
+#ifdef CPU_X86
+/// @brief The sad_abs function sums the absolute values of signed bytes into
+///        the two 64-bit halves of a vector.
+/// @param r The signed bytes.
+/// @return The sums of the low and high eight bytes.
+__attribute__((target("sse2")))
+static inline __m128i sad_abs(__m128i r) {
+    const __m128i zero = _mm_setzero_si128();
+    return _mm_sad_epu8(_mm_min_epu8(r, _mm_sub_epi8(zero, r)), zero);
+}
+
+/// @brief The paeth_bytes function finds the Paeth predictor of 16 bytes at
+///        once by widening them to 16-bit lanes.
+/// @param a The bytes to the left.
+/// @param b The bytes above.
+/// @param c The bytes above and to the left.
+/// @return The predicted bytes.
+__attribute__((target("sse2")))
+static inline __m128i paeth_bytes(__m128i a, __m128i b, __m128i c) {
+    const __m128i zero = _mm_setzero_si128();
+    __m128i half[2];
+
+    for(int h = 0; h < 2; h++) {
+        __m128i a16 = h == 0 ? _mm_unpacklo_epi8(a, zero) : _mm_unpackhi_epi8(a, zero);
+        __m128i b16 = h == 0 ? _mm_unpacklo_epi8(b, zero) : _mm_unpackhi_epi8(b, zero);
+        __m128i c16 = h == 0 ? _mm_unpacklo_epi8(c, zero) : _mm_unpackhi_epi8(c, zero);
+        __m128i pa = _mm_sub_epi16(b16, c16);
+        __m128i pb = _mm_sub_epi16(a16, c16);
+        __m128i pc = _mm_add_epi16(pa, pb);
+        half[h] = paeth_select(a16, b16, c16, abs_epi16(pa), abs_epi16(pb), abs_epi16(pc));
+    }
+
+    return _mm_packus_epi16(half[0], half[1]);
+}
+
+/// @brief The costs_sse2 function adds up the cost of all five filter types
+///        over a row in a single pass, 16 bytes at a time.
+/// @param row The row, preceded by bpp zero bytes.
+/// @param prev The previous row, preceded by bpp zero bytes.
+/// @param length The length of the row.
+/// @param bpp The bytes per pixel.
+/// @param costs The running cost of each filter type.
+__attribute__((target("sse2")))
+static void costs_sse2(const unsigned char* row, const unsigned char* prev, size_t length,
+                        unsigned int bpp, uint64_t costs[5]) {
+    const __m128i one = _mm_set1_epi8(1);
+    __m128i sum[5];
+    size_t i = 0;
+    int f;
+
+    for(f = 0; f < 5; f++)
+        sum[f] = _mm_setzero_si128();
+    for(; i + 16 <= length; i += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i*) (row + i));
+        __m128i a = _mm_loadu_si128((const __m128i*) (row + i - bpp));
+        __m128i b = _mm_loadu_si128((const __m128i*) (prev + i));
+        __m128i c = _mm_loadu_si128((const __m128i*) (prev + i - bpp));
+        __m128i avg = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), one));
+
+        sum[FILTER_NONE] = _mm_add_epi64(sum[FILTER_NONE], sad_abs(x));
+        sum[FILTER_SUB] = _mm_add_epi64(sum[FILTER_SUB], sad_abs(_mm_sub_epi8(x, a)));
+        sum[FILTER_UP] = _mm_add_epi64(sum[FILTER_UP], sad_abs(_mm_sub_epi8(x, b)));
+        sum[FILTER_AVERAGE] = _mm_add_epi64(sum[FILTER_AVERAGE], sad_abs(_mm_sub_epi8(x, avg)));
+        sum[FILTER_PAETH] = _mm_add_epi64(sum[FILTER_PAETH],
+                                            sad_abs(_mm_sub_epi8(x, paeth_bytes(a, b, c))));
+    }
+
+    for(f = 0; f < 5; f++) {
+        uint64_t halves[2];
+        _mm_storeu_si128((__m128i*) halves, sum[f]);
+        costs[f] += halves[0] + halves[1];
+    }
+    costs_scalar(row, prev, i, length, bpp, costs);
+}
+
+/// @brief The costs_avx2 function adds up the cost of all five filter types
+///        over a row in a single pass, 32 bytes at a time.
+/// @param row The row, preceded by bpp zero bytes.
+/// @param prev The previous row, preceded by bpp zero bytes.
+/// @param length The length of the row.
+/// @param bpp The bytes per pixel.
+/// @param costs The running cost of each filter type.
+__attribute__((target("avx2")))
+static void costs_avx2(const unsigned char* row, const unsigned char* prev, size_t length,
+                        unsigned int bpp, uint64_t costs[5]) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i one = _mm256_set1_epi8(1);
+    __m256i sum[5];
+    size_t i = 0;
+    int f;
+
+    for(f = 0; f < 5; f++)
+        sum[f] = zero;
+    for(; i + 32 <= length; i += 32) {
+        __m256i x = _mm256_loadu_si256((const __m256i*) (row + i));
+        __m256i a = _mm256_loadu_si256((const __m256i*) (row + i - bpp));
+        __m256i b = _mm256_loadu_si256((const __m256i*) (prev + i));
+        __m256i c = _mm256_loadu_si256((const __m256i*) (prev + i - bpp));
+        __m256i avg = _mm256_sub_epi8(_mm256_avg_epu8(a, b),
+                                        _mm256_and_si256(_mm256_xor_si256(a, b), one));
+
+        // the Paeth predictor in 16-bit lanes, unpacked and packed within each
+        // 128-bit half so the byte order comes back unchanged
+        __m256i pred[2];
+        for(int h = 0; h < 2; h++) {
+            __m256i a16 = h == 0 ? _mm256_unpacklo_epi8(a, zero) : _mm256_unpackhi_epi8(a, zero);
+            __m256i b16 = h == 0 ? _mm256_unpacklo_epi8(b, zero) : _mm256_unpackhi_epi8(b, zero);
+            __m256i c16 = h == 0 ? _mm256_unpacklo_epi8(c, zero) : _mm256_unpackhi_epi8(c, zero);
+            __m256i pa = _mm256_sub_epi16(b16, c16);
+            __m256i pb = _mm256_sub_epi16(a16, c16);
+            __m256i pc = _mm256_abs_epi16(_mm256_add_epi16(pa, pb));
+            pa = _mm256_abs_epi16(pa);
+            pb = _mm256_abs_epi16(pb);
+            __m256i use_c = _mm256_cmpgt_epi16(pb, pc);
+            __m256i nearest = _mm256_blendv_epi8(b16, c16, use_c);
+            __m256i use_bc = _mm256_cmpgt_epi16(pa, _mm256_min_epi16(pb, pc));
+            pred[h] = _mm256_blendv_epi8(a16, nearest, use_bc);
+        }
+        __m256i paeth = _mm256_packus_epi16(pred[0], pred[1]);
+
+        // sum the absolute values of the residuals as signed bytes
+        __m256i r[5];
+        r[FILTER_NONE] = x;
+        r[FILTER_SUB] = _mm256_sub_epi8(x, a);
+        r[FILTER_UP] = _mm256_sub_epi8(x, b);
+        r[FILTER_AVERAGE] = _mm256_sub_epi8(x, avg);
+        r[FILTER_PAETH] = _mm256_sub_epi8(x, paeth);
+        for(f = 0; f < 5; f++)
+            sum[f] = _mm256_add_epi64(sum[f], _mm256_sad_epu8(_mm256_abs_epi8(r[f]), zero));
+    }
+
+    for(f = 0; f < 5; f++) {
+        uint64_t quarters[4];
+        _mm256_storeu_si256((__m256i*) quarters, sum[f]);
+        costs[f] += quarters[0] + quarters[1] + quarters[2] + quarters[3];
+    }
+    costs_sse2(row + i, prev + i, length - i, bpp, costs);
+}
+#endif
+
+/// @brief The filter_costs_isa function finds the minimum-sum-of-absolute-
+///        differences cost of each filter type for a row, without going above
+///        the given instruction set.
+/// @param row The row, preceded by bpp readable zero bytes.
+/// @param prev The previous row, preceded by bpp readable zero bytes.
+/// @param length The length of the row.
+/// @param bpp The bytes per pixel.
+/// @param isa The highest instruction set to use.
+/// @param costs Where to store the cost of each filter type.
+void filter_costs_isa(const unsigned char* row, const unsigned char* prev, size_t length,
+                        unsigned int bpp, UNFILTER_ISA isa, uint64_t costs[5]) {
+    memset(costs, 0, sizeof(uint64_t) * 5);
+
+#ifdef CPU_X86
+    if(isa >= UNFILTER_AVX2 && cpu_has_avx2()) {
+        costs_avx2(row, prev, length, bpp, costs);
+        return;
+    }
+    if(isa >= UNFILTER_SSE2 && cpu_has_sse2()) {
+        costs_sse2(row, prev, length, bpp, costs);
+        return;
+    }
+#else
+    (void) isa;
+#endif
+    costs_scalar(row, prev, 0, length, bpp, costs);
+}
+
+/// @brief The filter_costs function finds the cost of each filter type for a
+///        row with the fastest kernel the CPU supports.
+/// @param row The row, preceded by bpp readable zero bytes.
+/// @param prev The previous row, preceded by bpp readable zero bytes.
+/// @param length The length of the row.
+/// @param bpp The bytes per pixel.
+/// @param costs Where to store the cost of each filter type.
+void filter_costs(const unsigned char* row, const unsigned char* prev, size_t length,
+                    unsigned int bpp, uint64_t costs[5]) {
+    filter_costs_isa(row, prev, length, bpp, UNFILTER_AVX2, costs);
+}
+
+/// @brief The trial_size function compresses a candidate row after the rows
+///        already chosen and measures the output.
+/// @param trial A buffer holding the chosen rows' tail, followed by room for
+///        the candidate line.
+/// @param dict The number of bytes of chosen rows in the buffer.
+/// @param line The candidate line, with its filter type byte.
+/// @param length The length of the line.
+/// @param state The compressor, reused for every trial.
+/// @param out A scratch buffer for the compressed output.
+/// @return The compressed size of the candidate, or 0 if memory ran out.
+static size_t trial_size(unsigned char* trial, size_t dict, const unsigned char* line,
+                            size_t length, DEFLATE_STATE* state, DEFLATE_BUFFER* out) {
+    memcpy(trial + dict, line, length);
+    deflate_buffer_reset(out);
+    if(!deflate_compress(state, trial, dict, dict + length, false, out))
+        return 0;
+    return out->length;
+}
+
+/// @brief The filter_image function filters every row of an image, choosing
+///        each row's filter type by the given strategy.
+/// @param pixels The rows of the image with no filter type bytes.
+/// @param height The number of rows.
+/// @param row_bytes The length of a row.
+/// @param bpp The bytes per pixel.
+/// @param strategy How to choose each row's filter type.
+/// @param type The filter type used by FILTER_STRATEGY_FIXED.
+/// @param level The compression level FILTER_STRATEGY_BRUTE measures with.
+/// @param restart_rows The number of rows between rows that must not look at
+///        the row above, using only None or Sub, or 0 for none.
+/// @param scanlines Where to store the filtered rows, each led by its filter
+///        type byte.
+/// @return True if every row was filtered, false if memory ran out.
+bool filter_image(const unsigned char* pixels, unsigned int height, size_t row_bytes,
+                    unsigned int bpp, FILTER_STRATEGY strategy, unsigned char type,
+                    int level, unsigned int restart_rows, unsigned char* scanlines) {
+    // padded copies of the current and previous row, zeros to the left
+    unsigned char* padded = calloc(2 * (row_bytes + FILTER_PAD), 1);
+    MEM_CHECK(padded);
+    unsigned char* cur = padded + FILTER_PAD;
+    unsigned char* prev = padded + row_bytes + 2 * FILTER_PAD;
+
+    // brute force compresses every candidate after the last 32 KB chosen
+    unsigned char* candidates = NULL;
+    unsigned char* trial = NULL;
+    DEFLATE_STATE* state = NULL;
+    DEFLATE_BUFFER out;
+    deflate_buffer_init(&out);
+    if(strategy == FILTER_STRATEGY_BRUTE) {
+        state = deflate_state_create(level);
+        candidates = malloc(5 * (row_bytes + 1));
+        trial = malloc(DEFLATE_WINDOW + row_bytes + 1);
+        if(state == NULL || candidates == NULL || trial == NULL) {
+            printf("Unable to allocate memory");
+            deflate_state_free(state);
+            free(candidates);
+            free(trial);
+            free(padded);
+            return false;
+        }
+    }
+
+    size_t filtered = 0;
+    size_t segment = 0;
+    for(unsigned int y = 0; y < height && !out.error; y++) {
+        unsigned char* line = scanlines + (size_t) y * (row_bytes + 1);
+        memcpy(cur, pixels + (size_t) y * row_bytes, row_bytes);
+
+        // a restart row can be decoded without the row above
+        bool restart = y > 0 && restart_rows > 0 && y % restart_rows == 0;
+        unsigned char highest = restart ? FILTER_SUB : FILTER_PAETH;
+
+        unsigned char best = type;
+        if(restart && type > FILTER_SUB)
+            best = type == FILTER_UP ? FILTER_NONE : FILTER_SUB;
+        if(strategy == FILTER_STRATEGY_MINSUM || strategy == FILTER_STRATEGY_AUTO) {
+            // every candidate is costed in one pass, ties going to the lower type
+            uint64_t costs[5];
+            filter_costs(cur, prev, row_bytes, bpp, costs);
+            best = FILTER_NONE;
+            for(unsigned char f = FILTER_SUB; f <= highest; f++)
+                if(costs[f] < costs[best])
+                    best = f;
+        } else if(strategy == FILTER_STRATEGY_BRUTE) {
+            // the compressor never looks back past the start of a segment
+            if(restart)
+                segment = filtered;
+            size_t dict = filtered - segment < DEFLATE_WINDOW ? filtered - segment : DEFLATE_WINDOW;
+            memcpy(trial, scanlines + filtered - dict, dict);
+            size_t best_size = 0;
+            for(unsigned char f = FILTER_NONE; f <= highest; f++) {
+                unsigned char* candidate = candidates + f * (row_bytes + 1);
+                candidate[0] = f;
+                filter_row(f, candidate + 1, cur, prev, row_bytes, bpp);
+                size_t size = trial_size(trial, dict, candidate, row_bytes + 1, state, &out);
+                if(f == FILTER_NONE || size < best_size) {
+                    best = f;
+                    best_size = size;
+                }
+            }
+        }
+
+        line[0] = best;
+        if(candidates != NULL)
+            memcpy(line + 1, candidates + best * (row_bytes + 1) + 1, row_bytes);
+        else
+            filter_row(best, line + 1, cur, prev, row_bytes, bpp);
+        filtered += row_bytes + 1;
+
+        // the current row becomes the previous one
+        unsigned char* swap = prev;
+        prev = cur;
+        cur = swap;
+    }
+
+    bool done = !out.error;
+    deflate_state_free(state);
+    deflate_buffer_free(&out);
+    free(candidates);
+    free(trial);
+    free(padded);
+    return done;
+}
@@ -0,0 +1,73 @@
+///
+/// @file filter.h
+/// @brief PNG scanline filter header
+/// @author Sam Cordry
+
+#ifndef FILTER_H
+#define FILTER_H
+
+// include needed system libraries
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+/// @brief PNG filter types, as stored in the first byte of each scanline
+#define FILTER_NONE 0
+#define FILTER_SUB 1
+#define FILTER_UP 2
+#define FILTER_AVERAGE 3
+#define FILTER_PAETH 4
+
+/// @brief Instruction set levels the unfilter kernels can be limited to
+typedef enum {
+    UNFILTER_SCALAR,
+    UNFILTER_SSE2,
+    UNFILTER_SSSE3,
+    UNFILTER_AVX2
+} UNFILTER_ISA;
+
+/// @brief Ways of choosing each row's filter type when encoding
+typedef enum {
+    FILTER_STRATEGY_AUTO, ///< left to the format, minimum sum when filtering
+    FILTER_STRATEGY_FIXED, ///< the same filter type on every row
+    FILTER_STRATEGY_MINSUM, ///< the smallest sum of absolute differences
+    FILTER_STRATEGY_BRUTE ///< the type whose row actually compresses smallest
+} FILTER_STRATEGY;
+
+/// @brief The number of zero bytes filter_costs may read before each row.
+#define FILTER_PAD 8
+
+/// @brief Kernel that undoes one filter type on a row, in place
+typedef void (*UNFILTER_FUNC)(unsigned char* row, const unsigned char* prev, size_t length);
+
+/// @brief Unfilter kernels chosen for one bytes-per-pixel value
+typedef struct {
+    unsigned int bpp; ///< bytes per complete pixel, rounded up to 1
+    UNFILTER_FUNC sub; ///< Sub kernel
+    UNFILTER_FUNC up; ///< Up kernel
+    UNFILTER_FUNC average; ///< Average kernel
+    UNFILTER_FUNC paeth; ///< Paeth kernel
+} UNFILTER;
+
+// unfilter functions
+bool unfilter_init(UNFILTER* unfilter, unsigned int bpp);
+bool unfilter_init_isa(UNFILTER* unfilter, unsigned int bpp, UNFILTER_ISA isa);
+bool unfilter_row(const UNFILTER* unfilter, unsigned char type, unsigned char* row,
+                    const unsigned char* prev, size_t length);
+bool unfilter_image(unsigned char* scanlines, unsigned int height, size_t row_bytes,
+                    unsigned int bpp);
+
+// filter functions
+void filter_row(unsigned char type, unsigned char* out, const unsigned char* row,
+                    const unsigned char* prev, size_t length, unsigned int bpp);
+void filter_costs_isa(const unsigned char* row, const unsigned char* prev, size_t length,
+                        unsigned int bpp, UNFILTER_ISA isa, uint64_t costs[5]);
+void filter_costs(const unsigned char* row, const unsigned char* prev, size_t length,
+                    unsigned int bpp, uint64_t costs[5]);
+bool filter_image(const unsigned char* pixels, unsigned int height, size_t row_bytes,
+                    unsigned int bpp, FILTER_STRATEGY strategy, unsigned char type,
+                    int level, unsigned int restart_rows, unsigned char* scanlines);
+
+#endif
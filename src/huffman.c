@@ -0,0 +1,1076 @@
+///
+/// @file huffman.c
+/// @brief JPEG Huffman entropy coder implementation
+/// @author Sam Cordry
+
+#include "huffman.h"
+
+/// @brief Natural order index of each zigzag position.
+const unsigned char huff_natural_order[64] = {
+     0,  1,  8, 16,  9,  2,  3, 10,
+    17, 24, 32, 25, 18, 11,  4,  5,
+    12, 19, 26, 33, 40, 48, 41, 34,
+    27, 20, 13,  6,  7, 14, 21, 28,
+    35, 42, 49, 56, 57, 50, 43, 36,
+    29, 22, 15, 23, 30, 37, 44, 51,
+    58, 59, 52, 45, 38, 31, 39, 46,
+    53, 60, 61, 54, 47, 55, 62, 63
+};
+
+/// @brief Annex K luminance DC table.
+const HUFF_SPEC huff_std_dc_luma = {
+    { 0, 1, 5, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0 },
+    { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11 }
+};
+
+/// @brief Annex K chrominance DC table.
+const HUFF_SPEC huff_std_dc_chroma = {
+    { 0, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0 },
+    { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11 }
+};
+
+/// @brief Annex K luminance AC table.
+const HUFF_SPEC huff_std_ac_luma = {
+    { 0, 2, 1, 3, 3, 2, 4, 3, 5, 5, 4, 4, 0, 0, 1, 0x7D },
+    {
+        0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12, 0x21, 0x31, 0x41, 0x06, 0x13, 0x51, 0x61, 0x07,
+        0x22, 0x71, 0x14, 0x32, 0x81, 0x91, 0xA1, 0x08, 0x23, 0x42, 0xB1, 0xC1, 0x15, 0x52, 0xD1, 0xF0,
+        0x24, 0x33, 0x62, 0x72, 0x82, 0x09, 0x0A, 0x16, 0x17, 0x18, 0x19, 0x1A, 0x25, 0x26, 0x27, 0x28,
+        0x29, 0x2A, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3A, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49,
+        0x4A, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5A, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69,
+        0x6A, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7A, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89,
+        0x8A, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9A, 0xA2, 0xA3, 0xA4, 0xA5, 0xA6, 0xA7,
+        0xA8, 0xA9, 0xAA, 0xB2, 0xB3, 0xB4, 0xB5, 0xB6, 0xB7, 0xB8, 0xB9, 0xBA, 0xC2, 0xC3, 0xC4, 0xC5,
+        0xC6, 0xC7, 0xC8, 0xC9, 0xCA, 0xD2, 0xD3, 0xD4, 0xD5, 0xD6, 0xD7, 0xD8, 0xD9, 0xDA, 0xE1, 0xE2,
+        0xE3, 0xE4, 0xE5, 0xE6, 0xE7, 0xE8, 0xE9, 0xEA, 0xF1, 0xF2, 0xF3, 0xF4, 0xF5, 0xF6, 0xF7, 0xF8,
+        0xF9, 0xFA
+    }
+};
+
+/// @brief Annex K chrominance AC table.
+const HUFF_SPEC huff_std_ac_chroma = {
+    { 0, 2, 1, 2, 4, 4, 3, 4, 7, 5, 4, 4, 0, 1, 2, 0x77 },
+    {
+        0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21, 0x31, 0x06, 0x12, 0x41, 0x51, 0x07, 0x61, 0x71,
+        0x13, 0x22, 0x32, 0x81, 0x08, 0x14, 0x42, 0x91, 0xA1, 0xB1, 0xC1, 0x09, 0x23, 0x33, 0x52, 0xF0,
+        0x15, 0x62, 0x72, 0xD1, 0x0A, 0x16, 0x24, 0x34, 0xE1, 0x25, 0xF1, 0x17, 0x18, 0x19, 0x1A, 0x26,
+        0x27, 0x28, 0x29, 0x2A, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3A, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48,
+        0x49, 0x4A, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5A, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
+        0x69, 0x6A, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7A, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87,
+        0x88, 0x89, 0x8A, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9A, 0xA2, 0xA3, 0xA4, 0xA5,
+        0xA6, 0xA7, 0xA8, 0xA9, 0xAA, 0xB2, 0xB3, 0xB4, 0xB5, 0xB6, 0xB7, 0xB8, 0xB9, 0xBA, 0xC2, 0xC3,
+        0xC4, 0xC5, 0xC6, 0xC7, 0xC8, 0xC9, 0xCA, 0xD2, 0xD3, 0xD4, 0xD5, 0xD6, 0xD7, 0xD8, 0xD9, 0xDA,
+        0xE2, 0xE3, 0xE4, 0xE5, 0xE6, 0xE7, 0xE8, 0xE9, 0xEA, 0xF2, 0xF3, 0xF4, 0xF5, 0xF6, 0xF7, 0xF8,
+        0xF9, 0xFA
+    }
+};
+
+/// @brief The extend function turns the magnitude bits of a coefficient into
+///        its signed value.
+/// @param bits The magnitude bits.
+/// @param size The number of magnitude bits.
+/// @return The coefficient value.
+static inline int extend(unsigned int bits, int size) {
+    if(bits < (1u << (size - 1)))
+        return (int) bits - (int) ((1u << size) - 1);
+    return (int) bits;
+}
+
+/// @brief The huff_decoder_build function builds the decode tables for one
+///        table of a DHT segment.
+/// @param dec The decoder to fill.
+/// @param counts The number of codes of each length from 1 to 16.
+/// @param symbols The symbols in code order.
+/// @param num_symbols The number of symbols available after the counts.
+/// @return True if the table was built, false if the counts are invalid.
+bool huff_decoder_build(HUFF_DECODER* dec, const unsigned char* counts,
+                            const unsigned char* symbols, int num_symbols) {
+    unsigned int code = 0;
+    int k = 0;
+
+    memset(dec->lookup, 0, sizeof(dec->lookup));
+    memset(dec->fast, 0, sizeof(dec->fast));
+
+    // assign canonical codes, shortest first
+    for(int length = 1; length <= 16; length++) {
+        dec->delta[length] = k - (int) code;
+        if(k + counts[length - 1] > num_symbols || k + counts[length - 1] > 256)
+            return false;
+        for(int i = 0; i < counts[length - 1]; i++, k++, code++) {
+            dec->symbols[k] = symbols[k];
+
+            // short codes fill every lookahead entry that starts with them
+            if(length <= HUFF_LOOKAHEAD) {
+                unsigned int shift = HUFF_LOOKAHEAD - length;
+                for(unsigned int j = 0; j < (1u << shift); j++)
+                    dec->lookup[(code << shift) | j] = (uint16_t) ((symbols[k] << 8) | length);
+            }
+        }
+        if(code > (1u << length))
+            return false;
+        dec->maxcode[length] = code << (16 - length);
+        code <<= 1;
+    }
+
+    // fold the magnitude bits into the entries that have room for them
+    for(unsigned int i = 0; i < (1u << HUFF_LOOKAHEAD); i++) {
+        int length = dec->lookup[i] & 0xFF;
+        int symbol = dec->lookup[i] >> 8;
+        int size = symbol & 15;
+        if(length == 0 || size == 0 || length + size > HUFF_LOOKAHEAD)
+            continue;
+        unsigned int bits = (i >> (HUFF_LOOKAHEAD - length - size)) & ((1u << size) - 1);
+        dec->fast[i].value = (int16_t) extend(bits, size);
+        dec->fast[i].run = (uint8_t) (symbol >> 4);
+        dec->fast[i].length = (uint8_t) (length + size);
+    }
+
+    return true;
+}
+
+/// @brief The bit_reader_init function starts reading an entropy-coded
+///        segment, such as one restart interval of a scan.
+/// @param br The reader to start.
+/// @param data The entropy-coded bytes.
+/// @param length The number of bytes.
+void bit_reader_init(BIT_READER* br, const unsigned char* data, size_t length) {
+    br->next = data;
+    br->end = data + length;
+    br->bits = 0;
+    br->count = 0;
+}
+
+/// @brief The load_be64 function loads eight bytes as a big-endian value.
+/// @param data The bytes to load.
+/// @return The loaded value.
+static inline uint64_t load_be64(const unsigned char* data) {
+    uint64_t word = 0;
+    for(int i = 0; i < 8; i++)
+        word = (word << 8) | data[i];
+    return word;
+}
+
+/// @brief The refill_slow function tops up the reservoir a byte at a time,
+///        removing stuffed zero bytes. At a marker or the end of the segment
+///        the reservoir is padded with zeros.
+/// @param br The reader to refill.
+static void refill_slow(BIT_READER* br) {
+    while(br->count <= 56) {
+        uint64_t byte = 0;
+        if(br->next < br->end) {
+            byte = *br->next;
+            if(byte != 0xFF)
+                br->next++;
+            else if(br->next + 1 < br->end && br->next[1] == 0x00)
+                br->next += 2;
+            else
+                byte = 0;
+        }
+        br->bits |= byte << (56 - br->count);
+        br->count += 8;
+    }
+}
+
+/// @brief The refill function tops up the reservoir to at least 56 bits,
+///        loading a whole word at once when none of its bytes is 0xFF.
+/// @param br The reader to refill.
+static inline void refill(BIT_READER* br) {
+    if(br->end - br->next >= 8) {
+        uint64_t word = load_be64(br->next);
+
+        // a byte of the word is 0xFF exactly when its complement has a zero byte
+        uint64_t inverse = ~word;
+        if(((inverse - 0x0101010101010101ull) & word & 0x8080808080808080ull) == 0) {
+            br->bits |= word >> br->count;
+            br->next += (63 - br->count) >> 3;
+            br->count |= 56;
+            br->bits &= ~(~0ull >> br->count);
+            return;
+        }
+    }
+    refill_slow(br);
+}
+
+/// @brief The drop_bits function removes bits from the top of the reservoir.
+/// @param br The reader.
+/// @param count The number of bits, at most what the reservoir holds.
+static inline void drop_bits(BIT_READER* br, int count) {
+    br->bits <<= count;
+    br->count -= count;
+}
+
+/// @brief The receive function takes the magnitude bits of a coefficient and
+///        sign extends them.
+/// @param br The reader, holding at least size bits.
+/// @param size The number of magnitude bits, from 1 to 15.
+/// @return The coefficient value.
+static inline int receive(BIT_READER* br, int size) {
+    unsigned int bits = (unsigned int) (br->bits >> (64 - size));
+    drop_bits(br, size);
+    return extend(bits, size);
+}
+
+/// @brief The decode_symbol function decodes one Huffman symbol, from the
+///        lookahead table when its code is short enough.
+/// @param br The reader, holding at least 16 bits.
+/// @param dec The table to decode with.
+/// @return The symbol, or -1 if the bits are not a code of the table.
+static inline int decode_symbol(BIT_READER* br, const HUFF_DECODER* dec) {
+    uint16_t entry = dec->lookup[br->bits >> (64 - HUFF_LOOKAHEAD)];
+    if(entry != 0) {
+        drop_bits(br, entry & 0xFF);
+        return entry >> 8;
+    }
+
+    // longer codes are found by comparing against the last code of each length
+    uint32_t code = (uint32_t) (br->bits >> 48);
+    int length = HUFF_LOOKAHEAD + 1;
+    while(length <= 16 && code >= dec->maxcode[length])
+        length++;
+    if(length > 16)
+        return -1;
+    drop_bits(br, length);
+
+    return dec->symbols[(code >> (16 - length)) + dec->delta[length]];
+}
+
+/// @brief The huff_decode function decodes one Huffman symbol.
+/// @param br The reader.
+/// @param dec The table to decode with.
+/// @return The symbol, or -1 if the bits are not a code of the table.
+int huff_decode(BIT_READER* br, const HUFF_DECODER* dec) {
+    if(br->count < 16)
+        refill(br);
+    return decode_symbol(br, dec);
+}
+
+/// @brief The huff_decode_block function decodes the coefficients of one block
+///        of a baseline scan. Most AC coefficients take a single lookup that
+///        resolves the run, the size and the magnitude bits together.
+/// @param br The reader.
+/// @param dc The DC table of the block's component.
+/// @param ac The AC table of the block's component.
+/// @param pred The DC prediction of the component, updated with the block.
+/// @param block The block to fill in natural order, which must start zeroed.
+/// @param last Set to one past the zigzag index of the last nonzero coefficient.
+/// @return True if the block was decoded, false if the data is corrupt.
+bool huff_decode_block(BIT_READER* br, const HUFF_DECODER* dc, const HUFF_DECODER* ac,
+                        int* pred, int16_t* block, unsigned char* last) {
+    // a code and its magnitude bits take at most 31 bits
+    if(br->count < 32)
+        refill(br);
+
+    // the DC coefficient is a difference from the last block's
+    int size = decode_symbol(br, dc);
+    if(size < 0 || size > 15)
+        return false;
+    int dc_value = *pred + (size != 0 ? receive(br, size) : 0);
+    if(dc_value < INT16_MIN || dc_value > INT16_MAX)
+        return false;
+    *pred = dc_value;
+    block[0] = (int16_t) dc_value;
+
+    // the AC coefficients are runs of zeros followed by a value
+    int k = 1;
+    int end = 1;
+    while(k < 64) {
+        if(br->count < 32)
+            refill(br);
+
+        const HUFF_FAST* fast = ac->fast + (br->bits >> (64 - HUFF_LOOKAHEAD));
+        if(fast->length != 0) {
+            drop_bits(br, fast->length);
+            k += fast->run;
+            if(k > 63)
+                return false;
+            block[huff_natural_order[k]] = fast->value;
+            end = ++k;
+            continue;
+        }
+
+        int symbol = decode_symbol(br, ac);
+        if(symbol < 0)
+            return false;
+        int run = symbol >> 4;
+        size = symbol & 15;
+        if(size == 0) {
+            // a run of 16 zeros, or the end of the block
+            if(run != 15)
+                break;
+            k += 16;
+            continue;
+        }
+        k += run;
+        if(k > 63)
+            return false;
+        block[huff_natural_order[k]] = (int16_t) receive(br, size);
+        end = ++k;
+    }
+    *last = (unsigned char) end;
+
+    return true;
+}
+
+/// @brief The get_bit function takes a single bit, such as a refinement bit
+///        of a progressive scan.
+/// @param br The reader.
+/// @return The bit.
+static inline int get_bit(BIT_READER* br) {
+    if(br->count < 1)
+        refill(br);
+    int bit = (int) (br->bits >> 63);
+    drop_bits(br, 1);
+    return bit;
+}
+
+/// @brief The get_bits function takes the extra bits of an end-of-band run.
+/// @param br The reader, holding at least count bits.
+/// @param count The number of bits, from 1 to 14.
+/// @return The bits.
+static inline unsigned int get_bits(BIT_READER* br, int count) {
+    unsigned int bits = (unsigned int) (br->bits >> (64 - count));
+    drop_bits(br, count);
+    return bits;
+}
+
+/// @brief The raise_last function notes a newly nonzero coefficient in a
+///        block's end marker.
+/// @param last One past the zigzag index of the block's last nonzero coefficient.
+/// @param k The zigzag index of the coefficient.
+static inline void raise_last(unsigned char* last, int k) {
+    if(*last <= k)
+        *last = (unsigned char) (k + 1);
+}
+
+/// @brief The huff_decode_dc_first function decodes the DC coefficient of
+///        one block in the first DC scan of a progressive image.
+/// @param br The reader.
+/// @param dc The DC table of the block's component.
+/// @param pred The DC prediction of the component, updated with the block.
+/// @param al The bit position the coefficient is shifted up to.
+/// @param block The block to fill in natural order.
+/// @param last Raised to cover the DC coefficient.
+/// @return True if the coefficient was decoded, false if the data is corrupt.
+bool huff_decode_dc_first(BIT_READER* br, const HUFF_DECODER* dc, int* pred, int al,
+                            int16_t* block, unsigned char* last) {
+    if(br->count < 32)
+        refill(br);
+
+    int size = decode_symbol(br, dc);
+    if(size < 0 || size > 15)
+        return false;
+    int value = *pred + (size != 0 ? receive(br, size) : 0);
+    if(value * (1 << al) < INT16_MIN || value * (1 << al) > INT16_MAX)
+        return false;
+    *pred = value;
+    block[0] = (int16_t) (value * (1 << al));
+    raise_last(last, 0);
+
+    return true;
+}
+
+/// @brief The huff_decode_dc_refine function adds the next bit of the DC
+///        coefficient of one block in a progressive image.
+/// @param br The reader.
+/// @param al The bit position of the refinement bit.
+/// @param block The block to refine.
+void huff_decode_dc_refine(BIT_READER* br, int al, int16_t* block) {
+    if(get_bit(br))
+        block[0] = (int16_t) (block[0] | (1 << al));
+}
+
+/// @brief The huff_decode_ac_first function decodes the first pass of a band
+///        of AC coefficients of one block in a progressive image. A run of
+///        blocks with nothing in the band is coded once as an end-of-band run.
+/// @param br The reader.
+/// @param ac The AC table of the block's component.
+/// @param ss The first zigzag index of the band.
+/// @param se The last zigzag index of the band.
+/// @param al The bit position the coefficients are shifted up to.
+/// @param eobrun The blocks left in the current end-of-band run, updated.
+/// @param block The block to fill in natural order.
+/// @param last Raised to cover each coefficient decoded.
+/// @return True if the band was decoded, false if the data is corrupt.
+bool huff_decode_ac_first(BIT_READER* br, const HUFF_DECODER* ac, int ss, int se, int al,
+                            unsigned int* eobrun, int16_t* block, unsigned char* last) {
+    if(*eobrun > 0) {
+        (*eobrun)--;
+        return true;
+    }
+
+    for(int k = ss; k <= se; k++) {
+        if(br->count < 32)
+            refill(br);
+        int symbol = decode_symbol(br, ac);
+        if(symbol < 0)
+            return false;
+        int run = symbol >> 4;
+        int size = symbol & 15;
+        if(size == 0) {
+            // a run of 16 zeros, or the end of the band for this and more blocks
+            if(run == 15) {
+                k += 15;
+                continue;
+            }
+            *eobrun = (1u << run) - 1;
+            if(run > 0)
+                *eobrun += get_bits(br, run);
+            break;
+        }
+        k += run;
+        if(k > se)
+            return false;
+        block[huff_natural_order[k]] = (int16_t) (receive(br, size) * (1 << al));
+        raise_last(last, k);
+    }
+
+    return true;
+}
+
+/// @brief The huff_decode_ac_refine function adds the next bit of a band of
+///        AC coefficients of one block in a progressive image. Coefficients
+///        that are already nonzero take a correction bit each, and new ones
+///        are coded as runs of the zero coefficients between them.
+/// @param br The reader.
+/// @param ac The AC table of the block's component.
+/// @param ss The first zigzag index of the band.
+/// @param se The last zigzag index of the band.
+/// @param al The bit position of the refinement bits.
+/// @param eobrun The blocks left in the current end-of-band run, updated.
+/// @param block The block to refine in natural order.
+/// @param last Raised to cover each new coefficient.
+/// @return True if the band was decoded, false if the data is corrupt.
+bool huff_decode_ac_refine(BIT_READER* br, const HUFF_DECODER* ac, int ss, int se, int al,
+                            unsigned int* eobrun, int16_t* block, unsigned char* last) {
+    int bit = 1 << al;
+    int k = ss;
+
+    if(*eobrun == 0) {
+        for(; k <= se; k++) {
+            if(br->count < 32)
+                refill(br);
+            int symbol = decode_symbol(br, ac);
+            if(symbol < 0)
+                return false;
+            int run = symbol >> 4;
+            int size = symbol & 15;
+            int value = 0;
+            if(size != 0) {
+                // a new coefficient is always one bit in size
+                if(size != 1)
+                    return false;
+                value = get_bit(br) ? bit : -bit;
+            } else if(run != 15) {
+                // the end of the band, with the rest of it only corrected
+                *eobrun = 1u << run;
+                if(run > 0)
+                    *eobrun += get_bits(br, run);
+                break;
+            }
+
+            // skip run zero coefficients, correcting the nonzero ones passed
+            for(; k <= se; k++) {
+                int16_t* coef = block + huff_natural_order[k];
+                if(*coef != 0) {
+                    if(get_bit(br) && (*coef & bit) == 0)
+                        *coef = (int16_t) (*coef + (*coef >= 0 ? bit : -bit));
+                } else if(run-- == 0)
+                    break;
+            }
+            if(value != 0) {
+                if(k > se)
+                    return false;
+                block[huff_natural_order[k]] = (int16_t) value;
+                raise_last(last, k);
+            }
+        }
+    }
+
+    // within an end-of-band run only the nonzero coefficients are corrected
+    if(*eobrun > 0) {
+        for(; k <= se; k++) {
+            int16_t* coef = block + huff_natural_order[k];
+            if(*coef != 0 && get_bit(br) && (*coef & bit) == 0)
+                *coef = (int16_t) (*coef + (*coef >= 0 ? bit : -bit));
+        }
+        (*eobrun)--;
+    }
+
+    return true;
+}
+
+/// @brief The huff_spec_symbols function counts the symbols of a table.
+/// @param spec The table.
+/// @return The number of symbols.
+int huff_spec_symbols(const HUFF_SPEC* spec) {
+    int total = 0;
+    for(int i = 0; i < 16; i++)
+        total += spec->counts[i];
+    return total;
+}
+
+/// @brief The huff_encoder_build function assigns the canonical code of each
+///        symbol of a table.
+/// @param enc The encoder to fill.
+/// @param spec The table.
+/// @return True if the table was built, false if the counts are invalid.
+bool huff_encoder_build(HUFF_ENCODER* enc, const HUFF_SPEC* spec) {
+    unsigned int code = 0;
+    int k = 0;
+
+    memset(enc->size, 0, sizeof(enc->size));
+    for(int length = 1; length <= 16; length++) {
+        if(k + spec->counts[length - 1] > 256)
+            return false;
+        for(int i = 0; i < spec->counts[length - 1]; i++, k++, code++) {
+            enc->code[spec->symbols[k]] = (uint16_t) code;
+            enc->size[spec->symbols[k]] = (uint8_t) length;
+        }
+        if(code > (1u << length))
+            return false;
+        code <<= 1;
+    }
+
+    return true;
+}
+
+/// @brief The huff_optimize function builds the optimal table for a set of
+///        symbol counts, with no code longer than 16 bits and no code of all
+///        ones, following section K.2 of the JPEG standard as libjpeg does.
+/// @param freq The number of times each symbol is coded.
+/// @param spec Where to store the table.
+void huff_optimize(const uint32_t* freq, HUFF_SPEC* spec) {
+    uint32_t count[257];
+    int codesize[257];
+    int others[257];
+    int bits[33];
+
+    // a pseudo-symbol that comes last keeps any code from being all ones
+    memcpy(count, freq, 256 * sizeof(uint32_t));
+    count[256] = 1;
+    memset(codesize, 0, sizeof(codesize));
+    memset(bits, 0, sizeof(bits));
+    for(int i = 0; i < 257; i++)
+        others[i] = -1;
+
+    // join the two least frequent trees until one is left, the larger
+    // symbol winning ties so the pseudo-symbol gets the longest code
+    while(true) {
+        int c1 = -1;
+        int c2 = -1;
+        for(int i = 0; i < 257; i++) {
+            if(count[i] == 0)
+                continue;
+            if(c1 < 0 || count[i] <= count[c1]) {
+                c2 = c1;
+                c1 = i;
+            } else if(c2 < 0 || count[i] <= count[c2])
+                c2 = i;
+        }
+        if(c2 < 0)
+            break;
+
+        count[c1] += count[c2];
+        count[c2] = 0;
+        for(codesize[c1]++; others[c1] >= 0; codesize[c1]++)
+            c1 = others[c1];
+        others[c1] = c2;
+        for(codesize[c2]++; others[c2] >= 0; codesize[c2]++)
+            c2 = others[c2];
+    }
+
+    for(int i = 0; i < 257; i++)
+        if(codesize[i] > 0)
+            bits[codesize[i] > 32 ? 32 : codesize[i]]++;
+
+    // move codes longer than 16 bits up, a pair at a time
+    for(int i = 32; i > 16; i--) {
+        while(bits[i] > 0) {
+            int j = i - 2;
+            while(bits[j] == 0)
+                j--;
+            bits[i] -= 2;
+            bits[i - 1]++;
+            bits[j + 1] += 2;
+            bits[j]--;
+        }
+    }
+
+    // drop the pseudo-symbol's code, the longest
+    int longest = 16;
+    while(longest > 0 && bits[longest] == 0)
+        longest--;
+    if(longest > 0)
+        bits[longest]--;
+    for(int i = 1; i <= 16; i++)
+        spec->counts[i - 1] = (unsigned char) bits[i];
+
+    // symbols go in order of code length, then value
+    int k = 0;
+    for(int length = 1; length <= 32; length++)
+        for(int i = 0; i < 256; i++)
+            if(codesize[i] == length)
+                spec->symbols[k++] = (unsigned char) i;
+}
+
+/// @brief The bit_writer_init function starts writing entropy-coded data.
+/// @param bw The writer to start.
+/// @param capacity The number of bytes to allocate up front.
+/// @return True if the writer was started, false if memory ran out.
+bool bit_writer_init(BIT_WRITER* bw, size_t capacity) {
+    bw->capacity = capacity > HUFF_BLOCK_BYTES ? capacity : HUFF_BLOCK_BYTES;
+    bw->data = malloc(bw->capacity);
+    bw->length = 0;
+    bw->bits = 0;
+    bw->free = 64;
+
+    return bw->data != NULL;
+}
+
+/// @brief The bit_writer_reserve function makes room for more bytes.
+/// @param bw The writer.
+/// @param length The number of bytes to make room for.
+/// @return True if there is room, false if memory ran out.
+bool bit_writer_reserve(BIT_WRITER* bw, size_t length) {
+    if(bw->capacity - bw->length >= length)
+        return true;
+
+    size_t capacity = bw->capacity * 2;
+    if(capacity - bw->length < length)
+        capacity = bw->length + length;
+    unsigned char* data = realloc(bw->data, capacity);
+    if(data == NULL)
+        return false;
+    bw->data = data;
+    bw->capacity = capacity;
+
+    return true;
+}
+
+/// @brief The store_be64 function stores a value as eight big-endian bytes.
+/// @param data Where to store the bytes.
+/// @param word The value to store.
+static inline void store_be64(unsigned char* data, uint64_t word) {
+    for(int i = 0; i < 8; i++)
+        data[i] = (unsigned char) (word >> (56 - 8 * i));
+}
+
+/// @brief The emit_word function writes a full reservoir, stuffing a zero
+///        after any 0xFF byte. Words without one are stored at once.
+/// @param bw The writer, with room for 16 more bytes.
+/// @param word The 64 bits to write.
+static inline void emit_word(BIT_WRITER* bw, uint64_t word) {
+    unsigned char* out = bw->data + bw->length;
+
+    // a byte of the word is 0xFF exactly when its complement has a zero byte
+    if(((~word - 0x0101010101010101ull) & word & 0x8080808080808080ull) == 0) {
+        store_be64(out, word);
+        bw->length += 8;
+        return;
+    }
+    for(int shift = 56; shift >= 0; shift -= 8) {
+        unsigned char byte = (unsigned char) (word >> shift);
+        *out++ = byte;
+        if(byte == 0xFF)
+            *out++ = 0x00;
+    }
+    bw->length = (size_t) (out - bw->data);
+}
+
+/// @brief The put_bits function adds bits to the reservoir, writing it out
+///        when it fills.
+/// @param bw The writer.
+/// @param bits The bits, right aligned with nothing above them.
+/// @param count The number of bits, from 1 to 32.
+static inline void put_bits(BIT_WRITER* bw, uint32_t bits, int count) {
+    if(count < bw->free) {
+        bw->bits = (bw->bits << count) | bits;
+        bw->free -= count;
+        return;
+    }
+
+    // the bits that do not fit start the next reservoir
+    int rest = count - bw->free;
+    emit_word(bw, (bw->bits << bw->free) | ((uint64_t) bits >> rest));
+    bw->bits = bits;
+    bw->free = 64 - rest;
+}
+
+/// @brief The bit_writer_flush function writes the bits left in the
+///        reservoir, padding the last byte with ones.
+/// @param bw The writer.
+/// @return True if the bits were written, false if memory ran out.
+bool bit_writer_flush(BIT_WRITER* bw) {
+    if(!bit_writer_reserve(bw, 16))
+        return false;
+
+    int count = 64 - bw->free;
+    int pad = (8 - count % 8) % 8;
+    uint64_t bits = (bw->bits << pad) | ((1u << pad) - 1);
+    unsigned char* out = bw->data + bw->length;
+    for(int shift = count + pad - 8; shift >= 0; shift -= 8) {
+        unsigned char byte = (unsigned char) (bits >> shift);
+        *out++ = byte;
+        if(byte == 0xFF)
+            *out++ = 0x00;
+    }
+    bw->length = (size_t) (out - bw->data);
+    bw->bits = 0;
+    bw->free = 64;
+
+    return true;
+}
+
+/// @brief The bit_writer_marker function ends a run of entropy-coded data
+///        with its bits padded out, then writes a marker such as RSTn.
+/// @param bw The writer.
+/// @param marker The marker, written after a 0xFF byte.
+/// @return True if the marker was written, false if memory ran out.
+bool bit_writer_marker(BIT_WRITER* bw, unsigned char marker) {
+    if(!bit_writer_flush(bw) || !bit_writer_reserve(bw, 2))
+        return false;
+    bw->data[bw->length++] = 0xFF;
+    bw->data[bw->length++] = marker;
+
+    return true;
+}
+
+/// @brief The bit_size function finds the number of magnitude bits of a
+///        coefficient, its category in the JPEG standard.
+/// @param value The coefficient.
+/// @return The number of bits, 0 for zero.
+static inline int bit_size(int value) {
+    unsigned int magnitude = (unsigned int) (value < 0 ? -value : value);
+    return magnitude == 0 ? 0 : 32 - __builtin_clz(magnitude);
+}
+
+/// @brief The magnitude_bits function finds the bits that follow a
+///        coefficient's code, the value itself or one less for negatives.
+/// @param value The coefficient.
+/// @param size The number of magnitude bits.
+/// @return The bits.
+static inline uint32_t magnitude_bits(int value, int size) {
+    return (uint32_t) (value < 0 ? value - 1 : value) & ((1u << size) - 1);
+}
+
+/// @brief The huff_encode_block function codes the coefficients of one block
+///        of a baseline scan. The nonzero coefficients are found up front, so
+///        runs of zeros take no work.
+/// @param bw The writer.
+/// @param dc The DC table of the block's component.
+/// @param ac The AC table of the block's component.
+/// @param pred The DC prediction of the component, updated with the block.
+/// @param block The coefficients of the block in natural order.
+/// @return True if the block was coded, false if a value has no code in the
+///         tables or memory ran out.
+bool huff_encode_block(BIT_WRITER* bw, const HUFF_ENCODER* dc, const HUFF_ENCODER* ac,
+                        int* pred, const int16_t* block) {
+    if(!bit_writer_reserve(bw, HUFF_BLOCK_BYTES))
+        return false;
+
+    // the DC coefficient is a difference from the last block's
+    int diff = block[0] - *pred;
+    int size = bit_size(diff);
+    if(dc->size[size] == 0)
+        return false;
+    *pred = block[0];
+    put_bits(bw, ((uint32_t) dc->code[size] << size) | magnitude_bits(diff, size),
+                dc->size[size] + size);
+
+    // mark the nonzero AC coefficients in zigzag order
+    int16_t zigzag[64];
+    uint64_t nonzero = 0;
+    for(int k = 1; k < 64; k++) {
+        zigzag[k] = block[huff_natural_order[k]];
+        nonzero |= (uint64_t) (zigzag[k] != 0) << k;
+    }
+
+    // each value follows the run of zeros before it, split into runs of 16
+    int k = 0;
+    while(nonzero != 0) {
+        int next = __builtin_ctzll(nonzero);
+        int run = next - k - 1;
+        for(; run >= 16; run -= 16)
+            put_bits(bw, ac->code[0xF0], ac->size[0xF0]);
+        int value = zigzag[next];
+        size = bit_size(value);
+        int symbol = (run << 4) | size;
+        if(ac->size[symbol] == 0 || size > 15)
+            return false;
+        put_bits(bw, ((uint32_t) ac->code[symbol] << size) | magnitude_bits(value, size),
+                    ac->size[symbol] + size);
+        k = next;
+        nonzero &= nonzero - 1;
+    }
+
+    // the end of block code stands in for the zeros after the last value
+    if(k != 63)
+        put_bits(bw, ac->code[0x00], ac->size[0x00]);
+
+    return true;
+}
+
+/// @brief The huff_count_block function counts the symbols coding one block
+///        of a baseline scan would take, to build optimal tables from.
+/// @param block The coefficients of the block in natural order.
+/// @param pred The DC prediction of the component, updated with the block.
+/// @param dc_freq The counts of the DC symbols.
+/// @param ac_freq The counts of the AC symbols.
+void huff_count_block(const int16_t* block, int* pred, uint32_t* dc_freq, uint32_t* ac_freq) {
+    dc_freq[bit_size(block[0] - *pred)]++;
+    *pred = block[0];
+
+    int run = 0;
+    for(int k = 1; k < 64; k++) {
+        int value = block[huff_natural_order[k]];
+        if(value == 0) {
+            run++;
+            continue;
+        }
+        for(; run >= 16; run -= 16)
+            ac_freq[0xF0]++;
+        ac_freq[(run << 4) | bit_size(value)]++;
+        run = 0;
+    }
+    if(run > 0)
+        ac_freq[0x00]++;
+}
+
+/// @brief The emit_symbol function codes a symbol of a progressive scan, or
+///        counts it when the scan is only being counted.
+/// @param coder The scan.
+/// @param symbol The symbol.
+/// @return True if the symbol was coded, false if it has no code.
+static inline bool emit_symbol(HUFF_SCAN_CODER* coder, int symbol) {
+    if(coder->bw == NULL) {
+        coder->freq[symbol]++;
+        return true;
+    }
+    if(coder->table->size[symbol] == 0)
+        return false;
+    put_bits(coder->bw, coder->table->code[symbol], coder->table->size[symbol]);
+
+    return true;
+}
+
+/// @brief The emit_bits function writes bits of a progressive scan that
+///        follow a symbol or stand alone, unless the scan is only being
+///        counted.
+/// @param coder The scan.
+/// @param bits The bits, right aligned with nothing above them.
+/// @param count The number of bits, from 0 to 16.
+static inline void emit_bits(HUFF_SCAN_CODER* coder, uint32_t bits, int count) {
+    if(coder->bw != NULL && count > 0)
+        put_bits(coder->bw, bits, count);
+}
+
+/// @brief The emit_corrections function writes correction bits of a
+///        progressive scan, up to 16 at a time, unless the scan is only being
+///        counted.
+/// @param coder The scan.
+/// @param bits The bits, one to a byte.
+/// @param count The number of bits.
+static inline void emit_corrections(HUFF_SCAN_CODER* coder, const unsigned char* bits,
+                                    unsigned int count) {
+    if(coder->bw == NULL)
+        return;
+    for(unsigned int i = 0; i < count; i += 16) {
+        unsigned int n = count - i < 16 ? count - i : 16;
+        uint32_t word = 0;
+        for(unsigned int j = 0; j < n; j++)
+            word = (word << 1) | bits[i + j];
+        put_bits(coder->bw, word, (int) n);
+    }
+}
+
+/// @brief The huff_encode_eobrun function codes the end-of-band run a
+///        progressive scan has built up, followed by the correction bits held
+///        back for its blocks. It is called before each restart marker and at
+///        the end of the scan.
+/// @param coder The scan.
+/// @return True if the run was coded, false if its symbol has no code or
+///         memory ran out.
+bool huff_encode_eobrun(HUFF_SCAN_CODER* coder) {
+    if(coder->eobrun == 0)
+        return true;
+    if(coder->bw != NULL && !bit_writer_reserve(coder->bw, HUFF_BLOCK_BYTES))
+        return false;
+
+    // the run's length is its size category followed by the bits below its top bit
+    int size = 31 - __builtin_clz(coder->eobrun);
+    if(!emit_symbol(coder, size << 4))
+        return false;
+    emit_bits(coder, coder->eobrun & ((1u << size) - 1), size);
+    emit_corrections(coder, coder->corrections, coder->num_corrections);
+    coder->eobrun = 0;
+    coder->num_corrections = 0;
+
+    return true;
+}
+
+/// @brief The huff_encode_dc_first function codes the DC coefficient of one
+///        block in the first DC scan of a progressive image, without its bits
+///        below al.
+/// @param coder The scan, with the table of the block's component set.
+/// @param pred The DC prediction of the component, updated with the block.
+/// @param al The bit position the coefficient is shifted down from.
+/// @param block The coefficients of the block in natural order.
+/// @return True if the coefficient was coded, false if it has no code or
+///         memory ran out.
+bool huff_encode_dc_first(HUFF_SCAN_CODER* coder, int* pred, int al, const int16_t* block) {
+    if(coder->bw != NULL && !bit_writer_reserve(coder->bw, HUFF_BLOCK_BYTES))
+        return false;
+
+    // the DC coefficient is shifted arithmetically, so that refinement adds bits
+    int value = block[0] >> al;
+    int diff = value - *pred;
+    int size = bit_size(diff);
+    *pred = value;
+    if(!emit_symbol(coder, size))
+        return false;
+    emit_bits(coder, magnitude_bits(diff, size), size);
+
+    return true;
+}
+
+/// @brief The huff_encode_dc_refine function codes the next bit of the DC
+///        coefficient of one block in a progressive image.
+/// @param coder The scan.
+/// @param al The bit position of the refinement bit.
+/// @param block The coefficients of the block in natural order.
+/// @return True if the bit was coded, false if memory ran out.
+bool huff_encode_dc_refine(HUFF_SCAN_CODER* coder, int al, const int16_t* block) {
+    if(coder->bw != NULL && !bit_writer_reserve(coder->bw, HUFF_BLOCK_BYTES))
+        return false;
+    emit_bits(coder, (uint32_t) (block[0] >> al) & 1, 1);
+
+    return true;
+}
+
+/// @brief The huff_encode_ac_first function codes the first pass of a band
+///        of AC coefficients of one block in a progressive image, without
+///        their bits below al. Blocks with nothing left in the band join an
+///        end-of-band run that is coded once for all of them.
+/// @param coder The scan, with the table of the block's component set.
+/// @param ss The first zigzag index of the band.
+/// @param se The last zigzag index of the band.
+/// @param al The bit position the coefficients are shifted down from.
+/// @param block The coefficients of the block in natural order.
+/// @return True if the band was coded, false if a value has no code or
+///         memory ran out.
+bool huff_encode_ac_first(HUFF_SCAN_CODER* coder, int ss, int se, int al, const int16_t* block) {
+    if(coder->bw != NULL && !bit_writer_reserve(coder->bw, HUFF_BLOCK_BYTES))
+        return false;
+
+    // shift the magnitudes, rounding towards zero, and mark the nonzero ones
+    int values[64];
+    uint64_t nonzero = 0;
+    for(int k = ss; k <= se; k++) {
+        int value = block[huff_natural_order[k]];
+        int magnitude = (value < 0 ? -value : value) >> al;
+        values[k] = value < 0 ? -magnitude : magnitude;
+        nonzero |= (uint64_t) (magnitude != 0) << k;
+    }
+
+    // each value ends the run before it, split into runs of 16
+    int k = ss - 1;
+    while(nonzero != 0) {
+        int next = __builtin_ctzll(nonzero);
+        int run = next - k - 1;
+        if(!huff_encode_eobrun(coder))
+            return false;
+        for(; run >= 16; run -= 16)
+            if(!emit_symbol(coder, 0xF0))
+                return false;
+        int size = bit_size(values[next]);
+        if(size > 14 || !emit_symbol(coder, (run << 4) | size))
+            return false;
+        emit_bits(coder, magnitude_bits(values[next], size), size);
+        k = next;
+        nonzero &= nonzero - 1;
+    }
+
+    // the zeros at the end of the band join the run, which has at most 32767 blocks
+    if(k != se && ++coder->eobrun == 0x7FFF)
+        return huff_encode_eobrun(coder);
+
+    return true;
+}
+
+/// @brief The huff_encode_ac_refine function codes the next bit of a band of
+///        AC coefficients of one block in a progressive image. Coefficients
+///        that became nonzero in earlier passes take a correction bit each,
+///        held back until the next coded value or the end of the
+///        end-of-band run, and new ones are coded as runs of zeros.
+/// @param coder The scan, with the table of the block's component set.
+/// @param ss The first zigzag index of the band.
+/// @param se The last zigzag index of the band.
+/// @param al The bit position of the refinement bits.
+/// @param block The coefficients of the block in natural order.
+/// @return True if the band was coded, false if a value has no code or
+///         memory ran out.
+bool huff_encode_ac_refine(HUFF_SCAN_CODER* coder, int ss, int se, int al,
+                            const int16_t* block) {
+    if(coder->bw != NULL && !bit_writer_reserve(coder->bw, HUFF_BLOCK_BYTES))
+        return false;
+
+    // find the magnitudes and the last coefficient that becomes nonzero in this pass
+    int magnitudes[64];
+    uint64_t nonzero = 0;
+    uint64_t ones = 0;
+    for(int k = ss; k <= se; k++) {
+        int value = block[huff_natural_order[k]];
+        magnitudes[k] = (value < 0 ? -value : value) >> al;
+        nonzero |= (uint64_t) (magnitudes[k] != 0) << k;
+        ones |= (uint64_t) (magnitudes[k] == 1) << k;
+    }
+    int end = ones != 0 ? 63 - __builtin_clzll(ones) : 0;
+
+    // the block's correction bits follow those held back for the run
+    unsigned char* pending = coder->corrections + coder->num_corrections;
+    unsigned int num_pending = 0;
+    int run = 0;
+    int k = ss - 1;
+    while(nonzero != 0) {
+        int next = __builtin_ctzll(nonzero);
+        run += next - k - 1;
+        k = next;
+        nonzero &= nonzero - 1;
+
+        // runs of 16 are only coded when a new value follows them
+        while(run >= 16 && k <= end) {
+            if(!huff_encode_eobrun(coder) || !emit_symbol(coder, 0xF0))
+                return false;
+            run -= 16;
+            emit_corrections(coder, pending, num_pending);
+            pending = coder->corrections;
+            num_pending = 0;
+        }
+
+        // coefficients that were already nonzero take their next bit
+        if(magnitudes[k] > 1) {
+            pending[num_pending++] = (unsigned char) (magnitudes[k] & 1);
+            continue;
+        }
+
+        // a new value takes its sign, then the correction bits before it
+        if(!huff_encode_eobrun(coder) || !emit_symbol(coder, (run << 4) | 1))
+            return false;
+        emit_bits(coder, block[huff_natural_order[k]] < 0 ? 0 : 1, 1);
+        emit_corrections(coder, pending, num_pending);
+        pending = coder->corrections;
+        num_pending = 0;
+        run = 0;
+    }
+    run += se - k;
+
+    // the rest of the band joins the run, its correction bits held back with it
+    if(run > 0 || num_pending > 0) {
+        coder->eobrun++;
+        coder->num_corrections += num_pending;
+        if(coder->eobrun == 0x7FFF || coder->num_corrections > HUFF_MAX_CORRECTIONS - 63)
+            return huff_encode_eobrun(coder);
+    }
+
+    return true;
+}
@@ -0,0 +1,129 @@
+///
+/// @file huffman.h
+/// @brief JPEG Huffman entropy coder header
+/// @author Sam Cordry
+
+#ifndef HUFFMAN_H
+#define HUFFMAN_H
+
+// include needed system libraries
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+/// @brief The number of bits every code is first looked up with.
+#define HUFF_LOOKAHEAD 9
+
+/// @brief Entry of the table that decodes a whole coefficient at once, for
+///        codes whose magnitude bits fit in the lookahead as well
+typedef struct {
+    int16_t value; ///< coefficient value, after sign extension
+    uint8_t run; ///< zero coefficients skipped before this one
+    uint8_t length; ///< code length plus magnitude bits, 0 if not decoded here
+} HUFF_FAST;
+
+/// @brief Decode tables built from one DHT table
+typedef struct {
+    uint16_t lookup[1 << HUFF_LOOKAHEAD]; ///< symbol << 8 | code length, 0 for longer codes
+    HUFF_FAST fast[1 << HUFF_LOOKAHEAD]; ///< run, size and magnitude in one lookup
+    uint32_t maxcode[17]; ///< one past the last code of each length, left aligned to 16 bits
+    int delta[17]; ///< index of each length's first symbol minus its first code
+    unsigned char symbols[256]; ///< symbols in code order
+} HUFF_DECODER;
+
+/// @brief Entropy-coded data reader, most significant bit first, with
+///        stuffed zero bytes removed
+typedef struct {
+    const unsigned char* next; ///< next unread byte
+    const unsigned char* end; ///< end of the entropy-coded segment
+    uint64_t bits; ///< bit reservoir, most significant bit first
+    int count; ///< number of valid bits in the reservoir
+} BIT_READER;
+
+/// @brief The most bytes one block can take once coded and stuffed, with
+///        room for the reservoir.
+#define HUFF_BLOCK_BYTES 1024
+
+/// @brief A Huffman table as a DHT segment stores it
+typedef struct {
+    unsigned char counts[16]; ///< number of codes of each length from 1 to 16
+    unsigned char symbols[256]; ///< symbols in code order
+} HUFF_SPEC;
+
+/// @brief Encode table built from one DHT table
+typedef struct {
+    uint16_t code[256]; ///< code of each symbol, right aligned
+    uint8_t size[256]; ///< code length of each symbol, 0 if it has no code
+} HUFF_ENCODER;
+
+/// @brief Entropy-coded data writer, most significant bit first, with a zero
+///        byte stuffed after every 0xFF byte
+typedef struct {
+    unsigned char* data; ///< the bytes written so far
+    size_t length; ///< number of bytes written
+    size_t capacity; ///< number of bytes allocated
+    uint64_t bits; ///< bits not yet written, in the low end
+    int free; ///< number of unused bits in the reservoir
+} BIT_WRITER;
+
+/// @brief The most correction bits a progressive AC refinement scan holds
+///        back for the blocks of an end-of-band run.
+#define HUFF_MAX_CORRECTIONS 1000
+
+/// @brief A progressive scan being coded, or counted to build its tables from
+typedef struct {
+    BIT_WRITER* bw; ///< the writer, or NULL to count the symbols instead
+    const HUFF_ENCODER* table; ///< the table of the next block's component, when coding
+    uint32_t* freq; ///< the symbol counts of the next block's component, when counting
+    unsigned int eobrun; ///< blocks in the end-of-band run not yet coded
+    unsigned int num_corrections; ///< correction bits held back for the run
+    unsigned char corrections[HUFF_MAX_CORRECTIONS]; ///< the bits, one to a byte
+} HUFF_SCAN_CODER;
+
+/// @brief Natural order index of each zigzag position.
+extern const unsigned char huff_natural_order[64];
+
+/// @brief The example tables of Annex K of the JPEG standard.
+extern const HUFF_SPEC huff_std_dc_luma;
+extern const HUFF_SPEC huff_std_ac_luma;
+extern const HUFF_SPEC huff_std_dc_chroma;
+extern const HUFF_SPEC huff_std_ac_chroma;
+
+// table functions
+bool huff_decoder_build(HUFF_DECODER* dec, const unsigned char* counts,
+                            const unsigned char* symbols, int num_symbols);
+int huff_spec_symbols(const HUFF_SPEC* spec);
+bool huff_encoder_build(HUFF_ENCODER* enc, const HUFF_SPEC* spec);
+void huff_optimize(const uint32_t* freq, HUFF_SPEC* spec);
+
+// decode functions
+void bit_reader_init(BIT_READER* br, const unsigned char* data, size_t length);
+int huff_decode(BIT_READER* br, const HUFF_DECODER* dec);
+bool huff_decode_block(BIT_READER* br, const HUFF_DECODER* dc, const HUFF_DECODER* ac,
+                        int* pred, int16_t* block, unsigned char* last);
+bool huff_decode_dc_first(BIT_READER* br, const HUFF_DECODER* dc, int* pred, int al,
+                            int16_t* block, unsigned char* last);
+void huff_decode_dc_refine(BIT_READER* br, int al, int16_t* block);
+bool huff_decode_ac_first(BIT_READER* br, const HUFF_DECODER* ac, int ss, int se, int al,
+                            unsigned int* eobrun, int16_t* block, unsigned char* last);
+bool huff_decode_ac_refine(BIT_READER* br, const HUFF_DECODER* ac, int ss, int se, int al,
+                            unsigned int* eobrun, int16_t* block, unsigned char* last);
+
+// encode functions
+bool bit_writer_init(BIT_WRITER* bw, size_t capacity);
+bool bit_writer_reserve(BIT_WRITER* bw, size_t length);
+bool bit_writer_flush(BIT_WRITER* bw);
+bool bit_writer_marker(BIT_WRITER* bw, unsigned char marker);
+void huff_count_block(const int16_t* block, int* pred, uint32_t* dc_freq, uint32_t* ac_freq);
+bool huff_encode_block(BIT_WRITER* bw, const HUFF_ENCODER* dc, const HUFF_ENCODER* ac,
+                        int* pred, const int16_t* block);
+bool huff_encode_dc_first(HUFF_SCAN_CODER* coder, int* pred, int al, const int16_t* block);
+bool huff_encode_dc_refine(HUFF_SCAN_CODER* coder, int al, const int16_t* block);
+bool huff_encode_ac_first(HUFF_SCAN_CODER* coder, int ss, int se, int al, const int16_t* block);
+bool huff_encode_ac_refine(HUFF_SCAN_CODER* coder, int ss, int se, int al,
+                            const int16_t* block);
+bool huff_encode_eobrun(HUFF_SCAN_CODER* coder);
+
+#endif
@@ -0,0 +1,782 @@
+///
+/// @file inflate.c
+/// @brief DEFLATE and zlib decoder implementation
+/// @author Sam Cordry
+
+#include "inflate.h"
+#include "adler.h"
+
+/// @brief Entry operation for a literal byte.
+#define OP_LITERAL 0
+
+/// @brief Entry operation flag for a length or distance base value.
+#define OP_BASE 16
+
+/// @brief Entry operation for the end of a block.
+#define OP_END 32
+
+/// @brief Entry operation for a code that is not in the table.
+#define OP_INVALID 64
+
+/// @brief The INFLATE_FAIL macro reports a corrupt stream.
+#define INFLATE_FAIL(message) { printf("Invalid DEFLATE stream: %s\n", message);\
+                                return false; }
+
+/// @brief The most zero bytes fed in past the end of the input before the
+///        stream is considered truncated.
+#define INFLATE_MAX_OVERRUN 8
+
+// base values and extra bits of the length symbols 257 to 285
+static const uint16_t length_base[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+static const uint8_t length_extra[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+
+// base values and extra bits of the distance symbols 0 to 29
+static const uint16_t dist_base[30] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
+};
+static const uint8_t dist_extra[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+
+// order the code length code lengths are stored in
+static const uint8_t codelen_order[19] = {
+    16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15
+};
+
+/// @brief The kinds of alphabet a decode table can be built for
+typedef enum {
+    TABLE_CODELEN,
+    TABLE_LITLEN,
+    TABLE_DIST
+} TABLE_KIND;
+
+/// @brief The load_le64 function loads eight bytes as a little-endian value.
+/// @param data The bytes to load.
+/// @return The loaded value.
+static inline uint64_t load_le64(const unsigned char* data) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    uint64_t word;
+    memcpy(&word, data, 8);
+    return word;
+#else
+    uint64_t word = 0;
+    for(int i = 7; i >= 0; i--)
+        word = (word << 8) | data[i];
+    return word;
+#endif
+}
+
+/// @brief The make_code function builds the table entry for a symbol.
+/// @param kind The alphabet the symbol belongs to.
+/// @param symbol The symbol.
+/// @param bits The number of bits the entry takes up.
+/// @return The table entry.
+static INFLATE_CODE make_code(TABLE_KIND kind, unsigned int symbol, unsigned int bits) {
+    INFLATE_CODE code = { OP_INVALID, (uint8_t) bits, 0 };
+
+    if(kind == TABLE_CODELEN) {
+        code.op = OP_LITERAL;
+        code.val = (uint16_t) symbol;
+    } else if(kind == TABLE_LITLEN) {
+        if(symbol < 256) {
+            code.op = OP_LITERAL;
+            code.val = (uint16_t) symbol;
+        } else if(symbol == 256) {
+            code.op = OP_END;
+        } else if(symbol < 286) {
+            code.op = OP_BASE | length_extra[symbol - 257];
+            code.val = length_base[symbol - 257];
+        }
+    } else if(symbol < 30) {
+        code.op = OP_BASE | dist_extra[symbol];
+        code.val = dist_base[symbol];
+    }
+
+    return code;
+}
+
+/// @brief The reverse_bits function reverses the low bits of a code, since
+///        DEFLATE packs Huffman codes starting from their last bit.
+/// @param code The code to reverse.
+/// @param length The number of bits in the code.
+/// @return The reversed code.
+static unsigned int reverse_bits(unsigned int code, unsigned int length) {
+    unsigned int reversed = 0;
+    for(unsigned int i = 0; i < length; i++) {
+        reversed = (reversed << 1) | (code & 1);
+        code >>= 1;
+    }
+    return reversed;
+}
+
+/// @brief The build_table function builds a two-level decode table from code
+///        lengths. The first level resolves root bits at once, and codes that
+///        are longer than that link to a second-level table sized for the
+///        longest code sharing their prefix.
+/// @param table The table to fill.
+/// @param capacity The number of entries available in the table.
+/// @param root The number of bits resolved by the first level.
+/// @param lengths The code length of every symbol, 0 for unused symbols.
+/// @param num_symbols The number of symbols.
+/// @param kind The alphabet the table is for.
+/// @return True if the table was built, false if the lengths are invalid.
+static bool build_table(INFLATE_CODE* table, size_t capacity, unsigned int root,
+                        const uint8_t* lengths, unsigned int num_symbols, TABLE_KIND kind) {
+    unsigned int count[16] = { 0 };
+    unsigned int next_code[16];
+    uint16_t codes[288];
+    uint8_t max_length[1 << INFLATE_LITLEN_BITS];
+    unsigned int symbol, length, i;
+
+    // count the codes of each length
+    for(symbol = 0; symbol < num_symbols; symbol++)
+        count[lengths[symbol]]++;
+    count[0] = 0;
+
+    // reject over-subscribed code lengths
+    int left = 1;
+    for(length = 1; length < 16; length++) {
+        left = (left << 1) - (int) count[length];
+        if(left < 0)
+            return false;
+    }
+
+    // assign canonical codes in symbol order
+    unsigned int code = 0;
+    for(length = 1; length < 16; length++) {
+        code = (code + count[length - 1]) << 1;
+        next_code[length] = code;
+    }
+    for(symbol = 0; symbol < num_symbols; symbol++)
+        if(lengths[symbol] != 0)
+            codes[symbol] = (uint16_t) reverse_bits(next_code[lengths[symbol]]++, lengths[symbol]);
+
+    // start with every first-level entry invalid
+    unsigned int size = 1u << root;
+    unsigned int mask = size - 1;
+    INFLATE_CODE invalid = { OP_INVALID, 1, 0 };
+    for(i = 0; i < size; i++) {
+        table[i] = invalid;
+        max_length[i] = 0;
+    }
+
+    // find the longest code behind every first-level prefix
+    for(symbol = 0; symbol < num_symbols; symbol++)
+        if(lengths[symbol] > root && lengths[symbol] > max_length[codes[symbol] & mask])
+            max_length[codes[symbol] & mask] = lengths[symbol];
+
+    // lay out the second-level tables after the first level
+    size_t used = size;
+    for(i = 0; i < size; i++) {
+        if(max_length[i] == 0)
+            continue;
+        unsigned int sub_bits = max_length[i] - root;
+        if(used + ((size_t) 1 << sub_bits) > capacity)
+            return false;
+        table[i].op = (uint8_t) sub_bits;
+        table[i].bits = (uint8_t) root;
+        table[i].val = (uint16_t) used;
+        for(size_t j = 0; j < ((size_t) 1 << sub_bits); j++)
+            table[used + j] = invalid;
+        used += (size_t) 1 << sub_bits;
+    }
+
+    // fill in the entries for every code, repeated for the unused high bits
+    for(symbol = 0; symbol < num_symbols; symbol++) {
+        length = lengths[symbol];
+        if(length == 0)
+            continue;
+        if(length <= root) {
+            INFLATE_CODE entry = make_code(kind, symbol, length);
+            for(i = codes[symbol]; i < size; i += 1u << length)
+                table[i] = entry;
+        } else {
+            INFLATE_CODE link = table[codes[symbol] & mask];
+            INFLATE_CODE entry = make_code(kind, symbol, length - root);
+            for(i = codes[symbol] >> root; i < (1u << link.op); i += 1u << (length - root))
+                table[link.val + i] = entry;
+        }
+    }
+
+    return true;
+}
+
+/// @brief The inflate_init function prepares to decode a stream.
+/// @param inf The decoder state.
+/// @param segments The compressed input, read in order as one stream.
+/// @param num_segments The number of segments.
+/// @param out The buffer to decode into.
+/// @param out_length The size of the buffer.
+void inflate_init(INFLATE* inf, const INFLATE_SEGMENT* segments, size_t num_segments,
+                    unsigned char* out, size_t out_length) {
+    inf->segments = segments;
+    inf->num_segments = num_segments;
+    inf->segment = 0;
+    inf->next = num_segments > 0 ? segments[0].data : NULL;
+    inf->end = num_segments > 0 ? segments[0].data + segments[0].length : NULL;
+    inf->bits = 0;
+    inf->count = 0;
+    inf->overrun = 0;
+    inf->out = out;
+    inf->out_length = out_length;
+    inf->out_pos = 0;
+    inf->block = INFLATE_BLOCK_NONE;
+    inf->final = false;
+    inf->done = false;
+    inf->stored_left = 0;
+}
+
+/// @brief The inflate_skip function moves past compressed bytes before any
+///        have been decoded, to start at a known block boundary.
+/// @param inf The decoder state.
+/// @param length The number of bytes to skip.
+/// @return True if the bytes were skipped, false if the input is too short.
+bool inflate_skip(INFLATE* inf, size_t length) {
+    while(length > 0) {
+        size_t available = (size_t) (inf->end - inf->next);
+        if(available > length)
+            available = length;
+        inf->next += available;
+        length -= available;
+        if(length > 0) {
+            if(inf->segment + 1 >= inf->num_segments)
+                return false;
+            inf->segment++;
+            inf->next = inf->segments[inf->segment].data;
+            inf->end = inf->next + inf->segments[inf->segment].length;
+        }
+    }
+
+    return true;
+}
+
+/// @brief The refill_slow function tops up the reservoir a byte at a time,
+///        moving on to the next segment whenever one runs out.
+/// @param inf The decoder state.
+/// @return False if the input has been overrun by too much, true otherwise.
+static bool refill_slow(INFLATE* inf) {
+    while(inf->count <= 56) {
+        while(inf->next == inf->end && inf->segment + 1 < inf->num_segments) {
+            inf->segment++;
+            inf->next = inf->segments[inf->segment].data;
+            inf->end = inf->next + inf->segments[inf->segment].length;
+        }
+
+        // past the end of the input the reservoir is padded with zeros
+        uint64_t byte = 0;
+        if(inf->next != inf->end)
+            byte = *inf->next++;
+        else if(++inf->overrun > INFLATE_MAX_OVERRUN)
+            return false;
+        inf->bits |= byte << inf->count;
+        inf->count += 8;
+    }
+
+    return true;
+}
+
+/// @brief The refill function tops up the reservoir to at least 56 bits,
+///        loading a whole word at once when the segment has room.
+/// @param inf The decoder state.
+/// @return False if the input has been overrun by too much, true otherwise.
+static inline bool refill(INFLATE* inf) {
+    if(inf->end - inf->next >= 8) {
+        inf->bits |= load_le64(inf->next) << inf->count;
+        inf->next += (63 - inf->count) >> 3;
+        inf->count |= 56;
+        inf->bits &= ((uint64_t) 1 << inf->count) - 1;
+        return true;
+    }
+    return refill_slow(inf);
+}
+
+/// @brief The take_bits function removes bits from the reservoir.
+/// @param inf The decoder state.
+/// @param count The number of bits, at most what the reservoir holds.
+/// @return The bits taken.
+static inline unsigned int take_bits(INFLATE* inf, unsigned int count) {
+    unsigned int value = (unsigned int) (inf->bits & (((uint64_t) 1 << count) - 1));
+    inf->bits >>= count;
+    inf->count -= count;
+    return value;
+}
+
+/// @brief The is_overrun function checks if bits past the end of the input
+///        have been used.
+/// @param inf The decoder state.
+/// @return True if the stream was truncated, false otherwise.
+static inline bool is_overrun(INFLATE* inf) {
+    return inf->overrun * 8 > inf->count;
+}
+
+/// @brief The start_stored function reads the length of a stored block.
+/// @param inf The decoder state.
+/// @return True if the length was valid, false otherwise.
+static bool start_stored(INFLATE* inf) {
+    // stored blocks start on a byte boundary
+    take_bits(inf, inf->count & 7);
+    if(!refill(inf))
+        INFLATE_FAIL("truncated stored block");
+    unsigned int length = take_bits(inf, 16);
+    unsigned int check = take_bits(inf, 16);
+    if(length != (~check & 0xffff))
+        INFLATE_FAIL("stored block length mismatch");
+    if(length > inf->out_length - inf->out_pos)
+        INFLATE_FAIL("too much data");
+    inf->stored_left = length;
+    inf->block = INFLATE_BLOCK_STORED;
+
+    return true;
+}
+
+/// @brief The inflate_stored function copies a stored block to the output,
+///        pausing once the output reaches the stop position.
+/// @param inf The decoder state, with the block's length read.
+/// @param stop The output position to pause at.
+/// @return True if the block was copied or paused, false otherwise.
+static bool inflate_stored(INFLATE* inf, size_t stop) {
+    size_t length = inf->stored_left;
+    if(stop > inf->out_pos && length > stop - inf->out_pos)
+        length = stop - inf->out_pos;
+    else if(stop <= inf->out_pos)
+        length = 0;
+    inf->stored_left -= length;
+    if(inf->stored_left == 0)
+        inf->block = INFLATE_BLOCK_NONE;
+
+    // the first bytes are already sitting in the reservoir
+    while(length > 0 && inf->count >= 8) {
+        inf->out[inf->out_pos++] = (unsigned char) take_bits(inf, 8);
+        length--;
+    }
+    if(is_overrun(inf))
+        INFLATE_FAIL("truncated stored block");
+
+    // the reservoir is empty by now, so the rest comes straight from the segments
+    while(length > 0) {
+        size_t available = (size_t) (inf->end - inf->next);
+        if(available == 0) {
+            if(inf->segment + 1 >= inf->num_segments)
+                INFLATE_FAIL("truncated stored block");
+            inf->segment++;
+            inf->next = inf->segments[inf->segment].data;
+            inf->end = inf->next + inf->segments[inf->segment].length;
+            continue;
+        }
+        if(available > length)
+            available = length;
+        memcpy(inf->out + inf->out_pos, inf->next, available);
+        inf->out_pos += available;
+        inf->next += available;
+        length -= available;
+    }
+
+    return true;
+}
+
+/// @brief The read_dynamic_tables function reads the code lengths of a
+///        dynamic block and builds its decode tables.
+/// @param inf The decoder state.
+/// @return True if the tables were built, false otherwise.
+static bool read_dynamic_tables(INFLATE* inf) {
+    uint8_t lengths[288 + 32];
+    uint8_t codelen_lengths[19] = { 0 };
+    INFLATE_CODE codelen[1 << 7];
+    unsigned int i;
+
+    // read the table sizes and the code length code
+    if(!refill(inf))
+        INFLATE_FAIL("truncated block header");
+    unsigned int num_litlen = take_bits(inf, 5) + 257;
+    unsigned int num_dist = take_bits(inf, 5) + 1;
+    unsigned int num_codelen = take_bits(inf, 4) + 4;
+    if(num_litlen > 286 || num_dist > 30)
+        INFLATE_FAIL("too many codes");
+    for(i = 0; i < num_codelen; i++) {
+        if(inf->count < 3 && !refill(inf))
+            INFLATE_FAIL("truncated block header");
+        codelen_lengths[codelen_order[i]] = (uint8_t) take_bits(inf, 3);
+    }
+    if(!build_table(codelen, 1 << 7, 7, codelen_lengths, 19, TABLE_CODELEN))
+        INFLATE_FAIL("invalid code length code");
+
+    // read the literal/length and distance code lengths as one sequence
+    i = 0;
+    while(i < num_litlen + num_dist) {
+        if(!refill(inf))
+            INFLATE_FAIL("truncated block header");
+        INFLATE_CODE entry = codelen[inf->bits & 0x7f];
+        if(entry.op == OP_INVALID)
+            INFLATE_FAIL("invalid code length");
+        take_bits(inf, entry.bits);
+
+        unsigned int repeat;
+        uint8_t value;
+        if(entry.val < 16) {
+            lengths[i++] = (uint8_t) entry.val;
+            continue;
+        } else if(entry.val == 16) {
+            if(i == 0)
+                INFLATE_FAIL("repeat with no previous length");
+            value = lengths[i - 1];
+            repeat = 3 + take_bits(inf, 2);
+        } else if(entry.val == 17) {
+            value = 0;
+            repeat = 3 + take_bits(inf, 3);
+        } else {
+            value = 0;
+            repeat = 11 + take_bits(inf, 7);
+        }
+        if(i + repeat > num_litlen + num_dist)
+            INFLATE_FAIL("too many code lengths");
+        memset(lengths + i, value, repeat);
+        i += repeat;
+    }
+    if(is_overrun(inf))
+        INFLATE_FAIL("truncated block header");
+    if(lengths[256] == 0)
+        INFLATE_FAIL("missing end of block code");
+
+    // build the decode tables
+    if(!build_table(inf->litlen, INFLATE_LITLEN_SIZE, INFLATE_LITLEN_BITS,
+                    lengths, num_litlen, TABLE_LITLEN))
+        INFLATE_FAIL("invalid literal/length code");
+    if(!build_table(inf->dist, INFLATE_DIST_SIZE, INFLATE_DIST_BITS,
+                    lengths + num_litlen, num_dist, TABLE_DIST))
+        INFLATE_FAIL("invalid distance code");
+
+    return true;
+}
+
+/// @brief The build_fixed_tables function builds the decode tables for a
+///        block compressed with the fixed Huffman codes.
+/// @param inf The decoder state.
+static void build_fixed_tables(INFLATE* inf) {
+    uint8_t lengths[288];
+    unsigned int i;
+
+    for(i = 0; i < 144; i++)
+        lengths[i] = 8;
+    for(; i < 256; i++)
+        lengths[i] = 9;
+    for(; i < 280; i++)
+        lengths[i] = 7;
+    for(; i < 288; i++)
+        lengths[i] = 8;
+    build_table(inf->litlen, INFLATE_LITLEN_SIZE, INFLATE_LITLEN_BITS, lengths, 288, TABLE_LITLEN);
+
+    for(i = 0; i < 32; i++)
+        lengths[i] = 5;
+    build_table(inf->dist, INFLATE_DIST_SIZE, INFLATE_DIST_BITS, lengths, 32, TABLE_DIST);
+}
+
+/// @brief The copy_match function copies a back-reference within the output,
+///        eight bytes at a time when the distance and remaining room allow it.
+/// @param out The output buffer.
+/// @param pos The position to copy to.
+/// @param out_length The size of the output buffer.
+/// @param distance The distance back to copy from.
+/// @param length The number of bytes to copy.
+static inline void copy_match(unsigned char* out, size_t pos, size_t out_length,
+                                unsigned int distance, unsigned int length) {
+    unsigned char* dst = out + pos;
+    const unsigned char* src = dst - distance;
+
+    if(out_length - pos >= (size_t) length + 8) {
+        unsigned char* stop = dst + length;
+        if(distance >= 8) {
+            // each word is read before the word it overlaps is written
+            do {
+                memcpy(dst, src, 8);
+                dst += 8;
+                src += 8;
+            } while(dst < stop);
+            return;
+        }
+        if(distance == 1) {
+            memset(dst, src[0], length);
+            return;
+        }
+    }
+
+    // short distances repeat a pattern, so copy them byte by byte
+    for(unsigned int i = 0; i < length; i++)
+        dst[i] = src[i];
+}
+
+/// @brief The inflate_huffman function decodes a Huffman-compressed block.
+///        The reservoir is kept in locals so it stays in registers while the
+///        output is written, and every symbol is decoded from one refill,
+///        which always holds enough bits for a length, a distance and their
+///        extra bits. Decoding pauses at the first symbol boundary at or past
+///        the stop position.
+/// @param inf The decoder state, with its tables built.
+/// @param stop The output position to pause at.
+/// @return True if the block was decoded or paused, false otherwise.
+static bool inflate_huffman(INFLATE* inf, size_t stop) {
+    const INFLATE_CODE* litlen = inf->litlen;
+    const INFLATE_CODE* dist = inf->dist;
+    unsigned char* out = inf->out;
+    const size_t out_length = inf->out_length;
+    const size_t limit = stop < out_length ? stop : out_length;
+    size_t pos = inf->out_pos;
+    uint64_t bits = inf->bits;
+    unsigned int count = inf->count;
+    const unsigned char* next = inf->next;
+    const unsigned char* end = inf->end;
+    const char* error = NULL;
+
+    while(pos < stop) {
+        // refill a word at a time, or fall back to crossing segments
+        if(end - next >= 8) {
+            bits |= load_le64(next) << count;
+            next += (63 - count) >> 3;
+            count |= 56;
+            bits &= ((uint64_t) 1 << count) - 1;
+        } else {
+            inf->bits = bits;
+            inf->count = count;
+            inf->next = next;
+            if(!refill_slow(inf)) {
+                error = "truncated block";
+                break;
+            }
+            bits = inf->bits;
+            count = inf->count;
+            next = inf->next;
+            end = inf->end;
+        }
+
+        // decode a literal/length symbol, following a link if the code is long
+        INFLATE_CODE entry = litlen[bits & ((1u << INFLATE_LITLEN_BITS) - 1)];
+        if(entry.op != OP_LITERAL && (entry.op & 0xf0) == 0) {
+            bits >>= entry.bits;
+            count -= entry.bits;
+            entry = litlen[entry.val + (bits & ((1u << entry.op) - 1))];
+        }
+        bits >>= entry.bits;
+        count -= entry.bits;
+
+        // literals go straight to the output
+        if(entry.op == OP_LITERAL) {
+            if(pos >= out_length) {
+                error = "too much data";
+                break;
+            }
+            out[pos++] = (unsigned char) entry.val;
+
+            // keep decoding literals while the reservoir holds a whole code
+            while(count >= 15 && pos < limit) {
+                entry = litlen[bits & ((1u << INFLATE_LITLEN_BITS) - 1)];
+                if(entry.op != OP_LITERAL)
+                    break;
+                bits >>= entry.bits;
+                count -= entry.bits;
+                out[pos++] = (unsigned char) entry.val;
+            }
+            continue;
+        }
+        if(entry.op & OP_END) {
+            inf->block = INFLATE_BLOCK_NONE;
+            break;
+        }
+        if(entry.op & OP_INVALID) {
+            error = "invalid literal/length code";
+            break;
+        }
+
+        // read the rest of the length
+        unsigned int extra = entry.op & 15;
+        unsigned int length = entry.val + (unsigned int) (bits & ((1u << extra) - 1));
+        bits >>= extra;
+        count -= extra;
+
+        // read the distance
+        entry = dist[bits & ((1u << INFLATE_DIST_BITS) - 1)];
+        if(entry.op != OP_LITERAL && (entry.op & 0xf0) == 0) {
+            bits >>= entry.bits;
+            count -= entry.bits;
+            entry = dist[entry.val + (bits & ((1u << entry.op) - 1))];
+        }
+        bits >>= entry.bits;
+        count -= entry.bits;
+        if(!(entry.op & OP_BASE)) {
+            error = "invalid distance code";
+            break;
+        }
+        extra = entry.op & 15;
+        unsigned int distance = entry.val + (unsigned int) (bits & ((1u << extra) - 1));
+        bits >>= extra;
+        count -= extra;
+
+        // copy the match
+        if(distance > pos) {
+            error = "distance too far back";
+            break;
+        }
+        if(length > out_length - pos) {
+            error = "too much data";
+            break;
+        }
+        copy_match(out, pos, out_length, distance, length);
+        pos += length;
+    }
+
+    // put the state back
+    inf->out_pos = pos;
+    inf->bits = bits;
+    inf->count = count;
+    inf->next = next;
+    if(error != NULL)
+        INFLATE_FAIL(error);
+    if(is_overrun(inf))
+        INFLATE_FAIL("truncated block");
+
+    return true;
+}
+
+/// @brief The decode_blocks function decodes blocks until the final one
+///        ends or the output reaches the stop position, picking up wherever
+///        the last call paused.
+/// @param inf The decoder state.
+/// @param stop The output position to pause at.
+/// @param stop_when_full Whether to stop at the first block boundary once the
+///        output buffer is full.
+/// @return True if the blocks were decoded or paused, false otherwise.
+static bool decode_blocks(INFLATE* inf, size_t stop, bool stop_when_full) {
+    while(true) {
+        // finish the block in progress, unless the stop comes first
+        if(inf->block == INFLATE_BLOCK_STORED && !inflate_stored(inf, stop))
+            return false;
+        if(inf->block == INFLATE_BLOCK_HUFFMAN && !inflate_huffman(inf, stop))
+            return false;
+        if(inf->block != INFLATE_BLOCK_NONE)
+            return true;
+        if(inf->final)
+            inf->done = true;
+        if(inf->done || inf->out_pos >= stop ||
+                (stop_when_full && inf->out_pos == inf->out_length))
+            return true;
+
+        // read the block header
+        if(!refill(inf))
+            INFLATE_FAIL("truncated block header");
+        inf->final = take_bits(inf, 1);
+        unsigned int type = take_bits(inf, 2);
+
+        // set up the block according to its type
+        if(type == 0) {
+            if(!start_stored(inf))
+                return false;
+        } else if(type == 1) {
+            build_fixed_tables(inf);
+            inf->block = INFLATE_BLOCK_HUFFMAN;
+        } else if(type == 2) {
+            if(!read_dynamic_tables(inf))
+                return false;
+            inf->block = INFLATE_BLOCK_HUFFMAN;
+        } else {
+            INFLATE_FAIL("invalid block type");
+        }
+    }
+}
+
+/// @brief The inflate_raw function decodes raw DEFLATE blocks into the output
+///        buffer until the final block.
+/// @param inf The decoder state.
+/// @param stop_when_full Whether to stop at the first block boundary once the
+///        output buffer is full, for streams split at flush points.
+/// @return True if the blocks were decoded, false otherwise.
+bool inflate_raw(INFLATE* inf, bool stop_when_full) {
+    return decode_blocks(inf, SIZE_MAX, stop_when_full);
+}
+
+/// @brief The inflate_until function decodes raw DEFLATE blocks until at
+///        least the given number of bytes are out, pausing partway through a
+///        block if need be, so that the start of the data can be used before
+///        the rest is decoded. Calling it again resumes where it stopped.
+/// @param inf The decoder state.
+/// @param stop The output position to decode up to.
+/// @return True if the blocks were decoded, false otherwise. The output falls
+///         short of the stop position only if the final block ended first.
+bool inflate_until(INFLATE* inf, size_t stop) {
+    return decode_blocks(inf, stop, false);
+}
+
+/// @brief The inflate_trailer function reads the big-endian Adler-32 that
+///        follows the final block of a zlib stream.
+/// @param inf The decoder state, just past the final block.
+/// @param adler Where to store the checksum.
+/// @return True if the checksum was there, false if the input ran out.
+bool inflate_trailer(INFLATE* inf, unsigned long* adler) {
+    take_bits(inf, inf->count & 7);
+    bool read = refill(inf);
+    *adler = 0;
+    for(int i = 0; i < 4; i++)
+        *adler = (*adler << 8) | take_bits(inf, 8);
+
+    return read && !is_overrun(inf);
+}
+
+/// @brief The inflate_header function reads and checks the two-byte header
+///        of a zlib stream, which cannot ask for a preset dictionary in a PNG.
+/// @param inf The decoder state, at the start of the stream.
+/// @return True if the header was valid, false otherwise.
+bool inflate_header(INFLATE* inf) {
+    bool read = refill(inf);
+    unsigned int cmf = take_bits(inf, 8);
+    unsigned int flg = take_bits(inf, 8);
+    if(!read || (cmf & 0x0f) != 8 || (cmf >> 4) > 7 || ((cmf << 8) | flg) % 31 != 0 ||
+                (flg & 0x20) != 0) {
+        printf("Invalid zlib header\n");
+        return false;
+    }
+
+    return true;
+}
+
+/// @brief The inflate_zlib function decodes a whole zlib stream, checking its
+///        header and Adler-32 checksum.
+/// @param segments The compressed input, read in order as one stream.
+/// @param num_segments The number of segments.
+/// @param out The buffer to decode into.
+/// @param out_length The size of the buffer.
+/// @param written Set to the number of bytes decoded.
+/// @return True if the stream was decoded, false otherwise.
+bool inflate_zlib(const INFLATE_SEGMENT* segments, size_t num_segments,
+                    unsigned char* out, size_t out_length, size_t* written) {
+    INFLATE* inf = malloc(sizeof(INFLATE));
+    if(inf == NULL)
+        return false;
+    inflate_init(inf, segments, num_segments, out, out_length);
+    *written = 0;
+
+    // check the header
+    if(!inflate_header(inf)) {
+        free(inf);
+        return false;
+    }
+
+    // decode the data, then check it against the big-endian trailer
+    bool decoded = inflate_raw(inf, false);
+    if(decoded) {
+        unsigned long adler;
+        decoded = inflate_trailer(inf, &adler);
+        if(!decoded || adler != adler_update(1, out, inf->out_pos)) {
+            printf("Invalid zlib stream: Failed Adler-32 Check\n");
+            decoded = false;
+        }
+    }
+    *written = inf->out_pos;
+    free(inf);
+
+    return decoded;
+}
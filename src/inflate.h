@@ -0,0 +1,81 @@
+///
+/// @file inflate.h
+/// @brief DEFLATE and zlib decoder header
+/// @author Sam Cordry
+
+#ifndef INFLATE_H
+#define INFLATE_H
+
+// include needed system libraries
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+/// @brief The number of bits resolved by the first level of the literal/length table.
+#define INFLATE_LITLEN_BITS 10
+
+/// @brief The number of bits resolved by the first level of the distance table.
+#define INFLATE_DIST_BITS 8
+
+/// @brief The capacity of the literal/length table, both levels included.
+#define INFLATE_LITLEN_SIZE 2048
+
+/// @brief The capacity of the distance table, both levels included.
+#define INFLATE_DIST_SIZE 1024
+
+/// @brief The kinds of block the decoder can be partway through
+typedef enum {
+    INFLATE_BLOCK_NONE, ///< between blocks
+    INFLATE_BLOCK_STORED, ///< copying a stored block
+    INFLATE_BLOCK_HUFFMAN ///< decoding a Huffman-compressed block
+} INFLATE_BLOCK;
+
+/// @brief A piece of compressed input, such as the data of one IDAT chunk
+typedef struct {
+    const unsigned char* data; ///< compressed bytes
+    size_t length; ///< number of compressed bytes
+} INFLATE_SEGMENT;
+
+/// @brief Huffman decode table entry
+typedef struct {
+    uint8_t op; ///< 0 literal, 16 + extra bits for a base value, 32 end of
+                ///< block, 64 invalid, otherwise the bits of a second level
+    uint8_t bits; ///< number of bits the code takes up at this level
+    uint16_t val; ///< literal, base value, or offset of the second level
+} INFLATE_CODE;
+
+/// @brief Decoder state for one DEFLATE stream read across several segments
+typedef struct {
+    const INFLATE_SEGMENT* segments; ///< compressed input
+    size_t num_segments; ///< number of segments
+    size_t segment; ///< index of the segment being read
+    const unsigned char* next; ///< next unread byte of the segment
+    const unsigned char* end; ///< end of the segment
+    uint64_t bits; ///< bit reservoir, least significant bit first
+    unsigned int count; ///< number of valid bits in the reservoir
+    size_t overrun; ///< zero bytes fed in after the input ran out
+    unsigned char* out; ///< caller-supplied output buffer
+    size_t out_length; ///< size of the output buffer
+    size_t out_pos; ///< number of bytes written so far
+    INFLATE_BLOCK block; ///< block being decoded when the decoder paused
+    bool final; ///< whether the block being decoded is the last one
+    bool done; ///< whether the last block has been decoded
+    size_t stored_left; ///< bytes of the stored block still to copy
+    INFLATE_CODE litlen[INFLATE_LITLEN_SIZE]; ///< literal/length table
+    INFLATE_CODE dist[INFLATE_DIST_SIZE]; ///< distance table
+} INFLATE;
+
+// inflate functions
+void inflate_init(INFLATE* inf, const INFLATE_SEGMENT* segments, size_t num_segments,
+                    unsigned char* out, size_t out_length);
+bool inflate_skip(INFLATE* inf, size_t length);
+bool inflate_raw(INFLATE* inf, bool stop_when_full);
+bool inflate_until(INFLATE* inf, size_t stop);
+bool inflate_header(INFLATE* inf);
+bool inflate_trailer(INFLATE* inf, unsigned long* adler);
+bool inflate_zlib(const INFLATE_SEGMENT* segments, size_t num_segments,
+                    unsigned char* out, size_t out_length, size_t* written);
+
+#endif
@@ -5,15 +5,168 @@
 
 // include the header for the JPEG file format
 #include "jpeg.h"
+#include "huffman.h"
+#include "dct.h"
+#include "pool.h"
+#include "cpu.h"
+
+#ifdef CPU_X86
+#include <immintrin.h>
+#endif
 
 /// @brief The MEM_CHECK macro checks if the given pointer is NULL.
 #define MEM_CHECK(ptr) if(ptr == NULL) { printf("Unable to allocate memory");\
                                             return false; }
 
-/// @brief The FEOF_CHECK macro checks if the end of the file has been reached.
-#define FEOF_CHECK(file) if(feof(file)) { printf("Unexpected end of file");\
+/// @brief The READ_CHECK macro checks if a read from the source succeeded.
+#define READ_CHECK(ok) if(!(ok)) { printf("Unexpected end of file");\
                                             return false; }
 
+/// @brief The least entropy-coded data decoded by a single pool job, in whole
+///        restart intervals.
+#define RESTART_JOB_BYTES (1 << 18)
+
+/// @brief The scan size below which restart intervals are decoded on one thread.
+#define RESTART_PARALLEL (1 << 20)
+
+/// @brief The least MCUs re-encoded by a single pool job when optimizing, in
+///        whole restart intervals.
+#define OPTIMIZE_JOB_MCUS (1 << 12)
+
+/// @brief Finds the first 0xFF byte in a block, returning its index or the
+///        length of the block if there is none
+typedef size_t (*FIND_FUNC)(const unsigned char* data, size_t length);
+
+/// @brief Tables in effect at a point in the file, updated as each DQT and
+///        DHT segment is passed
+typedef struct {
+    uint16_t quant[4][64]; ///< quantization tables in natural order
+    bool has_quant[4]; ///< whether each quantization table has been defined
+    HUFF_DECODER dc[4]; ///< DC Huffman tables
+    HUFF_DECODER ac[4]; ///< AC Huffman tables
+    bool has_dc[4]; ///< whether each DC table has been defined
+    bool has_ac[4]; ///< whether each AC table has been defined
+} DECODE_TABLES;
+
+/// @brief Scan header fields, with the entropy-coded data they apply to
+typedef struct {
+    int num_components; ///< number of components in the scan
+    int index[JPEG_MAX_COMPONENTS]; ///< frame index of each component
+    int dc[JPEG_MAX_COMPONENTS]; ///< DC table of each component
+    int ac[JPEG_MAX_COMPONENTS]; ///< AC table of each component
+    int ss; ///< first zigzag index of the spectral selection
+    int se; ///< last zigzag index of the spectral selection
+    int ah; ///< previous successive approximation bit position
+    int al; ///< successive approximation bit position
+    bool progressive; ///< whether the scan is one pass of a progressive frame
+    size_t mcus_wide; ///< MCUs in each row of the scan
+    size_t num_mcus; ///< number of MCUs in the scan
+} SCAN_INFO;
+
+/// @brief A run of consecutive restart intervals decoded by one pool job
+typedef struct {
+    JPEG_IMAGE* image; ///< the image to decode into
+    const DECODE_TABLES* tables; ///< the tables in effect
+    const SCAN* scan; ///< the scan segment
+    const SCAN_INFO* info; ///< the scan header fields
+    size_t first; ///< the first interval
+    size_t count; ///< the number of intervals
+    bool decoded; ///< set when every interval decoded cleanly
+} RESTART_JOB;
+
+/// @brief Samples of one component for three MCU rows, reused in turn so the
+///        rows either side of the one being converted are at hand
+typedef struct {
+    unsigned char* samples; ///< the rows, each with room for a repeated sample at both ends
+    unsigned char* wide; ///< a row repeated out to the image width, for large factors
+    size_t stride; ///< distance between rows of samples
+    unsigned int rows; ///< sample rows in each MCU row
+    unsigned int hf; ///< horizontal upsampling factor
+    unsigned int vf; ///< vertical upsampling factor
+    bool fancy; ///< whether the component is upsampled with the triangle filter
+} SAMPLE_RING;
+
+/// @brief An image being encoded and the tables it is coded with
+typedef struct {
+    JPEG_IMAGE* image; ///< the image, whose coefficients are filled as rows are encoded
+    const unsigned char* pixels; ///< the pixels, row by row with no padding
+    unsigned int channels; ///< samples in each pixel, 1 for gray, 3 for RGB or 4 for RGBA
+    DCT_DIVISORS divisors[2]; ///< quantization by the luma and chroma tables
+    HUFF_ENCODER dc[JPEG_MAX_COMPONENTS]; ///< DC table of each pair, luma then chroma when encoding
+    HUFF_ENCODER ac[JPEG_MAX_COMPONENTS]; ///< AC table of each pair, luma then chroma when encoding
+    unsigned char tables[JPEG_MAX_COMPONENTS]; ///< DC and AC table pair each component is coded with
+    size_t restart_interval; ///< MCUs between restart markers, 0 for none
+    size_t stride; ///< distance between rows of each band's planes and samples
+    const JPEG_SCAN_SPEC* scan; ///< the progressive scan being coded, NULL for a sequential one
+    bool counting; ///< whether the bands only count the symbols of the scan
+    bool grouping; ///< whether each progressive scan groups its components into pairs itself
+} ENCODER;
+
+/// @brief A run of whole restart intervals coded on its own, with the rows
+///        its pixels are converted into
+typedef struct {
+    const ENCODER* enc; ///< the encoder
+    size_t first; ///< the first MCU, at the start of an MCU row when converting pixels
+    size_t count; ///< the number of MCUs
+    unsigned char* planes[3]; ///< an MCU row of each plane at full resolution
+    unsigned char* samples[3]; ///< an MCU row of each component, the plane itself if not subsampled
+    BIT_WRITER bw; ///< the entropy-coded data of the band
+    size_t* restarts; ///< offset of each RSTn marker within the band's data
+    size_t num_restarts; ///< number of RSTn markers within the band's data
+    uint32_t freq[2 * JPEG_MAX_COMPONENTS][256]; ///< DC then AC symbols of each pair, when counting
+    bool encoded; ///< set when the band was coded
+} ENCODE_BAND;
+
+/// @brief The Annex K luminance quantization table in natural order.
+static const unsigned char std_luma_quant[64] = {
+    16, 11, 10, 16, 24, 40, 51, 61,
+    12, 12, 14, 19, 26, 58, 60, 55,
+    14, 13, 16, 24, 40, 57, 69, 56,
+    14, 17, 22, 29, 51, 87, 80, 62,
+    18, 22, 37, 56, 68, 109, 103, 77,
+    24, 35, 55, 64, 81, 104, 113, 92,
+    49, 64, 78, 87, 103, 121, 120, 101,
+    72, 92, 95, 98, 112, 100, 103, 99
+};
+
+/// @brief The Annex K chrominance quantization table in natural order.
+static const unsigned char std_chroma_quant[64] = {
+    17, 18, 24, 47, 99, 99, 99, 99,
+    18, 21, 26, 66, 99, 99, 99, 99,
+    24, 26, 56, 99, 99, 99, 99, 99,
+    47, 66, 99, 99, 99, 99, 99, 99,
+    99, 99, 99, 99, 99, 99, 99, 99,
+    99, 99, 99, 99, 99, 99, 99, 99,
+    99, 99, 99, 99, 99, 99, 99, 99,
+    99, 99, 99, 99, 99, 99, 99, 99
+};
+
+/// @brief The progressive scan script libjpeg uses for color images. The
+///        DC coefficients and the first luma AC coefficients come first, at
+///        reduced precision, for a quick coarse image.
+static const JPEG_SCAN_SPEC color_script[10] = {
+    { 3, { 0, 1, 2 }, 0, 0, 0, 1 },
+    { 1, { 0 }, 1, 5, 0, 2 },
+    { 1, { 2 }, 1, 63, 0, 1 },
+    { 1, { 1 }, 1, 63, 0, 1 },
+    { 1, { 0 }, 6, 63, 0, 2 },
+    { 1, { 0 }, 1, 63, 2, 1 },
+    { 3, { 0, 1, 2 }, 0, 0, 1, 0 },
+    { 1, { 2 }, 1, 63, 1, 0 },
+    { 1, { 1 }, 1, 63, 1, 0 },
+    { 1, { 0 }, 1, 63, 1, 0 }
+};
+
+/// @brief The progressive scan script libjpeg uses for gray images.
+static const JPEG_SCAN_SPEC gray_script[6] = {
+    { 1, { 0 }, 0, 0, 0, 1 },
+    { 1, { 0 }, 1, 5, 0, 2 },
+    { 1, { 0 }, 6, 63, 0, 2 },
+    { 1, { 0 }, 1, 63, 2, 1 },
+    { 1, { 0 }, 0, 0, 1, 0 },
+    { 1, { 0 }, 1, 63, 1, 0 }
+};
+
 #ifdef DEBUG
 /// @brief The print_info function prints the given data to the console.
 /// @param data The data to print.
@@ -29,53 +182,148 @@ void print_info(unsigned char* data, int length) {
 }
 #endif
 
+/// @brief The find_ff_scalar function finds the first 0xFF byte in a block.
+/// @param data The block to search.
+/// @param length The length of the block.
+/// @return The index of the byte, or length if there is none.
+static size_t find_ff_scalar(const unsigned char* data, size_t length) {
+    const unsigned char* match = memchr(data, START, length);
+    return match == NULL ? length : (size_t) (match - data);
+}
+
+#ifdef CPU_X86
+/// @brief The find_ff_sse2 function finds the first 0xFF byte in a block,
+///        16 bytes at a time.
+/// @param data The block to search.
+/// @param length The length of the block.
+/// @return The index of the byte, or length if there is none.
+__attribute__((target("sse2")))
+static size_t find_ff_sse2(const unsigned char* data, size_t length) {
+    const __m128i ff = _mm_set1_epi8((char) START);
+    size_t i = 0;
+
+    for(; i + 16 <= length; i += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i*) (data + i));
+        unsigned int mask = (unsigned int) _mm_movemask_epi8(_mm_cmpeq_epi8(x, ff));
+        if(mask != 0)
+            return i + (size_t) __builtin_ctz(mask);
+    }
+    return i + find_ff_scalar(data + i, length - i);
+}
+
+/// @brief The find_ff_avx2 function finds the first 0xFF byte in a block,
+///        testing 64 bytes per branch so long runs go at memory speed.
+/// @param data The block to search.
+/// @param length The length of the block.
+/// @return The index of the byte, or length if there is none.
+__attribute__((target("avx2")))
+static size_t find_ff_avx2(const unsigned char* data, size_t length) {
+    const __m256i ff = _mm256_set1_epi8((char) START);
+    size_t i = 0;
+
+    for(; i + 64 <= length; i += 64) {
+        __m256i a = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*) (data + i)), ff);
+        __m256i b = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*) (data + i + 32)), ff);
+        if(_mm256_testz_si256(_mm256_or_si256(a, b), _mm256_or_si256(a, b)))
+            continue;
+        unsigned int low = (unsigned int) _mm256_movemask_epi8(a);
+        if(low != 0)
+            return i + (size_t) __builtin_ctz(low);
+        return i + 32 + (size_t) __builtin_ctz((unsigned int) _mm256_movemask_epi8(b));
+    }
+    if(i + 32 <= length) {
+        __m256i a = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*) (data + i)), ff);
+        unsigned int mask = (unsigned int) _mm256_movemask_epi8(a);
+        if(mask != 0)
+            return i + (size_t) __builtin_ctz(mask);
+        i += 32;
+    }
+    return i + find_ff_sse2(data + i, length - i);
+}
+#endif
+
+/// @brief The find_ff_func function picks the fastest 0xFF search the CPU
+///        supports.
+/// @return The search function.
+static FIND_FUNC find_ff_func(void) {
+#ifdef CPU_X86
+    if(cpu_has_avx2())
+        return find_ff_avx2;
+    if(cpu_has_sse2())
+        return find_ff_sse2;
+#endif
+    return find_ff_scalar;
+}
+
+/// @brief The jpeg_add_segment function records where a segment falls in the
+///        file.
+/// @param jpeg The JPEG struct the segment was read into.
+/// @param marker The marker of the segment.
+/// @param index The index of the segment in the array for its marker.
+/// @return True if the segment was recorded, false otherwise.
+static bool jpeg_add_segment(JPEG* jpeg, unsigned char marker, int index) {
+    JPEG_SEGMENT* segments = realloc(jpeg->segments,
+                                        sizeof(JPEG_SEGMENT) * (jpeg->num_segments + 1));
+    MEM_CHECK(segments);
+    jpeg->segments = segments;
+    jpeg->segments[jpeg->num_segments].marker = marker;
+    jpeg->segments[jpeg->num_segments].index = index;
+    jpeg->num_segments++;
+
+    return true;
+}
+
 /// @brief The jpeg_create function initializes a pointer to a JPEG struct.
-/// @return A pointer to the created JPEG struct.
+/// @return A pointer to the created JPEG struct, or NULL if memory ran out.
 JPEG* jpeg_create(void) {
     JPEG* jpeg = malloc(sizeof(JPEG));
-    
+    if(jpeg == NULL)
+        return NULL;
+
     jpeg->frames = NULL;
     jpeg->quant_tables = NULL;
     jpeg->huff_tables = NULL;
     jpeg->scans = NULL;
     jpeg->app_segments = NULL;
+    jpeg->segments = NULL;
 
     jpeg->num_frames = 0;
     jpeg->num_quant_tables = 0;
     jpeg->num_huff_tables = 0;
     jpeg->num_scans = 0;
     jpeg->num_app_segments = 0;
+    jpeg->num_segments = 0;
 
     return jpeg;
 }
 
-/// @brief The jpeg_read function reads a frame segment from the given data.
+/// @brief The jpeg_read_frame function reads a frame segment from the given
+///        data.
 /// @param jpeg The JPEG struct to read into.
+/// @param marker The SOFn marker of the frame.
 /// @param data The data to read from.
 /// @param length The length of the data.
 /// @return True if the frame was read successfully, false otherwise.
-bool jpeg_read_frame(JPEG* jpeg, unsigned char* data, int length) {
-    // terate the number of frames and allocate memory appropriately
-    if(jpeg->num_frames == 0) {
-        jpeg->num_frames = 1;
-        jpeg->frames = malloc(sizeof(FRAME));
-    } else {
-        jpeg->num_frames++;
-        jpeg->frames = realloc(jpeg->frames, sizeof(FRAME) * jpeg->num_frames);
-    }
-    MEM_CHECK(jpeg->frames);
+bool jpeg_read_frame(JPEG* jpeg, unsigned char marker, const unsigned char* data, int length) {
+    // make room for one more frame, counted once its data is allocated
+    FRAME* frames = realloc(jpeg->frames, sizeof(FRAME) * (jpeg->num_frames + 1));
+    MEM_CHECK(frames);
+    jpeg->frames = frames;
 
     // allocate memory for the frame data
-    jpeg->frames[jpeg->num_frames - 1].data = malloc(length);
-    MEM_CHECK(jpeg->frames[jpeg->num_frames - 1].data);
+    unsigned char* frame_data = malloc(length > 0 ? length : 1);
+    MEM_CHECK(frame_data);
+    jpeg->num_frames++;
 
-    // set the frame data length
+    // set the frame marker, data and its length
+    jpeg->frames[jpeg->num_frames - 1].marker = marker;
+    jpeg->frames[jpeg->num_frames - 1].data = frame_data;
     jpeg->frames[jpeg->num_frames - 1].length = length;
 
     // copy the data into the frame data
-    memcpy(jpeg->frames[jpeg->num_frames - 1].data, data, length);
+    memcpy(frame_data, data, length);
 
-    return true;
+    return jpeg_add_segment(jpeg, marker, jpeg->num_frames - 1);
 }
 
 /// @brief The jpeg_read_quant_table function reads a quantization table
@@ -84,29 +332,26 @@ bool jpeg_read_frame(JPEG* jpeg, unsigned char* data, int length) {
 /// @param data  The data to read from.
 /// @param length The length of the data.
 /// @return True if the table was read successfully, false otherwise.
-bool jpeg_read_quant_table(JPEG* jpeg, unsigned char* data, int length) {
-    // iterate the number of tables and allocate memory appropriately
-    if(jpeg->num_quant_tables == 0) {
-        jpeg->num_quant_tables = 1;
-        jpeg->quant_tables = malloc(sizeof(QUANT_TABLE));
-    } else {
-        jpeg->quant_tables = realloc(jpeg->quant_tables,\
-                                sizeof(QUANT_TABLE) * jpeg->num_quant_tables);
-        jpeg->num_quant_tables++;
-    }
-    MEM_CHECK(jpeg->quant_tables);
+bool jpeg_read_quant_table(JPEG* jpeg, const unsigned char* data, int length) {
+    // make room for one more table, counted once its data is allocated
+    QUANT_TABLE* tables = realloc(jpeg->quant_tables,
+                                    sizeof(QUANT_TABLE) * (jpeg->num_quant_tables + 1));
+    MEM_CHECK(tables);
+    jpeg->quant_tables = tables;
 
     // allocate memory for the table data
-    jpeg->quant_tables[jpeg->num_quant_tables - 1].data = malloc(length);
-    MEM_CHECK(jpeg->quant_tables[jpeg->num_quant_tables - 1].data);
+    unsigned char* table_data = malloc(length > 0 ? length : 1);
+    MEM_CHECK(table_data);
+    jpeg->num_quant_tables++;
 
-    // set the table data length
+    // set the table data and its length
+    jpeg->quant_tables[jpeg->num_quant_tables - 1].data = table_data;
     jpeg->quant_tables[jpeg->num_quant_tables - 1].length = length;
 
     // copy the data into the table data
-    memcpy(jpeg->quant_tables[jpeg->num_quant_tables - 1].data, data, length);
+    memcpy(table_data, data, length);
 
-    return true;
+    return jpeg_add_segment(jpeg, DQT, jpeg->num_quant_tables - 1);
 }
 
 /// @brief The jpeg_read_huff_table function reads a huffman table segment
@@ -115,120 +360,219 @@ bool jpeg_read_quant_table(JPEG* jpeg, unsigned char* data, int length) {
 /// @param data The data to read from.
 /// @param length The length of the data.
 /// @return True if the table was read successfully, false otherwise.
-bool jpeg_read_huff_table(JPEG* jpeg, unsigned char* data, int length) {
-    // iterate the number of tables and allocate memory appropriately
-    if(jpeg->num_huff_tables == 0) {
-        jpeg->num_huff_tables = 1;
-        jpeg->huff_tables = malloc(sizeof(HUFF_TABLE));
-    } else {
-        jpeg->num_huff_tables++;
-        jpeg->huff_tables = realloc(jpeg->huff_tables,\
-                                sizeof(HUFF_TABLE) * jpeg->num_huff_tables);
-    }
-    MEM_CHECK(jpeg->huff_tables);
+bool jpeg_read_huff_table(JPEG* jpeg, const unsigned char* data, int length) {
+    // make room for one more table, counted once its data is allocated
+    HUFF_TABLE* tables = realloc(jpeg->huff_tables,
+                                    sizeof(HUFF_TABLE) * (jpeg->num_huff_tables + 1));
+    MEM_CHECK(tables);
+    jpeg->huff_tables = tables;
 
     // allocate memory for the table data
-    jpeg->huff_tables[jpeg->num_huff_tables - 1].data = malloc(length);
-    MEM_CHECK(jpeg->huff_tables[jpeg->num_huff_tables - 1].data);
+    unsigned char* table_data = malloc(length > 0 ? length : 1);
+    MEM_CHECK(table_data);
+    jpeg->num_huff_tables++;
 
-    // set the table data length
+    // set the table data and its length
+    jpeg->huff_tables[jpeg->num_huff_tables - 1].data = table_data;
     jpeg->huff_tables[jpeg->num_huff_tables - 1].length = length;
 
     // copy the data into the table data
-    memcpy(jpeg->huff_tables[jpeg->num_huff_tables - 1].data, data, length);
+    memcpy(table_data, data, length);
 
-    return true;
+    return jpeg_add_segment(jpeg, DHT, jpeg->num_huff_tables - 1);
 }
 
 /// @brief The jpeg_read_scan function reads a scan segment from the given data.
+///        The scan takes the data and restart offsets as they are rather than
+///        copying them.
 /// @param jpeg The JPEG struct to read into.
-/// @param data The data to read from.
+/// @param data The scan header followed by the entropy-coded data.
 /// @param length The length of the data.
-/// @return True if the scan was read successfully, false otherwise.
-bool jpeg_read_scan(JPEG* jpeg, unsigned char* data, int length) {
-    // iterate the number of scans and allocate memory appropriately
-    if(jpeg->num_scans == 0) {
-        jpeg->num_scans = 1;
-        jpeg->scans = malloc(sizeof(SCAN));
-    } else {
-        jpeg->num_scans++;
-        jpeg->scans = realloc(jpeg->scans, sizeof(SCAN) * jpeg->num_scans);
+/// @param header_length The length of the scan header.
+/// @param restart_interval The restart interval from the latest DRI segment.
+/// @param restarts The offset of each RSTn marker in the data, owned by the
+///        scan from now on.
+/// @param num_restarts The number of RSTn markers.
+/// @param borrowed True if the data belongs to the input source, false if the
+///        scan now owns it.
+/// @return True if the scan was read successfully, false otherwise, in
+///         which case the data and restart offsets are still the caller's.
+bool jpeg_read_scan(JPEG* jpeg, unsigned char* data, size_t length, int header_length,
+                        unsigned int restart_interval, size_t* restarts, size_t num_restarts,
+                        bool borrowed) {
+    // make room for one more scan
+    SCAN* scans = realloc(jpeg->scans, sizeof(SCAN) * (jpeg->num_scans + 1));
+    MEM_CHECK(scans);
+    jpeg->scans = scans;
+    jpeg->num_scans++;
+
+    // set the scan data, its length and where its restart markers are
+    SCAN* scan = jpeg->scans + jpeg->num_scans - 1;
+    scan->data = data;
+    scan->length = length;
+    scan->header_length = header_length;
+    scan->restart_interval = restart_interval;
+    scan->restarts = restarts;
+    scan->num_restarts = num_restarts;
+    scan->borrowed = borrowed;
+
+    // the scan is dropped again if it cannot be placed in the file
+    if(!jpeg_add_segment(jpeg, SOS, jpeg->num_scans - 1)) {
+        jpeg->num_scans--;
+        return false;
     }
-    MEM_CHECK(jpeg->scans);
-
-    // allocate memory for the scan data
-    jpeg->scans[jpeg->num_scans - 1].data = malloc(length);
-    MEM_CHECK(jpeg->scans[jpeg->num_scans - 1].data);
-
-    // set the scan data length
-    jpeg->scans[jpeg->num_scans - 1].length = length;
-
-    // copy the data into the scan datas
-    memcpy(jpeg->scans[jpeg->num_scans - 1].data, data, length);
 
     return true;
 }
 
-/// @brief The jpeg_read_app_seg function reads an application segment from the
-///        given data.
+/// @brief The jpeg_read_app_seg function reads an application segment, or
+///        any other segment kept as it is, from the given data. The segment
+///        takes the data as is rather than copying it.
 /// @param jpeg The JPEG struct to read into.
+/// @param marker The marker of the segment.
 /// @param data The data to read from.
 /// @param length The length of the data.
-/// @return True if the segment was read successfully, false otherwise.
-bool jpeg_read_app_seg(JPEG* jpeg, unsigned char* data, int length) {
-    // iterate the number of app segments and allocate memory appropriately
-    if(jpeg->num_app_segments == 0) {
-        jpeg->num_app_segments = 1;
-        jpeg->app_segments = malloc(sizeof(APP_SEG));
-    } else {
-        jpeg->num_app_segments++;
-        jpeg->app_segments = realloc(jpeg->app_segments,\
-                                sizeof(APP_SEG) * jpeg->num_app_segments);
+/// @param borrowed True if the data belongs to the input source, false if the
+///        segment now owns it.
+/// @return True if the segment was read successfully, false otherwise, in
+///         which case the data is still the caller's.
+bool jpeg_read_app_seg(JPEG* jpeg, unsigned char marker, unsigned char* data, int length,
+                        bool borrowed) {
+    // make room for one more app segment
+    APP_SEG* app_segments = realloc(jpeg->app_segments,
+                                    sizeof(APP_SEG) * (jpeg->num_app_segments + 1));
+    MEM_CHECK(app_segments);
+    jpeg->app_segments = app_segments;
+    jpeg->num_app_segments++;
+
+    // set the app segment marker, data and its length
+    jpeg->app_segments[jpeg->num_app_segments - 1].marker = marker;
+    jpeg->app_segments[jpeg->num_app_segments - 1].data = data;
+    jpeg->app_segments[jpeg->num_app_segments - 1].length = length;
+    jpeg->app_segments[jpeg->num_app_segments - 1].borrowed = borrowed;
+
+    // the segment is dropped again if it cannot be placed in the file
+    if(!jpeg_add_segment(jpeg, marker, jpeg->num_app_segments - 1)) {
+        jpeg->num_app_segments--;
+        return false;
     }
-    MEM_CHECK(jpeg->app_segments);
 
-    // allocate memory for the app segment data
-    jpeg->app_segments[jpeg->num_app_segments - 1].data = malloc(length);
-    MEM_CHECK(jpeg->app_segments[jpeg->num_app_segments - 1].data);
+    return true;
+}
 
-    // set the app segment data length
-    jpeg->app_segments[jpeg->num_app_segments - 1].length = length;
+/// @brief The jpeg_scan_entropy function finds where the entropy-coded data
+///        after a scan header ends, without consuming anything. Stuffed 0xFF00
+///        bytes and RSTn markers belong to the data, and any other marker
+///        ends it.
+/// @param src The source to search, positioned at the scan header.
+/// @param start The length of the scan header.
+/// @param find The 0xFF search to use.
+/// @param length Set to the length of the header and the entropy-coded data.
+/// @param restarts Set to the offset of each RSTn marker from the source
+///        position, to be freed by the caller.
+/// @param num_restarts Set to the number of RSTn markers.
+/// @return True if the data was scanned, false otherwise.
+static bool jpeg_scan_entropy(SOURCE* src, size_t start, FIND_FUNC find, size_t* length,
+                                size_t** restarts, size_t* num_restarts) {
+    size_t searched = start;
+    size_t capacity = 0;
+
+    *restarts = NULL;
+    *num_restarts = 0;
+    while(true) {
+        // every 0xFF needs the byte after it, so ask for one more than searched
+        size_t available;
+        const unsigned char* data = source_peek(src, searched + 2, &available);
+        if(available < searched + 2) {
+            // the input ends inside the entropy-coded data
+            *length = available;
+            return true;
+        }
 
-    // copy the data into the app segment data
-    memcpy(jpeg->app_segments[jpeg->num_app_segments - 1].data, data, length);
+        // look at each 0xFF whose next byte is already available
+        size_t end = available - 1;
+        while(searched < end) {
+            size_t i = searched + find(data + searched, end - searched);
+            if(i == end)
+                break;
 
-    return true;
+            // stuffed bytes and restart markers are skipped, anything else ends the data
+            unsigned char next = data[i + 1];
+            if(next >= RST0 && next <= RST7) {
+                if(*num_restarts == capacity) {
+                    capacity = capacity == 0 ? 64 : capacity * 2;
+                    size_t* grown = realloc(*restarts, sizeof(size_t) * capacity);
+                    if(grown == NULL)
+                        free(*restarts);
+                    *restarts = grown;
+                    MEM_CHECK(grown);
+                }
+                (*restarts)[(*num_restarts)++] = i;
+            } else if(next != 0x00) {
+                *length = i;
+                return true;
+            }
+            searched = i + 2;
+        }
+        if(searched < end)
+            searched = end;
+    }
 }
 
-/// @brief The jpeg_read function reads a JPEG file from the given file.
+/// @brief The jpeg_read function reads a JPEG file from the given source. Each
+///        marker segment is skipped by its declared length, and the
+///        entropy-coded data after each scan header runs to the next marker
+///        that is not a stuffed byte or a restart marker. Scan and other
+///        segment data may point into the source, so it has to stay open
+///        until the JPEG struct is freed.
 /// @param jpeg The JPEG struct to read into.
-/// @param file The file to read from.
+/// @param src The source to read from.
 /// @return True if the file was read successfully, false otherwise.
-bool jpeg_read(JPEG* jpeg, FILE* file) {
-    // check if the file starts with the JPEG start marker
-    if(fgetc(file) != START) {
+bool jpeg_read(JPEG* jpeg, SOURCE* src) {
+    // check if the file starts with the start of image marker
+    uint8_t start;
+    uint8_t marker;
+    if(!source_read_u8(src, &start) || !source_read_u8(src, &marker) ||
+            start != START || marker != SOI) {
         printf("Invalid JPEG file\n");
         return false;
     }
 
     // set variables for later use
-    unsigned char marker;
-    unsigned char* data = malloc(MAX_DATA_LENGTH + 1);
-
-    // read the file until the end of the file is reached
-    while(!feof(file)) {
-        // read the marker
-        marker = fgetc(file);
-        FEOF_CHECK(file);
-        
-        // read the data
-        char c;
-        int i;
-        for(i = 0; (unsigned char) (c = fgetc(file)) != START; i++) {
-            data[i] = (unsigned char) c;
-            FEOF_CHECK(file);
-        }
-        data[i] = '\0';
+    FIND_FUNC find = find_ff_func();
+    unsigned int restart_interval = 0;
+    uint16_t length;
+    unsigned char* data;
+    bool borrowed;
+    size_t total;
+    size_t* restarts;
+    size_t num_restarts;
+
+    // read segments until the end of image marker or the end of the input
+    while(!source_at_end(src)) {
+        // read the marker, skipping any fill bytes before it
+        READ_CHECK(source_read_u8(src, &start));
+        if(start != START) {
+            printf("Invalid JPEG: expected a marker, found %x\n", start);
+            return false;
+        }
+        do {
+            READ_CHECK(source_read_u8(src, &marker));
+        } while(marker == START);
+
+        // markers without a segment
+        if(marker == EOI)
+            break;
+        if(marker == SOI || marker == TEM || (marker >= RST0 && marker <= RST7))
+            continue;
+
+        // every other marker is followed by the length of its segment
+        READ_CHECK(source_read_u16(src, &length));
+        if(length < 2) {
+            printf("Invalid JPEG: segment length %u is too short\n", length);
+            return false;
+        }
+        length -= 2;
 
         // read the data based on the marker, if the marker is recognized
         switch(marker) {
@@ -246,19 +590,58 @@ bool jpeg_read(JPEG* jpeg, FILE* file) {
             case SOF14:
             case SOF15:
                 // read data as a frame
-                jpeg_read_frame(jpeg, data, i);
+                data = (unsigned char*) source_read(src, length);
+                READ_CHECK(data);
+                if(!jpeg_read_frame(jpeg, marker, data, length))
+                    return false;
                 break;
             case DQT:
                 // read data as a quantization table
-                jpeg_read_quant_table(jpeg, data, i);
+                data = (unsigned char*) source_read(src, length);
+                READ_CHECK(data);
+                if(!jpeg_read_quant_table(jpeg, data, length))
+                    return false;
                 break;
             case DHT:
                 // read data as a huffman table
-                jpeg_read_huff_table(jpeg, data, i);
+                data = (unsigned char*) source_read(src, length);
+                READ_CHECK(data);
+                if(!jpeg_read_huff_table(jpeg, data, length))
+                    return false;
                 break;
             case SOS:
-                // read data as a scan
-                jpeg_read_scan(jpeg, data, i);
+                // read the header and the entropy-coded data after it as a
+                // scan, in place if the source allows it
+                READ_CHECK(source_ensure(src, length));
+                if(!jpeg_scan_entropy(src, length, find, &total, &restarts, &num_restarts))
+                    return false;
+                data = source_payload(src, total, &borrowed);
+                if(data == NULL)
+                    free(restarts);
+                MEM_CHECK(data);
+                if(!jpeg_read_scan(jpeg, data, total, length, restart_interval, restarts,
+                                    num_restarts, borrowed)) {
+                    // the data and restart offsets are still ours to free
+                    if(!borrowed)
+                        free(data);
+                    free(restarts);
+                    return false;
+                }
+                break;
+            case DRI:
+                // note the restart interval for the scans after it
+                if(length != 2) {
+                    printf("Invalid JPEG: DRI segment length %u\n", length);
+                    return false;
+                }
+                data = source_payload(src, length, &borrowed);
+                MEM_CHECK(data);
+                restart_interval = (unsigned int) ((data[0] << 8) | data[1]);
+                if(!jpeg_read_app_seg(jpeg, marker, data, length, borrowed)) {
+                    if(!borrowed)
+                        free(data);
+                    return false;
+                }
                 break;
             case APP0:
             case APP1:
@@ -276,25 +659,34 @@ bool jpeg_read(JPEG* jpeg, FILE* file) {
             case APP13:
             case APP14:
             case APP15:
-                // read data as an application segment
-                jpeg_read_app_seg(jpeg, data, i);
-                break;
-            case EOI:
-            case SOI:
             case JPG:
             case DAC:
             case DNL:
-            case DRI:
-            case RST0:
-            case RST1:
-            case RST2:
-            case RST3:
-            case RST4:
-            case RST5:
-            case RST6:
-            case RST7:
+            case DHP:
+            case EXP:
+            case JPG0:
+            case JPG1:
+            case JPG2:
+            case JPG3:
+            case JPG4:
+            case JPG5:
+            case JPG6:
+            case JPG7:
+            case JPG8:
+            case JPG9:
+            case JPG10:
+            case JPG11:
+            case JPG12:
+            case JPG13:
             case COM:
-                // ignore these markers
+                // keep the segment as it is, in place if possible
+                data = source_payload(src, length, &borrowed);
+                MEM_CHECK(data);
+                if(!jpeg_read_app_seg(jpeg, marker, data, length, borrowed)) {
+                    if(!borrowed)
+                        free(data);
+                    return false;
+                }
                 break;
             default:
                 // unknown marker
@@ -303,233 +695,2052 @@ bool jpeg_read(JPEG* jpeg, FILE* file) {
         }
     }
 
-    // free the data
-    free(data);
-
     return true;
 }
 
-/// @brief The jpeg_write_app_seg function writes an application segment to the
-///        given file.
-/// @param app_seg The application segment to write.
-/// @param file The file to write to.
-/// @param count The number of the application segment.
+/// @brief The jpeg_write_segment function writes a marker and the length and
+///        data of its segment to the given sink.
+/// @param sink The sink to write to.
+/// @param marker The marker of the segment.
+/// @param data The segment data, after the length field.
+/// @param length The length of the data.
 /// @return True if the segment was written successfully, false otherwise.
-bool jpeg_write_app_seg(APP_SEG* app_seg, FILE* file, int count) {
-    // write the start marker
-    fprintf(file, "%c", START);
-
-    // write the marker based on the count
-    switch(count) {
-        case 0:
-            fprintf(file, "%c", APP0);
-            break;
-        case 1:
-            fprintf(file, "%c", APP1);
-            break;
-        case 2:
-            fprintf(file, "%c", APP2);
-            break;
-        case 3:
-            fprintf(file, "%c", APP3);
-            break;
-        case 4:
-            fprintf(file, "%c", APP4);
-            break;
-        case 5:
-            fprintf(file, "%c", APP5);
-            break;
-        case 6:
-            fprintf(file, "%c", APP6);
-            break;
-        case 7:
-            fprintf(file, "%c", APP7);
-            break;
-        case 8:
-            fprintf(file, "%c", APP8);
-            break;
-        case 9:
-            fprintf(file, "%c", APP9);
-            break;
-        case 10:
-            fprintf(file, "%c", APP10);
-            break;
-        case 11:
-            fprintf(file, "%c", APP11);
-            break;
-        case 12:
-            fprintf(file, "%c", APP12);
-            break;
-        case 13:
-            fprintf(file, "%c", APP13);
-            break;
-        case 14:
-            fprintf(file, "%c", APP14);
-            break;
-        case 15:
-            fprintf(file, "%c", APP15);
-            break;
-        default:
-            printf("Invalid APP segment count: %d", count);
-            return false;
+static bool jpeg_write_segment(SINK* sink, unsigned char marker, const unsigned char* data,
+                                size_t length) {
+    if(length > MAX_DATA_LENGTH - 2) {
+        printf("Segment is too long: %zu", length);
+        return false;
     }
 
+    // write the start marker, the marker and the length, which counts itself
+    sink_write_u8(sink, START);
+    sink_write_u8(sink, marker);
+    sink_write_u16(sink, (uint16_t) (length + 2));
+
     // write the data in the segment
-    char zero = 0;
-    for(int i = 0; i < app_seg->length; i++)
-        fprintf(file, "%c", (app_seg->data[i] == '\0') ? zero : app_seg->data[i]);
+    return sink_write(sink, data, length);
+}
 
-    return true;
+/// @brief The jpeg_write_app_seg function writes an application segment, or
+///        any other segment kept as it is, to the given sink.
+/// @param app_seg The application segment to write.
+/// @param sink The sink to write to.
+/// @return True if the segment was written successfully, false otherwise.
+bool jpeg_write_app_seg(APP_SEG* app_seg, SINK* sink) {
+    return jpeg_write_segment(sink, app_seg->marker, app_seg->data, app_seg->length);
 }
 
 /// @brief The jpeg_write_huff_table function writes a huffman table to the
-///        given file.
+///        given sink.
 /// @param table The huffman table to write.
-/// @param file The file to write to.
+/// @param sink The sink to write to.
 /// @return True if the table was written successfully, false otherwise.
-bool jpeg_write_huff_table(HUFF_TABLE* table, FILE* file) {
-    // write the start marker and the huffman table marker
-    fprintf(file, "%c%c", START, DHT);
-
-    // write the data in the table
-    char zero = 0;
-    for(int i = 0; i < table->length; i++)
-        fprintf(file, "%c", (table->data[i] == '\0') ? zero : table->data[i]);
-    
-    return true;
+bool jpeg_write_huff_table(HUFF_TABLE* table, SINK* sink) {
+    return jpeg_write_segment(sink, DHT, table->data, table->length);
 }
 
-/// @brief The jpeg_write_frame function writes a frame to the given file.
+/// @brief The jpeg_write_frame function writes a frame to the given sink.
 /// @param frame The frame to write.
-/// @param file The file to write to.
-/// @param count The number of the frame.
+/// @param sink The sink to write to.
 /// @return True if the frame was written successfully, false otherwise.
-bool jpeg_write_frame(FRAME* frame, FILE* file, int count) {
-    // write the start marker
-    fprintf(file, "%c", START);
-
-    // write the marker based on the count
-    switch(count) {
-        case 0:
-            fprintf(file, "%c", SOF0);
-            break;
-        case 1:
-            fprintf(file, "%c", SOF1);
-            break;
-        case 2:
-            fprintf(file, "%c", SOF2);
-            break;
-        case 3:
-            fprintf(file, "%c", SOF3);
-            break;
-        case 4:
-            fprintf(file, "%c", SOF5);
-            break;
-        case 5:
-            fprintf(file, "%c", SOF6);
-            break;
-        case 6:
-            fprintf(file, "%c", SOF7);
-            break;
-        case 7:
-            fprintf(file, "%c", SOF9);
-            break;
-        case 8:
-            fprintf(file, "%c", SOF10);
-            break;
-        case 9:
-            fprintf(file, "%c", SOF11);
-            break;
-        case 10:
-            fprintf(file, "%c", SOF13);
-            break;
-        case 11:
-            fprintf(file, "%c", SOF14);
-            break;
-        case 12:
-            fprintf(file, "%c", SOF15);
-            break;
-        default:
-            printf("Invalid frame count: %d", count);
-            return false;
-    }
-
-    // write the data in the frame
-    char zero = 0;
-    for(int i = 0; i < frame->length; i++)
-        fprintf(file, "%c", (frame->data[i] == '\0') ? zero : frame->data[i]);
-    
-    return true;
+bool jpeg_write_frame(FRAME* frame, SINK* sink) {
+    return jpeg_write_segment(sink, frame->marker, frame->data, frame->length);
 }
 
 /// @brief The jpeg_write_quant_table function writes a quantization table to
-///        the given file.
+///        the given sink.
 /// @param table The quantization table to write.
-/// @param file The file to write to.
+/// @param sink The sink to write to.
 /// @return True if the table was written successfully, false otherwise.
-bool jpeg_write_quant_table(QUANT_TABLE* table, FILE* file) {
-    // write the start marker and the quantization table marker
-    fprintf(file, "%c%c", START, DQT);
-
-    // write the data in the table
-    char zero = 0;
-    for(int i = 0; i < table->length; i++)
-        fprintf(file, "%c", (table->data[i] == '\0') ? zero : table->data[i]);
-    
-    return true;
+bool jpeg_write_quant_table(QUANT_TABLE* table, SINK* sink) {
+    return jpeg_write_segment(sink, DQT, table->data, table->length);
 }
 
-/// @brief The jpeg_write_scan function writes a scan to the given file.
+/// @brief The jpeg_write_scan function writes a scan to the given sink.
 /// @param scan The scan to write.
-/// @param file The file to write to.
+/// @param sink The sink to write to.
 /// @return True if the scan was written successfully, false otherwise.
-bool jpeg_write_scan(SCAN* scan, FILE* file) {
-    // write the start marker and the scan marker
-    fprintf(file, "%c%c", START, SOS);
-
-    // write the data in the scan
-    char zero = 0;
-    for(int i = 0; i < scan->length; i++)
-        fprintf(file, "%c", (scan->data[i] == '\0') ? zero : scan->data[i]);
-    
-    return true;
+bool jpeg_write_scan(SCAN* scan, SINK* sink) {
+    // write the scan header as a segment
+    if(!jpeg_write_segment(sink, SOS, scan->data, scan->header_length))
+        return false;
+
+    // write the entropy-coded data after it
+    return sink_write(sink, scan->data + scan->header_length,
+                        scan->length - scan->header_length);
 }
 
-/// @brief The jpeg_write function writes a jpeg to the given file.
+/// @brief The jpeg_write function writes a jpeg to the given file, with its
+///        segments in the order they were read.
 /// @param jpeg The jpeg to write.
 /// @param file The file to write to.
 /// @return True if the jpeg was written successfully, false otherwise.
 bool jpeg_write(JPEG* jpeg, FILE* file) {
+    SINK sink;
+    if(!sink_open(&sink, file))
+        return false;
+
     // write the start of image marker
-    fprintf(file, "%c%c", START, SOI);
+    sink_write_u8(&sink, START);
+    sink_write_u8(&sink, SOI);
+
+    // write each segment from the array for its marker
+    bool written = true;
+    for(int i = 0; i < jpeg->num_segments && written; i++) {
+        int index = jpeg->segments[i].index;
+        switch(jpeg->segments[i].marker) {
+            case SOF0:
+            case SOF1:
+            case SOF2:
+            case SOF3:
+            case SOF5:
+            case SOF6:
+            case SOF7:
+            case SOF9:
+            case SOF10:
+            case SOF11:
+            case SOF13:
+            case SOF14:
+            case SOF15:
+                written = jpeg_write_frame(jpeg->frames + index, &sink);
+                break;
+            case DQT:
+                written = jpeg_write_quant_table(jpeg->quant_tables + index, &sink);
+                break;
+            case DHT:
+                written = jpeg_write_huff_table(jpeg->huff_tables + index, &sink);
+                break;
+            case SOS:
+                written = jpeg_write_scan(jpeg->scans + index, &sink);
+                break;
+            default:
+                written = jpeg_write_app_seg(jpeg->app_segments + index, &sink);
+                break;
+        }
+    }
 
-    // write the app segments
-    int i;
-    for(i = 0; i < jpeg->num_app_segments; i++)
-        jpeg_write_app_seg(jpeg->app_segments + i, file, i);
+    // write the end of image marker
+    sink_write_u8(&sink, START);
+    sink_write_u8(&sink, EOI);
 
-    // write the quantization tables
-    for(i = 0; i < jpeg->num_quant_tables; i++)
-        jpeg_write_quant_table(jpeg->quant_tables + i, file);
+    return sink_close(&sink) && written;
+}
 
-    // write the frames
-    for(i = 0; i < jpeg->num_frames; i++)
-        jpeg_write_frame(jpeg->frames + i, file, i);
+/// @brief The is_frame_marker function checks if a marker is one of the SOFn
+///        markers.
+/// @param marker The marker to check.
+/// @return True if the marker starts a frame, false otherwise.
+static bool is_frame_marker(unsigned char marker) {
+    return marker >= SOF0 && marker <= SOF15 && marker != DHT && marker != JPG && marker != DAC;
+}
 
-    // write the huffman tables
-    for(i = 0; i < jpeg->num_huff_tables; i++)
-        jpeg_write_huff_table(jpeg->huff_tables + i, file);
+/// @brief The read_dqt function reads the quantization tables of a DQT
+///        segment into the tables in effect.
+/// @param tables The tables in effect.
+/// @param data The segment data.
+/// @param length The length of the data.
+/// @return True if the tables were read, false if the segment is invalid.
+static bool read_dqt(DECODE_TABLES* tables, const unsigned char* data, int length) {
+    int pos = 0;
+
+    while(pos < length) {
+        int precision = data[pos] >> 4;
+        int id = data[pos] & 15;
+        int size = precision == 0 ? 64 : 128;
+        if(precision > 1 || id > 3 || pos + 1 + size > length) {
+            printf("Invalid DQT segment\n");
+            return false;
+        }
+        pos++;
 
-    // write the scans
-    for(i = 0; i < jpeg->num_scans; i++)
-        jpeg_write_scan(jpeg->scans + i, file);
+        // the values are in zigzag order, and 16 bits wide at precision 1
+        for(int k = 0; k < 64; k++) {
+            uint16_t value = precision == 0 ? data[pos + k] :
+                                (uint16_t) ((data[pos + 2 * k] << 8) | data[pos + 2 * k + 1]);
+            tables->quant[id][huff_natural_order[k]] = value;
+        }
+        tables->has_quant[id] = true;
+        pos += size;
+    }
 
-    // write the end of image marker
-    fprintf(file, "%c%c", START, EOI);
+    return true;
+}
+
+/// @brief The read_dht function builds the Huffman tables of a DHT segment
+///        into the tables in effect.
+/// @param tables The tables in effect.
+/// @param data The segment data.
+/// @param length The length of the data.
+/// @return True if the tables were built, false if the segment is invalid.
+static bool read_dht(DECODE_TABLES* tables, const unsigned char* data, int length) {
+    int pos = 0;
+
+    while(pos < length) {
+        if(pos + 17 > length || (data[pos] >> 4) > 1 || (data[pos] & 15) > 3) {
+            printf("Invalid DHT segment\n");
+            return false;
+        }
+        bool ac = (data[pos] >> 4) == 1;
+        int id = data[pos] & 15;
+        const unsigned char* counts = data + pos + 1;
+        int num_symbols = 0;
+        for(int i = 0; i < 16; i++)
+            num_symbols += counts[i];
+
+        // build the table the segment replaces
+        HUFF_DECODER* dec = ac ? tables->ac + id : tables->dc + id;
+        if(!huff_decoder_build(dec, counts, data + pos + 17, length - pos - 17)) {
+            printf("Invalid DHT segment\n");
+            return false;
+        }
+        if(ac)
+            tables->has_ac[id] = true;
+        else
+            tables->has_dc[id] = true;
+        pos += 17 + num_symbols;
+    }
+
+    return true;
+}
+
+/// @brief The layout_image function sizes each component of an image from
+///        its sampling factors and allocates its coefficients.
+/// @param image The image, with its dimensions and each component's sampling
+///        factors set.
+/// @return True if the coefficients were allocated, false otherwise.
+static bool layout_image(JPEG_IMAGE* image) {
+    image->h_max = 1;
+    image->v_max = 1;
+    for(int c = 0; c < image->num_components; c++) {
+        if(image->components[c].h > image->h_max)
+            image->h_max = image->components[c].h;
+        if(image->components[c].v > image->v_max)
+            image->v_max = image->components[c].v;
+    }
+
+    // size each component, with its blocks padded out to whole MCUs
+    image->mcus_wide = (image->width + 8 * image->h_max - 1) / (8 * image->h_max);
+    image->mcus_high = (image->height + 8 * image->v_max - 1) / (8 * image->v_max);
+    for(int c = 0; c < image->num_components; c++) {
+        JPEG_COMPONENT* comp = image->components + c;
+        comp->width = (image->width * comp->h + image->h_max - 1) / image->h_max;
+        comp->height = (image->height * comp->v + image->v_max - 1) / image->v_max;
+        comp->blocks_wide = image->mcus_wide * comp->h;
+        comp->blocks_high = image->mcus_high * comp->v;
+        size_t blocks = (size_t) comp->blocks_wide * comp->blocks_high;
+        comp->coeffs = calloc(blocks * 64, sizeof(int16_t));
+        comp->last = calloc(blocks, 1);
+        MEM_CHECK(comp->coeffs);
+        MEM_CHECK(comp->last);
+    }
+
+    return true;
+}
+
+/// @brief The read_sof function reads a frame header and sets up the
+///        coefficient storage of each component.
+/// @param frame The frame segment.
+/// @return The image, or NULL if the frame is invalid or not supported.
+static JPEG_IMAGE* read_sof(FRAME* frame) {
+    // only 8-bit Huffman-coded sequential and progressive frames are decoded
+    if(frame->marker != SOF0 && frame->marker != SOF1 && frame->marker != SOF2) {
+        printf("Unsupported JPEG frame type: %x\n", frame->marker);
+        return NULL;
+    }
+    const unsigned char* data = frame->data;
+    if(frame->length < 6 || data[0] != 8 || frame->length != 6 + 3 * data[5] ||
+            data[5] < 1 || data[5] > JPEG_MAX_COMPONENTS) {
+        printf("Invalid or unsupported SOF segment\n");
+        return NULL;
+    }
+
+    JPEG_IMAGE* image = calloc(1, sizeof(JPEG_IMAGE));
+    MEM_CHECK(image);
+    image->marker = frame->marker;
+    image->height = (unsigned int) ((data[1] << 8) | data[2]);
+    image->width = (unsigned int) ((data[3] << 8) | data[4]);
+    image->num_components = data[5];
+    if(image->width == 0 || image->height == 0) {
+        printf("Invalid image dimensions\n");
+        free(image);
+        return NULL;
+    }
+
+    // read each component's sampling factors
+    for(int c = 0; c < image->num_components; c++) {
+        JPEG_COMPONENT* comp = image->components + c;
+        comp->id = data[6 + 3 * c];
+        comp->h = data[7 + 3 * c] >> 4;
+        comp->v = data[7 + 3 * c] & 15;
+        comp->quant_id = data[8 + 3 * c];
+        if(comp->h < 1 || comp->h > 4 || comp->v < 1 || comp->v > 4 || comp->quant_id > 3) {
+            printf("Invalid SOF segment\n");
+            free(image);
+            return NULL;
+        }
+    }
+
+    if(!layout_image(image)) {
+        jpeg_image_free(image);
+        return NULL;
+    }
+
+    return image;
+}
+
+/// @brief The read_sos function reads a scan header and checks it against the
+///        frame and the tables in effect.
+/// @param image The image the scan belongs to.
+/// @param tables The tables in effect.
+/// @param scan The scan segment.
+/// @param info The scan header fields to fill.
+/// @return True if the header was read, false if it is invalid.
+static bool read_sos(JPEG_IMAGE* image, DECODE_TABLES* tables, SCAN* scan, SCAN_INFO* info) {
+    const unsigned char* data = scan->data;
+    if(scan->header_length < 1 || data[0] < 1 || data[0] > image->num_components ||
+            scan->header_length != 4 + 2 * data[0]) {
+        printf("Invalid SOS segment\n");
+        return false;
+    }
+
+    // match each scan component to a frame component
+    info->num_components = data[0];
+    for(int i = 0; i < info->num_components; i++) {
+        info->index[i] = -1;
+        for(int c = 0; c < image->num_components; c++)
+            if(image->components[c].id == data[1 + 2 * i])
+                info->index[i] = c;
+        info->dc[i] = data[2 + 2 * i] >> 4;
+        info->ac[i] = data[2 + 2 * i] & 15;
+        if(info->index[i] < 0 || info->dc[i] > 3 || info->ac[i] > 3) {
+            printf("Invalid SOS segment\n");
+            return false;
+        }
+    }
+    info->ss = data[1 + 2 * info->num_components];
+    info->se = data[2 + 2 * info->num_components];
+    info->ah = data[3 + 2 * info->num_components] >> 4;
+    info->al = data[3 + 2 * info->num_components] & 15;
+
+    info->progressive = image->marker == SOF2;
+
+    // sequential scans cover every coefficient, progressive ones the DC
+    // coefficients or a band of one component's AC coefficients a bit at a time
+    bool valid;
+    if(!info->progressive)
+        valid = info->ss == 0 && info->se == 63 && info->ah == 0 && info->al == 0;
+    else if(info->ss == 0)
+        valid = info->se == 0;
+    else
+        valid = info->se >= info->ss && info->se <= 63 && info->num_components == 1;
+    if(info->progressive && (info->al > 13 || (info->ah != 0 && info->al != info->ah - 1)))
+        valid = false;
+    if(!valid) {
+        printf("Invalid SOS segment\n");
+        return false;
+    }
+
+    // refining the DC coefficients takes no tables, and a DC scan takes no AC table
+    bool dc_table = !info->progressive || (info->ss == 0 && info->ah == 0);
+    bool ac_table = !info->progressive || info->ss != 0;
+    for(int i = 0; i < info->num_components; i++) {
+        if((dc_table && !tables->has_dc[info->dc[i]]) ||
+                (ac_table && !tables->has_ac[info->ac[i]])) {
+            printf("Invalid JPEG: Huffman table is missing\n");
+            return false;
+        }
+    }
+
+    // a single component is coded block by block, several in whole MCUs
+    if(info->num_components == 1) {
+        JPEG_COMPONENT* comp = image->components + info->index[0];
+        info->mcus_wide = (comp->width + 7) / 8;
+        info->num_mcus = info->mcus_wide * ((comp->height + 7) / 8);
+    } else {
+        info->mcus_wide = image->mcus_wide;
+        info->num_mcus = (size_t) image->mcus_wide * image->mcus_high;
+    }
+
+    return true;
+}
+
+/// @brief The decode_mcus function decodes a run of MCUs from one
+///        entropy-coded segment, with the DC predictions and end-of-band run
+///        starting from zero. Progressive scans add to the coefficients the
+///        scans before them left.
+/// @param image The image to decode into.
+/// @param tables The tables in effect.
+/// @param info The scan header fields.
+/// @param data The entropy-coded segment.
+/// @param length The length of the segment.
+/// @param first The index of the first MCU.
+/// @param count The number of MCUs.
+/// @return True if the MCUs were decoded, false if the data is corrupt.
+static bool decode_mcus(JPEG_IMAGE* image, const DECODE_TABLES* tables, const SCAN_INFO* info,
+                            const unsigned char* data, size_t length, size_t first, size_t count) {
+    BIT_READER br;
+    int pred[JPEG_MAX_COMPONENTS] = { 0 };
+    unsigned int eobrun = 0;
+
+    bit_reader_init(&br, data, length);
+    for(size_t m = first; m < first + count; m++) {
+        size_t mx = m % info->mcus_wide;
+        size_t my = m / info->mcus_wide;
+
+        for(int i = 0; i < info->num_components; i++) {
+            JPEG_COMPONENT* comp = image->components + info->index[i];
+            const HUFF_DECODER* dc = tables->dc + info->dc[i];
+            const HUFF_DECODER* ac = tables->ac + info->ac[i];
+
+            // a lone component's MCU is one block, otherwise it is h by v blocks
+            int h = info->num_components == 1 ? 1 : comp->h;
+            int v = info->num_components == 1 ? 1 : comp->v;
+            for(int y = 0; y < v; y++) {
+                for(int x = 0; x < h; x++) {
+                    size_t block = (my * v + y) * comp->blocks_wide + mx * h + x;
+                    int16_t* coeffs = comp->coeffs + block * 64;
+                    unsigned char* last = comp->last + block;
+                    bool decoded = true;
+                    if(!info->progressive) {
+                        memset(coeffs, 0, 64 * sizeof(int16_t));
+                        decoded = huff_decode_block(&br, dc, ac, pred + i, coeffs, last);
+                    } else if(info->ss == 0 && info->ah == 0)
+                        decoded = huff_decode_dc_first(&br, dc, pred + i, info->al, coeffs, last);
+                    else if(info->ss == 0)
+                        huff_decode_dc_refine(&br, info->al, coeffs);
+                    else if(info->ah == 0)
+                        decoded = huff_decode_ac_first(&br, ac, info->ss, info->se, info->al,
+                                                        &eobrun, coeffs, last);
+                    else
+                        decoded = huff_decode_ac_refine(&br, ac, info->ss, info->se, info->al,
+                                                        &eobrun, coeffs, last);
+                    if(!decoded) {
+                        printf("Invalid JPEG: Corrupt scan data\n");
+                        return false;
+                    }
+                }
+            }
+        }
+    }
+
+    return true;
+}
+
+/// @brief The interval_mcus function finds the size of a scan's restart
+///        intervals in MCUs.
+/// @param scan The scan segment.
+/// @param info The scan header fields.
+/// @return The number of MCUs in each interval, the last one possibly short.
+static size_t interval_mcus(const SCAN* scan, const SCAN_INFO* info) {
+    return scan->restart_interval != 0 ? scan->restart_interval : info->num_mcus;
+}
+
+/// @brief The restart_job function decodes a run of restart intervals. Each
+///        interval starts just after the marker that ends the one before it
+///        and fills its own MCUs, so runs can be decoded in any order.
+/// @param arg The RESTART_JOB to run.
+static void restart_job(void* arg) {
+    RESTART_JOB* job = arg;
+    const SCAN* scan = job->scan;
+    const SCAN_INFO* info = job->info;
+    size_t interval = interval_mcus(scan, info);
+    job->decoded = true;
+
+    for(size_t i = job->first; i < job->first + job->count && job->decoded; i++) {
+        size_t start = i == 0 ? (size_t) scan->header_length : scan->restarts[i - 1] + 2;
+        size_t end = i < scan->num_restarts ? scan->restarts[i] : scan->length;
+        size_t first = i * interval;
+        size_t count = info->num_mcus - first < interval ? info->num_mcus - first : interval;
+        job->decoded = decode_mcus(job->image, job->tables, info, scan->data + start,
+                                    end - start, first, count);
+    }
+}
+
+/// @brief The decode_scan function decodes a baseline or extended
+///        sequential scan, or one pass of a progressive frame. When the scan
+///        is large and has restart markers, its intervals are split into runs
+///        of about RESTART_JOB_BYTES and decoded on a thread pool.
+/// @param image The image to decode into.
+/// @param tables The tables in effect.
+/// @param scan The scan segment.
+/// @param info The scan header fields.
+/// @return True if the scan was decoded, false otherwise.
+static bool decode_scan(JPEG_IMAGE* image, const DECODE_TABLES* tables, SCAN* scan,
+                            const SCAN_INFO* info) {
+    // intervals past the end of the image are ignored
+    size_t interval = interval_mcus(scan, info);
+    size_t num_intervals = (info->num_mcus + interval - 1) / interval;
+    if(num_intervals > scan->num_restarts + 1)
+        num_intervals = scan->num_restarts + 1;
+
+    RESTART_JOB all = { image, tables, scan, info, 0, num_intervals, false };
+    POOL* pool = NULL;
+    RESTART_JOB* jobs = NULL;
+    if(num_intervals > 1 && scan->length >= RESTART_PARALLEL) {
+        pool = pool_create(0);
+        jobs = malloc(sizeof(RESTART_JOB) * (scan->length / RESTART_JOB_BYTES + 1));
+    }
+    if(pool == NULL || jobs == NULL) {
+        pool_free(pool);
+        free(jobs);
+        restart_job(&all);
+        return all.decoded;
+    }
+
+    // group intervals so that each job but the last has a worthwhile amount of data
+    size_t num_jobs = 0;
+    size_t start = 0;
+    for(size_t i = 0; i < num_intervals; i++) {
+        if(i == 0 || scan->restarts[i - 1] - start >= RESTART_JOB_BYTES) {
+            start = i == 0 ? 0 : scan->restarts[i - 1];
+            jobs[num_jobs] = all;
+            jobs[num_jobs].first = i;
+            jobs[num_jobs].count = 0;
+            num_jobs++;
+        }
+        jobs[num_jobs - 1].count++;
+    }
+    for(size_t i = 0; i < num_jobs; i++)
+        if(!pool_submit(pool, restart_job, jobs + i))
+            restart_job(jobs + i);
+    pool_wait(pool);
+    pool_free(pool);
+
+    bool decoded = true;
+    for(size_t i = 0; i < num_jobs; i++)
+        decoded = decoded && jobs[i].decoded;
+    free(jobs);
+
+    return decoded;
+}
+
+/// @brief The jpeg_idct_rows function dequantizes and inverse transforms rows
+///        of blocks of one component into samples.
+/// @param image The decoded image.
+/// @param c The index of the component.
+/// @param first The first row of blocks.
+/// @param count The number of rows of blocks.
+/// @param out Where the first sample of the first row goes, with room for
+///        blocks_wide * 8 samples in each of count * 8 rows.
+/// @param stride The distance between rows of samples.
+void jpeg_idct_rows(JPEG_IMAGE* image, int c, unsigned int first, unsigned int count,
+                        unsigned char* out, size_t stride) {
+    JPEG_COMPONENT* comp = image->components + c;
+    int16_t quant[64];
+
+    dct_prepare_quant(comp->quant, quant);
+    for(unsigned int row = first; row < first + count; row++) {
+        size_t block = (size_t) row * comp->blocks_wide;
+        dct_idct_row(comp->coeffs + block * 64, comp->last + block, comp->blocks_wide, quant,
+                        out + (size_t) (row - first) * 8 * stride, stride);
+    }
+}
+
+/// @brief The ring_row function finds a row of samples in a component's ring.
+/// @param ring The component's ring.
+/// @param row The row of the component.
+/// @return The first sample of the row.
+static unsigned char* ring_row(const SAMPLE_RING* ring, unsigned int row) {
+    size_t slot = (row / ring->rows) % 3 * ring->rows + row % ring->rows;
+    return ring->samples + slot * ring->stride + 16;
+}
+
+/// @brief The ring_fill function inverse transforms one MCU row of a
+///        component into its ring, repeating the samples at each end of every
+///        row for the upsampling filter.
+/// @param image The decoded image.
+/// @param c The index of the component.
+/// @param ring The component's ring.
+/// @param mcu_row The MCU row.
+static void ring_fill(JPEG_IMAGE* image, int c, SAMPLE_RING* ring, unsigned int mcu_row) {
+    JPEG_COMPONENT* comp = image->components + c;
+    unsigned int first = mcu_row * ring->rows;
+
+    jpeg_idct_rows(image, c, mcu_row * comp->v, comp->v, ring_row(ring, first), ring->stride);
+    for(unsigned int r = first; r < first + ring->rows; r++) {
+        unsigned char* row = ring_row(ring, r);
+        row[-1] = row[0];
+        row[comp->width] = row[comp->width - 1];
+    }
+}
+
+/// @brief The ring_plane function sets up a component's part of a row of
+///        output.
+/// @param image The decoded image.
+/// @param c The index of the component.
+/// @param ring The component's ring.
+/// @param y The row of output.
+/// @param plane The plane to fill.
+static void ring_plane(JPEG_IMAGE* image, int c, SAMPLE_RING* ring, unsigned int y,
+                        COLOR_PLANE* plane) {
+    JPEG_COMPONENT* comp = image->components + c;
+    unsigned int cy = y / ring->vf;
+    const unsigned char* near = ring_row(ring, cy);
+
+    plane->near = near;
+    plane->far = near;
+    plane->h = ring->hf <= 2 ? (unsigned char) ring->hf : 1;
+    plane->fancy = ring->fancy;
+    plane->blend = ring->fancy && ring->vf == 2;
+    plane->upper = y % 2 == 0;
+
+    // the row on the output row's side, repeating the first and last rows
+    if(plane->blend) {
+        if(plane->upper)
+            plane->far = ring_row(ring, cy > 0 ? cy - 1 : 0);
+        else
+            plane->far = ring_row(ring, cy + 1 < comp->height ? cy + 1 : cy);
+    }
+
+    // factors above 2 repeat each sample out to a row of the full width
+    if(ring->hf > 2) {
+        for(unsigned int x = 0; x < image->width; x++)
+            ring->wide[x] = near[x / ring->hf];
+        plane->near = ring->wide;
+        plane->far = ring->wide;
+    }
+}
+
+/// @brief The jpeg_color_space function finds the color space of a JPEG's
+///        components from its JFIF and Adobe segments, as libjpeg does.
+/// @param jpeg The JPEG holding the segments.
+/// @param image The decoded frame.
+/// @param space Set to the color space.
+/// @return True if the color space was found, false if the number of
+///         components has none.
+bool jpeg_color_space(JPEG* jpeg, const JPEG_IMAGE* image, COLOR_SPACE* space) {
+    bool jfif = false;
+    bool adobe = false;
+    unsigned char transform = 0;
+
+    // find the first JFIF and Adobe segments
+    for(int i = 0; i < jpeg->num_app_segments; i++) {
+        APP_SEG* seg = jpeg->app_segments + i;
+        if(seg->marker == APP0 && seg->length >= 5 && memcmp(seg->data, "JFIF", 5) == 0)
+            jfif = true;
+        else if(seg->marker == APP14 && seg->length >= 12 && !adobe &&
+                    memcmp(seg->data, "Adobe", 5) == 0) {
+            adobe = true;
+            transform = seg->data[11];
+        }
+    }
+
+    if(image->num_components == 1)
+        *space = COLOR_GRAY;
+    else if(image->num_components == 3) {
+        // without either segment, components named R, G and B are not transformed
+        const JPEG_COMPONENT* comps = image->components;
+        bool rgb = comps[0].id == 'R' && comps[1].id == 'G' && comps[2].id == 'B';
+        if(jfif)
+            *space = COLOR_YCBCR;
+        else if(adobe)
+            *space = transform == 0 ? COLOR_RGB : COLOR_YCBCR;
+        else
+            *space = rgb ? COLOR_RGB : COLOR_YCBCR;
+    } else if(image->num_components == 4)
+        *space = adobe && transform != 0 ? COLOR_YCCK : COLOR_CMYK;
+    else {
+        printf("Unsupported number of JPEG components: %d\n", image->num_components);
+        return false;
+    }
+
+    return true;
+}
+
+/// @brief The render_image function upsamples and color converts the
+///        coefficients of an image to interleaved 8-bit pixels. Each MCU row
+///        is inverse transformed just ahead of the one being upsampled and
+///        converted, so the samples stay in cache between the two.
+/// @param image The decoded image.
+/// @param space The color space of its components.
+/// @param fancy Whether subsampled components are filtered rather than repeated.
+/// @return The pixels, row by row with no padding, or NULL on failure.
+static unsigned char* render_image(JPEG_IMAGE* image, COLOR_SPACE space, bool fancy) {
+    // each component takes a ring of three MCU rows of samples
+    SAMPLE_RING rings[JPEG_MAX_COMPONENTS];
+    bool allocated = true;
+    memset(rings, 0, sizeof(rings));
+    for(int c = 0; c < image->num_components; c++) {
+        JPEG_COMPONENT* comp = image->components + c;
+        SAMPLE_RING* ring = rings + c;
+        if(image->h_max % comp->h != 0 || image->v_max % comp->v != 0) {
+            printf("Unsupported JPEG sampling factors\n");
+            allocated = false;
+            break;
+        }
+        ring->hf = image->h_max / comp->h;
+        ring->vf = image->v_max / comp->v;
+        ring->fancy = fancy && ring->hf <= 2 && ring->vf <= 2;
+        ring->rows = comp->v * 8u;
+        ring->stride = (size_t) comp->blocks_wide * 8 + 32;
+        ring->samples = malloc(ring->stride * ring->rows * 3);
+        if(ring->hf > 2)
+            ring->wide = malloc(image->width);
+        if(ring->samples == NULL || (ring->hf > 2 && ring->wide == NULL)) {
+            printf("Unable to allocate memory");
+            allocated = false;
+            break;
+        }
+    }
+
+    size_t row_bytes = (size_t) image->width * color_channels(space);
+    unsigned char* pixels = allocated ? malloc(row_bytes * image->height) : NULL;
+    if(allocated && pixels == NULL)
+        printf("Unable to allocate memory");
+
+    // convert each MCU row once the next one, which its last rows blend with, is ready
+    if(pixels != NULL) {
+        COLOR_ROW row;
+        row.space = space;
+        unsigned int mcu_height = image->v_max * 8u;
+        for(int c = 0; c < image->num_components; c++)
+            ring_fill(image, c, rings + c, 0);
+        for(unsigned int m = 0; m < image->mcus_high; m++) {
+            for(int c = 0; c < image->num_components && m + 1 < image->mcus_high; c++)
+                ring_fill(image, c, rings + c, m + 1);
+            unsigned int end = (m + 1) * mcu_height < image->height ? (m + 1) * mcu_height :
+                                image->height;
+            for(unsigned int y = m * mcu_height; y < end; y++) {
+                for(int c = 0; c < image->num_components; c++)
+                    ring_plane(image, c, rings + c, y, row.planes + c);
+                color_convert_row(&row, image->width, pixels + y * row_bytes);
+            }
+        }
+    }
+
+    for(int c = 0; c < image->num_components; c++) {
+        free(rings[c].samples);
+        free(rings[c].wide);
+    }
+
+    return pixels;
+}
+
+/// @brief The render_preview function renders the coefficients decoded so
+///        far and passes them to the preview function. Coefficients the
+///        scans have not reached yet are zero, so the preview is a blurred or
+///        coarse version of the image.
+/// @param jpeg The JPEG being decoded.
+/// @param image The image decoded so far.
+/// @param options The preview function and how to upsample.
+/// @param scans The number of scans decoded.
+static void render_preview(JPEG* jpeg, JPEG_IMAGE* image, const JPEG_DECODE_OPTIONS* options,
+                            int scans) {
+    COLOR_SPACE space;
+    if(!jpeg_color_space(jpeg, image, &space))
+        return;
+    unsigned char* pixels = render_image(image, space,
+                                            options->upsample == COLOR_UPSAMPLE_FANCY);
+    if(pixels != NULL)
+        options->preview(options->user, pixels, image->width, image->height,
+                            color_channels(space), scans);
+    free(pixels);
+}
+
+/// @brief The decode_frame function entropy decodes the frame of a JPEG into
+///        quantized DCT coefficients, applying each table segment in file
+///        order and rendering a preview after the scans asked for.
+/// @param jpeg The JPEG to decode.
+/// @param options When to preview and how to upsample, or NULL for no previews.
+/// @return The decoded image, or NULL on failure.
+static JPEG_IMAGE* decode_frame(JPEG* jpeg, const JPEG_DECODE_OPTIONS* options) {
+    DECODE_TABLES* tables = calloc(1, sizeof(DECODE_TABLES));
+    MEM_CHECK(tables);
+    JPEG_IMAGE* image = NULL;
+    bool seen[JPEG_MAX_COMPONENTS] = { false };
+    bool decoded = true;
+    int scans = 0;
+
+    // walk the segments in file order, since tables may change between scans
+    for(int i = 0; i < jpeg->num_segments && decoded; i++) {
+        int index = jpeg->segments[i].index;
+        unsigned char marker = jpeg->segments[i].marker;
+        if(marker == DQT) {
+            QUANT_TABLE* table = jpeg->quant_tables + index;
+            decoded = read_dqt(tables, table->data, table->length);
+        } else if(marker == DHT) {
+            HUFF_TABLE* table = jpeg->huff_tables + index;
+            decoded = read_dht(tables, table->data, table->length);
+        } else if(marker == SOS) {
+            SCAN_INFO info;
+            if(image == NULL) {
+                printf("Invalid JPEG: Scan before the frame header\n");
+                decoded = false;
+                break;
+            }
+            decoded = read_sos(image, tables, jpeg->scans + index, &info);
+            if(!decoded)
+                break;
+
+            // components take the quantization table in effect at their first scan
+            for(int c = 0; c < info.num_components; c++) {
+                JPEG_COMPONENT* comp = image->components + info.index[c];
+                if(seen[info.index[c]])
+                    continue;
+                if(!tables->has_quant[comp->quant_id]) {
+                    printf("Invalid JPEG: Quantization table is missing\n");
+                    decoded = false;
+                    break;
+                }
+                memcpy(comp->quant, tables->quant[comp->quant_id], sizeof(comp->quant));
+                seen[info.index[c]] = true;
+            }
+            decoded = decoded && decode_scan(image, tables, jpeg->scans + index, &info);
+            scans++;
+            if(decoded && options != NULL && options->preview != NULL && scans <= 64 &&
+                    (options->preview_scans >> (scans - 1) & 1) != 0)
+                render_preview(jpeg, image, options, scans);
+        } else if(is_frame_marker(marker)) {
+            if(image != NULL) {
+                printf("Invalid JPEG: More than one frame\n");
+                decoded = false;
+                break;
+            }
+            image = read_sof(jpeg->frames + index);
+            decoded = image != NULL;
+        }
+    }
+    free(tables);
+
+    if(!decoded || image == NULL) {
+        if(decoded)
+            printf("Invalid JPEG: No frame header\n");
+        jpeg_image_free(image);
+        return NULL;
+    }
+
+    return image;
+}
+
+/// @brief The jpeg_decode_coefficients function entropy decodes the frame of
+///        a JPEG into quantized DCT coefficients, applying each table
+///        segment in file order.
+/// @param jpeg The JPEG to decode.
+/// @return The decoded image, or NULL on failure. The caller frees it with
+///         jpeg_image_free.
+JPEG_IMAGE* jpeg_decode_coefficients(JPEG* jpeg) {
+    return decode_frame(jpeg, NULL);
+}
+
+/// @brief The jpeg_decode function decodes a JPEG to interleaved 8-bit RGB,
+///        or gray for a single component. Progressive scans are all decoded
+///        into the coefficients before they are rendered once.
+/// @param jpeg The JPEG to decode.
+/// @param options How to upsample and when to preview, or NULL for the default.
+/// @param width Set to the image width.
+/// @param height Set to the image height.
+/// @param channels Set to the samples in each pixel, 1 or 3.
+/// @return The pixels, row by row with no padding, or NULL on failure. The
+///         caller frees them.
+unsigned char* jpeg_decode(JPEG* jpeg, const JPEG_DECODE_OPTIONS* options, unsigned int* width,
+                            unsigned int* height, unsigned int* channels) {
+    JPEG_IMAGE* image = decode_frame(jpeg, options);
+    if(image == NULL)
+        return NULL;
+    COLOR_SPACE space;
+    if(!jpeg_color_space(jpeg, image, &space)) {
+        jpeg_image_free(image);
+        return NULL;
+    }
+
+    bool fancy = options == NULL || options->upsample == COLOR_UPSAMPLE_FANCY;
+    unsigned char* pixels = render_image(image, space, fancy);
+    *width = image->width;
+    *height = image->height;
+    *channels = color_channels(space);
+    jpeg_image_free(image);
+
+    return pixels;
+}
+
+/// @brief The scale_quant function scales a standard quantization table to a
+///        quality the way libjpeg does, keeping every value baseline.
+/// @param std The standard table in natural order.
+/// @param quality The quality, from 1 to 100.
+/// @param quant Where to store the scaled table in natural order.
+static void scale_quant(const unsigned char* std, int quality, uint16_t* quant) {
+    int scale = quality < 50 ? 5000 / quality : 200 - 2 * quality;
+
+    for(int k = 0; k < 64; k++) {
+        int value = (std[k] * scale + 50) / 100;
+        quant[k] = (uint16_t) (value < 1 ? 1 : value > 255 ? 255 : value);
+    }
+}
+
+/// @brief The convert_mcu_row function converts an MCU row of pixels to
+///        samples and transforms and quantizes them into the image's
+///        coefficients. Rows and columns past the edges repeat the last ones.
+/// @param band The band the row belongs to.
+/// @param m The MCU row.
+static void convert_mcu_row(ENCODE_BAND* band, unsigned int m) {
+    const ENCODER* enc = band->enc;
+    JPEG_IMAGE* image = enc->image;
+    unsigned int rows = image->v_max * 8u;
+    unsigned int padded = image->mcus_wide * image->h_max * 8u;
+    size_t row_bytes = (size_t) image->width * enc->channels;
+
+    // convert each row to planes at full resolution
+    for(unsigned int r = 0; r < rows; r++) {
+        unsigned int y = m * rows + r < image->height ? m * rows + r : image->height - 1;
+        const unsigned char* in = enc->pixels + y * row_bytes;
+        unsigned char* out[3];
+        for(int c = 0; c < image->num_components; c++)
+            out[c] = band->planes[c] + r * enc->stride;
+        if(enc->channels == 1)
+            memcpy(out[0], in, image->width);
+        else
+            color_ycc_row(in, enc->channels, image->width, out[0], out[1], out[2]);
+        for(int c = 0; c < image->num_components; c++)
+            memset(out[c] + image->width, out[c][image->width - 1], padded - image->width);
+    }
+
+    // halve the subsampled planes down to their components
+    for(int c = 1; c < image->num_components; c++) {
+        JPEG_COMPONENT* comp = image->components + c;
+        if(comp->h == image->h_max)
+            continue;
+        unsigned int vf = image->v_max / comp->v;
+        for(unsigned int r = 0; r < comp->v * 8u; r++) {
+            const unsigned char* top = band->planes[c] + r * vf * enc->stride;
+            color_downsample_row(top, vf == 2 ? top + enc->stride : NULL, comp->blocks_wide * 8,
+                                    band->samples[c] + r * enc->stride);
+        }
+    }
+
+    // transform each row of blocks
+    for(int c = 0; c < image->num_components; c++) {
+        JPEG_COMPONENT* comp = image->components + c;
+        for(unsigned int by = 0; by < comp->v; by++) {
+            size_t block = (size_t) (m * comp->v + by) * comp->blocks_wide;
+            dct_fdct_row(band->samples[c] + by * 8 * enc->stride, enc->stride, comp->blocks_wide,
+                            enc->divisors + comp->quant_id, comp->coeffs + block * 64);
+        }
+    }
+}
+
+/// @brief The encode_mcu function entropy-codes the blocks of an MCU in
+///        interleaved order.
+/// @param enc The encoder.
+/// @param mx The column of the MCU.
+/// @param my The row of the MCU.
+/// @param bw The writer to code into.
+/// @param pred The DC prediction of each component, updated as blocks are coded.
+/// @return True if the MCU was coded, false if a value has no code or memory
+///         ran out.
+static bool encode_mcu(const ENCODER* enc, size_t mx, size_t my, BIT_WRITER* bw, int* pred) {
+    JPEG_IMAGE* image = enc->image;
+
+    for(int c = 0; c < image->num_components; c++) {
+        JPEG_COMPONENT* comp = image->components + c;
+        const HUFF_ENCODER* dc = enc->dc + enc->tables[c];
+        const HUFF_ENCODER* ac = enc->ac + enc->tables[c];
+        for(unsigned int y = 0; y < comp->v; y++) {
+            for(unsigned int x = 0; x < comp->h; x++) {
+                size_t block = (my * comp->v + y) * comp->blocks_wide + mx * comp->h + x;
+                if(!huff_encode_block(bw, dc, ac, pred + c, comp->coeffs + block * 64))
+                    return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+/// @brief The encode_scan_mcu function codes, or counts, the blocks of an
+///        MCU of a progressive scan.
+/// @param enc The encoder, with its scan set.
+/// @param coder The scan's coder.
+/// @param freq The symbol counts of each table pair, when counting.
+/// @param mx The column of the MCU.
+/// @param my The row of the MCU.
+/// @param pred The DC prediction of each scan component, updated as blocks are coded.
+/// @return True if the MCU was coded, false if a value has no code or memory
+///         ran out.
+static bool encode_scan_mcu(const ENCODER* enc, HUFF_SCAN_CODER* coder,
+                                uint32_t freq[2 * JPEG_MAX_COMPONENTS][256], size_t mx,
+                                size_t my, int* pred) {
+    const JPEG_SCAN_SPEC* scan = enc->scan;
+    JPEG_IMAGE* image = enc->image;
+
+    for(int i = 0; i < scan->num_components; i++) {
+        int c = scan->components[i];
+        JPEG_COMPONENT* comp = image->components + c;
+        int t = enc->tables[c];
+        coder->table = scan->ss == 0 ? enc->dc + t : enc->ac + t;
+        coder->freq = freq[2 * t + (scan->ss != 0)];
+
+        // a lone component's MCU is one block, otherwise it is h by v blocks
+        unsigned int h = scan->num_components == 1 ? 1 : comp->h;
+        unsigned int v = scan->num_components == 1 ? 1 : comp->v;
+        for(unsigned int y = 0; y < v; y++) {
+            for(unsigned int x = 0; x < h; x++) {
+                size_t block = (my * v + y) * comp->blocks_wide + mx * h + x;
+                const int16_t* coeffs = comp->coeffs + block * 64;
+                bool encoded;
+                if(scan->ss == 0 && scan->ah == 0)
+                    encoded = huff_encode_dc_first(coder, pred + i, scan->al, coeffs);
+                else if(scan->ss == 0)
+                    encoded = huff_encode_dc_refine(coder, scan->al, coeffs);
+                else if(scan->ah == 0)
+                    encoded = huff_encode_ac_first(coder, scan->ss, scan->se, scan->al, coeffs);
+                else
+                    encoded = huff_encode_ac_refine(coder, scan->ss, scan->se, scan->al, coeffs);
+                if(!encoded)
+                    return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+/// @brief The scan_mcus function finds the MCUs of the scan an encoder codes.
+/// @param enc The encoder.
+/// @param mcus_wide Set to the MCUs in each row of the scan.
+/// @return The number of MCUs in the scan.
+static size_t scan_mcus(const ENCODER* enc, size_t* mcus_wide) {
+    const JPEG_IMAGE* image = enc->image;
+
+    // a scan of one component is coded block by block over just that component
+    if(enc->scan != NULL && enc->scan->num_components == 1) {
+        const JPEG_COMPONENT* comp = image->components + enc->scan->components[0];
+        *mcus_wide = (comp->width + 7) / 8;
+        return *mcus_wide * ((comp->height + 7) / 8);
+    }
+    *mcus_wide = image->mcus_wide;
+
+    return (size_t) image->mcus_wide * image->mcus_high;
+}
+
+/// @brief The alloc_planes function allocates the MCU row of each plane a
+///        band converts its pixels into.
+/// @param band The band.
+/// @return True if the rows were allocated, false otherwise.
+static bool alloc_planes(ENCODE_BAND* band) {
+    const ENCODER* enc = band->enc;
+    JPEG_IMAGE* image = enc->image;
+
+    // each plane takes an MCU row at full resolution
+    for(int c = 0; c < image->num_components; c++) {
+        band->planes[c] = malloc(enc->stride * image->v_max * 8);
+        band->samples[c] = image->components[c].h == image->h_max ? band->planes[c] :
+                            malloc(enc->stride * image->components[c].v * 8);
+        if(band->planes[c] == NULL || band->samples[c] == NULL)
+            return false;
+    }
+
+    return true;
+}
+
+/// @brief The free_planes function frees the MCU rows of a band's planes.
+/// @param band The band.
+static void free_planes(ENCODE_BAND* band) {
+    for(int c = 0; c < band->enc->image->num_components; c++) {
+        if(band->samples[c] != band->planes[c])
+            free(band->samples[c]);
+        free(band->planes[c]);
+        band->samples[c] = NULL;
+        band->planes[c] = NULL;
+    }
+}
+
+/// @brief The convert_band function transforms and quantizes the MCU rows of
+///        a band into the image's coefficients, for the scans of a
+///        progressive frame to code afterwards.
+/// @param arg The ENCODE_BAND to convert, of whole MCU rows.
+static void convert_band(void* arg) {
+    ENCODE_BAND* band = arg;
+    JPEG_IMAGE* image = band->enc->image;
+
+    band->encoded = alloc_planes(band);
+    for(size_t i = band->first; i < band->first + band->count && band->encoded;
+            i += image->mcus_wide)
+        convert_mcu_row(band, (unsigned int) (i / image->mcus_wide));
+    free_planes(band);
+}
+
+/// @brief The encode_band function codes the MCUs of a band, with the DC
+///        predictions and end-of-band run starting from zero and a RSTn
+///        marker before each restart interval after the first. Pixels are
+///        converted an MCU row at a time, so each row is coded while it is
+///        still in the cache. When counting, the band's symbols are counted
+///        instead.
+/// @param arg The ENCODE_BAND to code.
+static void encode_band(void* arg) {
+    ENCODE_BAND* band = arg;
+    const ENCODER* enc = band->enc;
+    JPEG_IMAGE* image = enc->image;
+    size_t interval = enc->restart_interval;
+    int pred[JPEG_MAX_COMPONENTS] = { 0 };
+    HUFF_SCAN_CODER coder;
+    size_t mcus_wide;
+    scan_mcus(enc, &mcus_wide);
+    memset(&coder, 0, sizeof(coder));
+
+    bool allocated = enc->pixels == NULL || alloc_planes(band);
+    size_t markers = interval != 0 && !enc->counting ? (band->count - 1) / interval : 0;
+    if(markers > 0) {
+        band->restarts = malloc(sizeof(size_t) * markers);
+        allocated = allocated && band->restarts != NULL;
+    }
+
+    // about four pixels to a byte is plenty to start with
+    size_t pixels = band->count * image->h_max * image->v_max * 64;
+    band->encoded = allocated && (enc->counting || bit_writer_init(&band->bw, pixels / 4));
+    coder.bw = enc->counting ? NULL : &band->bw;
+    for(size_t i = band->first; i < band->first + band->count && band->encoded; i++) {
+        size_t mx = i % mcus_wide;
+        size_t my = i / mcus_wide;
+        if(i != band->first && interval != 0 && i % interval == 0) {
+            band->encoded = enc->scan == NULL || huff_encode_eobrun(&coder);
+            if(!enc->counting) {
+                band->encoded = band->encoded && bit_writer_marker(&band->bw,
+                                                (unsigned char) (RST0 + (i / interval - 1) % 8));
+                band->restarts[band->num_restarts++] = band->bw.length - 2;
+            }
+            memset(pred, 0, sizeof(pred));
+        }
+        if(enc->pixels != NULL && mx == 0)
+            convert_mcu_row(band, (unsigned int) my);
+        if(enc->scan == NULL)
+            band->encoded = band->encoded && encode_mcu(enc, mx, my, &band->bw, pred);
+        else
+            band->encoded = band->encoded && encode_scan_mcu(enc, &coder, band->freq, mx, my,
+                                                                pred);
+    }
+    if(enc->scan != NULL)
+        band->encoded = band->encoded && huff_encode_eobrun(&coder);
+    if(!enc->counting)
+        band->encoded = band->encoded && bit_writer_flush(&band->bw);
+
+    if(enc->pixels != NULL)
+        free_planes(band);
+}
+
+/// @brief The split_bands function splits the MCUs of an image, or of the
+///        progressive scan being coded, into bands of whole restart intervals.
+/// @param enc The encoder.
+/// @param band_mcus The MCUs in each band but the last, a multiple of the
+///        restart interval.
+/// @param num_bands Set to the number of bands.
+/// @return The bands, or NULL if memory ran out. The caller frees them with
+///         free_bands.
+static ENCODE_BAND* split_bands(const ENCODER* enc, size_t band_mcus, size_t* num_bands) {
+    size_t mcus_wide;
+    size_t num_mcus = scan_mcus(enc, &mcus_wide);
+    *num_bands = (num_mcus + band_mcus - 1) / band_mcus;
+    ENCODE_BAND* bands = calloc(*num_bands, sizeof(ENCODE_BAND));
+    if(bands == NULL)
+        return NULL;
+
+    for(size_t i = 0; i < *num_bands; i++) {
+        bands[i].enc = enc;
+        bands[i].first = i * band_mcus;
+        bands[i].count = num_mcus - bands[i].first < band_mcus ? num_mcus - bands[i].first :
+                            band_mcus;
+    }
+
+    return bands;
+}
+
+/// @brief The free_bands function frees bands and their data.
+/// @param bands The bands to free.
+/// @param num_bands The number of bands.
+static void free_bands(ENCODE_BAND* bands, size_t num_bands) {
+    if(bands == NULL)
+        return;
+
+    for(size_t i = 0; i < num_bands; i++) {
+        free(bands[i].bw.data);
+        free(bands[i].restarts);
+    }
+    free(bands);
+}
+
+/// @brief The encode_bands function codes or converts every band of an
+///        image, on a thread pool when there is more than one. The bands are
+///        split by the restart interval alone, so the output does not depend
+///        on the number of threads.
+/// @param bands The bands, with their encoder and MCUs set.
+/// @param num_bands The number of bands.
+/// @param threads The number of threads, or 0 for one per core.
+/// @param task The job to run on each band, encode_band or convert_band.
+/// @return True if every band was coded, false otherwise.
+static bool encode_bands(ENCODE_BAND* bands, size_t num_bands, int threads, POOL_TASK task) {
+    POOL* pool = num_bands > 1 ? pool_create(threads) : NULL;
+    for(size_t i = 0; i < num_bands; i++)
+        if(pool == NULL || !pool_submit(pool, task, bands + i))
+            task(bands + i);
+    if(pool != NULL) {
+        pool_wait(pool);
+        pool_free(pool);
+    }
+
+    bool encoded = true;
+    for(size_t i = 0; i < num_bands; i++)
+        encoded = encoded && bands[i].encoded;
+
+    return encoded;
+}
+
+/// @brief The join_bands function adds the scan of an encoded image, or the
+///        progressive scan being coded, to a JPEG, its header followed by the
+///        data of each band with a RSTn marker between bands.
+/// @param jpeg The JPEG to add to.
+/// @param enc The encoder.
+/// @param bands The coded bands.
+/// @param num_bands The number of bands.
+/// @return True if the scan was added, false otherwise.
+static bool join_bands(JPEG* jpeg, const ENCODER* enc, const ENCODE_BAND* bands,
+                        size_t num_bands) {
+    const JPEG_IMAGE* image = enc->image;
+    const JPEG_SCAN_SPEC* scan = enc->scan;
+    int num_components = scan != NULL ? scan->num_components : image->num_components;
+    int header_length = 4 + 2 * num_components;
+    size_t length = (size_t) header_length + 2 * (num_bands - 1);
+    size_t num_restarts = num_bands - 1;
+    for(size_t i = 0; i < num_bands; i++) {
+        length += bands[i].bw.length;
+        num_restarts += bands[i].num_restarts;
+    }
+    unsigned char* data = malloc(length);
+    size_t* restarts = num_restarts > 0 ? malloc(sizeof(size_t) * num_restarts) : NULL;
+    if(data == NULL || (num_restarts > 0 && restarts == NULL)) {
+        printf("Unable to allocate memory");
+        free(data);
+        free(restarts);
+        return false;
+    }
+
+    // the scan header names each component with its pair of tables
+    data[0] = (unsigned char) num_components;
+    for(int i = 0; i < num_components; i++) {
+        int c = scan != NULL ? scan->components[i] : i;
+        data[1 + 2 * i] = image->components[c].id;
+        data[2 + 2 * i] = (unsigned char) ((enc->tables[c] << 4) | enc->tables[c]);
+    }
+    data[header_length - 3] = (unsigned char) (scan != NULL ? scan->ss : 0);
+    data[header_length - 2] = (unsigned char) (scan != NULL ? scan->se : 63);
+    data[header_length - 1] = (unsigned char) (scan != NULL ? (scan->ah << 4) | scan->al : 0);
+
+    // each band after the first is led by the RSTn marker of its first interval
+    size_t pos = (size_t) header_length;
+    size_t r = 0;
+    for(size_t i = 0; i < num_bands; i++) {
+        if(i > 0) {
+            restarts[r++] = pos;
+            data[pos++] = START;
+            data[pos++] = (unsigned char) (RST0 +
+                                            (bands[i].first / enc->restart_interval - 1) % 8);
+        }
+        memcpy(data + pos, bands[i].bw.data, bands[i].bw.length);
+        for(size_t j = 0; j < bands[i].num_restarts; j++)
+            restarts[r++] = pos + bands[i].restarts[j];
+        pos += bands[i].bw.length;
+    }
+
+    // the scan owns the data once it is added
+    if(!jpeg_read_scan(jpeg, data, length, header_length, (unsigned int) enc->restart_interval,
+                        restarts, num_restarts, false)) {
+        free(data);
+        free(restarts);
+        return false;
+    }
+
+    return true;
+}
+
+/// @brief The add_huff_tables function adds a DHT segment with the DC and AC
+///        tables of each table pair.
+/// @param jpeg The JPEG to add to.
+/// @param specs The tables, DC then AC of each pair, NULL for any left out.
+/// @param pairs The number of pairs.
+/// @return True if the segment was added, false otherwise.
+static bool add_huff_tables(JPEG* jpeg, const HUFF_SPEC* const* specs, int pairs) {
+    unsigned char data[2 * JPEG_MAX_COMPONENTS * (17 + 256)];
+    int length = 0;
+
+    for(int t = 0; t < 2 * pairs; t++) {
+        if(specs[t] == NULL)
+            continue;
+        int num_symbols = huff_spec_symbols(specs[t]);
+        data[length++] = (unsigned char) (((t & 1) << 4) | (t >> 1));
+        memcpy(data + length, specs[t]->counts, 16);
+        memcpy(data + length + 16, specs[t]->symbols, num_symbols);
+        length += 16 + num_symbols;
+    }
+
+    return jpeg_read_huff_table(jpeg, data, length);
+}
+
+/// @brief The encode_tables function adds the JFIF, quantization, frame,
+///        Huffman table and restart interval segments of an encoded image to
+///        a JPEG.
+/// @param jpeg The JPEG to add to.
+/// @param image The image being encoded.
+/// @param quant The luma and chroma quantization tables in natural order.
+/// @param restart_interval The MCUs between restart markers, 0 for none.
+/// @return True if the segments were added, false otherwise.
+static bool encode_tables(JPEG* jpeg, const JPEG_IMAGE* image, uint16_t quant[2][64],
+                            unsigned int restart_interval) {
+    static const HUFF_SPEC* specs[4] = {
+        &huff_std_dc_luma, &huff_std_ac_luma, &huff_std_dc_chroma, &huff_std_ac_chroma
+    };
+    int tables = image->num_components == 1 ? 1 : 2;
+    unsigned char data[2 * 65 + 6 + 3 * JPEG_MAX_COMPONENTS];
+    int length = 0;
+
+    // a JFIF header with square pixels and no thumbnail
+    static const unsigned char jfif[14] = { 'J', 'F', 'I', 'F', 0, 1, 1, 0, 0, 1, 0, 1, 0, 0 };
+    unsigned char* app = malloc(sizeof(jfif));
+    MEM_CHECK(app);
+    memcpy(app, jfif, sizeof(jfif));
+    if(!jpeg_read_app_seg(jpeg, APP0, app, sizeof(jfif), false)) {
+        free(app);
+        return false;
+    }
+
+    // every quantization table in one segment, in zigzag order
+    for(int t = 0; t < tables; t++) {
+        data[length++] = (unsigned char) t;
+        for(int k = 0; k < 64; k++)
+            data[length++] = (unsigned char) quant[t][huff_natural_order[k]];
+    }
+    if(!jpeg_read_quant_table(jpeg, data, length))
+        return false;
+
+    // the frame header
+    length = 0;
+    data[length++] = 8;
+    data[length++] = (unsigned char) (image->height >> 8);
+    data[length++] = (unsigned char) image->height;
+    data[length++] = (unsigned char) (image->width >> 8);
+    data[length++] = (unsigned char) image->width;
+    data[length++] = (unsigned char) image->num_components;
+    for(int c = 0; c < image->num_components; c++) {
+        const JPEG_COMPONENT* comp = image->components + c;
+        data[length++] = comp->id;
+        data[length++] = (unsigned char) ((comp->h << 4) | comp->v);
+        data[length++] = comp->quant_id;
+    }
+    if(!jpeg_read_frame(jpeg, image->marker, data, length))
+        return false;
+
+    // every Huffman table in one segment, unless each progressive scan brings its own
+    if(image->marker != SOF2 && !add_huff_tables(jpeg, specs, tables))
+        return false;
+
+    // the restart interval, when there is one
+    if(restart_interval == 0)
+        return true;
+    unsigned char* dri = malloc(2);
+    MEM_CHECK(dri);
+    dri[0] = (unsigned char) (restart_interval >> 8);
+    dri[1] = (unsigned char) restart_interval;
+    if(!jpeg_read_app_seg(jpeg, DRI, dri, 2, false)) {
+        free(dri);
+        return false;
+    }
+
+    return true;
+}
+
+/// @brief The check_script function checks that a progressive scan script
+///        codes each coefficient's bits in order, as libjpeg does. Every
+///        component must have its DC coefficients coded, but the script may
+///        leave out AC coefficients or their last bits.
+/// @param image The image the script is for.
+/// @param scans The scans of the script.
+/// @param num_scans The number of scans.
+/// @return True if the script is valid, false otherwise.
+static bool check_script(const JPEG_IMAGE* image, const JPEG_SCAN_SPEC* scans, int num_scans) {
+    // the bit position each coefficient was last coded down to, -1 before its first scan
+    signed char bits[JPEG_MAX_COMPONENTS][64];
+    memset(bits, -1, sizeof(bits));
+
+    for(int s = 0; s < num_scans; s++) {
+        const JPEG_SCAN_SPEC* scan = scans + s;
+        if(scan->num_components < 1 || scan->num_components > image->num_components)
+            return false;
+        if(scan->ss == 0 ? scan->se != 0 : (scan->se < scan->ss || scan->se > 63 ||
+                scan->num_components != 1))
+            return false;
+        if(scan->al < 0 || scan->al > 13 || (scan->ah != 0 && scan->al != scan->ah - 1))
+            return false;
+
+        // components come in frame order, each taking the bits after its last scan's
+        for(int i = 0; i < scan->num_components; i++) {
+            int c = scan->components[i];
+            if(c < 0 || c >= image->num_components || (i > 0 && c <= scan->components[i - 1]))
+                return false;
+            for(int k = scan->ss; k <= scan->se; k++) {
+                if(bits[c][k] != (scan->ah == 0 ? -1 : scan->ah))
+                    return false;
+                bits[c][k] = (signed char) scan->al;
+            }
+        }
+    }
+    for(int c = 0; c < image->num_components; c++)
+        if(bits[c][0] < 0)
+            return false;
+
+    return true;
+}
+
+/// @brief The table_cost function finds the bytes a table takes in a DHT
+///        segment and the codes of the symbols it codes take in a scan.
+/// @param freq The number of times each symbol is coded.
+/// @param spec The table.
+/// @return The number of bytes.
+static size_t table_cost(const uint32_t* freq, const HUFF_SPEC* spec) {
+    uint64_t bits = 0;
+    int s = 0;
+    for(int l = 0; l < 16; l++)
+        for(int n = 0; n < spec->counts[l]; n++, s++)
+            bits += (uint64_t) freq[spec->symbols[s]] * (uint64_t) (l + 1);
+
+    return (size_t) (bits / 8) + 17 + (size_t) s;
+}
+
+/// @brief The group_tables function chooses which components of a scan share
+///        a table pair. Every way of grouping them is tried, and the one whose
+///        tables and codes take the fewest bytes is kept, since a pair of its
+///        own only pays off for a component whose symbols are coded often
+///        enough.
+/// @param enc The encoder, whose tables are set to the pair of each component.
+/// @param components The index of each component of the scan.
+/// @param num_components The number of components.
+/// @param freq The counts of the DC then AC symbols of each component, as
+///        counted with a pair for each, replaced by the counts of each chosen
+///        pair.
+/// @return The number of pairs.
+static int group_tables(ENCODER* enc, const int* components, int num_components,
+                        uint32_t freq[2 * JPEG_MAX_COMPONENTS][256]) {
+    uint32_t merged[2 * JPEG_MAX_COMPONENTS][256];
+    int group[JPEG_MAX_COMPONENTS] = { 0 };
+    size_t best = SIZE_MAX;
+    int pairs = 1;
+
+    // each grouping numbers its pairs in order of their first component
+    bool more = true;
+    while(more) {
+        int num_groups = 0;
+        memset(merged, 0, sizeof(merged));
+        for(int i = 0; i < num_components; i++) {
+            int c = components[i];
+            num_groups = group[i] + 1 > num_groups ? group[i] + 1 : num_groups;
+            for(int j = 0; j < 256; j++) {
+                merged[2 * group[i]][j] += freq[2 * c][j];
+                merged[2 * group[i] + 1][j] += freq[2 * c + 1][j];
+            }
+        }
+        size_t cost = 0;
+        for(int t = 0; t < 2 * num_groups; t++) {
+            HUFF_SPEC spec;
+            huff_optimize(merged[t], &spec);
+            cost += table_cost(merged[t], &spec);
+        }
+        if(cost < best) {
+            best = cost;
+            pairs = num_groups;
+            for(int i = 0; i < num_components; i++)
+                enc->tables[components[i]] = (unsigned char) group[i];
+        }
+
+        // the next grouping moves the last component that can to the next pair
+        more = false;
+        for(int i = num_components - 1; i > 0 && !more; i--) {
+            int highest = 0;
+            for(int k = 0; k < i; k++)
+                highest = group[k] > highest ? group[k] : highest;
+            if(group[i] <= highest) {
+                group[i]++;
+                for(int k = i + 1; k < num_components; k++)
+                    group[k] = 0;
+                more = true;
+            }
+        }
+    }
+
+    // the counts of each chosen pair
+    memset(merged, 0, sizeof(merged));
+    for(int i = 0; i < num_components; i++) {
+        int c = components[i];
+        for(int j = 0; j < 256; j++) {
+            merged[2 * enc->tables[c]][j] += freq[2 * c][j];
+            merged[2 * enc->tables[c] + 1][j] += freq[2 * c + 1][j];
+        }
+    }
+    memcpy(freq, merged, sizeof(merged));
+
+    return pairs;
+}
+
+/// @brief The encode_scans function adds the scans of a progressive frame
+///        to a JPEG, coding each from the coefficients in the image. The
+///        symbols of each scan are counted first, and the scan is led by a
+///        DHT segment with the optimal tables for them. When the encoder is
+///        grouping, the components of each scan are counted with a pair each
+///        and then grouped into whichever pairs take the fewest bytes.
+/// @param jpeg The JPEG to add to.
+/// @param enc The encoder, with every coefficient of its image filled in.
+/// @param scans The scans of the script.
+/// @param num_scans The number of scans.
+/// @param threads The number of threads bands of restart intervals are coded on.
+/// @return True if every scan was added, false otherwise.
+static bool encode_scans(JPEG* jpeg, ENCODER* enc, const JPEG_SCAN_SPEC* scans, int num_scans,
+                            int threads) {
+    bool encoded = true;
+
+    for(int s = 0; s < num_scans && encoded; s++) {
+        const JPEG_SCAN_SPEC* scan = scans + s;
+        enc->scan = scan;
+        size_t mcus_wide;
+        size_t band_mcus = enc->restart_interval != 0 ? enc->restart_interval :
+                            scan_mcus(enc, &mcus_wide);
+        size_t num_bands = 0;
+        ENCODE_BAND* bands = split_bands(enc, band_mcus, &num_bands);
+        if(bands == NULL) {
+            printf("Unable to allocate memory");
+            return false;
+        }
+
+        // count the symbols of the scan, then build its tables from them,
+        // unless it only refines the DC coefficients a bit at a time
+        bool refine = scan->ss == 0 && scan->ah != 0;
+        if(enc->grouping)
+            for(int i = 0; i < scan->num_components; i++)
+                enc->tables[scan->components[i]] = (unsigned char) scan->components[i];
+        enc->counting = true;
+        encoded = refine || encode_bands(bands, num_bands, threads, encode_band);
+        uint32_t freq[2 * JPEG_MAX_COMPONENTS][256];
+        memset(freq, 0, sizeof(freq));
+        for(size_t b = 0; b < num_bands && !refine; b++)
+            for(int t = 0; t < 2 * JPEG_MAX_COMPONENTS; t++)
+                for(int j = 0; j < 256; j++)
+                    freq[t][j] += bands[b].freq[t][j];
+        if(enc->grouping && !refine && scan->num_components > 1)
+            group_tables(enc, scan->components, scan->num_components, freq);
+        HUFF_SPEC specs[2 * JPEG_MAX_COMPONENTS];
+        const HUFF_SPEC* spec_list[2 * JPEG_MAX_COMPONENTS] = { NULL };
+        for(int i = 0; i < scan->num_components && encoded && !refine; i++) {
+            int t = 2 * enc->tables[scan->components[i]] + (scan->ss != 0);
+            if(spec_list[t] != NULL)
+                continue;
+            huff_optimize(freq[t], specs + t);
+            huff_encoder_build(t % 2 == 0 ? enc->dc + t / 2 : enc->ac + t / 2, specs + t);
+            spec_list[t] = specs + t;
+        }
+        encoded = encoded && (refine || add_huff_tables(jpeg, spec_list, JPEG_MAX_COMPONENTS));
+
+        // code the scan with its tables
+        enc->counting = false;
+        encoded = encoded && encode_bands(bands, num_bands, threads, encode_band) &&
+                    join_bands(jpeg, enc, bands, num_bands);
+        free_bands(bands, num_bands);
+    }
+
+    return encoded;
+}
+
+/// @brief The jpeg_encode function encodes pixels as a baseline JPEG. Color
+///        pixels are converted to YCbCr and their chroma subsampled, and each
+///        MCU row is transformed, quantized and Huffman coded with the Annex K
+///        tables while its samples are still in the cache. With a restart
+///        interval, the bands of MCU rows between restart markers are coded
+///        in parallel. A progressive JPEG instead has every MCU row
+///        transformed and quantized into the image's coefficients first, which
+///        each scan of the script then codes with tables of its own.
+/// @param pixels The pixels, row by row with no padding.
+/// @param width The image width, up to 65535.
+/// @param height The image height, up to 65535.
+/// @param channels The samples in each pixel, 1 for gray, 3 for RGB or 4 for
+///        RGBA, whose alpha is dropped.
+/// @param options The quality, subsampling, restart interval and scan script,
+///        or NULL for a baseline JPEG at quality 75 and 4:2:0 without restarts.
+/// @return The JPEG, ready for jpeg_write, or NULL on failure.
+JPEG* jpeg_encode(const unsigned char* pixels, unsigned int width, unsigned int height,
+                    unsigned int channels, const JPEG_ENCODE_OPTIONS* options) {
+    if(width == 0 || height == 0 || width > 65535 || height > 65535 ||
+            (channels != 1 && channels != 3 && channels != 4)) {
+        printf("Unsupported image for JPEG encoding\n");
+        return NULL;
+    }
+    int quality = options != NULL ? options->quality : JPEG_DEFAULT_QUALITY;
+    quality = quality < 1 ? 1 : quality > 100 ? 100 : quality;
+    JPEG_SUBSAMPLING subsampling = options != NULL ? options->subsampling : JPEG_SUBSAMPLE_420;
+    int threads = options != NULL ? options->threads : 0;
+    bool progressive = options != NULL && options->progressive;
+
+    ENCODER enc;
+    memset(&enc, 0, sizeof(enc));
+    enc.pixels = pixels;
+    enc.channels = channels;
+    JPEG_IMAGE* image = calloc(1, sizeof(JPEG_IMAGE));
+    MEM_CHECK(image);
+    enc.image = image;
+
+    // gray is one luma component, and color is luma with two chroma components
+    image->marker = progressive ? SOF2 : SOF0;
+    image->width = width;
+    image->height = height;
+    image->num_components = channels == 1 ? 1 : 3;
+    for(int c = 0; c < image->num_components; c++) {
+        image->components[c].id = (unsigned char) (c + 1);
+        image->components[c].h = 1;
+        image->components[c].v = 1;
+        image->components[c].quant_id = c == 0 ? 0 : 1;
+        enc.tables[c] = image->components[c].quant_id;
+    }
+    if(image->num_components == 3) {
+        image->components[0].h = subsampling == JPEG_SUBSAMPLE_444 ? 1 : 2;
+        image->components[0].v = subsampling == JPEG_SUBSAMPLE_420 ? 2 : 1;
+    }
+
+    // a progressive frame follows its scan script, libjpeg's by default
+    const JPEG_SCAN_SPEC* scans = image->num_components == 1 ? gray_script : color_script;
+    int num_scans = image->num_components == 1 ? 6 : 10;
+    if(progressive && options->scans != NULL) {
+        scans = options->scans;
+        num_scans = options->num_scans;
+    }
+    if(progressive && !check_script(image, scans, num_scans)) {
+        printf("Invalid progressive scan script\n");
+        free(image);
+        return NULL;
+    }
+
+    // scale the tables and build what the kernels need from them
+    uint16_t quant[2][64];
+    scale_quant(std_luma_quant, quality, quant[0]);
+    scale_quant(std_chroma_quant, quality, quant[1]);
+    for(int t = 0; t < 2; t++)
+        dct_prepare_divisors(quant[t], enc.divisors + t);
+    huff_encoder_build(enc.dc, &huff_std_dc_luma);
+    huff_encoder_build(enc.ac, &huff_std_ac_luma);
+    huff_encoder_build(enc.dc + 1, &huff_std_dc_chroma);
+    huff_encoder_build(enc.ac + 1, &huff_std_ac_chroma);
+
+    // split the MCU rows into bands, one restart interval each
+    JPEG* jpeg = NULL;
+    ENCODE_BAND* bands = NULL;
+    size_t num_bands = 0;
+    bool allocated = layout_image(image);
+    enc.stride = (size_t) image->mcus_wide * image->h_max * 8;
+    unsigned int band_rows = options != NULL ? options->restart_rows : 0;
+    if(band_rows > 65535 / image->mcus_wide)
+        band_rows = 65535 / image->mcus_wide;
+    if(band_rows == 0 || band_rows >= image->mcus_high)
+        band_rows = image->mcus_high;
+    else
+        enc.restart_interval = (size_t) band_rows * image->mcus_wide;
+    if(allocated) {
+        bands = split_bands(&enc, (size_t) band_rows * image->mcus_wide, &num_bands);
+        allocated = bands != NULL;
+        if(!allocated)
+            printf("Unable to allocate memory");
+    }
+
+    // code the bands and join them into the scan, or fill in the
+    // coefficients for the scans of a progressive frame
+    bool encoded = allocated && encode_bands(bands, num_bands, threads,
+                                                progressive ? convert_band : encode_band);
+    if(encoded) {
+        jpeg = jpeg_create();
+        enc.pixels = NULL;
+        if(jpeg == NULL)
+            printf("Unable to allocate memory");
+        encoded = jpeg != NULL &&
+                    encode_tables(jpeg, image, quant, (unsigned int) enc.restart_interval) &&
+                    (progressive ? encode_scans(jpeg, &enc, scans, num_scans, threads) :
+                        join_bands(jpeg, &enc, bands, num_bands));
+    }
+    if(allocated && !encoded) {
+        printf("Unable to encode JPEG\n");
+        jpeg_free(jpeg);
+        jpeg = NULL;
+    }
+
+    free_bands(bands, num_bands);
+    jpeg_image_free(image);
+
+    return jpeg;
+}
+
+/// @brief The count_symbols function counts the symbols coding every MCU of
+///        an image would take, with each pair of tables counted together.
+/// @param enc The encoder, with its image, table pairs and restart interval set.
+/// @param freq The counts of the DC then AC symbols of each pair.
+static void count_symbols(const ENCODER* enc, uint32_t freq[2 * JPEG_MAX_COMPONENTS][256]) {
+    JPEG_IMAGE* image = enc->image;
+    size_t num_mcus = (size_t) image->mcus_wide * image->mcus_high;
+    int pred[JPEG_MAX_COMPONENTS] = { 0 };
+
+    for(size_t i = 0; i < num_mcus; i++) {
+        size_t mx = i % image->mcus_wide;
+        size_t my = i / image->mcus_wide;
+        if(enc->restart_interval != 0 && i % enc->restart_interval == 0)
+            memset(pred, 0, sizeof(pred));
+        for(int c = 0; c < image->num_components; c++) {
+            JPEG_COMPONENT* comp = image->components + c;
+            int t = enc->tables[c];
+            for(unsigned int y = 0; y < comp->v; y++) {
+                for(unsigned int x = 0; x < comp->h; x++) {
+                    size_t block = (my * comp->v + y) * comp->blocks_wide + mx * comp->h + x;
+                    huff_count_block(comp->coeffs + block * 64, pred + c, freq[2 * t],
+                                        freq[2 * t + 1]);
+                }
+            }
+        }
+    }
+}
+
+/// @brief The copy_segment function adds a copy of a segment that is kept as
+///        it is to a JPEG.
+/// @param jpeg The JPEG to add to.
+/// @param app_seg The segment to copy.
+/// @return True if the segment was added, false otherwise.
+static bool copy_segment(JPEG* jpeg, const APP_SEG* app_seg) {
+    unsigned char* data = malloc(app_seg->length > 0 ? app_seg->length : 1);
+    MEM_CHECK(data);
+    memcpy(data, app_seg->data, app_seg->length);
+    if(!jpeg_read_app_seg(jpeg, app_seg->marker, data, app_seg->length, false)) {
+        free(data);
+        return false;
+    }
 
     return true;
 }
 
+/// @brief The copy_scan function adds a copy of a scan that is kept as it is
+///        to a JPEG.
+/// @param jpeg The JPEG to add to.
+/// @param scan The scan to copy.
+/// @return True if the scan was added, false otherwise.
+static bool copy_scan(JPEG* jpeg, const SCAN* scan) {
+    unsigned char* data = malloc(scan->length > 0 ? scan->length : 1);
+    size_t* restarts = scan->num_restarts > 0 ? malloc(sizeof(size_t) * scan->num_restarts) :
+                        NULL;
+    if(data == NULL || (scan->num_restarts > 0 && restarts == NULL)) {
+        printf("Unable to allocate memory");
+        free(data);
+        free(restarts);
+        return false;
+    }
+    memcpy(data, scan->data, scan->length);
+    if(scan->num_restarts > 0)
+        memcpy(restarts, scan->restarts, sizeof(size_t) * scan->num_restarts);
+
+    // the scan owns the data once it is added
+    if(!jpeg_read_scan(jpeg, data, scan->length, scan->header_length, scan->restart_interval,
+                        restarts, scan->num_restarts, false)) {
+        free(data);
+        free(restarts);
+        return false;
+    }
+
+    return true;
+}
+
+/// @brief The copy_jpeg function copies every segment of a JPEG as it is.
+/// @param jpeg The JPEG to copy.
+/// @return The copy, or NULL on failure.
+static JPEG* copy_jpeg(const JPEG* jpeg) {
+    JPEG* out = jpeg_create();
+    bool added = out != NULL;
+
+    for(int i = 0; i < jpeg->num_segments && added; i++) {
+        int index = jpeg->segments[i].index;
+        unsigned char marker = jpeg->segments[i].marker;
+        if(is_frame_marker(marker))
+            added = jpeg_read_frame(out, marker, jpeg->frames[index].data,
+                                        jpeg->frames[index].length);
+        else if(marker == DQT)
+            added = jpeg_read_quant_table(out, jpeg->quant_tables[index].data,
+                                            jpeg->quant_tables[index].length);
+        else if(marker == DHT)
+            added = jpeg_read_huff_table(out, jpeg->huff_tables[index].data,
+                                            jpeg->huff_tables[index].length);
+        else if(marker == SOS)
+            added = copy_scan(out, jpeg->scans + index);
+        else
+            added = copy_segment(out, jpeg->app_segments + index);
+    }
+    if(!added) {
+        jpeg_free(out);
+        return NULL;
+    }
+
+    return out;
+}
+
+/// @brief The file_length function finds the length of the file jpeg_write
+///        would write for a JPEG.
+/// @param jpeg The JPEG.
+/// @return The length in bytes.
+static size_t file_length(const JPEG* jpeg) {
+    // the start and end of image markers, then each segment's marker and length field
+    size_t length = 4;
+
+    for(int i = 0; i < jpeg->num_segments; i++) {
+        int index = jpeg->segments[i].index;
+        unsigned char marker = jpeg->segments[i].marker;
+        length += 4;
+        if(is_frame_marker(marker))
+            length += (size_t) jpeg->frames[index].length;
+        else if(marker == DQT)
+            length += (size_t) jpeg->quant_tables[index].length;
+        else if(marker == DHT)
+            length += (size_t) jpeg->huff_tables[index].length;
+        else if(marker == SOS)
+            length += jpeg->scans[index].length;
+        else
+            length += (size_t) jpeg->app_segments[index].length;
+    }
+
+    return length;
+}
+
+/// @brief The read_script function reads the scan script of a progressive
+///        JPEG back from its scan headers.
+/// @param jpeg The JPEG.
+/// @param image The image decoded from it.
+/// @return The scans of the script, one for each in the JPEG, or NULL if
+///         memory ran out or the script is not one encode_scans can code.
+static JPEG_SCAN_SPEC* read_script(const JPEG* jpeg, const JPEG_IMAGE* image) {
+    JPEG_SCAN_SPEC* scans = malloc(sizeof(JPEG_SCAN_SPEC) * (size_t) jpeg->num_scans);
+    if(scans == NULL) {
+        printf("Unable to allocate memory");
+        return NULL;
+    }
+
+    // the headers were checked as the image was decoded
+    for(int s = 0; s < jpeg->num_scans; s++) {
+        const unsigned char* data = jpeg->scans[s].data;
+        JPEG_SCAN_SPEC* scan = scans + s;
+        scan->num_components = data[0];
+        for(int i = 0; i < scan->num_components; i++)
+            for(int c = 0; c < image->num_components; c++)
+                if(image->components[c].id == data[1 + 2 * i])
+                    scan->components[i] = c;
+        scan->ss = data[1 + 2 * scan->num_components];
+        scan->se = data[2 + 2 * scan->num_components];
+        scan->ah = data[3 + 2 * scan->num_components] >> 4;
+        scan->al = data[3 + 2 * scan->num_components] & 15;
+    }
+    if(!check_script(image, scans, jpeg->num_scans)) {
+        free(scans);
+        return NULL;
+    }
+
+    return scans;
+}
+
+/// @brief The tables_redefined function checks if a DQT segment after the
+///        first scan redefines a quantization table, which the components
+///        scanned before it keep using.
+/// @param jpeg The JPEG.
+/// @return True if a table is redefined after the first scan, false otherwise.
+static bool tables_redefined(const JPEG* jpeg) {
+    bool defined[4] = { false, false, false, false };
+    bool scanned = false;
+
+    for(int i = 0; i < jpeg->num_segments; i++) {
+        if(jpeg->segments[i].marker == SOS)
+            scanned = true;
+        if(jpeg->segments[i].marker != DQT)
+            continue;
+
+        // each table is its precision and id, then 64 entries of one or two bytes
+        const QUANT_TABLE* table = jpeg->quant_tables + jpeg->segments[i].index;
+        for(int pos = 0; pos < table->length; pos += 1 + (table->data[pos] >> 4 ? 128 : 64)) {
+            int id = table->data[pos] & 15;
+            if(id > 3)
+                continue;
+            if(scanned && defined[id])
+                return true;
+            defined[id] = true;
+        }
+    }
+
+    return false;
+}
+
+/// @brief The jpeg_optimize function rewrites a JPEG with Huffman tables
+///        built for its own coefficients, without going back to pixels. The
+///        scans are entropy decoded and the coefficients coded again with the
+///        same restart interval, in parallel when it has one. A sequential
+///        frame becomes one interleaved scan, its components grouped into
+///        table pairs however takes the fewest bytes, and a baseline one
+///        needing more than the two pairs baseline allows is marked as
+///        extended sequential. A progressive frame keeps its scan script,
+///        each scan led by the optimal tables for it, with a pair for each
+///        component. The new scans take the place of the first, so any
+///        quantization tables defined between scans are moved ahead of it.
+///        Every other segment is kept as it is, so the pixels are unchanged,
+///        and when the result is no smaller, or its scans cannot be coded
+///        again, it is a copy of the original.
+/// @param jpeg The JPEG to optimize.
+/// @return The optimized JPEG, or NULL on failure. The original is left as
+///         it is.
+JPEG* jpeg_optimize(JPEG* jpeg) {
+    JPEG_IMAGE* image = jpeg_decode_coefficients(jpeg);
+    if(image == NULL)
+        return NULL;
+    bool progressive = image->marker == SOF2;
+
+    // an MCU of an interleaved scan is at most ten blocks
+    int blocks = 0;
+    for(int c = 0; c < image->num_components; c++)
+        blocks += image->components[c].h * image->components[c].v;
+    if(blocks > 10 && !progressive) {
+        printf("Unsupported JPEG sampling factors\n");
+        jpeg_image_free(image);
+        return NULL;
+    }
+
+    // a lone component is coded block by block whatever its sampling factors
+    if(image->num_components == 1) {
+        JPEG_COMPONENT* comp = image->components;
+        image->mcus_wide = (comp->width + 7) / 8;
+        image->mcus_high = (comp->height + 7) / 8;
+        comp->h = 1;
+        comp->v = 1;
+    }
+
+    // every component starts with a table pair of its own, and those of a
+    // scan are grouped into pairs once its symbols are counted
+    ENCODER enc;
+    memset(&enc, 0, sizeof(enc));
+    enc.image = image;
+    enc.grouping = true;
+    for(int c = 0; c < image->num_components; c++)
+        enc.tables[c] = (unsigned char) c;
+    enc.restart_interval = jpeg->scans[0].restart_interval;
+    int pairs = image->num_components;
+
+    // the scans are coded again only when they all share the first's restart
+    // interval, and no table they were coded with is redefined between them
+    bool recode = !tables_redefined(jpeg);
+    for(int s = 1; s < jpeg->num_scans; s++)
+        recode = recode && jpeg->scans[s].restart_interval == enc.restart_interval;
+    JPEG_SCAN_SPEC* scans = recode && progressive ? read_script(jpeg, image) : NULL;
+    recode = recode && (!progressive || scans != NULL);
+
+    // build the tables of a sequential frame from the symbol counts, with the
+    // components grouped into pairs however takes the fewest bytes, and code
+    // bands of whole restart intervals in parallel
+    uint32_t freq[2 * JPEG_MAX_COMPONENTS][256];
+    HUFF_SPEC specs[2 * JPEG_MAX_COMPONENTS];
+    const HUFF_SPEC* spec_list[2 * JPEG_MAX_COMPONENTS];
+    ENCODE_BAND* bands = NULL;
+    size_t num_bands = 0;
+    bool encoded = true;
+    if(recode && !progressive) {
+        memset(freq, 0, sizeof(freq));
+        count_symbols(&enc, freq);
+        static const int all[JPEG_MAX_COMPONENTS] = { 0, 1, 2, 3 };
+        pairs = group_tables(&enc, all, image->num_components, freq);
+        for(int t = 0; t < 2 * pairs; t++) {
+            huff_optimize(freq[t], specs + t);
+            huff_encoder_build(t % 2 == 0 ? enc.dc + t / 2 : enc.ac + t / 2, specs + t);
+            spec_list[t] = specs + t;
+        }
+        size_t num_mcus = (size_t) image->mcus_wide * image->mcus_high;
+        size_t band_mcus = num_mcus;
+        if(enc.restart_interval != 0)
+            band_mcus = (OPTIMIZE_JOB_MCUS + enc.restart_interval - 1) / enc.restart_interval *
+                            enc.restart_interval;
+        bands = split_bands(&enc, band_mcus, &num_bands);
+        encoded = bands != NULL && encode_bands(bands, num_bands, 0, encode_band);
+    }
+
+    // keep every segment but the tables and scans, which the new ones replace
+    JPEG* out = recode && encoded ? jpeg_create() : NULL;
+    bool added = out != NULL;
+    bool scanned = false;
+    for(int i = 0; i < jpeg->num_segments && added; i++) {
+        int index = jpeg->segments[i].index;
+        unsigned char marker;
+        switch(jpeg->segments[i].marker) {
+            case SOF0:
+            case SOF1:
+            case SOF2:
+                // baseline frames are limited to two pairs of tables
+                marker = jpeg->segments[i].marker;
+                if(marker == SOF0 && pairs > 2)
+                    marker = SOF1;
+                added = jpeg_read_frame(out, marker, jpeg->frames[index].data,
+                                            jpeg->frames[index].length);
+                break;
+            case DQT:
+                // tables after the first scan were moved ahead of it
+                if(!scanned)
+                    added = jpeg_read_quant_table(out, jpeg->quant_tables[index].data,
+                                                    jpeg->quant_tables[index].length);
+                break;
+            case DHT:
+                break;
+            case SOS:
+                if(scanned)
+                    break;
+                scanned = true;
+
+                // every table the scans take goes ahead of them
+                for(int j = i + 1; j < jpeg->num_segments && added; j++)
+                    if(jpeg->segments[j].marker == DQT)
+                        added = jpeg_read_quant_table(out,
+                                    jpeg->quant_tables[jpeg->segments[j].index].data,
+                                    jpeg->quant_tables[jpeg->segments[j].index].length);
+                if(progressive)
+                    added = added && encode_scans(out, &enc, scans, jpeg->num_scans, 0);
+                else
+                    added = added && add_huff_tables(out, spec_list, pairs) &&
+                            join_bands(out, &enc, bands, num_bands);
+                break;
+            case DRI:
+                // the first scan's interval holds for every scan
+                if(!scanned)
+                    added = copy_segment(out, jpeg->app_segments + index);
+                break;
+            default:
+                added = copy_segment(out, jpeg->app_segments + index);
+                break;
+        }
+    }
+
+    // as a last resort the original is kept as it is
+    bool kept = !recode || (added && file_length(out) >= file_length(jpeg));
+    if(kept || !added) {
+        jpeg_free(out);
+        out = kept ? copy_jpeg(jpeg) : NULL;
+    }
+    if(out == NULL)
+        printf("Unable to optimize JPEG\n");
+
+    free_bands(bands, num_bands);
+    free(scans);
+    jpeg_image_free(image);
+
+    return out;
+}
+
+/// @brief The jpeg_image_free function frees a decoded image.
+/// @param image The image to free.
+void jpeg_image_free(JPEG_IMAGE* image) {
+    // check if the image is null
+    if(image == NULL)
+        return;
+
+    // free the coefficients of each component
+    for(int c = 0; c < image->num_components; c++) {
+        free(image->components[c].coeffs);
+        free(image->components[c].last);
+    }
+
+    free(image);
+}
+
 /// @brief The jpeg_free function frees the memory allocated to the given jpeg.
 /// @param jpeg The jpeg to free.
 void jpeg_free(JPEG* jpeg) {
@@ -552,16 +2763,23 @@ void jpeg_free(JPEG* jpeg) {
         free(jpeg->huff_tables[i].data);
     free(jpeg->huff_tables);
 
-    // free the scans
-    for(int i = 0; i < jpeg->num_scans; i++)
-        free(jpeg->scans[i].data);
+    // free the scans and their restart offsets
+    for(int i = 0; i < jpeg->num_scans; i++) {
+        if(!jpeg->scans[i].borrowed)
+            free(jpeg->scans[i].data);
+        free(jpeg->scans[i].restarts);
+    }
     free(jpeg->scans);
 
     // free the app segments
     for(int i = 0; i < jpeg->num_app_segments; i++)
-        free(jpeg->app_segments[i].data);
+        if(!jpeg->app_segments[i].borrowed)
+            free(jpeg->app_segments[i].data);
     free(jpeg->app_segments);
 
+    // free the segment order
+    free(jpeg->segments);
+
     // free the jpeg
     free(jpeg);
 }
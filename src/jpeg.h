@@ -11,9 +11,15 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stdint.h>
+
+#include "source.h"
+#include "sink.h"
+#include "color.h"
 
 // define macros to JPEG markers
 #define START (unsigned char) 0xFF
+#define TEM (unsigned char) 0x01
 #define SOF0 (unsigned char) 0xC0
 #define SOF1 (unsigned char) 0xC1
 #define SOF2 (unsigned char) 0xC2
@@ -80,36 +86,53 @@
 
 #define MAX_DATA_LENGTH 65535
 
+/// @brief The most components a frame can have.
+#define JPEG_MAX_COMPONENTS 4
+
 /// @brief JPEG frame
 typedef struct {
-    unsigned char* data; ///< JPEG frame data
+    unsigned char marker; ///< SOFn marker of the frame
+    unsigned char* data; ///< JPEG frame data, after the length field
     int length; ///< JPEG frame length
 } FRAME;
 
 /// @brief JPEG quantization table
 typedef struct {
-    unsigned char* data; ///< JPEG quantization table data
+    unsigned char* data; ///< JPEG quantization table data, after the length field
     int length; ///< JPEG quantization table length
 } QUANT_TABLE;
 
 /// @brief JPEG Huffman table
 typedef struct {
-    unsigned char* data; ///< JPEG huffman table data
+    unsigned char* data; ///< JPEG huffman table data, after the length field
     int length; ///< JPEG huffman table length
 } HUFF_TABLE;
 
-/// @brief JPEG scan
+/// @brief JPEG scan, its header followed by its entropy-coded data
 typedef struct {
-    unsigned char* data; ///< JPEG scan data
-    int length; ///< JPEG scan length
+    unsigned char* data; ///< JPEG scan data, after the length field
+    size_t length; ///< JPEG scan length, with the entropy-coded data
+    int header_length; ///< length of the scan header at the start of the data
+    unsigned int restart_interval; ///< MCUs between restart markers, 0 for none
+    size_t* restarts; ///< offset of each RSTn marker in the data
+    size_t num_restarts; ///< number of RSTn markers in the data
+    bool borrowed; ///< whether the data points into the input source
 } SCAN;
 
-/// @brief JPEG APP segment
+/// @brief JPEG APP segment, or any other segment that is kept as it is
 typedef struct {
-    unsigned char* data; ///< JPEG app segment data
+    unsigned char marker; ///< APPn, COM, DRI or other marker of the segment
+    unsigned char* data; ///< JPEG app segment data, after the length field
     int length; ///< JPEG app segment length
+    bool borrowed; ///< whether the data points into the input source
 } APP_SEG;
 
+/// @brief Where a segment falls in the file, so it is written back in order
+typedef struct {
+    unsigned char marker; ///< marker of the segment
+    int index; ///< index of the segment in the array for its marker
+} JPEG_SEGMENT;
+
 /// @brief JPEG struct containing all JPEG data
 typedef struct {
     FRAME* frames; ///< JPEG frames
@@ -117,32 +140,123 @@ typedef struct {
     HUFF_TABLE* huff_tables; ///< JPEG huffman tables
     SCAN* scans; ///< JPEG scans
     APP_SEG* app_segments; ///< JPEG app segments
+    JPEG_SEGMENT* segments; ///< every segment above, in file order
     int num_frames; ///< number of JPEG frames
     int num_quant_tables; ///< number of JPEG quantization tables
     int num_huff_tables; ///< number of JPEG huffman tables
     int num_scans; ///< number of JPEG scans
     int num_app_segments; ///< number of JPEG app segments
+    int num_segments; ///< number of JPEG segments of any kind
 } JPEG;
 
+/// @brief Component of a decoded frame, with its quantized DCT coefficients
+typedef struct {
+    unsigned char id; ///< component identifier from the frame header
+    unsigned char h; ///< horizontal sampling factor
+    unsigned char v; ///< vertical sampling factor
+    unsigned char quant_id; ///< quantization table selector
+    unsigned int width; ///< width in samples
+    unsigned int height; ///< height in samples
+    unsigned int blocks_wide; ///< blocks in each row, padded to whole MCUs
+    unsigned int blocks_high; ///< rows of blocks, padded to whole MCUs
+    uint16_t quant[64]; ///< quantization table in natural order, as of the first scan
+    int16_t* coeffs; ///< 64 coefficients per block in natural order, blocks row by row
+    unsigned char* last; ///< one past the zigzag index of each block's last nonzero coefficient
+} JPEG_COMPONENT;
+
+/// @brief Frame of a JPEG decoded to quantized DCT coefficients
+typedef struct {
+    unsigned char marker; ///< SOFn marker of the frame
+    unsigned int width; ///< image width
+    unsigned int height; ///< image height
+    int num_components; ///< number of components
+    JPEG_COMPONENT components[JPEG_MAX_COMPONENTS]; ///< components in frame order
+    unsigned char h_max; ///< largest horizontal sampling factor
+    unsigned char v_max; ///< largest vertical sampling factor
+    unsigned int mcus_wide; ///< MCUs in each row of an interleaved scan
+    unsigned int mcus_high; ///< rows of MCUs in an interleaved scan
+} JPEG_IMAGE;
+
+/// @brief Called once the scans asked for of a progressive image are
+///        decoded, with the whole image rendered from the coefficients so far
+typedef void (*JPEG_PREVIEW_FUNC)(void* user, const unsigned char* pixels, unsigned int width,
+                                    unsigned int height, unsigned int channels, int scans);
+
+/// @brief Settings for jpeg_decode
+typedef struct {
+    COLOR_UPSAMPLE upsample; ///< how subsampled components are brought to full resolution
+    uint64_t preview_scans; ///< bit n set to preview once n + 1 scans are decoded, 0 for none
+    JPEG_PREVIEW_FUNC preview; ///< called with each preview
+    void* user; ///< passed to the preview function
+} JPEG_DECODE_OPTIONS;
+
+/// @brief Chroma resolutions jpeg_encode can store
+typedef enum {
+    JPEG_SUBSAMPLE_444, ///< chroma at full resolution
+    JPEG_SUBSAMPLE_422, ///< chroma at half the width
+    JPEG_SUBSAMPLE_420 ///< chroma at half the width and height
+} JPEG_SUBSAMPLING;
+
+/// @brief One scan of a progressive scan script
+typedef struct {
+    int num_components; ///< components in the scan, 1 for AC scans
+    int components[JPEG_MAX_COMPONENTS]; ///< index of each, 0 for luma and 1 and 2 for chroma
+    int ss; ///< first zigzag index of the spectral selection, 0 for a DC scan
+    int se; ///< last zigzag index of the spectral selection, 0 for a DC scan
+    int ah; ///< bit position of the previous scan of these coefficients, 0 for the first
+    int al; ///< bit position this scan codes down to
+} JPEG_SCAN_SPEC;
+
+/// @brief Settings for jpeg_encode
+typedef struct {
+    int quality; ///< from 1 to 100, scaling the Annex K quantization tables as libjpeg does
+    JPEG_SUBSAMPLING subsampling; ///< chroma resolution of color images
+    unsigned int restart_rows; ///< MCU rows between restart markers, coded in parallel, 0 for none
+    int threads; ///< threads the restart intervals are coded on, 0 for one per core
+    bool progressive; ///< whether to write a progressive frame with a table for each scan
+    const JPEG_SCAN_SPEC* scans; ///< the progressive scan script, NULL for libjpeg's default
+    int num_scans; ///< number of scans in the script
+} JPEG_ENCODE_OPTIONS;
+
+/// @brief The quality jpeg_encode uses without options.
+#define JPEG_DEFAULT_QUALITY 75
+
 // create function
 JPEG* jpeg_create(void);
 
 // read functions
-bool jpeg_read_frame(JPEG* jpeg, unsigned char* data, int length);
-bool jpeg_read_quant_table(JPEG* jpeg, unsigned char* data, int length);
-bool jpeg_read_huff_table(JPEG* jpeg, unsigned char* data, int length);
-bool jpeg_read_scan(JPEG* jpeg, unsigned char* data, int length);
-bool jpeg_read_app_seg(JPEG* jpeg, unsigned char* data, int length);
-bool jpeg_read(JPEG* jpeg, FILE* file);
+bool jpeg_read_frame(JPEG* jpeg, unsigned char marker, const unsigned char* data, int length);
+bool jpeg_read_quant_table(JPEG* jpeg, const unsigned char* data, int length);
+bool jpeg_read_huff_table(JPEG* jpeg, const unsigned char* data, int length);
+bool jpeg_read_scan(JPEG* jpeg, unsigned char* data, size_t length, int header_length,
+                        unsigned int restart_interval, size_t* restarts, size_t num_restarts,
+                        bool borrowed);
+bool jpeg_read_app_seg(JPEG* jpeg, unsigned char marker, unsigned char* data, int length,
+                        bool borrowed);
+bool jpeg_read(JPEG* jpeg, SOURCE* src);
 
 // write functions
-bool jpeg_write_app_seg(APP_SEG* jpeg, FILE* file, int count);
-bool jpeg_write_huff_table(HUFF_TABLE* jpeg, FILE* file);
-bool jpeg_write_frame(FRAME* jpeg, FILE* file, int count);
-bool jpeg_write_quant_table(QUANT_TABLE* jpeg, FILE* file);
-bool jpeg_write_scan(SCAN* jpeg, FILE* file);
+bool jpeg_write_app_seg(APP_SEG* jpeg, SINK* sink);
+bool jpeg_write_huff_table(HUFF_TABLE* jpeg, SINK* sink);
+bool jpeg_write_frame(FRAME* jpeg, SINK* sink);
+bool jpeg_write_quant_table(QUANT_TABLE* jpeg, SINK* sink);
+bool jpeg_write_scan(SCAN* jpeg, SINK* sink);
 bool jpeg_write(JPEG* jpeg, FILE* file);
 
+// decode functions
+JPEG_IMAGE* jpeg_decode_coefficients(JPEG* jpeg);
+void jpeg_idct_rows(JPEG_IMAGE* image, int c, unsigned int first, unsigned int count,
+                        unsigned char* out, size_t stride);
+bool jpeg_color_space(JPEG* jpeg, const JPEG_IMAGE* image, COLOR_SPACE* space);
+unsigned char* jpeg_decode(JPEG* jpeg, const JPEG_DECODE_OPTIONS* options, unsigned int* width,
+                            unsigned int* height, unsigned int* channels);
+void jpeg_image_free(JPEG_IMAGE* image);
+
+// encode functions
+JPEG* jpeg_encode(const unsigned char* pixels, unsigned int width, unsigned int height,
+                    unsigned int channels, const JPEG_ENCODE_OPTIONS* options);
+JPEG* jpeg_optimize(JPEG* jpeg);
+
 // free function
 void jpeg_free(JPEG* jpeg);
 
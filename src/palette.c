@@ -0,0 +1,266 @@
+///
+/// @file palette.c
+/// @brief PNG palette lookup and expansion implementation
+/// @author Sam Cordry
+
+#include "palette.h"
+#include "cpu.h"
+
+#ifdef CPU_X86
+#include <immintrin.h>
+#endif
+
+/// @brief The palette_pack function builds the lookup table from PLTE data.
+///        Each entry holds red in its low byte, then green, blue and alpha,
+///        which is the RGBA byte order on a little-endian machine. Entries
+///        past the end of the palette are opaque black, so an out of range
+///        index still reads a defined color.
+/// @param lut The lookup table to fill.
+/// @param rgb The palette as red, green, blue triples.
+/// @param count The number of entries, at most PALETTE_SIZE.
+void palette_pack(uint32_t lut[PALETTE_SIZE], const unsigned char* rgb, unsigned int count) {
+    for(unsigned int i = 0; i < PALETTE_SIZE; i++) {
+        if(i < count)
+            lut[i] = (uint32_t) rgb[3 * i] | ((uint32_t) rgb[3 * i + 1] << 8) |
+                        ((uint32_t) rgb[3 * i + 2] << 16) | 0xff000000u;
+        else
+            lut[i] = 0xff000000u;
+    }
+}
+
+/// @brief The palette_set_alpha function applies tRNS alpha values to the
+///        first entries of the lookup table.
+/// @param lut The lookup table to update.
+/// @param alpha The alpha of each entry.
+/// @param count The number of alpha values, at most PALETTE_SIZE.
+void palette_set_alpha(uint32_t lut[PALETTE_SIZE], const unsigned char* alpha, unsigned int count) {
+    for(unsigned int i = 0; i < count; i++)
+        lut[i] = (lut[i] & 0x00ffffffu) | ((uint32_t) alpha[i] << 24);
+}
+
+/// @brief The palette_unpack function turns the lookup table back into PLTE
+///        data.
+/// @param lut The lookup table.
+/// @param count The number of entries to write.
+/// @param rgb Where to store the red, green, blue triples.
+void palette_unpack(const uint32_t lut[PALETTE_SIZE], unsigned int count, unsigned char* rgb) {
+    for(unsigned int i = 0; i < count; i++) {
+        rgb[3 * i] = (unsigned char) lut[i];
+        rgb[3 * i + 1] = (unsigned char) (lut[i] >> 8);
+        rgb[3 * i + 2] = (unsigned char) (lut[i] >> 16);
+    }
+}
+
+/// @brief The unpack_scalar function spreads packed 1, 2 or 4-bit indices
+///        out to one byte each.
+/// @param in The packed indices, most significant bits first.
+/// @param count The number of indices.
+/// @param bit_depth The bits per index.
+/// @param idx Where to store the indices.
+static void unpack_scalar(const unsigned char* in, unsigned int count, unsigned int bit_depth,
+                            unsigned char* idx) {
+    unsigned int per_byte = 8 / bit_depth;
+    unsigned int mask = (1u << bit_depth) - 1;
+    for(unsigned int i = 0; i < count; i++) {
+        unsigned int shift = 8 - bit_depth * (i % per_byte + 1);
+        idx[i] = (unsigned char) ((in[i / per_byte] >> shift) & mask);
+    }
+}
+
+/// @brief The lookup_scalar function maps indices through the lookup table.
+/// @param lut The lookup table.
+/// @param idx The indices.
+/// @param count The number of indices.
+/// @param alpha Whether to write RGBA rather than RGB.
+/// @param out Where to store the pixels.
+static void lookup_scalar(const uint32_t* lut, const unsigned char* idx, unsigned int count,
+                            bool alpha, unsigned char* out) {
+    if(alpha) {
+        for(unsigned int i = 0; i < count; i++) {
+            uint32_t c = lut[idx[i]];
+            out[4 * i] = (unsigned char) c;
+            out[4 * i + 1] = (unsigned char) (c >> 8);
+            out[4 * i + 2] = (unsigned char) (c >> 16);
+            out[4 * i + 3] = (unsigned char) (c >> 24);
+        }
+    } else {
+        for(unsigned int i = 0; i < count; i++) {
+            uint32_t c = lut[idx[i]];
+            out[3 * i] = (unsigned char) c;
+            out[3 * i + 1] = (unsigned char) (c >> 8);
+            out[3 * i + 2] = (unsigned char) (c >> 16);
+        }
+    }
+}
+
+#ifdef CPU_X86
+/// @brief The unpack_simd function spreads packed 1, 2 or 4-bit indices out
+///        to one byte each, 16 at a time. It is inlined into each caller so
+///        that it is encoded to match the caller's instruction set.
+/// @param in The packed indices, most significant bits first.
+/// @param count The number of indices.
+/// @param bit_depth The bits per index.
+/// @param idx Where to store the indices.
+__attribute__((target("sse2")))
+static inline void unpack_simd(const unsigned char* in, unsigned int count, unsigned int bit_depth,
+                            unsigned char* idx) {
+    const __m128i ones = _mm_set1_epi8(1);
+    const __m128i bits = _mm_setr_epi8((char) 0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01,
+                                        (char) 0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01);
+    const __m128i twos = _mm_set1_epi8(3);
+    const __m128i nibble = _mm_set1_epi8(0x0f);
+    unsigned int i = 0;
+
+    for(; i + 16 <= count; i += 16) {
+        __m128i v;
+        if(bit_depth == 1) {
+            // copy each byte across eight lanes and test one bit per lane
+            uint16_t b;
+            memcpy(&b, in + i / 8, 2);
+            v = _mm_cvtsi32_si128(b);
+            v = _mm_unpacklo_epi8(v, v);
+            v = _mm_unpacklo_epi16(v, v);
+            v = _mm_unpacklo_epi32(v, v);
+            v = _mm_and_si128(_mm_cmpeq_epi8(_mm_and_si128(v, bits), bits), ones);
+        } else if(bit_depth == 2) {
+            // split out each pair of bits, then interleave them back in order
+            uint32_t b;
+            memcpy(&b, in + i / 4, 4);
+            __m128i w = _mm_cvtsi32_si128((int) b);
+            __m128i a = _mm_and_si128(_mm_srli_epi16(w, 6), twos);
+            __m128i c = _mm_and_si128(_mm_srli_epi16(w, 4), twos);
+            __m128i d = _mm_and_si128(_mm_srli_epi16(w, 2), twos);
+            __m128i e = _mm_and_si128(w, twos);
+            v = _mm_unpacklo_epi16(_mm_unpacklo_epi8(a, c), _mm_unpacklo_epi8(d, e));
+        } else {
+            // split the high and low nibbles, then interleave them
+            __m128i w = _mm_loadl_epi64((const __m128i*) (in + i / 2));
+            __m128i hi = _mm_and_si128(_mm_srli_epi16(w, 4), nibble);
+            __m128i lo = _mm_and_si128(w, nibble);
+            v = _mm_unpacklo_epi8(hi, lo);
+        }
+        _mm_storeu_si128((__m128i*) (idx + i), v);
+    }
+
+    unpack_scalar(in + i * bit_depth / 8, count - i, bit_depth, idx + i);
+}
+
+/// @brief The unpack_sse2 function spreads packed indices out with SSE2.
+/// @param in The packed indices, most significant bits first.
+/// @param count The number of indices.
+/// @param bit_depth The bits per index.
+/// @param idx Where to store the indices.
+__attribute__((target("sse2")))
+static void unpack_sse2(const unsigned char* in, unsigned int count, unsigned int bit_depth,
+                            unsigned char* idx) {
+    unpack_simd(in, count, bit_depth, idx);
+}
+
+/// @brief The unpack_avx2 function spreads packed indices out with the same
+///        kernel VEX encoded, so that mixing it with lookup_avx2 does not
+///        pay for switching between SSE and AVX.
+/// @param in The packed indices, most significant bits first.
+/// @param count The number of indices.
+/// @param bit_depth The bits per index.
+/// @param idx Where to store the indices.
+__attribute__((target("avx2")))
+static void unpack_avx2(const unsigned char* in, unsigned int count, unsigned int bit_depth,
+                            unsigned char* idx) {
+    unpack_simd(in, count, bit_depth, idx);
+}
+
+/// @brief The lookup_avx2 function maps indices through the lookup table
+///        eight at a time with a gather, packing away the alpha byte with a
+///        shuffle when writing RGB.
+/// @param lut The lookup table.
+/// @param idx The indices.
+/// @param count The number of indices.
+/// @param alpha Whether to write RGBA rather than RGB.
+/// @param out Where to store the pixels.
+__attribute__((target("avx2")))
+static void lookup_avx2(const uint32_t* lut, const unsigned char* idx, unsigned int count,
+                            bool alpha, unsigned char* out) {
+    const __m256i drop = _mm256_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1,
+                                            0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+    const __m256i join = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7);
+    const __m256i low6 = _mm256_setr_epi32(-1, -1, -1, -1, -1, -1, 0, 0);
+    unsigned int i = 0;
+
+    for(; i + 8 <= count; i += 8) {
+        __m256i v = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*) (idx + i)));
+        __m256i c = _mm256_i32gather_epi32((const int*) lut, v, 4);
+        if(alpha) {
+            _mm256_storeu_si256((__m256i*) (out + 4 * i), c);
+        } else {
+            // twelve bytes per lane, then the lanes are joined into 24
+            c = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(c, drop), join);
+            _mm256_maskstore_epi32((int*) (out + 3 * i), low6, c);
+        }
+    }
+
+    lookup_scalar(lut, idx + i, count - i, alpha, out + (alpha ? 4 : 3) * i);
+}
+#endif
+
+/// @brief The palette_expand_row_isa function expands one row of palette
+///        indices to RGB or RGBA pixels, using kernels no newer than the
+///        given instruction set.
+/// @param lut The lookup table.
+/// @param row The row of packed indices, with no filter type byte.
+/// @param width The number of pixels in the row.
+/// @param bit_depth The bits per index: 1, 2, 4 or 8.
+/// @param alpha Whether to write RGBA rather than RGB.
+/// @param out Where to store the pixels.
+/// @param isa The newest instruction set to use.
+void palette_expand_row_isa(const uint32_t lut[PALETTE_SIZE], const unsigned char* row,
+                                unsigned int width, unsigned int bit_depth, bool alpha,
+                                unsigned char* out, PALETTE_ISA isa) {
+    void (*unpack)(const unsigned char*, unsigned int, unsigned int, unsigned char*) = unpack_scalar;
+    void (*lookup)(const uint32_t*, const unsigned char*, unsigned int, bool, unsigned char*) =
+        lookup_scalar;
+#ifdef CPU_X86
+    if(isa >= PALETTE_SSE2)
+        unpack = unpack_sse2;
+    if(isa >= PALETTE_AVX2) {
+        unpack = unpack_avx2;
+        lookup = lookup_avx2;
+    }
+#else
+    (void) isa;
+#endif
+
+    // 8-bit indices are used in place, smaller ones a block at a time
+    if(bit_depth == 8) {
+        lookup(lut, row, width, alpha, out);
+        return;
+    }
+
+    unsigned char idx[PALETTE_BLOCK];
+    size_t pixel = alpha ? 4 : 3;
+    for(unsigned int x = 0; x < width; x += PALETTE_BLOCK) {
+        unsigned int count = width - x < PALETTE_BLOCK ? width - x : PALETTE_BLOCK;
+        unpack(row + (size_t) x * bit_depth / 8, count, bit_depth, idx);
+        lookup(lut, idx, count, alpha, out + x * pixel);
+    }
+}
+
+/// @brief The palette_expand_row function expands one row of palette indices
+///        to RGB or RGBA pixels with the best kernels the CPU supports.
+/// @param lut The lookup table.
+/// @param row The row of packed indices, with no filter type byte.
+/// @param width The number of pixels in the row.
+/// @param bit_depth The bits per index: 1, 2, 4 or 8.
+/// @param alpha Whether to write RGBA rather than RGB.
+/// @param out Where to store the pixels.
+void palette_expand_row(const uint32_t lut[PALETTE_SIZE], const unsigned char* row,
+                            unsigned int width, unsigned int bit_depth, bool alpha,
+                            unsigned char* out) {
+    PALETTE_ISA isa = PALETTE_SCALAR;
+#ifdef CPU_X86
+    if(cpu_has_avx2())
+        isa = PALETTE_AVX2;
+    else if(cpu_has_sse2())
+        isa = PALETTE_SSE2;
+#endif
+    palette_expand_row_isa(lut, row, width, bit_depth, alpha, out, isa);
+}
@@ -0,0 +1,42 @@
+///
+/// @file palette.h
+/// @brief PNG palette lookup and expansion header
+/// @author Sam Cordry
+
+#ifndef PALETTE_H
+#define PALETTE_H
+
+// include needed system libraries
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+/// @brief The most entries a palette can hold.
+#define PALETTE_SIZE 256
+
+/// @brief The number of pixels whose indices are unpacked at once.
+#define PALETTE_BLOCK 64
+
+/// @brief Instruction set levels the expansion kernels can be limited to
+typedef enum {
+    PALETTE_SCALAR,
+    PALETTE_SSE2,
+    PALETTE_AVX2
+} PALETTE_ISA;
+
+// lookup table functions
+void palette_pack(uint32_t lut[PALETTE_SIZE], const unsigned char* rgb, unsigned int count);
+void palette_set_alpha(uint32_t lut[PALETTE_SIZE], const unsigned char* alpha, unsigned int count);
+void palette_unpack(const uint32_t lut[PALETTE_SIZE], unsigned int count, unsigned char* rgb);
+
+// expansion functions
+void palette_expand_row_isa(const uint32_t lut[PALETTE_SIZE], const unsigned char* row,
+                                unsigned int width, unsigned int bit_depth, bool alpha,
+                                unsigned char* out, PALETTE_ISA isa);
+void palette_expand_row(const uint32_t lut[PALETTE_SIZE], const unsigned char* row,
+                            unsigned int width, unsigned int bit_depth, bool alpha,
+                            unsigned char* out);
+
+#endif
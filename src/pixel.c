@@ -0,0 +1,692 @@
+///
+/// @file pixel.c
+/// @brief PNG sample unpacking and packing implementation
+/// @author Sam Cordry
+
+#include "pixel.h"
+#include "cpu.h"
+
+#ifdef CPU_X86
+#include <immintrin.h>
+#endif
+
+/// @brief The expand_gray8 function turns gray samples into RGBA pixels.
+/// @param in The samples.
+/// @param count The number of pixels.
+/// @param out Where to store the pixels.
+static void expand_gray8(const unsigned char* in, unsigned int count, unsigned char* out) {
+    for(unsigned int i = 0; i < count; i++) {
+        out[4 * i] = out[4 * i + 1] = out[4 * i + 2] = in[i];
+        out[4 * i + 3] = 255;
+    }
+}
+
+/// @brief The expand_ga8 function turns gray and alpha samples into RGBA pixels.
+/// @param in The samples.
+/// @param count The number of pixels.
+/// @param out Where to store the pixels.
+static void expand_ga8(const unsigned char* in, unsigned int count, unsigned char* out) {
+    for(unsigned int i = 0; i < count; i++) {
+        out[4 * i] = out[4 * i + 1] = out[4 * i + 2] = in[2 * i];
+        out[4 * i + 3] = in[2 * i + 1];
+    }
+}
+
+/// @brief The expand_rgb8 function turns RGB samples into RGBA pixels.
+/// @param in The samples.
+/// @param count The number of pixels.
+/// @param out Where to store the pixels.
+static void expand_rgb8(const unsigned char* in, unsigned int count, unsigned char* out) {
+    for(unsigned int i = 0; i < count; i++) {
+        out[4 * i] = in[3 * i];
+        out[4 * i + 1] = in[3 * i + 1];
+        out[4 * i + 2] = in[3 * i + 2];
+        out[4 * i + 3] = 255;
+    }
+}
+
+/// @brief The copy_rgba8 function copies RGBA pixels as they are.
+/// @param in The samples.
+/// @param count The number of pixels.
+/// @param out Where to store the pixels.
+static void copy_rgba8(const unsigned char* in, unsigned int count, unsigned char* out) {
+    memcpy(out, in, 4 * (size_t) count);
+}
+
+/// @brief The contract_gray8 function keeps the red sample of RGBA pixels as
+///        their gray.
+/// @param in The pixels.
+/// @param count The number of pixels.
+/// @param out Where to store the samples.
+static void contract_gray8(const unsigned char* in, unsigned int count, unsigned char* out) {
+    for(unsigned int i = 0; i < count; i++)
+        out[i] = in[4 * i];
+}
+
+/// @brief The contract_ga8 function keeps the red and alpha samples of RGBA
+///        pixels as their gray and alpha.
+/// @param in The pixels.
+/// @param count The number of pixels.
+/// @param out Where to store the samples.
+static void contract_ga8(const unsigned char* in, unsigned int count, unsigned char* out) {
+    for(unsigned int i = 0; i < count; i++) {
+        out[2 * i] = in[4 * i];
+        out[2 * i + 1] = in[4 * i + 3];
+    }
+}
+
+/// @brief The contract_rgb8 function drops the alpha sample of RGBA pixels.
+/// @param in The pixels.
+/// @param count The number of pixels.
+/// @param out Where to store the samples.
+static void contract_rgb8(const unsigned char* in, unsigned int count, unsigned char* out) {
+    for(unsigned int i = 0; i < count; i++) {
+        out[3 * i] = in[4 * i];
+        out[3 * i + 1] = in[4 * i + 1];
+        out[3 * i + 2] = in[4 * i + 2];
+    }
+}
+
+/// @brief The narrow_be_scalar function keeps the high byte of big-endian
+///        16-bit samples.
+/// @param in The samples.
+/// @param count The number of samples.
+/// @param out Where to store the 8-bit samples.
+static void narrow_be_scalar(const unsigned char* in, unsigned int count, unsigned char* out) {
+    for(unsigned int i = 0; i < count; i++)
+        out[i] = in[2 * i];
+}
+
+/// @brief The narrow_host_scalar function keeps the high byte of host order
+///        16-bit samples.
+/// @param in The samples.
+/// @param count The number of samples.
+/// @param out Where to store the 8-bit samples.
+static void narrow_host_scalar(const unsigned char* in, unsigned int count, unsigned char* out) {
+    // the samples need not be aligned for 16-bit loads, so copy each one out
+    for(unsigned int i = 0; i < count; i++) {
+        uint16_t sample;
+        memcpy(&sample, in + 2 * i, sizeof(sample));
+        out[i] = (unsigned char) (sample >> 8);
+    }
+}
+
+/// @brief The swap_scalar function converts 16-bit samples between
+///        big-endian and host order.
+/// @param in The samples.
+/// @param count The number of samples.
+/// @param out Where to store the converted samples.
+static void swap_scalar(const unsigned char* in, unsigned int count, unsigned char* out) {
+    for(unsigned int i = 0; i < count; i++) {
+        uint16_t sample = (uint16_t) ((in[2 * i] << 8) | in[2 * i + 1]);
+        memcpy(out + 2 * i, &sample, sizeof(sample));
+    }
+}
+
+/// @brief The widen_scalar function scales 8-bit samples to 16 bits. Both
+///        bytes of the result are the sample, so the byte order is moot.
+/// @param in The samples.
+/// @param count The number of samples.
+/// @param out Where to store the 16-bit samples.
+static void widen_scalar(const unsigned char* in, unsigned int count, unsigned char* out) {
+    for(unsigned int i = 0; i < count; i++)
+        out[2 * i] = out[2 * i + 1] = in[i];
+}
+
+#ifdef CPU_X86
+/// @brief The expand_gray8_ssse3 function turns 16 gray samples at a time
+///        into RGBA pixels, pairing each gray with itself and with an opaque
+///        alpha through byte and word unpacks.
+/// @param in The samples.
+/// @param count The number of pixels.
+/// @param out Where to store the pixels.
+__attribute__((target("ssse3")))
+static void expand_gray8_ssse3(const unsigned char* in, unsigned int count, unsigned char* out) {
+    const __m128i opaque = _mm_set1_epi8((char) 0xff);
+    unsigned int i = 0;
+
+    for(; i + 16 <= count; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*) (in + i));
+        __m128i gg_low = _mm_unpacklo_epi8(v, v), gg_high = _mm_unpackhi_epi8(v, v);
+        __m128i ga_low = _mm_unpacklo_epi8(v, opaque), ga_high = _mm_unpackhi_epi8(v, opaque);
+        _mm_storeu_si128((__m128i*) (out + 4 * i), _mm_unpacklo_epi16(gg_low, ga_low));
+        _mm_storeu_si128((__m128i*) (out + 4 * i + 16), _mm_unpackhi_epi16(gg_low, ga_low));
+        _mm_storeu_si128((__m128i*) (out + 4 * i + 32), _mm_unpacklo_epi16(gg_high, ga_high));
+        _mm_storeu_si128((__m128i*) (out + 4 * i + 48), _mm_unpackhi_epi16(gg_high, ga_high));
+    }
+    expand_gray8(in + i, count - i, out + 4 * i);
+}
+
+/// @brief The expand_ga8_ssse3 function turns 8 gray and alpha pairs at a
+///        time into RGBA pixels.
+/// @param in The samples.
+/// @param count The number of pixels.
+/// @param out Where to store the pixels.
+__attribute__((target("ssse3")))
+static void expand_ga8_ssse3(const unsigned char* in, unsigned int count, unsigned char* out) {
+    const __m128i low = _mm_setr_epi8(0, 0, 0, 1, 2, 2, 2, 3, 4, 4, 4, 5, 6, 6, 6, 7);
+    const __m128i high = _mm_setr_epi8(8, 8, 8, 9, 10, 10, 10, 11, 12, 12, 12, 13, 14, 14, 14, 15);
+    unsigned int i = 0;
+
+    for(; i + 8 <= count; i += 8) {
+        __m128i v = _mm_loadu_si128((const __m128i*) (in + 2 * i));
+        _mm_storeu_si128((__m128i*) (out + 4 * i), _mm_shuffle_epi8(v, low));
+        _mm_storeu_si128((__m128i*) (out + 4 * i + 16), _mm_shuffle_epi8(v, high));
+    }
+    expand_ga8(in + 2 * i, count - i, out + 4 * i);
+}
+
+/// @brief The expand_rgb8_ssse3 function turns RGB samples into RGBA pixels
+///        four at a time.
+/// @param in The samples.
+/// @param count The number of pixels.
+/// @param out Where to store the pixels.
+__attribute__((target("ssse3")))
+static void expand_rgb8_ssse3(const unsigned char* in, unsigned int count, unsigned char* out) {
+    const __m128i spread = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+    const __m128i opaque = _mm_set1_epi32((int) 0xff000000u);
+    unsigned int i = 0;
+
+    // each load reads 16 bytes for 12, so stop while there is room
+    for(; i + 6 <= count; i += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i*) (in + 3 * i));
+        _mm_storeu_si128((__m128i*) (out + 4 * i), _mm_or_si128(_mm_shuffle_epi8(v, spread), opaque));
+    }
+    expand_rgb8(in + 3 * i, count - i, out + 4 * i);
+}
+
+/// @brief The contract_gray8_ssse3 function keeps the red sample of 16 RGBA
+///        pixels at a time.
+/// @param in The pixels.
+/// @param count The number of pixels.
+/// @param out Where to store the samples.
+__attribute__((target("ssse3")))
+static void contract_gray8_ssse3(const unsigned char* in, unsigned int count, unsigned char* out) {
+    const __m128i pick = _mm_setr_epi8(0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+    unsigned int i = 0;
+
+    for(; i + 16 <= count; i += 16) {
+        // gather each group's reds into its low dword, then join the dwords
+        __m128i a = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*) (in + 4 * i)), pick);
+        __m128i b = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*) (in + 4 * i + 16)), pick);
+        __m128i c = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*) (in + 4 * i + 32)), pick);
+        __m128i d = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*) (in + 4 * i + 48)), pick);
+        __m128i v = _mm_unpacklo_epi64(_mm_unpacklo_epi32(a, b), _mm_unpacklo_epi32(c, d));
+        _mm_storeu_si128((__m128i*) (out + i), v);
+    }
+    contract_gray8(in + 4 * i, count - i, out + i);
+}
+
+/// @brief The contract_ga8_ssse3 function keeps the red and alpha samples of
+///        8 RGBA pixels at a time.
+/// @param in The pixels.
+/// @param count The number of pixels.
+/// @param out Where to store the samples.
+__attribute__((target("ssse3")))
+static void contract_ga8_ssse3(const unsigned char* in, unsigned int count, unsigned char* out) {
+    const __m128i pick = _mm_setr_epi8(0, 3, 4, 7, 8, 11, 12, 15, -1, -1, -1, -1, -1, -1, -1, -1);
+    unsigned int i = 0;
+
+    for(; i + 8 <= count; i += 8) {
+        __m128i a = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*) (in + 4 * i)), pick);
+        __m128i b = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*) (in + 4 * i + 16)), pick);
+        _mm_storeu_si128((__m128i*) (out + 2 * i), _mm_unpacklo_epi64(a, b));
+    }
+    contract_ga8(in + 4 * i, count - i, out + 2 * i);
+}
+
+/// @brief The contract_rgb8_ssse3 function drops the alpha sample of RGBA
+///        pixels four at a time.
+/// @param in The pixels.
+/// @param count The number of pixels.
+/// @param out Where to store the samples.
+__attribute__((target("ssse3")))
+static void contract_rgb8_ssse3(const unsigned char* in, unsigned int count, unsigned char* out) {
+    const __m128i pick = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+    unsigned int i = 0;
+
+    // each store writes 16 bytes for 12, so stop while there is room
+    for(; i + 6 <= count; i += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i*) (in + 4 * i));
+        _mm_storeu_si128((__m128i*) (out + 3 * i), _mm_shuffle_epi8(v, pick));
+    }
+    contract_rgb8(in + 4 * i, count - i, out + 3 * i);
+}
+
+/// @brief The narrow_be_ssse3 function keeps the high byte of 16 big-endian
+///        samples at a time.
+/// @param in The samples.
+/// @param count The number of samples.
+/// @param out Where to store the 8-bit samples.
+__attribute__((target("ssse3")))
+static void narrow_be_ssse3(const unsigned char* in, unsigned int count, unsigned char* out) {
+    const __m128i pick = _mm_setr_epi8(0, 2, 4, 6, 8, 10, 12, 14, -1, -1, -1, -1, -1, -1, -1, -1);
+    unsigned int i = 0;
+
+    for(; i + 16 <= count; i += 16) {
+        __m128i a = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*) (in + 2 * i)), pick);
+        __m128i b = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*) (in + 2 * i + 16)), pick);
+        _mm_storeu_si128((__m128i*) (out + i), _mm_unpacklo_epi64(a, b));
+    }
+    narrow_be_scalar(in + 2 * i, count - i, out + i);
+}
+
+/// @brief The narrow_host_ssse3 function keeps the high byte of 16 host
+///        order samples at a time.
+/// @param in The samples.
+/// @param count The number of samples.
+/// @param out Where to store the 8-bit samples.
+__attribute__((target("ssse3")))
+static void narrow_host_ssse3(const unsigned char* in, unsigned int count, unsigned char* out) {
+    const __m128i pick = _mm_setr_epi8(1, 3, 5, 7, 9, 11, 13, 15, -1, -1, -1, -1, -1, -1, -1, -1);
+    unsigned int i = 0;
+
+    for(; i + 16 <= count; i += 16) {
+        __m128i a = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*) (in + 2 * i)), pick);
+        __m128i b = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*) (in + 2 * i + 16)), pick);
+        _mm_storeu_si128((__m128i*) (out + i), _mm_unpacklo_epi64(a, b));
+    }
+    narrow_host_scalar(in + 2 * i, count - i, out + i);
+}
+
+/// @brief The swap_ssse3 function converts 8 16-bit samples at a time
+///        between big-endian and host order.
+/// @param in The samples.
+/// @param count The number of samples.
+/// @param out Where to store the converted samples.
+__attribute__((target("ssse3")))
+static void swap_ssse3(const unsigned char* in, unsigned int count, unsigned char* out) {
+    const __m128i swap = _mm_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+    unsigned int i = 0;
+
+    for(; i + 8 <= count; i += 8) {
+        __m128i v = _mm_loadu_si128((const __m128i*) (in + 2 * i));
+        _mm_storeu_si128((__m128i*) (out + 2 * i), _mm_shuffle_epi8(v, swap));
+    }
+    swap_scalar(in + 2 * i, count - i, out + 2 * i);
+}
+
+/// @brief The widen_sse2 function scales 16 8-bit samples at a time to 16
+///        bits by pairing each byte with itself.
+/// @param in The samples.
+/// @param count The number of samples.
+/// @param out Where to store the 16-bit samples.
+__attribute__((target("sse2")))
+static void widen_sse2(const unsigned char* in, unsigned int count, unsigned char* out) {
+    unsigned int i = 0;
+
+    for(; i + 16 <= count; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*) (in + i));
+        _mm_storeu_si128((__m128i*) (out + 2 * i), _mm_unpacklo_epi8(v, v));
+        _mm_storeu_si128((__m128i*) (out + 2 * i + 16), _mm_unpackhi_epi8(v, v));
+    }
+    widen_scalar(in + i, count - i, out + 2 * i);
+}
+
+/// @brief The pack_top_bits function gathers the top bit of 16 samples.
+/// @param in The samples.
+/// @return The top bit of sample i in bit i.
+__attribute__((target("sse2")))
+static unsigned int pack_top_bits(const unsigned char* in) {
+    return (unsigned int) _mm_movemask_epi8(_mm_loadu_si128((const __m128i*) in));
+}
+#endif
+
+/// @brief The expand_wide function turns host order 16-bit samples into
+///        RGBA16 pixels.
+/// @param in The samples.
+/// @param count The number of pixels.
+/// @param channels The samples per pixel.
+/// @param out Where to store the pixels.
+static void expand_wide(const uint16_t* in, unsigned int count, unsigned int channels,
+                            uint16_t* out) {
+    for(unsigned int i = 0; i < count; i++, in += channels, out += 4) {
+        out[0] = in[0];
+        out[1] = channels >= 3 ? in[1] : in[0];
+        out[2] = channels >= 3 ? in[2] : in[0];
+        out[3] = channels == 2 ? in[1] : channels == 4 ? in[3] : 0xffff;
+    }
+}
+
+/// @brief The contract_wide function turns RGBA16 pixels into host order
+///        16-bit samples.
+/// @param in The pixels.
+/// @param count The number of pixels.
+/// @param channels The samples per pixel.
+/// @param out Where to store the samples.
+static void contract_wide(const uint16_t* in, unsigned int count, unsigned int channels,
+                            uint16_t* out) {
+    for(unsigned int i = 0; i < count; i++, in += 4, out += channels) {
+        out[0] = in[0];
+        if(channels == 2)
+            out[1] = in[3];
+        if(channels >= 3) {
+            out[1] = in[1];
+            out[2] = in[2];
+        }
+        if(channels == 4)
+            out[3] = in[3];
+    }
+}
+
+/// @brief The unpack_gray function spreads 1, 2 or 4-bit gray samples out to
+///        scaled 8-bit ones, a whole packed byte per table lookup.
+/// @param conv The converter holding the table.
+/// @param in The packed samples.
+/// @param count The number of samples.
+/// @param out Where to store the samples, with 8 bytes of slack.
+static void unpack_gray(const PIXEL_CONVERTER* conv, const unsigned char* in, unsigned int count,
+                            unsigned char* out) {
+    unsigned int per_byte = 8 / conv->bit_depth;
+    for(unsigned int i = 0; i < count; i += per_byte)
+        memcpy(out + i, &conv->gray[in[i / per_byte]], 8);
+}
+
+/// @brief The pack_bits function packs 1, 2 or 4-bit values, most
+///        significant bits first.
+/// @param in The values, one per byte.
+/// @param count The number of values.
+/// @param bit_depth The bits per value.
+/// @param out Where to store the packed values.
+static void pack_bits(const unsigned char* in, unsigned int count, unsigned int bit_depth,
+                        unsigned char* out) {
+    unsigned int per_byte = 8 / bit_depth;
+    for(unsigned int i = 0; i < count; i += per_byte) {
+        unsigned int byte = 0;
+        for(unsigned int j = 0; j < per_byte; j++)
+            byte = (byte << bit_depth) | (i + j < count ? in[i + j] : 0);
+        out[i / per_byte] = (unsigned char) byte;
+    }
+}
+
+/// @brief The reverse_bits function reverses the bits of a byte.
+/// @param b The byte.
+/// @return The byte with its bits in the opposite order.
+static unsigned char reverse_bits(unsigned int b) {
+    b = ((b & 0xf0) >> 4) | ((b & 0x0f) << 4);
+    b = ((b & 0xcc) >> 2) | ((b & 0x33) << 2);
+    b = ((b & 0xaa) >> 1) | ((b & 0x55) << 1);
+    return (unsigned char) b;
+}
+
+/// @brief The pack_gray function packs 8-bit gray samples down to 1, 2 or 4
+///        bits. With SSE2, 1-bit rows take the top bit of 16 samples with one
+///        movemask and put them in PNG order by reversing each byte.
+/// @param conv The converter.
+/// @param in The samples.
+/// @param count The number of samples.
+/// @param out Where to store the packed samples.
+static void pack_gray(const PIXEL_CONVERTER* conv, const unsigned char* in, unsigned int count,
+                        unsigned char* out) {
+    unsigned char values[PIXEL_BLOCK];
+    unsigned int shift = 8 - conv->bit_depth;
+    unsigned int i = 0;
+
+#ifdef CPU_X86
+    if(conv->bit_depth == 1 && conv->isa >= PIXEL_SSSE3) {
+        for(; i + 16 <= count; i += 16) {
+            unsigned int bits = pack_top_bits(in + i);
+            out[i / 8] = reverse_bits(bits & 0xff);
+            out[i / 8 + 1] = reverse_bits(bits >> 8);
+        }
+    }
+#endif
+    for(unsigned int j = i; j < count; j++)
+        values[j - i] = (unsigned char) (in[j] >> shift);
+    pack_bits(values, count - i, conv->bit_depth, out + i * conv->bit_depth / 8);
+}
+
+/// @brief The pixel_converter_create_isa function prepares conversion between
+///        packed rows of one bit depth and color type and a working format,
+///        using kernels no newer than the given instruction set.
+/// @param bit_depth The bits per sample of the packed rows.
+/// @param color_type The color type of the packed rows.
+/// @param format The working pixel format.
+/// @param palette The palette lookup table for color type 3, or NULL.
+/// @param palette_size The number of entries in the palette.
+/// @param isa The newest instruction set to use.
+/// @return The converter, or NULL if the depth and color type do not match or
+///         memory ran out.
+PIXEL_CONVERTER* pixel_converter_create_isa(unsigned char bit_depth, unsigned char color_type,
+                                                PIXEL_FORMAT format, const uint32_t* palette,
+                                                unsigned int palette_size, PIXEL_ISA isa) {
+    // check the pair is one the PNG specification allows
+    bool valid;
+    unsigned int channels;
+    switch(color_type) {
+        case 0: valid = bit_depth == 1 || bit_depth == 2 || bit_depth == 4 || bit_depth == 8 ||
+                        bit_depth == 16; channels = 1; break;
+        case 3: valid = (bit_depth == 1 || bit_depth == 2 || bit_depth == 4 || bit_depth == 8) &&
+                        palette != NULL; channels = 1; break;
+        case 4: valid = bit_depth == 8 || bit_depth == 16; channels = 2; break;
+        case 2: valid = bit_depth == 8 || bit_depth == 16; channels = 3; break;
+        case 6: valid = bit_depth == 8 || bit_depth == 16; channels = 4; break;
+        default: valid = false; channels = 0; break;
+    }
+    if(!valid)
+        return NULL;
+
+    PIXEL_CONVERTER* conv = malloc(sizeof(PIXEL_CONVERTER));
+    if(conv == NULL) {
+        printf("Unable to allocate memory");
+        return NULL;
+    }
+    conv->bit_depth = bit_depth;
+    conv->color_type = color_type;
+    conv->channels = channels;
+    conv->format = format;
+    conv->isa = isa;
+
+    // pick the kernels for the channel count
+    PIXEL_FUNC expands[4] = { expand_gray8, expand_ga8, expand_rgb8, copy_rgba8 };
+    PIXEL_FUNC contracts[4] = { contract_gray8, contract_ga8, contract_rgb8, copy_rgba8 };
+    conv->narrow_be = narrow_be_scalar;
+    conv->narrow_host = narrow_host_scalar;
+    conv->swap = swap_scalar;
+    conv->widen = widen_scalar;
+#ifdef CPU_X86
+    if(isa >= PIXEL_SSSE3) {
+        expands[0] = expand_gray8_ssse3;
+        expands[1] = expand_ga8_ssse3;
+        expands[2] = expand_rgb8_ssse3;
+        contracts[0] = contract_gray8_ssse3;
+        contracts[1] = contract_ga8_ssse3;
+        contracts[2] = contract_rgb8_ssse3;
+        conv->narrow_be = narrow_be_ssse3;
+        conv->narrow_host = narrow_host_ssse3;
+        conv->swap = swap_ssse3;
+        conv->widen = widen_sse2;
+    }
+#endif
+    conv->expand = expands[channels - 1];
+    conv->contract = contracts[channels - 1];
+
+    // each packed byte of low bit depth gray maps to up to 8 scaled samples
+    if(bit_depth < 8) {
+        unsigned int per_byte = 8 / bit_depth;
+        unsigned int scale = 255 / ((1u << bit_depth) - 1);
+        for(unsigned int b = 0; b < 256; b++) {
+            unsigned char samples[8] = { 0 };
+            for(unsigned int j = 0; j < per_byte; j++)
+                samples[j] = (unsigned char) (((b >> (8 - bit_depth * (j + 1))) & ((1u << bit_depth) - 1)) * scale);
+            memcpy(&conv->gray[b], samples, 8);
+        }
+    }
+
+    // map each palette color back to its first index
+    memset(conv->indices, 0xff, sizeof(conv->indices));
+    if(color_type == 3) {
+        if(palette_size > PALETTE_SIZE)
+            palette_size = PALETTE_SIZE;
+        memcpy(conv->palette, palette, sizeof(conv->palette));
+        for(unsigned int i = 0; i < palette_size; i++) {
+            uint32_t slot = (palette[i] * 2654435761u) >> 22;
+            while(conv->indices[slot] >= 0 && conv->keys[slot] != palette[i])
+                slot = (slot + 1) % PIXEL_HASH_SIZE;
+            if(conv->indices[slot] < 0) {
+                conv->keys[slot] = palette[i];
+                conv->indices[slot] = (int16_t) i;
+            }
+        }
+    }
+
+    return conv;
+}
+
+/// @brief The pixel_converter_create function prepares conversion with the
+///        best kernels the CPU supports.
+/// @param bit_depth The bits per sample of the packed rows.
+/// @param color_type The color type of the packed rows.
+/// @param format The working pixel format.
+/// @param palette The palette lookup table for color type 3, or NULL.
+/// @param palette_size The number of entries in the palette.
+/// @return The converter, or NULL if the depth and color type do not match or
+///         memory ran out.
+PIXEL_CONVERTER* pixel_converter_create(unsigned char bit_depth, unsigned char color_type,
+                                            PIXEL_FORMAT format, const uint32_t* palette,
+                                            unsigned int palette_size) {
+    PIXEL_ISA isa = PIXEL_SCALAR;
+#ifdef CPU_X86
+    if(cpu_has_ssse3())
+        isa = PIXEL_SSSE3;
+#endif
+    return pixel_converter_create_isa(bit_depth, color_type, format, palette, palette_size, isa);
+}
+
+/// @brief The pixel_converter_free function frees a converter.
+/// @param conv The converter to free.
+void pixel_converter_free(PIXEL_CONVERTER* conv) {
+    free(conv);
+}
+
+/// @brief The pixel_size function finds the size of a working format pixel.
+/// @param format The working pixel format.
+/// @return The number of bytes per pixel.
+size_t pixel_size(PIXEL_FORMAT format) {
+    return format == PIXEL_RGBA16 ? 8 : 4;
+}
+
+/// @brief The unpack_block function converts up to PIXEL_BLOCK packed pixels
+///        to the working format.
+/// @param conv The converter.
+/// @param in The packed pixels, starting on a byte boundary.
+/// @param count The number of pixels.
+/// @param out Where to store the pixels.
+static void unpack_block(const PIXEL_CONVERTER* conv, const unsigned char* in, unsigned int count,
+                            unsigned char* out) {
+    uint16_t wide[4 * PIXEL_BLOCK];
+    unsigned char narrow[4 * PIXEL_BLOCK + 8];
+    unsigned char rgba[4 * PIXEL_BLOCK];
+    unsigned char* rgba_out = conv->format == PIXEL_RGBA8 ? out : rgba;
+    const unsigned char* samples = in;
+
+    if(conv->bit_depth == 16 && conv->format == PIXEL_RGBA16) {
+        // keep all 16 bits, only the byte order changes
+        conv->swap(in, count * conv->channels, (unsigned char*) wide);
+        expand_wide(wide, count, conv->channels, (uint16_t*) out);
+        return;
+    } else if(conv->bit_depth == 16) {
+        conv->narrow_be(in, count * conv->channels, narrow);
+        samples = narrow;
+    } else if(conv->color_type == 3) {
+        palette_expand_row(conv->palette, in, count, conv->bit_depth, true, rgba_out);
+        samples = NULL;
+    } else if(conv->bit_depth < 8) {
+        unpack_gray(conv, in, count, narrow);
+        samples = narrow;
+    }
+
+    if(samples != NULL)
+        conv->expand(samples, count, rgba_out);
+    if(conv->format == PIXEL_RGBA16)
+        conv->widen(rgba, 4 * count, out);
+}
+
+/// @brief The pack_block function converts up to PIXEL_BLOCK working format
+///        pixels to packed ones.
+/// @param conv The converter.
+/// @param in The pixels.
+/// @param count The number of pixels.
+/// @param out Where to store the packed pixels, starting on a byte boundary.
+/// @return True if every pixel could be packed, false if a color is not in
+///         the palette.
+static bool pack_block(const PIXEL_CONVERTER* conv, const unsigned char* in, unsigned int count,
+                        unsigned char* out) {
+    uint16_t wide[4 * PIXEL_BLOCK];
+    unsigned char narrow[4 * PIXEL_BLOCK];
+    unsigned char rgba[4 * PIXEL_BLOCK];
+
+    if(conv->bit_depth == 16 && conv->format == PIXEL_RGBA16) {
+        contract_wide((const uint16_t*) in, count, conv->channels, wide);
+        conv->swap((const unsigned char*) wide, count * conv->channels, out);
+        return true;
+    } else if(conv->format == PIXEL_RGBA16) {
+        conv->narrow_host(in, 4 * count, rgba);
+        in = rgba;
+    }
+
+    if(conv->color_type == 3) {
+        // look every color up in the reverse palette table
+        for(unsigned int i = 0; i < count; i++) {
+            uint32_t color = (uint32_t) in[4 * i] | ((uint32_t) in[4 * i + 1] << 8) |
+                                ((uint32_t) in[4 * i + 2] << 16) | ((uint32_t) in[4 * i + 3] << 24);
+            uint32_t slot = (color * 2654435761u) >> 22;
+            while(conv->indices[slot] >= 0 && conv->keys[slot] != color)
+                slot = (slot + 1) % PIXEL_HASH_SIZE;
+            if(conv->indices[slot] < 0)
+                return false;
+            narrow[i] = (unsigned char) conv->indices[slot];
+        }
+        if(conv->bit_depth == 8)
+            memcpy(out, narrow, count);
+        else
+            pack_bits(narrow, count, conv->bit_depth, out);
+    } else if(conv->bit_depth == 16) {
+        conv->contract(in, count, narrow);
+        conv->widen(narrow, count * conv->channels, out);
+    } else if(conv->bit_depth < 8) {
+        conv->contract(in, count, narrow);
+        pack_gray(conv, narrow, count, out);
+    } else {
+        conv->contract(in, count, out);
+    }
+
+    return true;
+}
+
+/// @brief The pixel_unpack_row function converts one packed row to the
+///        working format.
+/// @param conv The converter.
+/// @param row The packed row, with no filter type byte.
+/// @param width The number of pixels in the row.
+/// @param out Where to store the pixels, pixel_size bytes each and aligned
+///        for 16-bit samples.
+void pixel_unpack_row(const PIXEL_CONVERTER* conv, const unsigned char* row, unsigned int width,
+                        void* out) {
+    size_t bits = (size_t) conv->channels * conv->bit_depth;
+    size_t size = pixel_size(conv->format);
+    for(unsigned int x = 0; x < width; x += PIXEL_BLOCK) {
+        unsigned int count = width - x < PIXEL_BLOCK ? width - x : PIXEL_BLOCK;
+        unpack_block(conv, row + x * bits / 8, count, (unsigned char*) out + x * size);
+    }
+}
+
+/// @brief The pixel_pack_row function converts one row of working format
+///        pixels to a packed row. Any unused bits of the last byte are zero.
+/// @param conv The converter.
+/// @param in The pixels, pixel_size bytes each and aligned for 16-bit samples.
+/// @param width The number of pixels in the row.
+/// @param row Where to store the packed row.
+/// @return True if the row was packed, false if a color is not in the palette.
+bool pixel_pack_row(const PIXEL_CONVERTER* conv, const void* in, unsigned int width,
+                        unsigned char* row) {
+    size_t bits = (size_t) conv->channels * conv->bit_depth;
+    size_t size = pixel_size(conv->format);
+    for(unsigned int x = 0; x < width; x += PIXEL_BLOCK) {
+        unsigned int count = width - x < PIXEL_BLOCK ? width - x : PIXEL_BLOCK;
+        if(!pack_block(conv, (const unsigned char*) in + x * size, count, row + x * bits / 8))
+            return false;
+    }
+
+    return true;
+}
@@ -0,0 +1,76 @@
+///
+/// @file pixel.h
+/// @brief PNG sample unpacking and packing header
+/// @author Sam Cordry
+
+#ifndef PIXEL_H
+#define PIXEL_H
+
+// include needed system libraries
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "palette.h"
+
+/// @brief The number of pixels converted through the scratch buffers at once.
+#define PIXEL_BLOCK 64
+
+/// @brief The number of slots in the table that maps colors back to palette
+///        indices.
+#define PIXEL_HASH_SIZE 1024
+
+/// @brief Working pixel formats the packed samples are converted to and from
+typedef enum {
+    PIXEL_RGBA8, ///< four 8-bit samples per pixel
+    PIXEL_RGBA16 ///< four 16-bit samples per pixel, in host byte order
+} PIXEL_FORMAT;
+
+/// @brief Instruction set levels the conversion kernels can be limited to
+typedef enum {
+    PIXEL_SCALAR,
+    PIXEL_SSSE3
+} PIXEL_ISA;
+
+/// @brief Converts pixels or samples between two layouts
+typedef void (*PIXEL_FUNC)(const unsigned char* in, unsigned int count, unsigned char* out);
+
+/// @brief Conversion between one IHDR bit depth and color type and a working
+///        format, with its kernels and tables chosen up front
+typedef struct {
+    unsigned char bit_depth; ///< bits per sample in the packed rows
+    unsigned char color_type; ///< color type of the packed rows
+    unsigned int channels; ///< samples per packed pixel
+    PIXEL_FORMAT format; ///< working pixel format
+    PIXEL_ISA isa; ///< newest instruction set the kernels use
+    PIXEL_FUNC expand; ///< 8-bit samples to RGBA8 pixels
+    PIXEL_FUNC contract; ///< RGBA8 pixels to 8-bit samples
+    PIXEL_FUNC narrow_be; ///< big-endian 16-bit samples to their high bytes
+    PIXEL_FUNC narrow_host; ///< host order 16-bit samples to their high bytes
+    PIXEL_FUNC swap; ///< 16-bit samples between big-endian and host order
+    PIXEL_FUNC widen; ///< 8-bit samples to 16-bit samples, either byte order
+    uint64_t gray[256]; ///< scaled 8-bit grays of each packed byte of 1, 2 or 4-bit gray
+    uint32_t palette[PALETTE_SIZE]; ///< palette lookup table, see palette_pack
+    uint32_t keys[PIXEL_HASH_SIZE]; ///< colors in the reverse palette table
+    int16_t indices[PIXEL_HASH_SIZE]; ///< palette index of each key, -1 if empty
+} PIXEL_CONVERTER;
+
+// converter functions
+PIXEL_CONVERTER* pixel_converter_create_isa(unsigned char bit_depth, unsigned char color_type,
+                                                PIXEL_FORMAT format, const uint32_t* palette,
+                                                unsigned int palette_size, PIXEL_ISA isa);
+PIXEL_CONVERTER* pixel_converter_create(unsigned char bit_depth, unsigned char color_type,
+                                            PIXEL_FORMAT format, const uint32_t* palette,
+                                            unsigned int palette_size);
+void pixel_converter_free(PIXEL_CONVERTER* conv);
+
+// row functions
+size_t pixel_size(PIXEL_FORMAT format);
+void pixel_unpack_row(const PIXEL_CONVERTER* conv, const unsigned char* row, unsigned int width,
+                        void* out);
+bool pixel_pack_row(const PIXEL_CONVERTER* conv, const void* in, unsigned int width,
+                        unsigned char* row);
+
+#endif
@@ -6,15 +6,64 @@
 // include PNG and CRC headers
 #include "png.h"
 #include "crc.h"
+#include "pool.h"
+#include "inflate.h"
+#include "filter.h"
+#include "deflate.h"
+#include "adler.h"
 
 /// @brief The MEM_CHECK macro checks if the given pointer is NULL.
 #define MEM_CHECK(ptr) if(ptr == NULL) { printf("Unable to allocate memory");\
                                             return false; }
 
-/// @brief The FEOF_CHECK macro checks if the end of the file has been reached.
-#define FEOF_CHECK(file) if(feof(file)) { printf("Unexpected end of file");\
+/// @brief The READ_CHECK macro checks if a read from the source succeeded.
+#define READ_CHECK(ok) if(!(ok)) { printf("Unexpected end of file");\
                                             return false; }
 
+/// @brief The largest piece of IDAT data checksummed by a single pool job.
+#define IDAT_CRC_SLICE (1 << 20)
+
+/// @brief The total IDAT size below which CRCs are checked on one thread.
+#define IDAT_CRC_PARALLEL (4 << 20)
+
+// Adam7 pass origins and spacings
+static const unsigned int adam7_start_x[7] = { 0, 4, 0, 2, 0, 1, 0 };
+static const unsigned int adam7_start_y[7] = { 0, 0, 4, 0, 2, 0, 1 };
+static const unsigned int adam7_step_x[7] = { 8, 8, 4, 4, 2, 2, 1 };
+static const unsigned int adam7_step_y[7] = { 8, 8, 8, 4, 4, 2, 2 };
+
+// the block each known pixel covers once a pass is done
+static const unsigned int adam7_block_x[7] = { 8, 4, 4, 2, 2, 1, 1 };
+static const unsigned int adam7_block_y[7] = { 8, 8, 4, 4, 2, 2, 1 };
+
+/// @brief A piece of one IDAT chunk and its finished CRC
+typedef struct {
+    const unsigned char* data;
+    size_t length;
+    unsigned long crc;
+} CRC_SLICE;
+
+/// @brief A run of consecutive slices checksummed by one pool job
+typedef struct {
+    CRC_SLICE* slices;
+    unsigned int count;
+} CRC_JOB;
+
+/// @brief One indexed segment of the image data, decoded by one pool job
+typedef struct {
+    const INFLATE_SEGMENT* input; ///< every IDAT chunk
+    unsigned int num_input; ///< number of IDAT chunks
+    size_t offset; ///< where the segment starts in the zlib stream
+    unsigned char* scanlines; ///< where the segment's rows go
+    unsigned int height; ///< number of rows in the segment
+    size_t row_bytes; ///< length of a row, without its filter type byte
+    unsigned int bpp; ///< bytes per pixel for the filters
+    bool last; ///< whether the segment ends the stream
+    bool decoded; ///< set when the segment decoded and unfiltered cleanly
+    unsigned long adler; ///< Adler-32 of the segment's filtered rows
+    unsigned long trailer; ///< the stream's checksum, read by the last segment
+} DECODE_JOB;
+
 /// @brief The is_png_header function checks if the string is a PNG header.
 /// @param header The header to check.
 /// @return True if the header is a PNG header, false otherwise.
@@ -55,6 +104,46 @@ bool is_iend_header(const char* header) {
                 memcmp(header, IEND_HEADER, 4) != 0);
 }
 
+/// @brief The is_trns_header function checks if the string is a tRNS header.
+/// @param header The header to check.
+/// @return True if the header is a tRNS header, false otherwise.
+bool is_trns_header(const char* header) {
+    return !(header == NULL || strlen(header) != 4 ||
+                memcmp(header, TRNS_HEADER, 4) != 0);
+}
+
+/// @brief The is_ffix_header function checks if the string is an ffIX header.
+/// @param header The header to check.
+/// @return True if the header is an ffIX header, false otherwise.
+bool is_ffix_header(const char* header) {
+    return !(header == NULL || strlen(header) != 4 ||
+                memcmp(header, FFIX_HEADER, 4) != 0);
+}
+
+/// @brief The is_actl_header function checks if the string is an acTL header.
+/// @param header The header to check.
+/// @return True if the header is an acTL header, false otherwise.
+bool is_actl_header(const char* header) {
+    return !(header == NULL || strlen(header) != 4 ||
+                memcmp(header, ACTL_HEADER, 4) != 0);
+}
+
+/// @brief The is_fctl_header function checks if the string is an fcTL header.
+/// @param header The header to check.
+/// @return True if the header is an fcTL header, false otherwise.
+bool is_fctl_header(const char* header) {
+    return !(header == NULL || strlen(header) != 4 ||
+                memcmp(header, FCTL_HEADER, 4) != 0);
+}
+
+/// @brief The is_fdat_header function checks if the string is an fdAT header.
+/// @param header The header to check.
+/// @return True if the header is an fdAT header, false otherwise.
+bool is_fdat_header(const char* header) {
+    return !(header == NULL || strlen(header) != 4 ||
+                memcmp(header, FDAT_HEADER, 4) != 0);
+}
+
 /// @brief The png_create function creates a PNG struct.
 /// @return A pointer to the PNG struct.
 PNG* png_create(void) {
@@ -68,53 +157,66 @@ PNG* png_create(void) {
     // initialize the PNG struct
     png->ihdr = NULL;
     png->plte = NULL;
+    png->ffix = NULL;
     png->idat = NULL;
     png->iend = NULL;
     png->num_idat_chunks = 0;
+    png->actl = NULL;
+    png->frames = NULL;
+    png->num_frames = 0;
+    png->fdat = NULL;
+    png->num_fdat_chunks = 0;
+    png->sequence = 0;
 
     // return the PNG struct
     return png;
 }
 
-/// @brief The png_destroy function destroys a PNG struct.
-/// @param png The PNG struct to destroy.
-/// @param file The file to close.
-/// @param length The length of the IDAT chunk.
-/// @return True if the PNG struct was destroyed, false otherwise.
-bool read_ihdr(PNG* png, FILE* file, int length) {
+/// @brief The get_u32 function decodes a big-endian 32-bit value.
+/// @param data The bytes to decode.
+/// @return The decoded value.
+static uint32_t get_u32(const unsigned char* data) {
+    return ((uint32_t) data[0] << 24) | ((uint32_t) data[1] << 16) |
+            ((uint32_t) data[2] << 8) | (uint32_t) data[3];
+}
+
+/// @brief The is_crc_valid function checks a chunk against its stored CRC.
+/// @param type The chunk type, which seeds the CRC.
+/// @param data The chunk data.
+/// @param length The length of the chunk data.
+/// @param stored The big-endian CRC read from the file.
+/// @return True if the CRC matches, false otherwise.
+static bool is_crc_valid(const char* type, const unsigned char* data,
+                            size_t length, const unsigned char* stored) {
+    unsigned long calc_crc = crc_update(0xffffffffL, (const unsigned char*) type, 4);
+    calc_crc = crc_update(calc_crc, data, length) ^ 0xffffffffL;
+
+    return calc_crc == get_u32(stored);
+}
+
+/// @brief The read_ihdr function reads an IHDR chunk.
+/// @param png The PNG struct to read into.
+/// @param src The source to read from.
+/// @param length The length of the IHDR chunk.
+/// @return True if the IHDR chunk was read, false otherwise.
+bool read_ihdr(PNG* png, SOURCE* src, int length) {
     // check if the length is valid
     if(length != 13) {
         printf("Invalid IHDR chunk length");
         return false;
     }
 
+    // read the chunk data and its CRC in one go
+    const unsigned char* data = source_read(src, 17);
+    READ_CHECK(data);
+
     // allocate memory for the IHDR struct
     png->ihdr = malloc(sizeof(IHDR));
     MEM_CHECK(png->ihdr);
 
-    // allocate memory for data to verify checksum
-    unsigned char* data = malloc(17);
-    memcpy(data, IHDR_HEADER, 4);
-
-    // read the width
-    int i;
-    char c;
-    png->ihdr->width = 0;
-    for(i = 0; i < 4; i++) {
-        c = fgetc(file);
-        png->ihdr->width = png->ihdr->width | (c << (8 * (3 - i)));
-        memcpy(data + 4 + i, &c, 1);
-        FEOF_CHECK(file);
-    }
-
-    // read the height
-    png->ihdr->height = 0;
-    for(i = 0; i < 4; i++) {
-        c = fgetc(file);
-        png->ihdr->height = png->ihdr->height | (c << (8 * (3 - i)));
-        memcpy(data + 8 + i, &c, 1);
-        FEOF_CHECK(file);
-    }
+    // read the width and height
+    png->ihdr->width = get_u32(data);
+    png->ihdr->height = get_u32(data + 4);
 
     // check if the width and height are valid
     if(png->ihdr->width == 0 || png->ihdr->height == 0 ||
@@ -122,14 +224,10 @@ bool read_ihdr(PNG* png, FILE* file, int length) {
         printf("Invalid image dimensions");
         return false;
     }
-    
-    // read the bit depth
-    png->ihdr->bit_depth = fgetc(file);
-    FEOF_CHECK(file);
-    
-    // read the color type
-    png->ihdr->color_type = fgetc(file);
-    FEOF_CHECK(file);
+
+    // read the bit depth and color type
+    png->ihdr->bit_depth = data[8];
+    png->ihdr->color_type = data[9];
 
     // check if the bit depth and color type are a valid combination
     if((png->ihdr->color_type == 0 && png->ihdr->bit_depth != 1 &&
@@ -145,131 +243,167 @@ bool read_ihdr(PNG* png, FILE* file, int length) {
         printf("Invalid bit depth and color type combination");
         return false;
     }
-    
-    // read the compression method
-    png->ihdr->compression_method = fgetc(file);
-    FEOF_CHECK(file);
 
-    // check if the compression method is valid
+    // read and check the compression method
+    png->ihdr->compression_method = data[10];
     if(png->ihdr->compression_method != 0) {
         printf("Invalid compression method");
         return false;
     }
-    
-    // read the filter method
-    png->ihdr->filter_method = fgetc(file);
-    FEOF_CHECK(file);
 
-    // check if the filter method is valid
+    // read and check the filter method
+    png->ihdr->filter_method = data[11];
     if(png->ihdr->filter_method != 0) {
         printf("Invalid filter method");
         return false;
     }
-    
-    // read the interlace method
-    png->ihdr->interlace_method = fgetc(file);
-    FEOF_CHECK(file);
 
-    // check if the interlace method is valid
+    // read and check the interlace method
+    png->ihdr->interlace_method = data[12];
     if(png->ihdr->interlace_method > 1) {
         printf("Invalid interlace method");
         return false;
     }
 
     // read the CRC
-    for(int i = 0; i < 4; i++) {
-        png->ihdr->crc[i] = fgetc(file);
-        FEOF_CHECK(file);
-    }
+    memcpy(png->ihdr->crc, data + 13, 4);
     png->ihdr->crc[4] = '\0';
 
-    // fill in the rest of the data for the chunk
-    memcpy(data + 12, &(png->ihdr->bit_depth), 1);
-    memcpy(data + 13, &(png->ihdr->color_type), 1);
-    memcpy(data + 14, &(png->ihdr->compression_method), 1);
-    memcpy(data + 15, &(png->ihdr->filter_method), 1);
-    memcpy(data + 16, &(png->ihdr->interlace_method), 1);
-
-    // calculate the expected checksum
-    unsigned long calc_crc = crc(data, 17);
-    unsigned char* crc = (unsigned char*) &calc_crc;
-
     // validate the read checksum against expected checksum
-    for(int i = 0; i < 4; i++) {
-        if(png->ihdr->crc[i] != crc[3 - i]) {
-            printf("Invalid PNG: Failed CRC Check\n");
-            return false;
-        }
+    if(!is_crc_valid(IHDR_HEADER, data, 13, data + 13)) {
+        printf("Invalid PNG: Failed CRC Check\n");
+        return false;
     }
 
     return true;
 }
 
-/// @brief The read_plte function reads a PLTE chunk.
+/// @brief The read_plte function reads a PLTE chunk into a lookup table.
 /// @param png The PNG struct to read the PLTE chunk into.
-/// @param file The file to read the PLTE chunk from.
+/// @param src The source to read the PLTE chunk from.
 /// @param length The length of the PLTE chunk.
 /// @return True if the PLTE chunk was read, false otherwise.
-bool read_plte(PNG* png, FILE* file, int length) {
-    // check if the length is valid
-    if(length != 3) {
+bool read_plte(PNG* png, SOURCE* src, int length) {
+    // check if the length is valid, and fits the bit depth of a palette image
+    unsigned int count = (unsigned int) length / 3;
+    bool indexed = png->ihdr != NULL && png->ihdr->color_type == 3;
+    if(length % 3 != 0 || count == 0 || count > PALETTE_SIZE ||
+            (indexed && count > (1u << png->ihdr->bit_depth)) || png->plte != NULL) {
         printf("Invalid PLTE chunk length\n");
         return false;
     }
 
+    // read the chunk data and its CRC in one go
+    const unsigned char* data = source_read(src, (size_t) length + 4);
+    READ_CHECK(data);
+
     // allocate memory for the PLTE struct
     png->plte = malloc(sizeof(PLTE));
     MEM_CHECK(png->plte);
 
-    // read the red value
-    png->plte->red = fgetc(file);
-    FEOF_CHECK(file);
+    // pack the palette entries
+    palette_pack(png->plte->entries, data, count);
+    png->plte->num_entries = count;
+    png->plte->num_alpha = 0;
 
-    // read the green value
-    png->plte->green = fgetc(file);
-    FEOF_CHECK(file);
+    // read the CRC
+    memcpy(png->plte->crc, data + length, 4);
+    png->plte->crc[4] = '\0';
 
-    // read the blue value
-    png->plte->blue = fgetc(file);
-    FEOF_CHECK(file);
+    // validate the read checksum against the calculated one
+    if(!is_crc_valid(PLTE_HEADER, data, length, data + length)) {
+        printf("Invalid PNG: Failed CRC Check\n");
+        return false;
+    }
 
-    // read the CRC
-    for(int i = 0; i < 4; i++) {
-        png->plte->crc[i] = fgetc(file);
-        FEOF_CHECK(file);
+    return true;
+}
+
+/// @brief The read_trns function reads a tRNS chunk. For a palette image the
+///        alpha values go into the palette's lookup table; the color keys of
+///        other images are not kept.
+/// @param png The PNG struct to read the tRNS chunk into.
+/// @param src The source to read the tRNS chunk from.
+/// @param length The length of the tRNS chunk.
+/// @return True if the tRNS chunk was read, false otherwise.
+bool read_trns(PNG* png, SOURCE* src, int length) {
+    // read the chunk data and its CRC in one go
+    const unsigned char* data = source_read(src, (size_t) length + 4);
+    READ_CHECK(data);
+
+    // validate the read checksum against the calculated one
+    if(!is_crc_valid(TRNS_HEADER, data, length, data + length)) {
+        printf("Invalid PNG: Failed CRC Check\n");
+        return false;
     }
-    png->plte->crc[4] = '\0';
 
-    // allocate memory for data to calculate checksum
-    unsigned char* data = malloc(7);
+    if(png->ihdr == NULL || png->ihdr->color_type != 3)
+        return true;
 
-    // copy needed data
-    memcpy(data, PLTE_HEADER, 4);
-    memcpy(data + 4, &(png->plte->red), 1);
-    memcpy(data + 5, &(png->plte->green), 1);
-    memcpy(data + 6, &(png->plte->blue), 1);
+    // a palette image needs its palette first, and no more alphas than colors
+    if(png->plte == NULL || (unsigned int) length > png->plte->num_entries) {
+        printf("Invalid tRNS chunk\n");
+        return false;
+    }
+    palette_set_alpha(png->plte->entries, data, (unsigned int) length);
+    png->plte->num_alpha = (unsigned int) length;
 
-    // calculate expected checksum
-    unsigned long calc_crc = crc(data, 7);
-    unsigned char* crc = (unsigned char*) &calc_crc;
+    return true;
+}
+
+/// @brief The read_ffix function reads an ffIX chunk. An index that is laid
+///        out wrongly is skipped, since the image decodes without it.
+/// @param png The PNG struct to read the ffIX chunk into.
+/// @param src The source to read the ffIX chunk from.
+/// @param length The length of the ffIX chunk.
+/// @return True if the ffIX chunk was read or skipped, false otherwise.
+bool read_ffix(PNG* png, SOURCE* src, int length) {
+    // read the chunk data and its CRC in one go
+    const unsigned char* data = source_read(src, (size_t) length + 4);
+    READ_CHECK(data);
 
     // validate the read checksum against the calculated one
-    for(int i = 0; i < 4; i++) {
-        if(png->plte->crc[i] != crc[3 - i]) {
-            printf("Invalid PNG: Failed CRC Check\n");
-            return false;
-        }
+    if(!is_crc_valid(FFIX_HEADER, data, length, data + length)) {
+        printf("Invalid PNG: Failed CRC Check\n");
+        return false;
     }
 
+    // a row count and at least one offset are needed
+    if(length < 8 || length % 4 != 0 || png->ffix != NULL || get_u32(data) == 0)
+        return true;
+
+    // allocate memory for the ffIX struct
+    png->ffix = malloc(sizeof(FFIX));
+    MEM_CHECK(png->ffix);
+    png->ffix->rows = get_u32(data);
+    png->ffix->count = (unsigned int) (length / 4 - 1);
+    png->ffix->offsets = malloc(sizeof(uint32_t) * png->ffix->count);
+    MEM_CHECK(png->ffix->offsets);
+
+    // read the offsets
+    for(unsigned int i = 0; i < png->ffix->count; i++)
+        png->ffix->offsets[i] = get_u32(data + 4 * (i + 1));
+
     return true;
 }
 
-/// @brief The read_idat function reads an IDAT chunk.
+/// @brief The read_idat function reads an IDAT chunk. Its CRC is checked
+///        later by png_verify_idat so that all chunks can be checked at once.
+///        When the source is mapped the data points straight into it.
 /// @param png The PNG struct to read into.
-/// @param file The file to read from.
+/// @param src The source to read from.
 /// @param length The length of the IDAT chunk.
 /// @return True if the IDAT chunk was read, false otherwise.
-bool read_idat(PNG* png, FILE* file, int length) {
+bool read_idat(PNG* png, SOURCE* src, int length) {
+    // make sure the whole chunk is there before taking anything from it
+    READ_CHECK(source_ensure(src, (size_t) length + 4));
+
+    // the image data cannot come after an animation frame of its own
+    if(png->num_frames > 0 && !png->frames[png->num_frames - 1].default_image) {
+        printf("Invalid PNG: IDAT chunk after an fdAT frame\n");
+        return false;
+    }
+
     // increment the number of IDAT chunks and allocate memory appropriately
     if(png->num_idat_chunks == 0) {
         png->num_idat_chunks = 1;
@@ -279,67 +413,310 @@ bool read_idat(PNG* png, FILE* file, int length) {
         png->idat = realloc(png->idat, png->num_idat_chunks* sizeof(IDAT));
     }
     MEM_CHECK(png->idat);
-
-    // allocate memory for the IDAT struct
-    png->idat[png->num_idat_chunks - 1].data = malloc(length);
-    MEM_CHECK(png->idat->data);
+    IDAT* idat = png->idat + png->num_idat_chunks - 1;
 
     // set the length of the IDAT chunk
-    png->idat[png->num_idat_chunks - 1].length = length;
+    idat->length = length;
 
-    // read the data
-    for(int i = 0; i < length; i++) {
-        png->idat->data[i] = fgetc(file);
-        FEOF_CHECK(file);
-    }
+    // take the data, in place if the source allows it
+    idat->data = source_payload(src, length, &idat->borrowed);
+    MEM_CHECK(idat->data);
 
     // read the CRC
-    for(int i = 0; i < 4; i++) {
-        png->idat->crc[i] = fgetc(file);
-        FEOF_CHECK(file);
+    memcpy(idat->crc, source_read(src, 4), 4);
+    idat->crc[4] = '\0';
+
+    return true;
+}
+
+/// @brief The read_actl function reads an acTL chunk, which makes the image
+///        an animation.
+/// @param png The PNG struct to read into.
+/// @param src The source to read from.
+/// @param length The length of the acTL chunk.
+/// @return True if the acTL chunk was read, false otherwise.
+bool read_actl(PNG* png, SOURCE* src, int length) {
+    // read the chunk data and its CRC in one go
+    const unsigned char* data = source_read(src, (size_t) length + 4);
+    READ_CHECK(data);
+
+    // validate the read checksum against the calculated one
+    if(!is_crc_valid(ACTL_HEADER, data, length, data + length)) {
+        printf("Invalid PNG: Failed CRC Check\n");
+        return false;
     }
-    png->idat->crc[4] = '\0';
 
-    // allocate memory for the data to calculate checksum
-    unsigned char* data = malloc(length + 4);
+    // there is one, before the image data, with at least one frame
+    if(length != 8 || png->actl != NULL || png->num_idat_chunks > 0 || get_u32(data) == 0) {
+        printf("Invalid acTL chunk\n");
+        return false;
+    }
 
-    // copy necessary data for checksum calculation
-    memcpy(data, &IDAT_HEADER, 4);
-    memcpy(data + 4, png->idat->data, length);
+    png->actl = malloc(sizeof(ACTL));
+    MEM_CHECK(png->actl);
+    png->actl->num_frames = get_u32(data);
+    png->actl->num_plays = get_u32(data + 4);
+    memcpy(png->actl->crc, data + length, 4);
+    png->actl->crc[4] = '\0';
 
-    // calculate checksum and read it as characters
-    unsigned long calc_crc = crc(data, length + 4);
-    unsigned char* crc = (unsigned char*) &calc_crc;
+    return true;
+}
 
-    // validate read checksum against expected checksum
-    for(int i = 0; i < 4; i++) {
-        if(png->idat->crc[i] != crc[3 - i]) {
+/// @brief The read_fctl function reads an fcTL chunk, which starts a frame.
+///        Without an acTL chunk the image is not an animation, so the chunk
+///        is skipped.
+/// @param png The PNG struct to read into.
+/// @param src The source to read from.
+/// @param length The length of the fcTL chunk.
+/// @return True if the fcTL chunk was read or skipped, false otherwise.
+bool read_fctl(PNG* png, SOURCE* src, int length) {
+    // read the chunk data and its CRC in one go
+    const unsigned char* data = source_read(src, (size_t) length + 4);
+    READ_CHECK(data);
+
+    // validate the read checksum against the calculated one
+    if(!is_crc_valid(FCTL_HEADER, data, length, data + length)) {
+        printf("Invalid PNG: Failed CRC Check\n");
+        return false;
+    }
+
+    if(png->actl == NULL)
+        return true;
+    if(length != 26 || png->ihdr == NULL || get_u32(data) != png->sequence ||
+            png->num_frames == png->actl->num_frames ||
+            (png->num_frames > 0 && !png->frames[png->num_frames - 1].default_image &&
+                png->frames[png->num_frames - 1].num_chunks == 0)) {
+        printf("Invalid fcTL chunk\n");
+        return false;
+    }
+    png->sequence++;
+
+    FCTL fctl;
+    fctl.width = get_u32(data + 4);
+    fctl.height = get_u32(data + 8);
+    fctl.x_offset = get_u32(data + 12);
+    fctl.y_offset = get_u32(data + 16);
+    fctl.delay_num = (uint16_t) ((data[20] << 8) | data[21]);
+    fctl.delay_den = (uint16_t) ((data[22] << 8) | data[23]);
+    fctl.dispose_op = data[24];
+    fctl.blend_op = data[25];
+    fctl.default_image = png->num_idat_chunks == 0;
+    fctl.first_chunk = png->num_fdat_chunks;
+    fctl.num_chunks = 0;
+
+    // the frame has to fit on the canvas, and a frame shown from the IDAT
+    // chunks has to cover all of it
+    if(fctl.width == 0 || fctl.height == 0 ||
+            (uint64_t) fctl.x_offset + fctl.width > png->ihdr->width ||
+            (uint64_t) fctl.y_offset + fctl.height > png->ihdr->height ||
+            fctl.dispose_op > FCTL_DISPOSE_PREVIOUS || fctl.blend_op > FCTL_BLEND_OVER ||
+            (fctl.default_image && (fctl.x_offset != 0 || fctl.y_offset != 0 ||
+                fctl.width != png->ihdr->width || fctl.height != png->ihdr->height))) {
+        printf("Invalid fcTL chunk\n");
+        return false;
+    }
+
+    png->frames = realloc(png->frames, sizeof(FCTL) * (png->num_frames + 1));
+    MEM_CHECK(png->frames);
+    png->frames[png->num_frames++] = fctl;
+
+    return true;
+}
+
+/// @brief The read_fdat function reads an fdAT chunk, which holds image data
+///        for the latest frame. Like IDAT, its CRC is checked later by
+///        png_verify_idat and its data may point straight into the source.
+/// @param png The PNG struct to read into.
+/// @param src The source to read from.
+/// @param length The length of the fdAT chunk.
+/// @return True if the fdAT chunk was read or skipped, false otherwise.
+bool read_fdat(PNG* png, SOURCE* src, int length) {
+    // make sure the whole chunk is there before taking anything from it
+    READ_CHECK(source_ensure(src, (size_t) length + 4));
+
+    if(png->actl == NULL) {
+        READ_CHECK(source_skip(src, (size_t) length + 4));
+        return true;
+    }
+
+    // take the data, in place if the source allows it, keeping the sequence
+    // number with it since the CRC covers both
+    bool borrowed;
+    unsigned char* data = source_payload(src, length, &borrowed);
+    MEM_CHECK(data);
+    const unsigned char* crc = source_read(src, 4);
+
+    // it belongs to a frame of its own, in sequence
+    if(length < 4 || png->num_frames == 0 || png->frames[png->num_frames - 1].default_image ||
+            get_u32(data) != png->sequence) {
+        printf("Invalid fdAT chunk\n");
+        if(!borrowed)
+            free(data);
+        return false;
+    }
+    png->sequence++;
+
+    IDAT* fdat = realloc(png->fdat, sizeof(IDAT) * (png->num_fdat_chunks + 1));
+    if(fdat == NULL && !borrowed)
+        free(data);
+    MEM_CHECK(fdat);
+    png->fdat = fdat;
+    fdat += png->num_fdat_chunks++;
+    png->frames[png->num_frames - 1].num_chunks++;
+    fdat->data = data;
+    fdat->length = length;
+    fdat->borrowed = borrowed;
+    memcpy(fdat->crc, crc, 4);
+    fdat->crc[4] = '\0';
+
+    return true;
+}
+
+/// @brief The crc_job function computes the CRC of every slice in a job.
+/// @param arg The CRC_JOB to run.
+static void crc_job(void* arg) {
+    CRC_JOB* job = arg;
+    for(unsigned int i = 0; i < job->count; i++)
+        job->slices[i].crc = crc_update(0xffffffffL, job->slices[i].data,
+                                        job->slices[i].length) ^ 0xffffffffL;
+}
+
+/// @brief The verify_chunks function checks the CRC of every chunk of one
+///        type. Large chunks are split into slices, and when there is enough
+///        data the slices are checksummed on a thread pool and stitched back
+///        together with crc_combine, seeded with the CRC of the chunk type.
+/// @param chunks The chunks to verify.
+/// @param count The number of chunks.
+/// @param type The chunk type.
+/// @return True if every chunk has a valid CRC, false otherwise.
+static bool verify_chunks(IDAT* chunks, unsigned int count, const char* type) {
+    // count the slices and the total amount of data
+    size_t total = 0;
+    unsigned int num_slices = 0;
+    unsigned int i;
+    for(i = 0; i < count; i++) {
+        total += chunks[i].length;
+        num_slices += chunks[i].length / IDAT_CRC_SLICE + 1;
+    }
+
+    // split every chunk into slices
+    CRC_SLICE* slices = malloc(sizeof(CRC_SLICE) * (num_slices > 0 ? num_slices : 1));
+    MEM_CHECK(slices);
+    unsigned int n = 0;
+    for(i = 0; i < count; i++) {
+        size_t offset = 0;
+        do {
+            size_t length = chunks[i].length - offset;
+            if(length > IDAT_CRC_SLICE)
+                length = IDAT_CRC_SLICE;
+            slices[n].data = chunks[i].data + offset;
+            slices[n].length = length;
+            n++;
+            offset += length;
+        } while(offset < chunks[i].length);
+    }
+    num_slices = n;
+
+    // checksum the slices, in parallel if there is enough data to pay off
+    POOL* pool = NULL;
+    if(total >= IDAT_CRC_PARALLEL)
+        pool = pool_create(0);
+    CRC_JOB* jobs = malloc(sizeof(CRC_JOB) * num_slices);
+    if(pool == NULL || jobs == NULL) {
+        CRC_JOB all = { slices, num_slices };
+        crc_job(&all);
+    } else {
+        // group small slices so that each job has a worthwhile amount of work
+        unsigned int num_jobs = 0;
+        size_t bytes = 0;
+        for(n = 0; n < num_slices; n++) {
+            if(n == 0 || bytes >= IDAT_CRC_SLICE) {
+                jobs[num_jobs].slices = slices + n;
+                jobs[num_jobs].count = 0;
+                num_jobs++;
+                bytes = 0;
+            }
+            jobs[num_jobs - 1].count++;
+            bytes += slices[n].length;
+        }
+        for(n = 0; n < num_jobs; n++)
+            if(!pool_submit(pool, crc_job, jobs + n))
+                crc_job(jobs + n);
+        pool_wait(pool);
+    }
+    pool_free(pool);
+    free(jobs);
+
+    // combine the slices of every chunk and compare with the stored CRC
+    bool valid = true;
+    unsigned long type_crc = crc_update(0xffffffffL, (const unsigned char*) type, 4) ^ 0xffffffffL;
+    n = 0;
+    for(i = 0; i < count && valid; i++) {
+        unsigned long calc_crc = type_crc;
+        size_t offset = 0;
+        do {
+            calc_crc = crc_combine(calc_crc, slices[n].crc, slices[n].length);
+            offset += slices[n].length;
+            n++;
+        } while(offset < chunks[i].length);
+
+        unsigned char* stored = chunks[i].crc;
+        if(calc_crc != (((unsigned long) stored[0] << 24) | ((unsigned long) stored[1] << 16) |
+                        ((unsigned long) stored[2] << 8) | (unsigned long) stored[3])) {
             printf("Invalid PNG: Failed CRC Check\n");
-            return false;
+            valid = false;
         }
     }
+    free(slices);
 
-    return true;
+    return valid;
+}
+
+/// @brief The png_verify_idat function checks the CRC of every IDAT and fdAT
+///        chunk.
+/// @param png The PNG struct to verify.
+/// @return True if every chunk has a valid CRC, false otherwise.
+bool png_verify_idat(PNG* png) {
+    return verify_chunks(png->idat, png->num_idat_chunks, IDAT_HEADER) &&
+            verify_chunks(png->fdat, png->num_fdat_chunks, FDAT_HEADER);
+}
+
+/// @brief The verify_frames function checks that an animation has all the
+///        frames its acTL chunk promised, each with image data.
+/// @param png The PNG struct to verify.
+/// @return True if the frames are complete or there is no animation, false
+///         otherwise.
+static bool verify_frames(PNG* png) {
+    if(png->actl == NULL)
+        return true;
+
+    bool complete = png->num_frames == png->actl->num_frames;
+    for(unsigned int i = 0; i < png->num_frames && complete; i++)
+        complete = png->frames[i].default_image || png->frames[i].num_chunks > 0;
+    if(!complete)
+        printf("Invalid PNG: Animation frames are missing\n");
+
+    return complete;
 }
 
 /// @brief The read_iend function reads an IEND chunk.
 /// @param png The PNG struct to read into.
-/// @param file The file to read from.
+/// @param src The source to read from.
 /// @return True if the IEND chunk was read, false otherwise.
-bool read_iend(PNG* png, FILE* file) {
+bool read_iend(PNG* png, SOURCE* src) {
+    // read the CRC
+    const unsigned char* data = source_read(src, 4);
+    READ_CHECK(data);
+
     // allocate memory for the IEND struct
     png->iend = malloc(sizeof(IEND));
     MEM_CHECK(png->iend);
 
-    // read the CRC
-    for(int i = 0; i < 4; i++) {
-        png->iend->crc[i] = fgetc(file);
-        FEOF_CHECK(file);
-    }
+    memcpy(png->iend->crc, data, 4);
     png->iend->crc[4] = '\0';
-    
+
     // validate checksum against known constant value
-    if(strcmp((char*) png->iend->crc, IEND_CRC) != 0) {
+    if(memcmp(png->iend->crc, IEND_CRC, 4) != 0) {
         printf("Invalid PNG: Failed CRC Check\n");
         return false;
     }
@@ -347,20 +724,23 @@ bool read_iend(PNG* png, FILE* file) {
     return true;
 }
 
-/// @brief The png_read function reads a PNG file from a given file.
+/// @brief The png_read function reads a PNG file from a given source. Chunk
+///        data may point into the source, so it has to stay open until the
+///        PNG struct is freed.
 /// @param png The PNG struct to read into.
-/// @param file The file to read from.
+/// @param src The source to read from.
 /// @return True if the PNG file was read, false otherwise.
-bool png_read(PNG* png, FILE* file) {
-    // check if the PNG and file exist
-    if(file == NULL || png == NULL)
+bool png_read(PNG* png, SOURCE* src) {
+    // check if the PNG and source exist
+    if(src == NULL || png == NULL)
         return false;
-    
+
     // read the header
+    const unsigned char* signature = source_read(src, 8);
+    if(signature == NULL)
+        return false;
     char header[9];
-    for(int i = 0; i < 8; i++) {
-        header[i] = fgetc(file);
-    }
+    memcpy(header, signature, 8);
     header[8] = '\0';
 
     // check if the header is valid
@@ -368,147 +748,244 @@ bool png_read(PNG* png, FILE* file) {
         return false;
 
     // read the chunks while there are still chunks to read
-    unsigned int chunk_size;
+    uint32_t chunk_size;
     char chunk_type[5];
     chunk_type[4] = '\0';
-    while(!feof(file)) {
-        // read the chunk size
-        for(int i = 3; i >= 0; i--) {
-            chunk_size = fgetc(file) << (8* i);
-            FEOF_CHECK(file);
+    while(!source_at_end(src)) {
+        // read the chunk size and type
+        const unsigned char* data = source_read(src, 8);
+        READ_CHECK(data);
+        chunk_size = get_u32(data);
+        memcpy(chunk_type, data + 4, 4);
+
+        // check if the chunk size is valid
+        if(chunk_size > 0x7FFFFFFF) {
+            printf("Invalid chunk length\n");
+            return false;
         }
 
-        // read the chunk type
-        for(int i = 0; i < 4; i++) {
-            chunk_type[i] = fgetc(file);
-            FEOF_CHECK(file);
-        }
-        
         // find the chunk type and read it accordingly
         if(is_idhr_header(chunk_type)) {
-            if(!read_ihdr(png, file, chunk_size))
+            if(!read_ihdr(png, src, chunk_size))
                 return false;
         } else if(is_plte_header(chunk_type)) {
-            if(!read_plte(png, file, chunk_size))
+            if(!read_plte(png, src, chunk_size))
+                return false;
+        } else if(is_trns_header(chunk_type)) {
+            if(!read_trns(png, src, chunk_size))
+                return false;
+        } else if(is_ffix_header(chunk_type)) {
+            if(!read_ffix(png, src, chunk_size))
                 return false;
         } else if(is_idat_header(chunk_type)) {
-            if(!read_idat(png, file, chunk_size))
+            if(!read_idat(png, src, chunk_size))
+                return false;
+        } else if(is_actl_header(chunk_type)) {
+            if(!read_actl(png, src, chunk_size))
+                return false;
+        } else if(is_fctl_header(chunk_type)) {
+            if(!read_fctl(png, src, chunk_size))
+                return false;
+        } else if(is_fdat_header(chunk_type)) {
+            if(!read_fdat(png, src, chunk_size))
                 return false;
         } else if(is_iend_header(chunk_type)) {
-            if(!read_iend(png, file))
+            if(!read_iend(png, src) || !png_verify_idat(png) || !verify_frames(png))
                 return false;
             else
                 break;
         } else {
+            // skip over the data and CRC
             printf("Not recognized.\n\n");
+            READ_CHECK(source_skip(src, (size_t) chunk_size + 4));
         }
     }
     return true;
 }
 
-/// @brief The ihdr_write function writes an IHDR chunk to a file.
+/// @brief The chunk_write function writes a chunk with a freshly computed CRC.
+/// @param sink The sink to write to.
+/// @param type The chunk type.
+/// @param data The chunk data.
+/// @param length The length of the chunk data.
+/// @return True if the chunk was written, false otherwise.
+static bool chunk_write(SINK* sink, const char* type, const unsigned char* data, size_t length) {
+    sink_write_u32(sink, (uint32_t) length);
+    sink_crc_begin(sink);
+    sink_write(sink, type, 4);
+    if(length > 0)
+        sink_write(sink, data, length);
+    return sink_crc_end(sink);
+}
+
+/// @brief The ihdr_write function writes an IHDR chunk to a sink.
 /// @param ihdr The IHDR struct to write from.
-/// @param file The file to write to.
+/// @param sink The sink to write to.
 /// @return True if the IHDR chunk was written, false otherwise.
-bool ihdr_write(IHDR* ihdr, FILE* file) {
+bool ihdr_write(IHDR* ihdr, SINK* sink) {
     // check if the IHDR chunk exists
     if(ihdr == NULL)
         return false;
-    
-    // write the IHDR header
-    char zero = 0;
-    fprintf(file, "%c%c%c\x0D%s", zero, zero, zero, IHDR_HEADER);
-
-    // write the width
-    int i;
-    for(i = 0; i < 4; i++)
-        fprintf(file, "%c", ((char) ((ihdr->width >> (8* (3 - i)))) & 0xFF));
-    
-    // write the height
-    for(i = 0; i < 4; i++)
-        fprintf(file, "%c", ((char) ((ihdr->height >> (8* (3 - i)))) & 0xFF));
-    
-    // write the other data present in the IHDR chunk
-    fprintf(file, "%c", ihdr->bit_depth);
-    fprintf(file, "%c", ihdr->color_type);
-    fprintf(file, "%c", ihdr->compression_method);
-    fprintf(file, "%c", ihdr->filter_method);
-    fprintf(file, "%c", ihdr->interlace_method);
-    fprintf(file, "%s", ihdr->crc);
 
-    return true;
+    // lay out the chunk data
+    unsigned char data[13];
+    for(int i = 0; i < 4; i++) {
+        data[i] = (unsigned char) (ihdr->width >> (8 * (3 - i)));
+        data[4 + i] = (unsigned char) (ihdr->height >> (8 * (3 - i)));
+    }
+    data[8] = ihdr->bit_depth;
+    data[9] = ihdr->color_type;
+    data[10] = ihdr->compression_method;
+    data[11] = ihdr->filter_method;
+    data[12] = ihdr->interlace_method;
+
+    return chunk_write(sink, IHDR_HEADER, data, 13);
 }
 
-/// @brief The plte_write function writes a PLTE chunk to a file.
-/// @param plte The PLTE struct to write from. 
-/// @param file The file to write to.
+/// @brief The plte_write function writes a PLTE chunk to a sink.
+/// @param plte The PLTE struct to write from.
+/// @param sink The sink to write to.
 /// @return True if the PLTE chunk was written, false otherwise.
-bool plte_write(PLTE* plte, FILE* file) {
+bool plte_write(PLTE* plte, SINK* sink) {
     // check if the PLTE chunk exists
     if(plte == NULL)
         return false;
-    
-    // write the PLTE header
-    char zero = 0;
-    fprintf(file, "%c%c%cx07%s", zero, zero, zero, PLTE_HEADER);
 
     // write the palette
-    fprintf(file, "%c%c%c", plte->red, plte->green, plte->blue);
+    unsigned char data[3 * PALETTE_SIZE];
+    palette_unpack(plte->entries, plte->num_entries, data);
+    return chunk_write(sink, PLTE_HEADER, data, 3 * (size_t) plte->num_entries);
+}
 
-    // write the CRC
-    fprintf(file, "%s", plte->crc);
+/// @brief The trns_write function writes the alpha of a palette's entries as
+///        a tRNS chunk to a sink.
+/// @param plte The PLTE struct to write from.
+/// @param sink The sink to write to.
+/// @return True if the tRNS chunk was written, false otherwise.
+bool trns_write(PLTE* plte, SINK* sink) {
+    // check if there is any alpha to write
+    if(plte == NULL || plte->num_alpha == 0)
+        return false;
 
-    return true;
+    unsigned char data[PALETTE_SIZE];
+    for(unsigned int i = 0; i < plte->num_alpha; i++)
+        data[i] = (unsigned char) (plte->entries[i] >> 24);
+    return chunk_write(sink, TRNS_HEADER, data, plte->num_alpha);
 }
 
-/// @brief The idat_write function writes all IDAT chunks to a file.
+/// @brief The ffix_write function writes an ffIX chunk to a sink.
+/// @param ffix The FFIX struct to write from.
+/// @param sink The sink to write to.
+/// @return True if the ffIX chunk was written, false otherwise.
+bool ffix_write(FFIX* ffix, SINK* sink) {
+    // check if the ffIX chunk exists
+    if(ffix == NULL)
+        return false;
+
+    // lay out the row count followed by the offsets
+    size_t length = 4 * ((size_t) ffix->count + 1);
+    unsigned char* data = malloc(length);
+    MEM_CHECK(data);
+    for(unsigned int i = 0; i <= ffix->count; i++) {
+        uint32_t value = i == 0 ? ffix->rows : ffix->offsets[i - 1];
+        for(int j = 0; j < 4; j++)
+            data[4 * i + j] = (unsigned char) (value >> (8 * (3 - j)));
+    }
+
+    bool written = chunk_write(sink, FFIX_HEADER, data, length);
+    free(data);
+    return written;
+}
+
+/// @brief The idat_write function writes all IDAT chunks to a sink.
 /// @param png The PNG struct to write from.
-/// @param file The file to write to.
+/// @param sink The sink to write to.
 /// @return True if the IDAT chunk was written, false otherwise.
-bool idat_write(PNG* png, FILE* file) {
+bool idat_write(PNG* png, SINK* sink) {
     // check if the IDAT chunk exists
     if(png->idat == NULL)
         return false;
-    
-    // loop for every IDAT chunk
-    char zero = 0;
-    for(unsigned int i = 0; i < png->num_idat_chunks; i++) {
-        // write the length
-        unsigned int j;
-        for(j = 0; j < 4; j++)
-            fprintf(file, "%c", ((int) (png->idat[i].length / pow(256, 3 - j))) % 256);
-        
-        // write the IDAT header
-        fprintf(file, "%s", IDAT_HEADER);
-
-        // write the data
-        for(j = 0; j < png->idat[i].length; j++)
-            fprintf(file, "%c", (png->idat[i].data[j] == '\0') ? zero : png->idat[i].data[j]);
-        
-        // write the CRC
-        fprintf(file, "%s", png->idat[i].crc);
-    }
+
+    // write every IDAT chunk, each payload in a single bulk write
+    for(unsigned int i = 0; i < png->num_idat_chunks; i++)
+        if(!chunk_write(sink, IDAT_HEADER, png->idat[i].data, png->idat[i].length))
+            return false;
 
     return true;
 }
 
-/// @brief The iend_write function writes an IEND chunk to a file.
+/// @brief The actl_write function writes an acTL chunk to a sink.
+/// @param actl The ACTL struct to write from.
+/// @param sink The sink to write to.
+/// @return True if the acTL chunk was written, false otherwise.
+bool actl_write(ACTL* actl, SINK* sink) {
+    // check if the acTL chunk exists
+    if(actl == NULL)
+        return false;
+
+    sink_write_u32(sink, 8);
+    sink_crc_begin(sink);
+    sink_write(sink, ACTL_HEADER, 4);
+    sink_write_u32(sink, actl->num_frames);
+    sink_write_u32(sink, actl->num_plays);
+    return sink_crc_end(sink);
+}
+
+/// @brief The fctl_write function writes an fcTL chunk to a sink.
+/// @param fctl The FCTL struct to write from.
+/// @param sequence The sequence number to give the chunk.
+/// @param sink The sink to write to.
+/// @return True if the fcTL chunk was written, false otherwise.
+bool fctl_write(FCTL* fctl, uint32_t sequence, SINK* sink) {
+    // check if the fcTL chunk exists
+    if(fctl == NULL)
+        return false;
+
+    sink_write_u32(sink, 26);
+    sink_crc_begin(sink);
+    sink_write(sink, FCTL_HEADER, 4);
+    sink_write_u32(sink, sequence);
+    sink_write_u32(sink, fctl->width);
+    sink_write_u32(sink, fctl->height);
+    sink_write_u32(sink, fctl->x_offset);
+    sink_write_u32(sink, fctl->y_offset);
+    sink_write_u16(sink, fctl->delay_num);
+    sink_write_u16(sink, fctl->delay_den);
+    sink_write_u8(sink, fctl->dispose_op);
+    sink_write_u8(sink, fctl->blend_op);
+    return sink_crc_end(sink);
+}
+
+/// @brief The fdat_write function writes an fdAT chunk to a sink, numbering
+///        it afresh.
+/// @param fdat The chunk to write, its data starting with the old sequence
+///        number.
+/// @param sequence The sequence number to give the chunk.
+/// @param sink The sink to write to.
+/// @return True if the fdAT chunk was written, false otherwise.
+bool fdat_write(IDAT* fdat, uint32_t sequence, SINK* sink) {
+    // check if the fdAT chunk exists
+    if(fdat == NULL || fdat->length < 4)
+        return false;
+
+    sink_write_u32(sink, fdat->length);
+    sink_crc_begin(sink);
+    sink_write(sink, FDAT_HEADER, 4);
+    sink_write_u32(sink, sequence);
+    sink_write(sink, fdat->data + 4, fdat->length - 4);
+    return sink_crc_end(sink);
+}
+
+/// @brief The iend_write function writes an IEND chunk to a sink.
 /// @param iend The IEND struct to write from.
-/// @param file The file to write to.
+/// @param sink The sink to write to.
 /// @return True if the IEND chunk was written, false otherwise.
-bool iend_write(IEND* iend, FILE* file) {
+bool iend_write(IEND* iend, SINK* sink) {
     // check if the IEND chunk exists
     if(iend == NULL)
         return false;
-    
-    // write the IEND header
-    char zero = 0;
-    fprintf(file, "%c%c%c%c%s", zero, zero, zero, zero, IEND_HEADER);
-
-    // write the CRC
-    fprintf(file, "%s", iend->crc);
 
-    return true;
+    return chunk_write(sink, IEND_HEADER, NULL, 0);
 }
 
 /// @brief The png_write function writes a PNG struct to a file.
@@ -516,18 +993,799 @@ bool iend_write(IEND* iend, FILE* file) {
 /// @param file The file to write to.
 /// @return True if the PNG struct was written, false otherwise.
 bool png_write(PNG* png, FILE* file) {
+    SINK sink;
+    if(!sink_open(&sink, file))
+        return false;
+
     // write the PNG header
-    fprintf(file, "%s", PNG_HEADER);
+    sink_write(&sink, PNG_HEADER, 8);
 
-    // write the chunks in the correct order
-    ihdr_write(png->ihdr, file);
-    plte_write(png->plte, file);
-    idat_write(png, file);
-    iend_write(png->iend, file);
+    // write the chunks in the correct order, the palette being optional
+    bool written = ihdr_write(png->ihdr, &sink);
+    if(png->actl != NULL)
+        written = written && actl_write(png->actl, &sink);
+    if(png->plte != NULL)
+        written = written && plte_write(png->plte, &sink);
+    if(png->plte != NULL && png->plte->num_alpha > 0)
+        written = written && trns_write(png->plte, &sink);
+    if(png->ffix != NULL)
+        written = written && ffix_write(png->ffix, &sink);
+
+    // the animation frames follow the image data, numbered from the start
+    uint32_t sequence = 0;
+    unsigned int frame = 0;
+    if(png->actl != NULL && png->num_frames > 0 && png->frames[0].default_image)
+        written = written && fctl_write(png->frames + frame++, sequence++, &sink);
+    written = written && idat_write(png, &sink);
+    for(; png->actl != NULL && frame < png->num_frames && written; frame++) {
+        FCTL* fctl = png->frames + frame;
+        written = fctl_write(fctl, sequence++, &sink);
+        for(unsigned int i = 0; i < fctl->num_chunks && written; i++)
+            written = fdat_write(png->fdat + fctl->first_chunk + i, sequence++, &sink);
+    }
+    written = written && iend_write(png->iend, &sink);
+
+    return sink_close(&sink) && written;
+}
+
+/// @brief The png_channels function finds the number of samples per pixel.
+/// @param color_type The color type from the IHDR chunk.
+/// @return The number of samples per pixel.
+unsigned int png_channels(unsigned char color_type) {
+    switch(color_type) {
+        case 2:
+            return 3;
+        case 4:
+            return 2;
+        case 6:
+            return 4;
+        default:
+            return 1;
+    }
+}
+
+/// @brief The png_row_bytes function finds the length of a row of pixels,
+///        without its filter type byte.
+/// @param ihdr The IHDR chunk describing the image.
+/// @param width The number of pixels in the row.
+/// @return The number of bytes in the row.
+size_t png_row_bytes(IHDR* ihdr, unsigned int width) {
+    return ((size_t) width * png_channels(ihdr->color_type) * ihdr->bit_depth + 7) / 8;
+}
+
+/// @brief The png_pass_size function finds the size of one Adam7 pass, or of
+///        the whole image when it is not interlaced.
+/// @param ihdr The IHDR chunk describing the image.
+/// @param pass The pass number from 0 to 6, ignored without interlacing.
+/// @param width Where to store the number of pixels per row of the pass.
+/// @param height Where to store the number of rows of the pass.
+/// @return True if the pass has any pixels, false if it is empty.
+bool png_pass_size(IHDR* ihdr, int pass, unsigned int* width, unsigned int* height) {
+    if(ihdr->interlace_method == 0) {
+        *width = ihdr->width;
+        *height = ihdr->height;
+    } else if(ihdr->width <= adam7_start_x[pass] || ihdr->height <= adam7_start_y[pass]) {
+        *width = 0;
+        *height = 0;
+    } else {
+        *width = (ihdr->width - adam7_start_x[pass] + adam7_step_x[pass] - 1) / adam7_step_x[pass];
+        *height = (ihdr->height - adam7_start_y[pass] + adam7_step_y[pass] - 1) / adam7_step_y[pass];
+    }
+
+    return *width > 0 && *height > 0;
+}
+
+/// @brief The png_raw_size function finds the size of the decompressed image
+///        data, which is every scanline with its filter type byte, across all
+///        seven passes for an interlaced image.
+/// @param ihdr The IHDR chunk describing the image.
+/// @return The size of the decompressed data.
+size_t png_raw_size(IHDR* ihdr) {
+    int passes = ihdr->interlace_method == 0 ? 1 : 7;
+    unsigned int width, height;
+
+    size_t size = 0;
+    for(int pass = 0; pass < passes; pass++) {
+        if(png_pass_size(ihdr, pass, &width, &height))
+            size += (size_t) height * (png_row_bytes(ihdr, width) + 1);
+    }
+
+    return size;
+}
+
+/// @brief The idat_segments function points an inflate segment at every
+///        IDAT chunk, so the data can be read without joining the chunks.
+/// @param png The PNG struct with the IDAT chunks.
+/// @return The segments, or NULL if memory ran out. The caller frees them.
+static INFLATE_SEGMENT* idat_segments(PNG* png) {
+    INFLATE_SEGMENT* segments = malloc(sizeof(INFLATE_SEGMENT) * png->num_idat_chunks);
+    if(segments == NULL) {
+        printf("Unable to allocate memory");
+        return NULL;
+    }
+    for(unsigned int i = 0; i < png->num_idat_chunks; i++) {
+        segments[i].data = png->idat[i].data;
+        segments[i].length = png->idat[i].length;
+    }
+
+    return segments;
+}
+
+/// @brief The png_inflate function decompresses the IDAT data straight into
+///        a caller-supplied buffer, reading across chunk boundaries without
+///        joining the chunks first.
+/// @param png The PNG struct to decompress.
+/// @param scanlines The buffer to decompress into, png_raw_size bytes long.
+/// @param length The size of the buffer.
+/// @return True if exactly the expected data was decompressed, false otherwise.
+bool png_inflate(PNG* png, unsigned char* scanlines, size_t length) {
+    // check if there is anything to decompress
+    if(png->ihdr == NULL || png->num_idat_chunks == 0)
+        return false;
+
+    INFLATE_SEGMENT* segments = idat_segments(png);
+    if(segments == NULL)
+        return false;
+
+    // decompress and make sure nothing is missing
+    size_t written;
+    bool inflated = inflate_zlib(segments, png->num_idat_chunks, scanlines, length, &written);
+    free(segments);
+    if(inflated && written != png_raw_size(png->ihdr)) {
+        printf("Invalid PNG: Image data is too short\n");
+        inflated = false;
+    }
+
+    return inflated;
+}
+
+/// @brief The png_filter_bpp function finds the byte distance the filters
+///        use to reach the pixel to the left.
+/// @param ihdr The IHDR chunk describing the image.
+/// @return The bytes per complete pixel, rounded up to 1.
+unsigned int png_filter_bpp(IHDR* ihdr) {
+    unsigned int bits = png_channels(ihdr->color_type) * ihdr->bit_depth;
+    return bits < 8 ? 1 : bits / 8;
+}
+
+/// @brief The png_unfilter function undoes the scanline filters in place,
+///        one Adam7 pass at a time for an interlaced image.
+/// @param ihdr The IHDR chunk describing the image.
+/// @param scanlines The decompressed data, png_raw_size bytes long.
+/// @return True if every row had a valid filter type, false otherwise.
+bool png_unfilter(IHDR* ihdr, unsigned char* scanlines) {
+    int passes = ihdr->interlace_method == 0 ? 1 : 7;
+    unsigned int bpp = png_filter_bpp(ihdr);
+    unsigned int width, height;
+
+    for(int pass = 0; pass < passes; pass++) {
+        if(!png_pass_size(ihdr, pass, &width, &height))
+            continue;
+        size_t row_bytes = png_row_bytes(ihdr, width);
+        if(!unfilter_image(scanlines, height, row_bytes, bpp))
+            return false;
+        scanlines += (size_t) height * (row_bytes + 1);
+    }
 
     return true;
 }
 
+/// @brief The decode_job function inflates one indexed segment from its full
+///        flush point and unfilters its rows.
+/// @param arg The DECODE_JOB to run.
+static void decode_job(void* arg) {
+    DECODE_JOB* job = arg;
+    size_t length = (size_t) job->height * (job->row_bytes + 1);
+    job->decoded = false;
+
+    INFLATE* inf = malloc(sizeof(INFLATE));
+    if(inf == NULL)
+        return;
+    inflate_init(inf, job->input, job->num_input, job->scanlines, length);
+
+    // every segment but the last stops at the flush point after its rows
+    bool inflated = inflate_skip(inf, job->offset) && inflate_raw(inf, !job->last) &&
+                    inf->out_pos == length;
+    if(inflated && job->last)
+        inflated = inflate_trailer(inf, &job->trailer);
+    free(inf);
+    if(!inflated)
+        return;
+
+    // the first row cannot look above, which the index promises
+    job->adler = adler_update(1, job->scanlines, length);
+    if(job->offset > 2 && job->scanlines[0] > FILTER_SUB)
+        return;
+    job->decoded = unfilter_image(job->scanlines, job->height, job->row_bytes, job->bpp);
+}
+
+/// @brief The decode_indexed function decodes the image data one ffIX
+///        segment per pool job.
+/// @param png The PNG struct to decode, with a usable ffIX chunk.
+/// @param scanlines The buffer to decode into, png_raw_size bytes long.
+/// @return True if every segment decoded and the checksum matched, false if
+///         the image has to be decoded serially instead.
+static bool decode_indexed(PNG* png, unsigned char* scanlines) {
+    IHDR* ihdr = png->ihdr;
+    FFIX* ffix = png->ffix;
+
+    // the index has to cover the rows of a plain image, in stream order
+    size_t total = 0;
+    for(unsigned int i = 0; i < png->num_idat_chunks; i++)
+        total += png->idat[i].length;
+    if(ihdr->interlace_method != 0 || ffix->count < 2 ||
+            ffix->count != ihdr->height / ffix->rows + (ihdr->height % ffix->rows != 0) ||
+            ffix->offsets[0] != 2 || ffix->offsets[ffix->count - 1] >= total)
+        return false;
+    for(unsigned int i = 1; i < ffix->count; i++)
+        if(ffix->offsets[i] <= ffix->offsets[i - 1])
+            return false;
+
+    // the zlib header has to be one with no preset dictionary
+    unsigned char header[2];
+    INFLATE_SEGMENT* input = malloc(sizeof(INFLATE_SEGMENT) * png->num_idat_chunks);
+    DECODE_JOB* jobs = malloc(sizeof(DECODE_JOB) * ffix->count);
+    if(input == NULL || jobs == NULL) {
+        free(input);
+        free(jobs);
+        return false;
+    }
+    size_t copied = 0;
+    for(unsigned int i = 0; i < png->num_idat_chunks; i++) {
+        input[i].data = png->idat[i].data;
+        input[i].length = png->idat[i].length;
+        for(size_t j = 0; j < input[i].length && copied < 2; j++)
+            header[copied++] = input[i].data[j];
+    }
+    if((header[0] & 0x0f) != 8 || (header[0] >> 4) > 7 ||
+            ((header[0] << 8) | header[1]) % 31 != 0 || (header[1] & 0x20) != 0) {
+        free(input);
+        free(jobs);
+        return false;
+    }
+
+    // decode every segment at once
+    size_t row_bytes = png_row_bytes(ihdr, ihdr->width);
+    POOL* pool = pool_create(0);
+    for(unsigned int i = 0; i < ffix->count; i++) {
+        DECODE_JOB* job = jobs + i;
+        job->input = input;
+        job->num_input = png->num_idat_chunks;
+        job->offset = ffix->offsets[i];
+        job->scanlines = scanlines + (size_t) i * ffix->rows * (row_bytes + 1);
+        job->height = i == ffix->count - 1 ? ihdr->height - i * ffix->rows : ffix->rows;
+        job->row_bytes = row_bytes;
+        job->bpp = png_filter_bpp(ihdr);
+        job->last = i == ffix->count - 1;
+        if(pool == NULL || !pool_submit(pool, decode_job, job))
+            decode_job(job);
+    }
+    if(pool != NULL)
+        pool_wait(pool);
+    pool_free(pool);
+
+    // stitch the checksums together and compare with the stream's
+    bool decoded = true;
+    unsigned long adler = 1;
+    for(unsigned int i = 0; i < ffix->count && decoded; i++) {
+        decoded = jobs[i].decoded;
+        adler = adler_combine(adler, jobs[i].adler, (size_t) jobs[i].height * (row_bytes + 1));
+    }
+    decoded = decoded && adler == jobs[ffix->count - 1].trailer;
+
+    free(input);
+    free(jobs);
+    return decoded;
+}
+
+/// @brief The copy_pixel function copies one pixel between rows of packed
+///        samples.
+/// @param in The row to copy from.
+/// @param in_x The pixel to copy.
+/// @param out The row to copy to.
+/// @param out_x Where to put the pixel.
+/// @param bits The bits per pixel: 1, 2, 4, or a multiple of 8.
+static inline void copy_pixel(const unsigned char* in, size_t in_x, unsigned char* out,
+                                size_t out_x, unsigned int bits) {
+    if(bits >= 8) {
+        memcpy(out + out_x * (bits / 8), in + in_x * (bits / 8), bits / 8);
+        return;
+    }
+
+    // pixels are packed most significant bits first
+    unsigned int mask = (1u << bits) - 1;
+    unsigned int in_shift = 8 - bits - (unsigned int) (in_x * bits % 8);
+    unsigned int out_shift = 8 - bits - (unsigned int) (out_x * bits % 8);
+    unsigned int value = (in[in_x * bits / 8] >> in_shift) & mask;
+    unsigned char* byte = out + out_x * bits / 8;
+    *byte = (unsigned char) ((*byte & ~(mask << out_shift)) | (value << out_shift));
+}
+
+/// @brief The SCATTER_CASE macro spreads whole pixels of a fixed size, so each
+///        copy compiles to a single load and store.
+#define SCATTER_CASE(size) case size: \
+    for(unsigned int i = 0; i < width; i++) \
+        memcpy(out + (size_t) i * step * size, in + (size_t) i * size, size); \
+    break;
+
+/// @brief The scatter_row function writes one row of an Adam7 pass into its
+///        row of the final image.
+/// @param in The unfiltered row of the pass.
+/// @param width The number of pixels in the row of the pass.
+/// @param bits The bits per pixel.
+/// @param start The column of the first pixel in the final image.
+/// @param step The columns between pixels in the final image.
+/// @param out The row of the final image.
+static void scatter_row(const unsigned char* in, unsigned int width, unsigned int bits,
+                            unsigned int start, unsigned int step, unsigned char* out) {
+    // the last pass fills whole rows, which a single copy handles
+    if(step == 1 && bits % 8 == 0) {
+        memcpy(out + (size_t) start * (bits / 8), in, (size_t) width * (bits / 8));
+        return;
+    } else if(bits < 8) {
+        for(unsigned int i = 0; i < width; i++)
+            copy_pixel(in, i, out, start + (size_t) i * step, bits);
+        return;
+    }
+
+    out += (size_t) start * (bits / 8);
+    switch(bits / 8) {
+        SCATTER_CASE(1)
+        SCATTER_CASE(2)
+        SCATTER_CASE(3)
+        SCATTER_CASE(4)
+        SCATTER_CASE(6)
+        SCATTER_CASE(8)
+        default:
+            break;
+    }
+}
+
+/// @brief The fill_preview function spreads every pixel decoded so far over
+///        the block of pixels it stands for until the later passes arrive.
+/// @param ihdr The IHDR chunk describing the image.
+/// @param pass The last pass decoded.
+/// @param image The final image, each row led by a filter type byte.
+static void fill_preview(IHDR* ihdr, int pass, unsigned char* image) {
+    unsigned int bits = png_channels(ihdr->color_type) * ihdr->bit_depth;
+    size_t stride = png_row_bytes(ihdr, ihdr->width) + 1;
+    unsigned int block_x = adam7_block_x[pass], block_y = adam7_block_y[pass];
+
+    for(unsigned int y = 0; y < ihdr->height; y += block_y) {
+        unsigned char* row = image + (size_t) y * stride + 1;
+        for(unsigned int x = 0; x < ihdr->width; x += block_x)
+            for(unsigned int i = x + 1; i < x + block_x && i < ihdr->width; i++)
+                copy_pixel(row, x, row, i, bits);
+        for(unsigned int i = y + 1; i < y + block_y && i < ihdr->height; i++)
+            memcpy(row + (size_t) (i - y) * stride, row, stride - 1);
+    }
+}
+
+/// @brief The decode_interlaced function inflates the seven Adam7 passes one
+///        at a time, unfiltering each row and scattering it straight into the
+///        final image while it is still in cache, with no sub-images to merge
+///        afterwards. The preview is shown as soon as its passes are in, before
+///        the rest of the data is decompressed.
+/// @param png The PNG struct to decode.
+/// @param options When to call the preview function, or NULL for none.
+/// @param image The final image, zeroed, each row led by a filter type byte.
+/// @return True if the image data was valid, false otherwise.
+static bool decode_interlaced(PNG* png, const PNG_DECODE_OPTIONS* options, unsigned char* image) {
+    IHDR* ihdr = png->ihdr;
+    if(png->num_idat_chunks == 0)
+        return false;
+
+    // the raw data stays filtered, since later matches copy from it, so rows
+    // are unfiltered into a pair of row buffers, the first above all zeros
+    UNFILTER unfilter;
+    unsigned int bits = png_channels(ihdr->color_type) * ihdr->bit_depth;
+    size_t length = png_raw_size(ihdr);
+    size_t stride = png_row_bytes(ihdr, ihdr->width) + 1;
+    unsigned char* scanlines = malloc(length > 0 ? length : 1);
+    unsigned char* rows = malloc(stride * 2);
+    INFLATE* inf = malloc(sizeof(INFLATE));
+    INFLATE_SEGMENT* segments = idat_segments(png);
+    bool decoded = false;
+    if(scanlines == NULL || rows == NULL || inf == NULL) {
+        printf("Unable to allocate memory");
+    } else if(segments != NULL && unfilter_init(&unfilter, png_filter_bpp(ihdr))) {
+        inflate_init(inf, segments, png->num_idat_chunks, scanlines, length);
+        decoded = inflate_header(inf);
+    }
+
+    unsigned char* line = scanlines;
+    for(int pass = 0; pass < 7 && decoded; pass++) {
+        unsigned int width, height;
+        if(png_pass_size(ihdr, pass, &width, &height)) {
+            // decompress just this pass
+            size_t row_bytes = png_row_bytes(ihdr, width);
+            size_t pass_end = (size_t) (line - scanlines) + (size_t) height * (row_bytes + 1);
+            decoded = inflate_until(inf, pass_end);
+            if(decoded && inf->out_pos < pass_end) {
+                printf("Invalid PNG: Image data is too short\n");
+                decoded = false;
+            }
+
+            unsigned char* row = rows;
+            unsigned char* prev = rows + stride;
+            memset(prev, 0, row_bytes);
+            for(unsigned int y = 0; y < height && decoded; y++) {
+                memcpy(row, line + 1, row_bytes);
+                decoded = unfilter_row(&unfilter, line[0], row, prev, row_bytes);
+                unsigned int out_y = adam7_start_y[pass] + y * adam7_step_y[pass];
+                scatter_row(row, width, bits, adam7_start_x[pass], adam7_step_x[pass],
+                                image + (size_t) out_y * stride + 1);
+                unsigned char* swap = prev;
+                prev = row;
+                row = swap;
+                line += row_bytes + 1;
+            }
+        }
+
+        // show what the passes so far look like before decompressing the rest
+        if(decoded && options != NULL && options->preview != NULL &&
+                pass + 1 == options->preview_passes) {
+            fill_preview(ihdr, pass, image);
+            options->preview(options->user, image, pass + 1);
+        }
+    }
+
+    // finish the stream, which must hold nothing more, and check it
+    if(decoded) {
+        unsigned long adler;
+        decoded = inflate_raw(inf, false);
+        if(decoded && (!inflate_trailer(inf, &adler) ||
+                    adler != adler_update(1, scanlines, length))) {
+            printf("Invalid zlib stream: Failed Adler-32 Check\n");
+            decoded = false;
+        }
+    }
+
+    free(segments);
+    free(inf);
+    free(rows);
+    free(scanlines);
+    return decoded;
+}
+
+/// @brief The png_decode function decompresses and unfilters the image data.
+///        An image with an ffIX index is decoded in parallel, one segment per
+///        thread, falling back to a serial decode if the index is unusable.
+///        An interlaced image is deinterlaced into plain rows as it decodes.
+/// @param png The PNG struct to decode.
+/// @param options When to preview an interlaced image, or NULL for never.
+/// @param length Where to store the size of the returned data.
+/// @return The unfiltered scanlines, each still led by its filter type byte,
+///         or NULL if the data is invalid. The rows of an interlaced image
+///         are led by None instead. The caller frees it.
+unsigned char* png_decode(PNG* png, const PNG_DECODE_OPTIONS* options, size_t* length) {
+    // check if the header is there to size the image
+    if(png->ihdr == NULL)
+        return NULL;
+
+    if(png->ihdr->interlace_method != 0) {
+        *length = (size_t) png->ihdr->height * (png_row_bytes(png->ihdr, png->ihdr->width) + 1);
+        unsigned char* image = calloc(*length > 0 ? *length : 1, 1);
+        MEM_CHECK(image);
+        if(!decode_interlaced(png, options, image)) {
+            free(image);
+            return NULL;
+        }
+        return image;
+    }
+
+    *length = png_raw_size(png->ihdr);
+    unsigned char* scanlines = malloc(*length > 0 ? *length : 1);
+    MEM_CHECK(scanlines);
+
+    if(png->ffix != NULL && png->num_idat_chunks > 0 && decode_indexed(png, scanlines))
+        return scanlines;
+
+    if(!png_inflate(png, scanlines, *length) || !png_unfilter(png->ihdr, scanlines)) {
+        free(scanlines);
+        return NULL;
+    }
+
+    return scanlines;
+}
+
+/// @brief The png_expand_palette function turns the decoded rows of a palette
+///        image into RGB or RGBA pixels.
+/// @param png The PNG struct the rows were decoded from.
+/// @param scanlines The rows from png_decode, each led by its filter type byte.
+/// @param alpha Whether to write RGBA rather than RGB.
+/// @param length Where to store the size of the returned data.
+/// @return The pixels, row after row, or NULL if the image is not a palette
+///         image. The caller frees it.
+unsigned char* png_expand_palette(PNG* png, const unsigned char* scanlines, bool alpha,
+                                    size_t* length) {
+    IHDR* ihdr = png->ihdr;
+    if(ihdr == NULL || ihdr->color_type != 3 || png->plte == NULL)
+        return NULL;
+
+    size_t row_bytes = png_row_bytes(ihdr, ihdr->width);
+    size_t out_bytes = (size_t) ihdr->width * (alpha ? 4 : 3);
+    *length = out_bytes * ihdr->height;
+    unsigned char* pixels = malloc(*length > 0 ? *length : 1);
+    MEM_CHECK(pixels);
+
+    for(unsigned int y = 0; y < ihdr->height; y++)
+        palette_expand_row(png->plte->entries, scanlines + (size_t) y * (row_bytes + 1) + 1,
+                            ihdr->width, ihdr->bit_depth, alpha, pixels + y * out_bytes);
+
+    return pixels;
+}
+
+/// @brief The png_unpack function turns the decoded rows of any bit depth and
+///        color type into RGBA pixels of a working format.
+/// @param png The PNG the rows were decoded from.
+/// @param scanlines The unfiltered scanlines from png_decode.
+/// @param format The working pixel format to unpack to.
+/// @param length Where to store the size of the returned data.
+/// @return The pixels, or NULL if color type 3 has no palette. The caller
+///         frees it.
+void* png_unpack(PNG* png, const unsigned char* scanlines, PIXEL_FORMAT format, size_t* length) {
+    IHDR* ihdr = png->ihdr;
+    if(ihdr == NULL)
+        return NULL;
+
+    PIXEL_CONVERTER* conv = pixel_converter_create(ihdr->bit_depth, ihdr->color_type, format,
+                                png->plte != NULL ? png->plte->entries : NULL,
+                                png->plte != NULL ? png->plte->num_entries : 0);
+    if(conv == NULL)
+        return NULL;
+
+    size_t row_bytes = png_row_bytes(ihdr, ihdr->width);
+    size_t out_bytes = (size_t) ihdr->width * pixel_size(format);
+    *length = out_bytes * ihdr->height;
+    unsigned char* pixels = malloc(*length > 0 ? *length : 1);
+    if(pixels == NULL) {
+        printf("Unable to allocate memory");
+        pixel_converter_free(conv);
+        return NULL;
+    }
+
+    for(unsigned int y = 0; y < ihdr->height; y++)
+        pixel_unpack_row(conv, scanlines + (size_t) y * (row_bytes + 1) + 1, ihdr->width,
+                            pixels + y * out_bytes);
+
+    pixel_converter_free(conv);
+    return pixels;
+}
+
+/// @brief The png_pack function turns RGBA pixels of a working format into
+///        rows of the PNG's bit depth and color type, ready for png_filter.
+///        Any channels the color type lacks are dropped.
+/// @param png The PNG whose IHDR, and PLTE for color type 3, describe the rows.
+/// @param pixels The pixels.
+/// @param format The working pixel format of the pixels.
+/// @param length Where to store the size of the returned data.
+/// @return The rows, png_row_bytes long each with no filter type bytes, or
+///         NULL if a color is not in the palette. The caller frees it.
+unsigned char* png_pack(PNG* png, const void* pixels, PIXEL_FORMAT format, size_t* length) {
+    IHDR* ihdr = png->ihdr;
+    if(ihdr == NULL)
+        return NULL;
+
+    PIXEL_CONVERTER* conv = pixel_converter_create(ihdr->bit_depth, ihdr->color_type, format,
+                                png->plte != NULL ? png->plte->entries : NULL,
+                                png->plte != NULL ? png->plte->num_entries : 0);
+    if(conv == NULL)
+        return NULL;
+
+    size_t row_bytes = png_row_bytes(ihdr, ihdr->width);
+    size_t in_bytes = (size_t) ihdr->width * pixel_size(format);
+    *length = row_bytes * ihdr->height;
+    unsigned char* rows = malloc(*length > 0 ? *length : 1);
+    if(rows == NULL) {
+        printf("Unable to allocate memory");
+        pixel_converter_free(conv);
+        return NULL;
+    }
+
+    for(unsigned int y = 0; y < ihdr->height; y++) {
+        if(!pixel_pack_row(conv, (const unsigned char*) pixels + y * in_bytes, ihdr->width,
+                            rows + y * row_bytes)) {
+            printf("Pixel color not found in palette\n");
+            free(rows);
+            pixel_converter_free(conv);
+            return NULL;
+        }
+    }
+
+    pixel_converter_free(conv);
+    return rows;
+}
+
+/// @brief The png_filter function filters an image ready for compression.
+/// @param ihdr The IHDR chunk describing the image.
+/// @param pixels The rows of the image, png_row_bytes long each with no
+///        filter type bytes, and not interlaced.
+/// @param options How to choose each row's filter, or NULL for the default.
+/// @param length Where to store the size of the returned data.
+/// @return The filtered scanlines, each led by its filter type byte, or NULL
+///         if memory ran out. The caller frees it.
+unsigned char* png_filter(IHDR* ihdr, const unsigned char* pixels,
+                            const PNG_ENCODE_OPTIONS* options, size_t* length) {
+    size_t row_bytes = png_row_bytes(ihdr, ihdr->width);
+    FILTER_STRATEGY strategy = options != NULL ? options->strategy : FILTER_STRATEGY_AUTO;
+    unsigned char type = options != NULL ? options->filter : FILTER_NONE;
+    int level = options != NULL ? options->level : DEFLATE_DEFAULT_LEVEL;
+    unsigned int index_rows = options != NULL ? options->index_rows : 0;
+
+    // palette and low bit depth images compress best unfiltered
+    if(strategy == FILTER_STRATEGY_AUTO) {
+        bool unfiltered = ihdr->color_type == 3 || ihdr->bit_depth < 8;
+        strategy = unfiltered ? FILTER_STRATEGY_FIXED : FILTER_STRATEGY_MINSUM;
+        type = FILTER_NONE;
+    }
+
+    *length = (size_t) ihdr->height * (row_bytes + 1);
+    unsigned char* scanlines = malloc(*length > 0 ? *length : 1);
+    MEM_CHECK(scanlines);
+    if(!filter_image(pixels, ihdr->height, row_bytes, png_filter_bpp(ihdr), strategy, type,
+                        level, index_rows, scanlines)) {
+        free(scanlines);
+        return NULL;
+    }
+
+    return scanlines;
+}
+
+/// @brief The idat_piece_write function writes one compressed piece as IDAT
+///        chunks of at most PNG_IDAT_MAX bytes, with the zlib header before
+///        the first piece and the checksum after the last.
+/// @param piece The compressed piece.
+/// @param header The zlib header, or NULL if this is not the first piece.
+/// @param trailer The zlib checksum, or NULL if this is not the last piece.
+/// @param sink The sink to write to.
+/// @return True if the chunks were written, false otherwise.
+static bool idat_piece_write(DEFLATE_PIECE* piece, const unsigned char* header,
+                                const unsigned char* trailer, SINK* sink) {
+    const unsigned char* data = piece->out.data;
+    size_t left = piece->out.length;
+    bool written = true;
+
+    do {
+        size_t length = left > PNG_IDAT_MAX ? PNG_IDAT_MAX : left;
+        left -= length;
+        size_t prefix = header != NULL ? 2 : 0;
+        size_t suffix = trailer != NULL && left == 0 ? 4 : 0;
+
+        // the CRC is taken as the chunk streams out, with no staging copy
+        sink_write_u32(sink, (uint32_t) (prefix + length + suffix));
+        sink_crc_begin(sink);
+        sink_write(sink, IDAT_HEADER, 4);
+        if(prefix > 0)
+            sink_write(sink, header, prefix);
+        sink_write(sink, data, length);
+        if(suffix > 0)
+            sink_write(sink, trailer, suffix);
+        written = sink_crc_end(sink) && written;
+
+        header = NULL;
+        data += length;
+    } while(left > 0);
+
+    return written;
+}
+
+/// @brief The png_encode function writes an image from pixel data, filtering
+///        it and compressing the scanlines in parallel on a thread pool.
+/// @param png The PNG struct holding the IHDR and, for a palette image, the
+///        PLTE chunk.
+/// @param pixels The rows of the image, png_row_bytes long each with no
+///        filter type bytes. The image is written without interlacing.
+/// @param options How to choose each row's filter, or NULL for the default.
+/// @param file The file to write to.
+/// @return True if the file was written, false otherwise.
+bool png_encode(PNG* png, const unsigned char* pixels, const PNG_ENCODE_OPTIONS* options,
+                    FILE* file) {
+    // check if the header is there to size the image
+    if(png->ihdr == NULL)
+        return false;
+    IHDR ihdr = *png->ihdr;
+    ihdr.interlace_method = 0;
+
+    // filter and compress, flushing fully at every indexed segment
+    size_t length;
+    int level = options != NULL ? options->level : DEFLATE_DEFAULT_LEVEL;
+    unsigned int index_rows = options != NULL ? options->index_rows : 0;
+    if(index_rows >= ihdr.height)
+        index_rows = 0;
+    unsigned char* scanlines = png_filter(&ihdr, pixels, options, &length);
+    if(scanlines == NULL)
+        return false;
+    POOL* pool = pool_create(0);
+    DEFLATE_STREAM stream;
+    bool compressed = deflate_parallel(scanlines, length,
+                        (size_t) index_rows * (png_row_bytes(&ihdr, ihdr.width) + 1), level, pool,
+                        &stream);
+    pool_free(pool);
+    free(scanlines);
+    if(!compressed) {
+        deflate_stream_free(&stream);
+        return false;
+    }
+
+    // index where each segment starts in the zlib stream, if it fits
+    FFIX ffix = { index_rows, 0, NULL };
+    if(index_rows > 0) {
+        ffix.offsets = malloc(sizeof(uint32_t) * stream.num_pieces);
+        if(ffix.offsets == NULL) {
+            printf("Unable to allocate memory");
+            deflate_stream_free(&stream);
+            return false;
+        }
+        size_t offset = 2;
+        for(size_t i = 0; i < stream.num_pieces && offset <= UINT32_MAX; i++) {
+            if(stream.pieces[i].restart)
+                ffix.offsets[ffix.count++] = (uint32_t) offset;
+            offset += stream.pieces[i].out.length;
+        }
+        if(offset > UINT32_MAX)
+            ffix.count = 0;
+    }
+
+    unsigned char header[2];
+    unsigned char trailer[4];
+    deflate_zlib_header(level, header);
+    for(int i = 0; i < 4; i++)
+        trailer[i] = (unsigned char) (stream.adler >> (8 * (3 - i)));
+
+    SINK sink;
+    if(!sink_open(&sink, file)) {
+        deflate_stream_free(&stream);
+        free(ffix.offsets);
+        return false;
+    }
+
+    // write the header chunks, then every piece as its own IDAT chunks
+    sink_write(&sink, PNG_HEADER, 8);
+    bool written = ihdr_write(&ihdr, &sink);
+    if(png->plte != NULL)
+        written = written && plte_write(png->plte, &sink);
+    if(png->plte != NULL && png->plte->num_alpha > 0)
+        written = written && trns_write(png->plte, &sink);
+    if(ffix.count > 0)
+        written = written && ffix_write(&ffix, &sink);
+    for(size_t i = 0; i < stream.num_pieces && written; i++)
+        written = idat_piece_write(stream.pieces + i, i == 0 ? header : NULL,
+                                    i == stream.num_pieces - 1 ? trailer : NULL, &sink);
+    written = written && chunk_write(&sink, IEND_HEADER, NULL, 0);
+
+    deflate_stream_free(&stream);
+    free(ffix.offsets);
+    return sink_close(&sink) && written;
+}
+
+/// @brief The png_reencode function decodes a read image and encodes it again
+///        with new settings.
+/// @param png The PNG struct to re-encode.
+/// @param options How to choose each row's filter, or NULL for the default.
+/// @param file The file to write to.
+/// @return True if the file was written, false otherwise.
+bool png_reencode(PNG* png, const PNG_ENCODE_OPTIONS* options, FILE* file) {
+    if(png->ihdr == NULL)
+        return false;
+
+    // interlaced images come back deinterlaced and are written without it
+    size_t length;
+    unsigned char* scanlines = png_decode(png, NULL, &length);
+    if(scanlines == NULL)
+        return false;
+
+    // drop the filter type bytes to leave plain rows of pixels
+    size_t row_bytes = png_row_bytes(png->ihdr, png->ihdr->width);
+    for(unsigned int y = 0; y < png->ihdr->height; y++)
+        memmove(scanlines + (size_t) y * row_bytes, scanlines + (size_t) y * (row_bytes + 1) + 1,
+                row_bytes);
+
+    bool written = png_encode(png, scanlines, options, file);
+    free(scanlines);
+    return written;
+}
+
 /// @brief The png_free function frees the memory allocated to a PNG struct.
 /// @param png The PNG struct to free.
 void png_free(PNG* png) {
@@ -542,11 +1800,17 @@ void png_free(PNG* png) {
     // free the PLTE chunk if it exists
     if(png->plte != NULL)
         free(png->plte);
+
+    // free the ffIX chunk if it exists
+    if(png->ffix != NULL) {
+        free(png->ffix->offsets);
+        free(png->ffix);
+    }
     
     // free the IDAT chunks if they exist
     if(png->idat != NULL) {
         for(unsigned int i = 0; i < png->num_idat_chunks; i++) {
-            if(png->idat[i].data != NULL)
+            if(png->idat[i].data != NULL && !png->idat[i].borrowed)
                 free(png->idat[i].data);
         }
         free(png->idat);
@@ -556,6 +1820,197 @@ void png_free(PNG* png) {
     if(png->iend != NULL)
         free(png->iend);
 
+    // free the animation chunks if they exist
+    free(png->actl);
+    free(png->frames);
+    if(png->fdat != NULL) {
+        for(unsigned int i = 0; i < png->num_fdat_chunks; i++)
+            if(!png->fdat[i].borrowed)
+                free(png->fdat[i].data);
+        free(png->fdat);
+    }
+
     // free the PNG struct    
     free(png);
 }
+
+/// @brief The png_stream function walks the chunks of a PNG one window at a
+///        time, verifying each CRC as the data goes by and handing the chunk
+///        to the callbacks. Only one window of data is held at once, so files
+///        far larger than memory can be processed.
+/// @param src The source to read from.
+/// @param callbacks The callbacks to hand chunks to, or NULL to only verify.
+/// @return True if every chunk was valid and accepted, false otherwise.
+bool png_stream(SOURCE* src, PNG_CALLBACKS* callbacks) {
+    // check the header
+    const unsigned char* signature = source_read(src, 8);
+    if(signature == NULL || memcmp(signature, PNG_HEADER, 8) != 0) {
+        printf("Invalid PNG header\n");
+        return false;
+    }
+
+    char chunk_type[5];
+    chunk_type[4] = '\0';
+    bool ended = false;
+    while(!ended && !source_at_end(src)) {
+        // read the chunk size and type
+        const unsigned char* data = source_read(src, 8);
+        READ_CHECK(data);
+        uint32_t chunk_size = get_u32(data);
+        memcpy(chunk_type, data + 4, 4);
+        if(chunk_size > 0x7FFFFFFF) {
+            printf("Invalid chunk length\n");
+            return false;
+        }
+        ended = is_iend_header(chunk_type);
+        if(callbacks != NULL && !callbacks->begin(callbacks->user, chunk_type, chunk_size))
+            return false;
+
+        // pass the data through one window at a time, checksumming as it goes
+        unsigned long calc_crc = crc_update(0xffffffffL, (const unsigned char*) chunk_type, 4);
+        uint32_t left = chunk_size;
+        while(left > 0) {
+            size_t length = left < PNG_STREAM_WINDOW ? left : PNG_STREAM_WINDOW;
+            data = source_read(src, length);
+            READ_CHECK(data);
+            calc_crc = crc_update(calc_crc, data, length);
+            if(callbacks != NULL && !callbacks->data(callbacks->user, data, length))
+                return false;
+            left -= length;
+        }
+
+        // check the CRC before the chunk is finished
+        data = source_read(src, 4);
+        READ_CHECK(data);
+        if((calc_crc ^ 0xffffffffL) != get_u32(data)) {
+            printf("Invalid PNG: Failed CRC Check\n");
+            return false;
+        }
+        if(callbacks != NULL && !callbacks->end(callbacks->user))
+            return false;
+    }
+
+    if(!ended) {
+        printf("Missing IEND chunk\n");
+        return false;
+    }
+
+    return true;
+}
+
+/// @brief The writer_flush_idat function writes pending re-chunked IDAT data.
+/// @param writer The stream writer.
+/// @return True if the data was written, false otherwise.
+static bool writer_flush_idat(PNG_STREAM_WRITER* writer) {
+    if(writer->pending_length == 0)
+        return true;
+
+    bool written = chunk_write(&writer->sink, IDAT_HEADER, writer->pending,
+                                writer->pending_length);
+    writer->pending_length = 0;
+
+    return written;
+}
+
+/// @brief The writer_begin function starts copying a chunk.
+/// @param user The stream writer.
+/// @param type The chunk type.
+/// @param length The length of the chunk data.
+/// @return True if the chunk was started, false otherwise.
+static bool writer_begin(void* user, const char* type, uint32_t length) {
+    PNG_STREAM_WRITER* writer = user;
+
+    // IDAT data is collected into chunks of the requested size
+    writer->skip = false;
+    writer->in_idat = writer->idat_size > 0 && is_idat_header(type);
+    if(writer->in_idat)
+        return true;
+    if(!writer_flush_idat(writer))
+        return false;
+
+    // ancillary chunks have a lowercase first letter
+    writer->skip = writer->strip && (type[0] & 0x20);
+    if(writer->skip)
+        return true;
+
+    sink_write_u32(&writer->sink, length);
+    sink_crc_begin(&writer->sink);
+    return sink_write(&writer->sink, type, 4);
+}
+
+/// @brief The writer_data function copies a window of chunk data.
+/// @param user The stream writer.
+/// @param data The chunk data.
+/// @param length The length of the chunk data.
+/// @return True if the data was copied, false otherwise.
+static bool writer_data(void* user, const unsigned char* data, size_t length) {
+    PNG_STREAM_WRITER* writer = user;
+
+    if(writer->skip)
+        return true;
+    if(!writer->in_idat)
+        return sink_write(&writer->sink, data, length);
+
+    // fill the pending IDAT chunk, writing it out every time it is full
+    while(length > 0) {
+        size_t count = writer->idat_size - writer->pending_length;
+        if(count > length)
+            count = length;
+        memcpy(writer->pending + writer->pending_length, data, count);
+        writer->pending_length += count;
+        data += count;
+        length -= count;
+        if(writer->pending_length == writer->idat_size && !writer_flush_idat(writer))
+            return false;
+    }
+
+    return true;
+}
+
+/// @brief The writer_end function finishes copying a chunk.
+/// @param user The stream writer.
+/// @return True if the chunk was finished, false otherwise.
+static bool writer_end(void* user) {
+    PNG_STREAM_WRITER* writer = user;
+
+    if(writer->skip || writer->in_idat)
+        return true;
+
+    return sink_crc_end(&writer->sink);
+}
+
+/// @brief The png_stream_copy function copies a PNG chunk by chunk, using
+///        only O(chunk) memory no matter how large the file is.
+/// @param src The source to read from.
+/// @param file The file to write to.
+/// @param idat_size The size to re-chunk IDAT data to, or 0 to keep the
+///        chunking of the input.
+/// @param strip Whether to drop ancillary chunks.
+/// @return True if the PNG was copied, false otherwise.
+bool png_stream_copy(SOURCE* src, FILE* file, uint32_t idat_size, bool strip) {
+    // set up the writer
+    PNG_STREAM_WRITER writer;
+    writer.idat_size = idat_size;
+    writer.strip = strip;
+    writer.skip = false;
+    writer.in_idat = false;
+    writer.pending_length = 0;
+    writer.pending = NULL;
+    if(idat_size > 0) {
+        writer.pending = malloc(idat_size);
+        MEM_CHECK(writer.pending);
+    }
+    if(!sink_open(&writer.sink, file)) {
+        free(writer.pending);
+        return false;
+    }
+
+    // write the header and stream every chunk across
+    sink_write(&writer.sink, PNG_HEADER, 8);
+    PNG_CALLBACKS callbacks = { writer_begin, writer_data, writer_end, &writer };
+    bool copied = png_stream(src, &callbacks);
+
+    free(writer.pending);
+
+    return sink_close(&writer.sink) && copied;
+}
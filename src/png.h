@@ -13,12 +13,23 @@
 #include <string.h>
 #include <math.h>
 
+#include "source.h"
+#include "sink.h"
+#include "filter.h"
+#include "palette.h"
+#include "pixel.h"
+
 // define png headers
 #define PNG_HEADER "\x89\x50\x4E\x47\x0D\x0A\x1A\x0A"
 #define IHDR_HEADER "\x49\x48\x44\x52"
 #define PLTE_HEADER "\x50\x4C\x54\x45"
 #define IDAT_HEADER "\x49\x44\x41\x54"
 #define IEND_HEADER "\x49\x45\x4E\x44"
+#define TRNS_HEADER "\x74\x52\x4E\x53"
+#define FFIX_HEADER "\x66\x66\x49\x58"
+#define ACTL_HEADER "\x61\x63\x54\x4C"
+#define FCTL_HEADER "\x66\x63\x54\x4C"
+#define FDAT_HEADER "\x66\x64\x41\x54"
 #define IEND_CRC "\xAE\x42\x60\x82"
 
 /// @brief IHDR chunk
@@ -33,11 +44,11 @@ typedef struct {
     unsigned char crc[5];
 } IHDR;
 
-/// @brief PLTE chunk
+/// @brief PLTE chunk, with any tRNS alpha folded into the same entries
 typedef struct {
-    unsigned char red;
-    unsigned char green;
-    unsigned char blue;
+    uint32_t entries[PALETTE_SIZE]; ///< RGBA lookup table, see palette_pack
+    unsigned int num_entries; ///< number of colors in the chunk
+    unsigned int num_alpha; ///< number of entries given an alpha by tRNS
     unsigned char crc[5];
 } PLTE;
 
@@ -46,6 +57,7 @@ typedef struct {
     unsigned char* data;
     unsigned int length;
     unsigned char crc[5];
+    bool borrowed;
 } IDAT;
 
 /// @brief IEND chunk
@@ -53,38 +65,181 @@ typedef struct {
     unsigned char crc[5];
 } IEND;
 
-/// @brief PNG file with all preceding chunks
+/// @brief ffIX chunk, a private index of the full flush points in the image
+///        data. Each segment of rows starts at a byte in the zlib stream where
+///        no earlier data is referenced, with a None or Sub filtered row, so
+///        the segments can be decoded in parallel.
+typedef struct {
+    unsigned int rows; ///< number of rows in every segment but the last
+    unsigned int count; ///< number of segments
+    uint32_t* offsets; ///< offset of each segment in the zlib stream
+} FFIX;
+
+// fcTL dispose operations, applied to the frame's region after it is shown
+#define FCTL_DISPOSE_NONE 0
+#define FCTL_DISPOSE_BACKGROUND 1
+#define FCTL_DISPOSE_PREVIOUS 2
+
+// fcTL blend operations, for drawing the frame onto the canvas
+#define FCTL_BLEND_SOURCE 0
+#define FCTL_BLEND_OVER 1
+
+/// @brief acTL chunk
+typedef struct {
+    unsigned int num_frames; ///< number of frames in the animation
+    unsigned int num_plays; ///< times to play the animation, 0 for forever
+    unsigned char crc[5];
+} ACTL;
+
+/// @brief fcTL chunk, with where its frame's image data was found
+typedef struct {
+    unsigned int width;
+    unsigned int height;
+    unsigned int x_offset;
+    unsigned int y_offset;
+    uint16_t delay_num; ///< frame delay numerator, in seconds
+    uint16_t delay_den; ///< frame delay denominator, 0 meaning 100
+    unsigned char dispose_op;
+    unsigned char blend_op;
+    bool default_image; ///< whether the frame's data is the IDAT chunks
+    unsigned int first_chunk; ///< index of the frame's first fdAT chunk
+    unsigned int num_chunks; ///< number of fdAT chunks in the frame
+} FCTL;
+
+/// @brief PNG file with all preceding chunks. The fdAT chunks are kept as
+///        IDAT structs whose data still starts with the sequence number.
 typedef struct {
     IHDR* ihdr;
     PLTE* plte;
+    FFIX* ffix;
     IDAT* idat;
     IEND* iend;
     unsigned int num_idat_chunks;
+    ACTL* actl;
+    FCTL* frames;
+    unsigned int num_frames;
+    IDAT* fdat;
+    unsigned int num_fdat_chunks;
+    unsigned int sequence; ///< next fcTL or fdAT sequence number expected
 } PNG;
 
+/// @brief Settings for png_encode
+typedef struct {
+    FILTER_STRATEGY strategy; ///< how each row's filter type is chosen
+    unsigned char filter; ///< filter type used by FILTER_STRATEGY_FIXED
+    int level; ///< DEFLATE compression level, 0 to DEFLATE_MAX_LEVEL
+    unsigned int index_rows; ///< rows between indexed full flush points, 0 for none
+} PNG_ENCODE_OPTIONS;
+
+/// @brief Called once the first Adam7 passes of an interlaced image are
+///        decoded, with the whole image filled in from the pixels so far
+typedef void (*PNG_PREVIEW_FUNC)(void* user, const unsigned char* scanlines, int passes);
+
+/// @brief Settings for png_decode
+typedef struct {
+    int preview_passes; ///< Adam7 passes to decode before the preview, 0 for none
+    PNG_PREVIEW_FUNC preview; ///< called with the preview of an interlaced image
+    void* user; ///< passed to the preview function
+} PNG_DECODE_OPTIONS;
+
+/// @brief The largest IDAT chunk png_encode writes.
+#define PNG_IDAT_MAX (1 << 20)
+
+/// @brief The size of the window png_stream reads chunk data through.
+#define PNG_STREAM_WINDOW (1 << 16)
+
+/// @brief Called when png_stream reaches the start of a chunk
+typedef bool (*PNG_CHUNK_BEGIN)(void* user, const char* type, uint32_t length);
+
+/// @brief Called with each window of a chunk's data
+typedef bool (*PNG_CHUNK_DATA)(void* user, const unsigned char* data, size_t length);
+
+/// @brief Called once a chunk's CRC has been verified
+typedef bool (*PNG_CHUNK_END)(void* user);
+
+/// @brief Callbacks png_stream hands every chunk to
+typedef struct {
+    PNG_CHUNK_BEGIN begin;
+    PNG_CHUNK_DATA data;
+    PNG_CHUNK_END end;
+    void* user;
+} PNG_CALLBACKS;
+
+/// @brief State for copying a PNG stream to a sink
+typedef struct {
+    SINK sink;
+    uint32_t idat_size; ///< size to re-chunk IDAT data to, 0 keeps the input's
+    bool strip; ///< whether ancillary chunks are dropped
+    bool skip; ///< whether the current chunk is being dropped
+    bool in_idat; ///< whether the current chunk is being re-chunked
+    unsigned char* pending; ///< IDAT data waiting to fill a chunk
+    uint32_t pending_length; ///< number of bytes of pending IDAT data
+} PNG_STREAM_WRITER;
+
 // header checker functions
 bool is_png_header(const char* header);
 bool is_ihdr_header(const char* header);
 bool is_plte_header(const char* header);
 bool is_idat_header(const char* header);
 bool is_iend_header(const char* header);
+bool is_trns_header(const char* header);
+bool is_ffix_header(const char* header);
+bool is_actl_header(const char* header);
+bool is_fctl_header(const char* header);
+bool is_fdat_header(const char* header);
 
 // chunk reader functions
-bool read_ihdr(PNG* png, FILE* file, int length);
-bool read_plte(PNG* png, FILE* file, int length);
-bool read_idat(PNG* png, FILE* file, int length);
-bool read_iend(PNG* png, FILE* file);
+bool read_ihdr(PNG* png, SOURCE* src, int length);
+bool read_plte(PNG* png, SOURCE* src, int length);
+bool read_trns(PNG* png, SOURCE* src, int length);
+bool read_ffix(PNG* png, SOURCE* src, int length);
+bool read_idat(PNG* png, SOURCE* src, int length);
+bool read_actl(PNG* png, SOURCE* src, int length);
+bool read_fctl(PNG* png, SOURCE* src, int length);
+bool read_fdat(PNG* png, SOURCE* src, int length);
+bool read_iend(PNG* png, SOURCE* src);
+
+// chunk verifier functions
+bool png_verify_idat(PNG* png);
 
 // chunk writer functions
-bool write_ihdr(PNG* png, FILE* file);
-bool write_plte(PNG* png, FILE* file);
-bool write_idat(PNG* png, FILE* file);
-bool write_iend(PNG* png, FILE* file);
+bool ihdr_write(IHDR* ihdr, SINK* sink);
+bool plte_write(PLTE* plte, SINK* sink);
+bool trns_write(PLTE* plte, SINK* sink);
+bool ffix_write(FFIX* ffix, SINK* sink);
+bool idat_write(PNG* png, SINK* sink);
+bool actl_write(ACTL* actl, SINK* sink);
+bool fctl_write(FCTL* fctl, uint32_t sequence, SINK* sink);
+bool fdat_write(IDAT* fdat, uint32_t sequence, SINK* sink);
+bool iend_write(IEND* iend, SINK* sink);
 
 // PNG functions
 PNG* png_create(void);
-bool png_read(PNG* png, FILE* file);
+bool png_read(PNG* png, SOURCE* src);
 bool png_write(PNG* png, FILE* file);
 void png_free(PNG* png);
 
+// image data functions
+unsigned int png_channels(unsigned char color_type);
+size_t png_row_bytes(IHDR* ihdr, unsigned int width);
+bool png_pass_size(IHDR* ihdr, int pass, unsigned int* width, unsigned int* height);
+size_t png_raw_size(IHDR* ihdr);
+bool png_inflate(PNG* png, unsigned char* scanlines, size_t length);
+unsigned int png_filter_bpp(IHDR* ihdr);
+bool png_unfilter(IHDR* ihdr, unsigned char* scanlines);
+unsigned char* png_decode(PNG* png, const PNG_DECODE_OPTIONS* options, size_t* length);
+unsigned char* png_expand_palette(PNG* png, const unsigned char* scanlines, bool alpha,
+                                    size_t* length);
+void* png_unpack(PNG* png, const unsigned char* scanlines, PIXEL_FORMAT format, size_t* length);
+unsigned char* png_pack(PNG* png, const void* pixels, PIXEL_FORMAT format, size_t* length);
+unsigned char* png_filter(IHDR* ihdr, const unsigned char* pixels,
+                            const PNG_ENCODE_OPTIONS* options, size_t* length);
+bool png_encode(PNG* png, const unsigned char* pixels, const PNG_ENCODE_OPTIONS* options,
+                    FILE* file);
+bool png_reencode(PNG* png, const PNG_ENCODE_OPTIONS* options, FILE* file);
+
+// PNG streaming functions
+bool png_stream(SOURCE* src, PNG_CALLBACKS* callbacks);
+bool png_stream_copy(SOURCE* src, FILE* file, uint32_t idat_size, bool strip);
+
 #endif
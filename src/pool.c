@@ -0,0 +1,188 @@
+///
+/// @file pool.c
+/// @brief Thread pool implementation
+/// @author Sam Cordry
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <unistd.h>
+
+#include "pool.h"
+
+/// @brief The largest number of threads a default pool will start.
+#define POOL_MAX_THREADS 16
+
+/// @brief The pool_default_threads function picks a thread count from the
+///        number of online cores.
+/// @return The number of threads to use.
+int pool_default_threads(void) {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    if(cores < 1)
+        return 1;
+    if(cores > POOL_MAX_THREADS)
+        return POOL_MAX_THREADS;
+    return (int) cores;
+}
+
+/// @brief The pool_worker function runs queued jobs until the pool stops.
+/// @param arg The pool the worker belongs to.
+/// @return Always NULL.
+static void* pool_worker(void* arg) {
+    POOL* pool = arg;
+
+    pthread_mutex_lock(&pool->lock);
+    while(true) {
+        // sleep until there is work or the pool is shutting down
+        while(pool->count == 0 && !pool->stopping)
+            pthread_cond_wait(&pool->work, &pool->lock);
+        if(pool->count == 0 && pool->stopping)
+            break;
+
+        // take the next job off the queue
+        POOL_JOB job = pool->jobs[pool->head];
+        pool->head = (pool->head + 1) % pool->capacity;
+        pool->count--;
+        pool->active++;
+
+        // run the job without holding the lock
+        pthread_mutex_unlock(&pool->lock);
+        job.task(job.arg);
+        pthread_mutex_lock(&pool->lock);
+
+        // wake any waiters once everything has drained
+        pool->active--;
+        if(pool->count == 0 && pool->active == 0)
+            pthread_cond_broadcast(&pool->idle);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+/// @brief The pool_create function starts a pool of worker threads.
+/// @param num_threads The number of threads, or 0 for one per core. A pool
+///        with a single thread runs every job inline in pool_submit.
+/// @return A pointer to the pool, or NULL on failure.
+POOL* pool_create(int num_threads) {
+    // allocate memory for the pool
+    POOL* pool = malloc(sizeof(POOL));
+    if(pool == NULL)
+        return NULL;
+
+    if(num_threads <= 0)
+        num_threads = pool_default_threads();
+
+    // initialize the pool
+    pool->threads = NULL;
+    pool->num_threads = 0;
+    pool->capacity = 64;
+    pool->head = 0;
+    pool->count = 0;
+    pool->active = 0;
+    pool->stopping = false;
+    pool->jobs = malloc(sizeof(POOL_JOB) * pool->capacity);
+    if(pool->jobs == NULL) {
+        free(pool);
+        return NULL;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work, NULL);
+    pthread_cond_init(&pool->idle, NULL);
+
+    // a single thread gains nothing from a worker, so run jobs inline
+    if(num_threads == 1)
+        return pool;
+
+    // start the workers, keeping however many were started successfully
+    pool->threads = malloc(sizeof(pthread_t) * num_threads);
+    if(pool->threads == NULL)
+        return pool;
+    for(int i = 0; i < num_threads; i++) {
+        if(pthread_create(&pool->threads[i], NULL, pool_worker, pool) != 0)
+            break;
+        pool->num_threads++;
+    }
+
+    return pool;
+}
+
+/// @brief The pool_submit function queues a job on the pool.
+/// @param pool The pool to run the job on.
+/// @param task The function to run.
+/// @param arg The argument to pass to the function.
+/// @return True if the job was queued or run, false otherwise.
+bool pool_submit(POOL* pool, POOL_TASK task, void* arg) {
+    if(pool == NULL || task == NULL)
+        return false;
+
+    // without workers the job runs right away
+    if(pool->num_threads == 0) {
+        task(arg);
+        return true;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+
+    // grow the queue if it is full, unrolling the circular order
+    if(pool->count == pool->capacity) {
+        POOL_JOB* jobs = malloc(sizeof(POOL_JOB) * pool->capacity * 2);
+        if(jobs == NULL) {
+            pthread_mutex_unlock(&pool->lock);
+            return false;
+        }
+        for(int i = 0; i < pool->count; i++)
+            jobs[i] = pool->jobs[(pool->head + i) % pool->capacity];
+        free(pool->jobs);
+        pool->jobs = jobs;
+        pool->head = 0;
+        pool->capacity *= 2;
+    }
+
+    // add the job to the end of the queue
+    pool->jobs[(pool->head + pool->count) % pool->capacity].task = task;
+    pool->jobs[(pool->head + pool->count) % pool->capacity].arg = arg;
+    pool->count++;
+    pthread_cond_signal(&pool->work);
+
+    pthread_mutex_unlock(&pool->lock);
+
+    return true;
+}
+
+/// @brief The pool_wait function blocks until every queued job has finished.
+/// @param pool The pool to wait on.
+void pool_wait(POOL* pool) {
+    if(pool == NULL || pool->num_threads == 0)
+        return;
+
+    pthread_mutex_lock(&pool->lock);
+    while(pool->count > 0 || pool->active > 0)
+        pthread_cond_wait(&pool->idle, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/// @brief The pool_free function finishes queued jobs and frees the pool.
+/// @param pool The pool to free.
+void pool_free(POOL* pool) {
+    // check if the pool exists
+    if(pool == NULL)
+        return;
+
+    // tell the workers to stop once the queue is empty
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = true;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+
+    // join the workers
+    for(int i = 0; i < pool->num_threads; i++)
+        pthread_join(pool->threads[i], NULL);
+
+    // free the pool
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->work);
+    pthread_cond_destroy(&pool->idle);
+    free(pool->threads);
+    free(pool->jobs);
+    free(pool);
+}
@@ -0,0 +1,45 @@
+///
+/// @file pool.h
+/// @brief Thread pool header
+/// @author Sam Cordry
+
+#ifndef POOL_H
+#define POOL_H
+
+// include needed system libraries
+#include <stdlib.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+/// @brief A unit of work run by the pool
+typedef void (*POOL_TASK)(void* arg);
+
+/// @brief Queued task and its argument
+typedef struct {
+    POOL_TASK task; ///< function to run
+    void* arg; ///< argument passed to the function
+} POOL_JOB;
+
+/// @brief Fixed-size pool of worker threads sharing one job queue
+typedef struct {
+    pthread_t* threads; ///< worker threads
+    int num_threads; ///< number of worker threads, 0 runs jobs inline
+    POOL_JOB* jobs; ///< circular job queue
+    int capacity; ///< capacity of the job queue
+    int head; ///< index of the next job to run
+    int count; ///< number of queued jobs
+    int active; ///< number of jobs currently running
+    bool stopping; ///< set when the pool is being freed
+    pthread_mutex_t lock; ///< guards the queue
+    pthread_cond_t work; ///< signalled when a job is queued
+    pthread_cond_t idle; ///< signalled when the pool runs out of work
+} POOL;
+
+// pool functions
+int pool_default_threads(void);
+POOL* pool_create(int num_threads);
+bool pool_submit(POOL* pool, POOL_TASK task, void* arg);
+void pool_wait(POOL* pool);
+void pool_free(POOL* pool);
+
+#endif
@@ -0,0 +1,132 @@
+///
+/// @file sink.c
+/// @brief Output sink implementation
+/// @author Sam Cordry
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "sink.h"
+#include "crc.h"
+
+/// @brief The sink_open function starts buffering output to a stream.
+/// @param sink The sink to open.
+/// @param file The stream to write to.
+/// @return True if the sink was opened, false otherwise.
+bool sink_open(SINK* sink, FILE* file) {
+    sink->file = file;
+    sink->length = 0;
+    sink->crc = 0;
+    sink->crc_active = false;
+    sink->error = false;
+
+    // allocate the buffer on a cache line boundary
+    void* buffer = NULL;
+    if(file == NULL || posix_memalign(&buffer, SINK_ALIGNMENT, SINK_BUFFER_SIZE) != 0) {
+        sink->buffer = NULL;
+        return false;
+    }
+    sink->buffer = buffer;
+
+    return true;
+}
+
+/// @brief The sink_flush function writes every pending byte to the stream.
+/// @param sink The sink to flush.
+/// @return True if nothing has failed so far, false otherwise.
+bool sink_flush(SINK* sink) {
+    if(sink->length > 0 && !sink->error &&
+                fwrite(sink->buffer, 1, sink->length, sink->file) != sink->length)
+        sink->error = true;
+    sink->length = 0;
+
+    return !sink->error;
+}
+
+/// @brief The sink_close function flushes the sink and frees its buffer. The
+///        stream itself is left open.
+/// @param sink The sink to close.
+/// @return True if everything was written, false otherwise.
+bool sink_close(SINK* sink) {
+    bool written = sink->buffer != NULL && sink_flush(sink) && fflush(sink->file) == 0;
+
+    free(sink->buffer);
+    sink->buffer = NULL;
+
+    return written;
+}
+
+/// @brief The sink_write function writes a block of bytes. Blocks too large
+///        for the buffer are handed to the stream whole, right after whatever
+///        was already pending.
+/// @param sink The sink to write to.
+/// @param data The bytes to write.
+/// @param length The number of bytes to write.
+/// @return True if nothing has failed so far, false otherwise.
+bool sink_write(SINK* sink, const void* data, size_t length) {
+    if(sink->crc_active)
+        sink->crc = crc_update(sink->crc, data, length);
+
+    // small writes are collected in the buffer
+    if(length <= SINK_BUFFER_SIZE - sink->length) {
+        memcpy(sink->buffer + sink->length, data, length);
+        sink->length += length;
+        return !sink->error;
+    }
+
+    // large writes flush the buffer and then go out in one call
+    if(!sink_flush(sink))
+        return false;
+    if(length >= SINK_BUFFER_SIZE / 2) {
+        if(fwrite(data, 1, length, sink->file) != length)
+            sink->error = true;
+    } else {
+        memcpy(sink->buffer, data, length);
+        sink->length = length;
+    }
+
+    return !sink->error;
+}
+
+/// @brief The sink_write_u8 function writes a single byte.
+/// @param sink The sink to write to.
+/// @param value The byte to write.
+/// @return True if nothing has failed so far, false otherwise.
+bool sink_write_u8(SINK* sink, uint8_t value) {
+    return sink_write(sink, &value, 1);
+}
+
+/// @brief The sink_write_u16 function writes a big-endian 16-bit value.
+/// @param sink The sink to write to.
+/// @param value The value to write.
+/// @return True if nothing has failed so far, false otherwise.
+bool sink_write_u16(SINK* sink, uint16_t value) {
+    unsigned char data[2] = { (unsigned char) (value >> 8), (unsigned char) value };
+    return sink_write(sink, data, 2);
+}
+
+/// @brief The sink_write_u32 function writes a big-endian 32-bit value.
+/// @param sink The sink to write to.
+/// @param value The value to write.
+/// @return True if nothing has failed so far, false otherwise.
+bool sink_write_u32(SINK* sink, uint32_t value) {
+    unsigned char data[4] = { (unsigned char) (value >> 24), (unsigned char) (value >> 16),
+                                (unsigned char) (value >> 8), (unsigned char) value };
+    return sink_write(sink, data, 4);
+}
+
+/// @brief The sink_crc_begin function starts a CRC over everything written
+///        until sink_crc_end.
+/// @param sink The sink to checksum.
+void sink_crc_begin(SINK* sink) {
+    sink->crc = 0xffffffffL;
+    sink->crc_active = true;
+}
+
+/// @brief The sink_crc_end function stops the running CRC and writes it out
+///        as a big-endian 32-bit value.
+/// @param sink The sink to checksum.
+/// @return True if nothing has failed so far, false otherwise.
+bool sink_crc_end(SINK* sink) {
+    sink->crc_active = false;
+    return sink_write_u32(sink, (uint32_t) (sink->crc ^ 0xffffffffL));
+}
@@ -0,0 +1,47 @@
+///
+/// @file sink.h
+/// @brief Output sink header, shared by all of the file format writers
+/// @author Sam Cordry
+
+#ifndef SINK_H
+#define SINK_H
+
+// include needed system libraries
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+/// @brief The size of the buffer writes are collected in.
+#define SINK_BUFFER_SIZE (1 << 18)
+
+/// @brief The alignment of the sink buffer.
+#define SINK_ALIGNMENT 64
+
+/// @brief Buffered output sink that can checksum what it writes
+typedef struct {
+    FILE* file; ///< stream to write to
+    unsigned char* buffer; ///< aligned buffer of pending bytes
+    size_t length; ///< number of pending bytes
+    unsigned long crc; ///< running CRC register
+    bool crc_active; ///< whether written bytes are added to the CRC
+    bool error; ///< set once a write to the stream has failed
+} SINK;
+
+// open and close functions
+bool sink_open(SINK* sink, FILE* file);
+bool sink_flush(SINK* sink);
+bool sink_close(SINK* sink);
+
+// write functions
+bool sink_write(SINK* sink, const void* data, size_t length);
+bool sink_write_u8(SINK* sink, uint8_t value);
+bool sink_write_u16(SINK* sink, uint16_t value);
+bool sink_write_u32(SINK* sink, uint32_t value);
+
+// CRC functions
+void sink_crc_begin(SINK* sink);
+bool sink_crc_end(SINK* sink);
+
+#endif
@@ -0,0 +1,344 @@
+///
+/// @file source.c
+/// @brief Input source implementation
+/// @author Sam Cordry
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "source.h"
+
+/// @brief The source_init function resets a source to an empty state.
+/// @param src The source to reset.
+static void source_init(SOURCE* src) {
+    src->data = NULL;
+    src->length = 0;
+    src->pos = 0;
+    src->offset = 0;
+    src->persistent = false;
+    src->map = NULL;
+    src->map_length = 0;
+    src->file = NULL;
+    src->owns_file = false;
+    src->buffer = NULL;
+    src->capacity = 0;
+    src->eof = false;
+}
+
+/// @brief The source_open_file function opens a file as a source, mapping it
+///        into memory when possible and falling back to a buffered stream.
+/// @param src The source to open.
+/// @param filename The name of the file to open.
+/// @return True if the file was opened, false otherwise.
+bool source_open_file(SOURCE* src, const char* filename) {
+    source_init(src);
+
+    // try to map the whole file
+    int fd = open(filename, O_RDONLY);
+    if(fd < 0)
+        return false;
+    struct stat info;
+    if(fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0) {
+        void* map = mmap(NULL, (size_t) info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(map != MAP_FAILED) {
+            posix_madvise(map, (size_t) info.st_size, POSIX_MADV_SEQUENTIAL);
+            close(fd);
+            src->map = map;
+            src->map_length = (size_t) info.st_size;
+            src->data = map;
+            src->length = src->map_length;
+            src->persistent = true;
+            return true;
+        }
+    }
+    close(fd);
+
+    // fall back to reading the file as a stream
+    FILE* file = fopen(filename, "rb");
+    if(file == NULL)
+        return false;
+    if(!source_open_stream(src, file)) {
+        fclose(file);
+        return false;
+    }
+    src->owns_file = true;
+
+    return true;
+}
+
+/// @brief The source_open_memory function uses a caller-supplied buffer as a
+///        source. The buffer must outlive the source and anything read from it.
+/// @param src The source to open.
+/// @param data The buffer to read from.
+/// @param length The length of the buffer.
+void source_open_memory(SOURCE* src, const unsigned char* data, size_t length) {
+    source_init(src);
+    src->data = data;
+    src->length = length;
+    src->persistent = true;
+}
+
+/// @brief The source_open_stream function reads a stream through a buffer.
+///        The stream is not closed with the source.
+/// @param src The source to open.
+/// @param file The stream to read from.
+/// @return True if the source was opened, false otherwise.
+bool source_open_stream(SOURCE* src, FILE* file) {
+    source_init(src);
+    if(file == NULL)
+        return false;
+
+    src->buffer = malloc(SOURCE_BUFFER_SIZE);
+    if(src->buffer == NULL)
+        return false;
+    src->capacity = SOURCE_BUFFER_SIZE;
+    src->data = src->buffer;
+    src->file = file;
+
+    return true;
+}
+
+/// @brief The source_close function releases everything held by a source.
+/// @param src The source to close.
+void source_close(SOURCE* src) {
+    if(src == NULL)
+        return;
+
+    if(src->map != NULL)
+        munmap(src->map, src->map_length);
+    if(src->owns_file)
+        fclose(src->file);
+    free(src->buffer);
+
+    source_init(src);
+}
+
+/// @brief The source_ensure function makes the next bytes of the input
+///        available in one contiguous block, reading more of a stream if
+///        needed. This is the only bounds check readers need per chunk.
+/// @param src The source to read from.
+/// @param length The number of bytes needed.
+/// @return True if the bytes are available, false at the end of the input.
+bool source_ensure(SOURCE* src, size_t length) {
+    if(src->length - src->pos >= length)
+        return true;
+    if(src->file == NULL || src->eof)
+        return false;
+
+    // move the unread bytes to the front of the buffer
+    size_t left = src->length - src->pos;
+    memmove(src->buffer, src->buffer + src->pos, left);
+    src->offset += src->pos;
+    src->pos = 0;
+    src->length = left;
+
+    // grow the buffer if the request does not fit
+    if(src->capacity < length) {
+        size_t capacity = src->capacity * 2;
+        if(capacity < length)
+            capacity = length;
+        unsigned char* buffer = realloc(src->buffer, capacity);
+        if(buffer == NULL)
+            return false;
+        src->buffer = buffer;
+        src->capacity = capacity;
+    }
+    src->data = src->buffer;
+
+    // fill as much of the buffer as the stream allows
+    while(src->length < length && !src->eof) {
+        size_t count = fread(src->buffer + src->length, 1,
+                                src->capacity - src->length, src->file);
+        if(count == 0)
+            src->eof = true;
+        src->length += count;
+    }
+
+    return src->length - src->pos >= length;
+}
+
+/// @brief The source_at_end function checks if the input is exhausted.
+/// @param src The source to check.
+/// @return True if there is nothing left to read, false otherwise.
+bool source_at_end(SOURCE* src) {
+    return !source_ensure(src, 1);
+}
+
+/// @brief The source_tell function finds the current offset in the input.
+/// @param src The source to check.
+/// @return The number of bytes read so far.
+size_t source_tell(SOURCE* src) {
+    return src->offset + src->pos;
+}
+
+/// @brief The source_skip function moves past bytes without reading them.
+/// @param src The source to skip in.
+/// @param length The number of bytes to skip.
+/// @return True if the bytes were skipped, false at the end of the input.
+bool source_skip(SOURCE* src, size_t length) {
+    // streams are skipped one buffer at a time so nothing has to grow
+    while(src->length - src->pos < length) {
+        length -= src->length - src->pos;
+        src->pos = src->length;
+        if(!source_ensure(src, length < src->capacity ? length : src->capacity))
+            return false;
+    }
+    src->pos += length;
+
+    return true;
+}
+
+/// @brief The source_read function reads a block of bytes. The returned
+///        pointer stays valid until the next call on a stream source, and
+///        until the source is closed otherwise.
+/// @param src The source to read from.
+/// @param length The number of bytes to read.
+/// @return A pointer to the bytes, or NULL at the end of the input.
+const unsigned char* source_read(SOURCE* src, size_t length) {
+    if(!source_ensure(src, length))
+        return NULL;
+
+    const unsigned char* data = src->data + src->pos;
+    src->pos += length;
+
+    return data;
+}
+
+/// @brief The source_payload function reads a block of bytes that has to
+///        outlive the read. Mapped and memory sources hand back a pointer
+///        into the input itself, streams hand back a heap copy.
+/// @param src The source to read from.
+/// @param length The number of bytes to read.
+/// @param borrowed Set to true if the payload points into the source and
+///        must not be freed or modified.
+/// @return A pointer to the payload, or NULL on failure.
+unsigned char* source_payload(SOURCE* src, size_t length, bool* borrowed) {
+    const unsigned char* data = source_read(src, length);
+    if(data == NULL)
+        return NULL;
+
+    // the input outlives the payload, so it can be used in place
+    if(src->persistent) {
+        *borrowed = true;
+        return (unsigned char*) data;
+    }
+
+    // otherwise the buffer will be reused, so copy the payload out
+    unsigned char* copy = malloc(length > 0 ? length : 1);
+    if(copy != NULL)
+        memcpy(copy, data, length);
+    *borrowed = false;
+
+    return copy;
+}
+
+/// @brief The source_find function finds the next occurrence of a byte
+///        without consuming anything.
+/// @param src The source to search.
+/// @param byte The byte to search for.
+/// @param distance Set to the number of bytes before the match, or to the
+///        number of bytes left in the input if there is no match.
+/// @return True if the byte was found, false otherwise.
+bool source_find(SOURCE* src, unsigned char byte, size_t* distance) {
+    size_t searched = 0;
+
+    while(true) {
+        // search everything that is already available
+        const unsigned char* start = src->data + src->pos;
+        const unsigned char* match = memchr(start + searched, byte,
+                                            src->length - src->pos - searched);
+        if(match != NULL) {
+            *distance = (size_t) (match - start);
+            return true;
+        }
+        searched = src->length - src->pos;
+
+        // pull in more of a stream, if there is any
+        if(!source_ensure(src, searched + 1)) {
+            *distance = src->length - src->pos;
+            return false;
+        }
+    }
+}
+
+/// @brief The source_peek function looks at the next bytes without consuming
+///        anything, pulling in more of a stream until the given number of
+///        bytes is available or the input ends. The pointer stays valid until
+///        the next call on a stream source.
+/// @param src The source to look at.
+/// @param length The number of bytes wanted.
+/// @param available Set to the number of bytes at the returned pointer, which
+///        is less than length only at the end of the input.
+/// @return A pointer to the next unread byte.
+const unsigned char* source_peek(SOURCE* src, size_t length, size_t* available) {
+    source_ensure(src, length);
+    *available = src->length - src->pos;
+
+    return src->data + src->pos;
+}
+
+/// @brief The source_read_u8 function reads a single byte.
+/// @param src The source to read from.
+/// @param value Set to the byte read.
+/// @return True if the byte was read, false at the end of the input.
+bool source_read_u8(SOURCE* src, uint8_t* value) {
+    const unsigned char* data = source_read(src, 1);
+    if(data == NULL)
+        return false;
+    *value = data[0];
+    return true;
+}
+
+/// @brief The source_read_u16 function reads a big-endian 16-bit value.
+/// @param src The source to read from.
+/// @param value Set to the value read.
+/// @return True if the value was read, false at the end of the input.
+bool source_read_u16(SOURCE* src, uint16_t* value) {
+    const unsigned char* data = source_read(src, 2);
+    if(data == NULL)
+        return false;
+    *value = (uint16_t) ((data[0] << 8) | data[1]);
+    return true;
+}
+
+/// @brief The source_read_u32 function reads a big-endian 32-bit value.
+/// @param src The source to read from.
+/// @param value Set to the value read.
+/// @return True if the value was read, false at the end of the input.
+bool source_read_u32(SOURCE* src, uint32_t* value) {
+    const unsigned char* data = source_read(src, 4);
+    if(data == NULL)
+        return false;
+    *value = ((uint32_t) data[0] << 24) | ((uint32_t) data[1] << 16) |
+                ((uint32_t) data[2] << 8) | (uint32_t) data[3];
+    return true;
+}
+
+/// @brief The source_read_u16_le function reads a little-endian 16-bit value.
+/// @param src The source to read from.
+/// @param value Set to the value read.
+/// @return True if the value was read, false at the end of the input.
+bool source_read_u16_le(SOURCE* src, uint16_t* value) {
+    const unsigned char* data = source_read(src, 2);
+    if(data == NULL)
+        return false;
+    *value = (uint16_t) (data[0] | (data[1] << 8));
+    return true;
+}
+
+/// @brief The source_read_u32_le function reads a little-endian 32-bit value.
+/// @param src The source to read from.
+/// @param value Set to the value read.
+/// @return True if the value was read, false at the end of the input.
+bool source_read_u32_le(SOURCE* src, uint32_t* value) {
+    const unsigned char* data = source_read(src, 4);
+    if(data == NULL)
+        return false;
+    *value = (uint32_t) data[0] | ((uint32_t) data[1] << 8) |
+                ((uint32_t) data[2] << 16) | ((uint32_t) data[3] << 24);
+    return true;
+}
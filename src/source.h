@@ -0,0 +1,59 @@
+///
+/// @file source.h
+/// @brief Input source header, shared by all of the file format readers
+/// @author Sam Cordry
+
+#ifndef SOURCE_H
+#define SOURCE_H
+
+// include needed system libraries
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+/// @brief The size of the buffer used when reading from a stream.
+#define SOURCE_BUFFER_SIZE (1 << 16)
+
+/// @brief Input source backed by a memory-mapped file, a caller-supplied
+///        buffer, or a buffered stream
+typedef struct {
+    const unsigned char* data; ///< readable bytes
+    size_t length; ///< number of readable bytes at data
+    size_t pos; ///< read position within data
+    size_t offset; ///< input offset of data[0]
+    bool persistent; ///< data stays valid until the source is closed
+    void* map; ///< mapped region, if the file was mapped
+    size_t map_length; ///< length of the mapped region
+    FILE* file; ///< stream to read from, if not mapped
+    bool owns_file; ///< whether the stream is closed with the source
+    unsigned char* buffer; ///< stream buffer
+    size_t capacity; ///< capacity of the stream buffer
+    bool eof; ///< set once the stream has been read to its end
+} SOURCE;
+
+// open and close functions
+bool source_open_file(SOURCE* src, const char* filename);
+void source_open_memory(SOURCE* src, const unsigned char* data, size_t length);
+bool source_open_stream(SOURCE* src, FILE* file);
+void source_close(SOURCE* src);
+
+// position functions
+bool source_ensure(SOURCE* src, size_t length);
+bool source_at_end(SOURCE* src);
+size_t source_tell(SOURCE* src);
+bool source_skip(SOURCE* src, size_t length);
+
+// read functions
+const unsigned char* source_read(SOURCE* src, size_t length);
+unsigned char* source_payload(SOURCE* src, size_t length, bool* borrowed);
+bool source_find(SOURCE* src, unsigned char byte, size_t* distance);
+const unsigned char* source_peek(SOURCE* src, size_t length, size_t* available);
+bool source_read_u8(SOURCE* src, uint8_t* value);
+bool source_read_u16(SOURCE* src, uint16_t* value);
+bool source_read_u32(SOURCE* src, uint32_t* value);
+bool source_read_u16_le(SOURCE* src, uint16_t* value);
+bool source_read_u32_le(SOURCE* src, uint32_t* value);
+
+#endif
@@ -10,24 +10,10 @@
 #define MEM_CHECK(ptr) if(ptr == NULL) { printf("Unable to allocate memory");\
                                             return false; }
 
-/// @brief The FEOF_CHECK macro checks if the end of the file has been reached.
-#define FEOF_CHECK(file) if(feof(file)) { printf("Unexpected end of file");\
+/// @brief The READ_CHECK macro checks if a read from the source succeeded.
+#define READ_CHECK(ok) if(!(ok)) { printf("Unexpected end of file");\
                                             return false; }
 
-/// @brief The skip_ahead function skips ahead in the file by the given amount.
-/// @param file The file to skip ahead in.
-/// @param amount The amount to skip ahead.
-/// @return True if the file was successfully skipped ahead, false otherwise.
-bool skip_ahead(FILE* file, int amount) {
-    int i;
-    for(i = 0; i < amount; i++) {
-        fgetc(file);
-        FEOF_CHECK(file);
-    }
-
-    return true;
-}
-
 /// @brief The is_little_tiff_header function checks if the given header is a
 ///        little-endian TIFF header.
 /// @param header The header to check.
@@ -55,12 +41,26 @@ bool is_ifd_header(const char* header) {
                 memcmp(header, IFD_HEADER, 2) != 0);
 }
 
-/// @brief The read_ifd function reads an IFD from the given file.
+/// @brief The read_ifd function reads an IFD entry from the given source.
 /// @param ifd The IFD to read into.
-/// @param file The file to read from.
+/// @param src The source to read from.
 /// @return True if the IFD was successfully read, false otherwise.
-bool read_ifd(IFD* ifd, FILE* file) {
-    return false;
+bool read_ifd(IFD* ifd, SOURCE* src) {
+    // read the whole entry at once
+    const unsigned char* data = source_read(src, 12);
+    READ_CHECK(data);
+
+    // copy the fields, which stay in the byte order of the file
+    memcpy(ifd->tag, data, 2);
+    ifd->tag[2] = '\0';
+    memcpy(ifd->type, data + 2, 2);
+    ifd->type[2] = '\0';
+    memcpy(ifd->count, data + 4, 4);
+    ifd->count[4] = '\0';
+    memcpy(ifd->value, data + 8, 4);
+    ifd->value[4] = '\0';
+
+    return true;
 }
 
 /// @brief The tiff_create function creates a TIFF structure.
@@ -72,23 +72,59 @@ TIFF* tiff_create() {
 
     // set default values
     tiff->ifd = NULL;
+    tiff->num_ifd = 0;
 
     // return created TIFF structure
     return tiff;
 }
 
-/// @brief The tiff_read function reads a TIFF file from the given file.
+/// @brief The tiff_read function reads a TIFF file from the given source.
 /// @param tiff The TIFF structure to read into.
-/// @param file The file to read from.
+/// @param src The source to read from.
 /// @return True if the TIFF file was successfully read, false otherwise.
-bool tiff_read(TIFF* tiff, FILE* file) {
-}
+bool tiff_read(TIFF* tiff, SOURCE* src) {
+    // read the byte order, magic number and IFD offset together
+    const unsigned char* data = source_read(src, 8);
+    READ_CHECK(data);
+    memcpy(tiff->byte_order, data, 2);
+    tiff->byte_order[2] = '\0';
+    memcpy(tiff->offset, data + 4, 4);
+    tiff->offset[4] = '\0';
+
+    // decode the offset in the byte order of the file
+    bool little = is_little_tiff_header(tiff->byte_order);
+    if(!little && !is_big_tiff_header(tiff->byte_order)) {
+        printf("Invalid TIFF header\n");
+        return false;
+    }
+    uint32_t offset;
+    if(little)
+        offset = (uint32_t) data[4] | ((uint32_t) data[5] << 8) |
+                    ((uint32_t) data[6] << 16) | ((uint32_t) data[7] << 24);
+    else
+        offset = ((uint32_t) data[4] << 24) | ((uint32_t) data[5] << 16) |
+                    ((uint32_t) data[6] << 8) | (uint32_t) data[7];
+
+    // move to the first IFD
+    if(offset < 8) {
+        printf("Invalid IFD offset\n");
+        return false;
+    }
+    READ_CHECK(source_skip(src, offset - 8));
 
-/// @brief The tiff_write function writes a TIFF file to the given file.
-/// @param tiff The TIFF structure to write from.
-/// @param file The file to write to.
-/// @return True if the TIFF file was successfully written, false otherwise.
-bool tiff_write(TIFF* tiff, FILE* file) {
+    // read the number of entries in the IFD
+    uint16_t count;
+    bool read = little ? source_read_u16_le(src, &count) : source_read_u16(src, &count);
+    READ_CHECK(read);
+
+    // read every entry
+    tiff->ifd = malloc(sizeof(IFD) * (count > 0 ? count : 1));
+    MEM_CHECK(tiff->ifd);
+    for(tiff->num_ifd = 0; tiff->num_ifd < count; tiff->num_ifd++)
+        if(!read_ifd(tiff->ifd + tiff->num_ifd, src))
+            return false;
+
+    return true;
 }
 
 /// @brief The tiff_free function frees the given TIFF structure.
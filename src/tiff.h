@@ -12,6 +12,8 @@
 #include <string.h>
 #include <stdbool.h>
 
+#include "source.h"
+
 // define macros for tags
 #define TIFF_HEADER_LITTLE "II"
 #define TIFF_HEADER_BIG "MM"
@@ -29,7 +31,8 @@ typedef struct {
 typedef struct {
     char byte_order[3]; ///< byte order
     char offset[5]; ///< offset
-    IFD* ifd; ///< IFD
+    IFD* ifd; ///< IFD entries
+    int num_ifd; ///< number of IFD entries
 } TIFF;
 
 // check header functions
@@ -38,12 +41,11 @@ bool is_big_tiff_header(const char* header);
 bool is_ifd_header(const char* header);
 
 // read function
-bool read_ifd(IFD* ifd, FILE* file);
+bool read_ifd(IFD* ifd, SOURCE* src);
 
 // TIFF functions
 TIFF* tiff_create();
-bool tiff_read(TIFF* tiff, FILE* file);
-bool tiff_write(TIFF* tiff, FILE* file);
+bool tiff_read(TIFF* tiff, SOURCE* src);
 void tiff_free(TIFF* tiff);
 
 #endif
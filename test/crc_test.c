@@ -0,0 +1,87 @@
+///
+/// @file crc_test.c
+/// @brief Tests for the CRC-32 engine
+/// @author Sam Cordry
+
+#include <string.h>
+#include <stdlib.h>
+
+#include "test.h"
+#include "crc.h"
+#include "cpu.h"
+
+/// @brief The bitwise_crc function is an independent bit-at-a-time reference
+///        that uses no tables.
+/// @param crc The running CRC register.
+/// @param buf The data to add to the CRC.
+/// @param len The length of the data.
+/// @return The updated CRC register.
+static unsigned long bitwise_crc(unsigned long crc, const unsigned char* buf, size_t len) {
+    uint32_t c = (uint32_t) crc;
+    for(size_t n = 0; n < len; n++) {
+        c ^= buf[n];
+        for(int k = 0; k < 8; k++)
+            c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+    }
+    return c;
+}
+
+/// @brief The main function checks CRCs against published vectors, every
+///        engine path against the reference loop, and crc_combine.
+/// @return Zero if every check passed.
+int main(void) {
+    // published check values
+    static const struct {
+        const char* text;
+        unsigned long crc;
+    } vectors[] = {
+        { "", 0x00000000 },
+        { "a", 0xe8b7be43 },
+        { "123456789", 0xcbf43926 },
+        { "IEND", 0xae426082 },
+        { "The quick brown fox jumps over the lazy dog", 0x414fa339 }
+    };
+    for(size_t i = 0; i < sizeof(vectors) / sizeof(vectors[0]); i++) {
+        unsigned long value = crc((unsigned char*) vectors[i].text, (int) strlen(vectors[i].text));
+        CHECK(value == vectors[i].crc, "crc(\"%s\") = %08lx, expected %08lx",
+                vectors[i].text, value, vectors[i].crc);
+    }
+    unsigned char zeros[32] = { 0 };
+    CHECK(crc(zeros, 32) == 0x190a55ad, "crc of 32 zero bytes = %08lx", crc(zeros, 32));
+
+    // every path against the reference, at random offsets and lengths
+    enum { SIZE = 1 << 16 };
+    unsigned char* data = malloc(SIZE);
+    if(data == NULL) {
+        printf("Unable to allocate memory\n");
+        return 1;
+    }
+    for(size_t i = 0; i < SIZE; i++)
+        data[i] = (unsigned char) test_random();
+    printf("crc: pclmul path %s\n", cpu_has_pclmul() ? "enabled" : "not supported, checking fallback");
+    for(int trial = 0; trial < 2000; trial++) {
+        size_t offset = test_random() % 64;
+        size_t len = trial < 300 ? (size_t) trial : test_random() % (SIZE - 64);
+        unsigned long start = test_random();
+        unsigned long expected = bitwise_crc(start, data + offset, len);
+        CHECK(crc_update_bytes(start, data + offset, len) == expected, "bytes, length %zu", len);
+        CHECK(crc_update_slice8(start, data + offset, len) == expected, "slice8, length %zu", len);
+        CHECK(crc_update_pclmul(start, data + offset, len) == expected, "pclmul, length %zu", len);
+        CHECK(crc_update(start, data + offset, len) == expected, "update, length %zu", len);
+    }
+
+    // combining the CRCs of two halves gives the CRC of the whole
+    for(int trial = 0; trial < 500; trial++) {
+        size_t len = test_random() % SIZE;
+        size_t split = len == 0 ? 0 : test_random() % (len + 1);
+        unsigned long whole = crc(data, (int) len);
+        unsigned long first = crc(data, (int) split);
+        unsigned long second = crc(data + split, (int) (len - split));
+        CHECK(crc_combine(first, second, len - split) == whole, "combine at %zu of %zu",
+                split, len);
+    }
+    CHECK(crc_combine(0xcbf43926, 0, 0) == 0xcbf43926, "combine with an empty range");
+    free(data);
+
+    return test_finish("crc");
+}
@@ -0,0 +1,102 @@
+///
+/// @file filter_test.c
+/// @brief Tests for the PNG filter and unfilter kernels
+/// @author Sam Cordry
+
+#include <string.h>
+#include <stdlib.h>
+
+#include "test.h"
+#include "filter.h"
+
+/// @brief The names of the instruction set levels, by UNFILTER_ISA.
+static const char* isa_names[] = { "scalar", "sse2", "ssse3", "avx2" };
+
+/// @brief The random_row function fills a row with random bytes, sometimes
+///        kept small or repeated so the Paeth and Average ties get exercised.
+/// @param row The row to fill.
+/// @param length The length of the row.
+static void random_row(unsigned char* row, size_t length) {
+    uint32_t mode = test_random() % 3;
+    for(size_t i = 0; i < length; i++) {
+        uint32_t value = test_random();
+        row[i] = (unsigned char) (mode == 0 ? value : mode == 1 ? value % 4 : (value % 8 == 0));
+    }
+}
+
+/// @brief The main function checks every unfilter kernel at every
+///        instruction set level against the scalar kernels, and against the
+///        filter it undoes, on randomized rows.
+/// @return Zero if every check passed.
+int main(void) {
+    static const unsigned int bpps[] = { 1, 2, 3, 4, 6, 8 };
+    UNFILTER_ISA isa;
+    for(unsigned int b = 0; b < sizeof(bpps) / sizeof(bpps[0]); b++) {
+        unsigned int bpp = bpps[b];
+        UNFILTER scalar;
+        CHECK(unfilter_init_isa(&scalar, bpp, UNFILTER_SCALAR), "no kernels for %u bpp", bpp);
+        for(int trial = 0; trial < 400; trial++) {
+            // exact-size rows, so a sanitizer catches any read past the end,
+            // with the zeros filter_costs reads before each row
+            size_t pixels = trial < 40 ? (size_t) trial : test_random() % 700;
+            size_t length = pixels * bpp;
+            unsigned char* padded_original = calloc(FILTER_PAD + length, 1);
+            unsigned char* padded_prev = calloc(FILTER_PAD + length, 1);
+            unsigned char* filtered = malloc(length > 0 ? length : 1);
+            unsigned char* expected = malloc(length > 0 ? length : 1);
+            unsigned char* row = malloc(length > 0 ? length : 1);
+            if(padded_original == NULL || padded_prev == NULL || filtered == NULL ||
+                    expected == NULL || row == NULL) {
+                printf("Unable to allocate memory\n");
+                return 1;
+            }
+            unsigned char* original = padded_original + FILTER_PAD;
+            unsigned char* prev = padded_prev + FILTER_PAD;
+            random_row(original, length);
+            random_row(prev, length);
+
+            for(unsigned char type = FILTER_NONE; type <= FILTER_PAETH; type++) {
+                // the scalar kernel undoes the filter
+                filter_row(type, filtered, original, prev, length, bpp);
+                memcpy(expected, filtered, length);
+                CHECK(unfilter_row(&scalar, type, expected, prev, length), "type %u", type);
+                CHECK(memcmp(expected, original, length) == 0,
+                        "scalar type %u, %u bpp, length %zu", type, bpp, length);
+
+                // and every other level agrees with it
+                for(isa = UNFILTER_SSE2; isa <= UNFILTER_AVX2; isa++) {
+                    UNFILTER unfilter;
+                    unfilter_init_isa(&unfilter, bpp, isa);
+                    memcpy(row, filtered, length);
+                    unfilter_row(&unfilter, type, row, prev, length);
+                    CHECK(memcmp(row, expected, length) == 0, "%s type %u, %u bpp, length %zu",
+                            isa_names[isa], type, bpp, length);
+                }
+            }
+
+            // the filter costs agree at every level too
+            uint64_t expected_costs[5];
+            filter_costs_isa(original, prev, length, bpp, UNFILTER_SCALAR, expected_costs);
+            for(isa = UNFILTER_SSE2; isa <= UNFILTER_AVX2; isa++) {
+                uint64_t costs[5];
+                filter_costs_isa(original, prev, length, bpp, isa, costs);
+                CHECK(memcmp(costs, expected_costs, sizeof(costs)) == 0,
+                        "%s costs, %u bpp, length %zu", isa_names[isa], bpp, length);
+            }
+
+            free(padded_original);
+            free(padded_prev);
+            free(filtered);
+            free(expected);
+            free(row);
+        }
+    }
+
+    // an unknown filter type is rejected
+    UNFILTER unfilter;
+    unsigned char row[4] = { 0 };
+    unfilter_init(&unfilter, 1);
+    CHECK(!unfilter_row(&unfilter, 5, row, row, 4), "filter type 5 was accepted");
+
+    return test_finish("filter");
+}
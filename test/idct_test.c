@@ -0,0 +1,203 @@
+///
+/// @file idct_test.c
+/// @brief IEEE 1180 accuracy tests for the IDCT kernels
+/// @author Sam Cordry
+
+#include <math.h>
+#include <string.h>
+
+#include "test.h"
+#include "dct.h"
+#include "huffman.h"
+
+/// @brief The number of blocks tested for each range and sign, as IEEE 1180
+///        asks for.
+#define IDCT_BLOCKS 10000
+
+/// @brief Pi, which C99 does not provide.
+#define IDCT_PI 3.14159265358979323846
+
+/// @brief The names of the instruction set levels, by DCT_ISA.
+static const char* isa_names[] = { "scalar", "sse2", "avx2" };
+
+/// @brief The basis function of each frequency at each position, with the
+///        normalization of the DCT folded in.
+static double basis[8][8];
+
+/// @brief The state of the IEEE 1180 random number generator.
+static uint32_t rand_state;
+
+/// @brief The ieee_random function returns the next value of the generator
+///        IEEE 1180 specifies, so the blocks match the standard's.
+/// @param low The negated lowest value.
+/// @param high The highest value.
+/// @return A value from -low to high.
+static long ieee_random(long low, long high) {
+    rand_state = rand_state * 1103515245u + 12345u;
+    double x = (double) (rand_state & 0x7ffffffe) / (double) 0x7fffffff;
+    return (long) (x * (double) (low + high + 1)) - low;
+}
+
+/// @brief The reference_fdct function finds the DCT of a block in double
+///        precision, rounded and clipped to 12-bit coefficients.
+/// @param in The samples, row by row.
+/// @param out The coefficients in natural order.
+static void reference_fdct(const long* in, int16_t* out) {
+    // rows first, then columns
+    double rows[64];
+    for(int y = 0; y < 8; y++)
+        for(int u = 0; u < 8; u++) {
+            double sum = 0;
+            for(int x = 0; x < 8; x++)
+                sum += (double) in[y * 8 + x] * basis[u][x];
+            rows[y * 8 + u] = sum;
+        }
+    for(int v = 0; v < 8; v++)
+        for(int u = 0; u < 8; u++) {
+            double sum = 0;
+            for(int y = 0; y < 8; y++)
+                sum += rows[y * 8 + u] * basis[v][y];
+            double value = floor(sum + 0.5);
+            out[v * 8 + u] = (int16_t) (value < -2048 ? -2048 : value > 2047 ? 2047 : value);
+        }
+}
+
+/// @brief The reference_idct function finds the inverse DCT of a block in
+///        double precision, rounded and clipped to 9-bit samples.
+/// @param in The coefficients in natural order.
+/// @param out The samples, row by row.
+static void reference_idct(const int16_t* in, long* out) {
+    // rows first, then columns
+    double rows[64];
+    for(int v = 0; v < 8; v++)
+        for(int x = 0; x < 8; x++) {
+            double sum = 0;
+            for(int u = 0; u < 8; u++)
+                sum += (double) in[v * 8 + u] * basis[u][x];
+            rows[v * 8 + x] = sum;
+        }
+    for(int y = 0; y < 8; y++)
+        for(int x = 0; x < 8; x++) {
+            double sum = 0;
+            for(int v = 0; v < 8; v++)
+                sum += rows[v * 8 + x] * basis[v][y];
+            double value = floor(sum + 0.5);
+            out[y * 8 + x] = (long) (value < -256 ? -256 : value > 255 ? 255 : value);
+        }
+}
+
+/// @brief The last_index function finds one past the zigzag index of a
+///        block's last nonzero coefficient.
+/// @param block The coefficients in natural order.
+/// @return The index, 0 for an empty block.
+static unsigned char last_index(const int16_t* block) {
+    unsigned char last = 0;
+    for(int z = 0; z < 64; z++)
+        if(block[huff_natural_order[z]] != 0)
+            last = (unsigned char) (z + 1);
+    return last;
+}
+
+/// @brief The run_range function runs the IEEE 1180 procedure for one range
+///        and sign on one kernel and checks the error statistics. The kernels
+///        write 8-bit samples with 128 added, so the reference is clipped to
+///        the same range before comparing.
+/// @param isa The highest instruction set the kernels may use.
+/// @param low The negated lowest sample.
+/// @param high The highest sample.
+/// @param sign 1 for the samples as generated, -1 to negate them.
+/// @param sparse The zigzag index to cut every block off at, 64 for none.
+static void run_range(DCT_ISA isa, long low, long high, int sign, int sparse) {
+    // coefficients go in unquantized
+    uint16_t ones[64];
+    int16_t quant[64];
+    for(int i = 0; i < 64; i++)
+        ones[i] = 1;
+    dct_prepare_quant(ones, quant);
+
+    double error[64] = { 0 }, squared[64] = { 0 };
+    long peak = 0;
+    rand_state = 1;
+    for(int n = 0; n < IDCT_BLOCKS; n += 2) {
+        // two blocks side by side, so the paired kernels get used
+        int16_t coeffs[128];
+        unsigned char last[2];
+        long expected[2][64];
+        for(int b = 0; b < 2; b++) {
+            long samples[64];
+            for(int i = 0; i < 64; i++)
+                samples[i] = ieee_random(low, high) * sign;
+            reference_fdct(samples, coeffs + b * 64);
+            for(int z = sparse; z < 64; z++)
+                coeffs[b * 64 + huff_natural_order[z]] = 0;
+            reference_idct(coeffs + b * 64, expected[b]);
+            last[b] = last_index(coeffs + b * 64);
+        }
+
+        unsigned char out[8 * 16];
+        dct_idct_row_isa(coeffs, last, 2, quant, out, 16, isa);
+        for(int b = 0; b < 2; b++)
+            for(int i = 0; i < 64; i++) {
+                long reference = expected[b][i] < -128 ? -128 : expected[b][i] > 127 ? 127 :
+                                    expected[b][i];
+                long diff = (long) out[(i / 8) * 16 + b * 8 + i % 8] - 128 - reference;
+                error[i] += (double) diff;
+                squared[i] += (double) (diff * diff);
+                peak = labs(diff) > peak ? labs(diff) : peak;
+            }
+    }
+
+    // the statistics and limits of the standard
+    double pmse = 0, omse = 0, pme = 0, ome = 0;
+    for(int i = 0; i < 64; i++) {
+        pmse = squared[i] / IDCT_BLOCKS > pmse ? squared[i] / IDCT_BLOCKS : pmse;
+        pme = fabs(error[i]) / IDCT_BLOCKS > pme ? fabs(error[i]) / IDCT_BLOCKS : pme;
+        omse += squared[i];
+        ome += error[i];
+    }
+    omse /= 64.0 * IDCT_BLOCKS;
+    ome = fabs(ome) / (64.0 * IDCT_BLOCKS);
+    printf("%-7s %4ld %4ld %3d %6d %5ld %8.5f %8.5f %8.5f %8.5f\n", isa_names[isa], low, high, sign,
+            sparse, peak, pmse, omse, pme, ome);
+    CHECK(peak <= 1 && pmse <= 0.06 && omse <= 0.02 && pme <= 0.015 && ome <= 0.0015,
+            "%s out of IEEE 1180 limits for -%ld to %ld, sign %d, cut at %d", isa_names[isa],
+            low, high, sign, sparse);
+}
+
+/// @brief The main function runs the IEEE 1180 procedure on every IDCT kernel
+///        for every range and sign, and on sparse blocks, and checks that an
+///        empty block comes out flat.
+/// @return Zero if every check passed.
+int main(void) {
+    static const long ranges[][2] = { { 256, 255 }, { 5, 5 }, { 300, 300 } };
+
+    for(int k = 0; k < 8; k++)
+        for(int x = 0; x < 8; x++)
+            basis[k][x] = (k == 0 ? sqrt(0.125) : 0.5) * cos((2 * x + 1) * k * IDCT_PI / 16);
+
+    printf("%-7s %4s %4s %3s %6s %5s %8s %8s %8s %8s\n", "kernel", "low", "high", "sgn", "cut",
+            "peak", "pmse", "omse", "pme", "ome");
+    for(int isa = DCT_SCALAR; isa <= DCT_AVX2; isa++) {
+        for(int r = 0; r < 3; r++)
+            for(int sign = 1; sign >= -1; sign -= 2)
+                run_range((DCT_ISA) isa, ranges[r][0], ranges[r][1], sign, 64);
+
+        // blocks the sparse kernels take
+        for(int sign = 1; sign >= -1; sign -= 2)
+            run_range((DCT_ISA) isa, 256, 255, sign, DCT_SPARSE_LAST);
+
+        // all zeros in, all zeros out
+        int16_t zeros[128] = { 0 };
+        unsigned char last[2] = { 64, 64 };
+        int16_t quant[64];
+        unsigned char out[8 * 16];
+        for(int i = 0; i < 64; i++)
+            quant[i] = 1;
+        dct_idct_row_isa(zeros, last, 2, quant, out, 16, (DCT_ISA) isa);
+        for(int i = 0; i < 8 * 16; i++)
+            CHECK(out[i] == 128, "%s turned an empty block into %u at %d", isa_names[isa],
+                    out[i], i);
+    }
+
+    return test_finish("idct");
+}
@@ -0,0 +1,420 @@
+///
+/// @file roundtrip_test.c
+/// @brief Tests that PNGs and JPEGs come back byte-identical from a read and
+///        a write
+/// @author Sam Cordry
+
+#include <string.h>
+#include <stdlib.h>
+
+#include "test.h"
+#include "crc.h"
+#include "png.h"
+#include "jpeg.h"
+#include "huffman.h"
+
+/// @brief A file being built in memory
+typedef struct {
+    unsigned char* data; ///< bytes of the file
+    size_t length; ///< number of bytes written
+    size_t capacity; ///< number of bytes allocated
+} BUFFER;
+
+/// @brief The append function adds bytes to a buffer, exiting the test if
+///        memory runs out.
+/// @param buffer The buffer to add to.
+/// @param data The bytes to add.
+/// @param length The number of bytes.
+static void append(BUFFER* buffer, const void* data, size_t length) {
+    if(buffer->length + length > buffer->capacity) {
+        buffer->capacity = (buffer->length + length) * 2;
+        buffer->data = realloc(buffer->data, buffer->capacity);
+        if(buffer->data == NULL) {
+            printf("Unable to allocate memory\n");
+            exit(1);
+        }
+    }
+    memcpy(buffer->data + buffer->length, data, length);
+    buffer->length += length;
+}
+
+/// @brief The put_u32 function stores a big-endian 32-bit value.
+/// @param out Where to store it.
+/// @param value The value to store.
+static void put_u32(unsigned char* out, uint32_t value) {
+    out[0] = (unsigned char) (value >> 24);
+    out[1] = (unsigned char) (value >> 16);
+    out[2] = (unsigned char) (value >> 8);
+    out[3] = (unsigned char) value;
+}
+
+/// @brief The append_chunk function adds a PNG chunk with its length and CRC.
+/// @param buffer The buffer to add to.
+/// @param type The chunk type.
+/// @param data The chunk data.
+/// @param length The length of the chunk data.
+static void append_chunk(BUFFER* buffer, const char* type, const unsigned char* data,
+                            size_t length) {
+    unsigned char field[4];
+    put_u32(field, (uint32_t) length);
+    append(buffer, field, 4);
+    unsigned long c = update_crc(0xffffffffL, (unsigned char*) type, 4);
+    c = update_crc(c, (unsigned char*) data, (int) length) ^ 0xffffffffL;
+    append(buffer, type, 4);
+    append(buffer, data, length);
+    put_u32(field, (uint32_t) c);
+    append(buffer, field, 4);
+}
+
+/// @brief The append_random function adds a chunk of random data, which is
+///        all a read and a write need from image data.
+/// @param buffer The buffer to add to.
+/// @param type The chunk type.
+/// @param sequence The sequence number to start the data with, or -1 for none.
+/// @param length The length of the chunk data.
+static void append_random(BUFFER* buffer, const char* type, long sequence, size_t length) {
+    unsigned char* data = malloc(length + 4);
+    if(data == NULL) {
+        printf("Unable to allocate memory\n");
+        exit(1);
+    }
+    for(size_t i = 0; i < length; i++)
+        data[i] = (unsigned char) test_random();
+    if(sequence >= 0)
+        put_u32(data, (uint32_t) sequence);
+    append_chunk(buffer, type, data, length);
+    free(data);
+}
+
+/// @brief The written_file function reads back everything written to a
+///        stream.
+/// @param file The stream.
+/// @param length Set to the number of bytes.
+/// @return The bytes, or NULL on failure. The caller frees them.
+static unsigned char* written_file(FILE* file, size_t* length) {
+    long size = ftell(file);
+    if(size < 0 || fseek(file, 0, SEEK_SET) != 0)
+        return NULL;
+    unsigned char* data = malloc((size_t) size + 1);
+    if(data != NULL && fread(data, 1, (size_t) size, file) != (size_t) size) {
+        free(data);
+        return NULL;
+    }
+    *length = (size_t) size;
+    return data;
+}
+
+/// @brief The check_same function compares a file with what was written.
+/// @param name The name of the case.
+/// @param expected The original file.
+/// @param length The length of the original file.
+/// @param file The stream that was written.
+static void check_same(const char* name, const unsigned char* expected, size_t length,
+                        FILE* file) {
+    size_t written_length = 0;
+    unsigned char* written = written_file(file, &written_length);
+    CHECK(written != NULL, "%s: nothing was written", name);
+    if(written == NULL)
+        return;
+    size_t first = 0;
+    while(first < length && first < written_length && written[first] == expected[first])
+        first++;
+    CHECK(written_length == length && first == length,
+            "%s: %zu bytes written for %zu, first difference at %zu", name, written_length,
+            length, first);
+    free(written);
+}
+
+/// @brief The png_roundtrip function reads a PNG from memory, writes it, and
+///        checks the output is the same file.
+/// @param name The name of the case.
+/// @param buffer The PNG.
+static void png_roundtrip(const char* name, const BUFFER* buffer) {
+    SOURCE src;
+    source_open_memory(&src, buffer->data, buffer->length);
+    PNG* png = png_create();
+    bool read = png != NULL && png_read(png, &src);
+    CHECK(read, "%s: the PNG was not read", name);
+    FILE* file = tmpfile();
+    if(read && file != NULL) {
+        CHECK(png_write(png, file), "%s: the PNG was not written", name);
+        check_same(name, buffer->data, buffer->length, file);
+    }
+    if(file != NULL)
+        fclose(file);
+    png_free(png);
+    source_close(&src);
+}
+
+/// @brief The png_start function begins a PNG with its signature and IHDR.
+/// @param buffer The buffer to start, which must be empty.
+/// @param width The image width.
+/// @param height The image height.
+/// @param depth The bit depth.
+/// @param color_type The color type.
+static void png_start(BUFFER* buffer, uint32_t width, uint32_t height, unsigned char depth,
+                        unsigned char color_type) {
+    static const unsigned char signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+    unsigned char ihdr[13] = { 0 };
+    put_u32(ihdr, width);
+    put_u32(ihdr + 4, height);
+    ihdr[8] = depth;
+    ihdr[9] = color_type;
+    append(buffer, signature, 8);
+    append_chunk(buffer, "IHDR", ihdr, 13);
+}
+
+/// @brief The check_optimized function optimizes the tables of a JPEG and
+///        checks that the result is no longer than the original, is still
+///        progressive if the original was, and has the same coefficients and
+///        quantization tables.
+/// @param name The name of the case.
+/// @param jpeg The JPEG.
+/// @param length The length of the JPEG's file.
+static void check_optimized(const char* name, JPEG* jpeg, size_t length) {
+    JPEG* optimized = jpeg_optimize(jpeg);
+    FILE* file = tmpfile();
+    bool written = optimized != NULL && file != NULL && jpeg_write(optimized, file);
+    CHECK(written, "%s: the JPEG was not optimized", name);
+    long size = written ? ftell(file) : -1;
+    CHECK(size >= 0 && (size_t) size <= length, "%s: optimized to %ld bytes from %zu", name,
+            size, length);
+    if(file != NULL)
+        fclose(file);
+
+    JPEG_IMAGE* before = jpeg_decode_coefficients(jpeg);
+    JPEG_IMAGE* after = written ? jpeg_decode_coefficients(optimized) : NULL;
+    bool same = before != NULL && after != NULL &&
+                (before->marker == SOF2) == (after->marker == SOF2) &&
+                before->num_components == after->num_components;
+    for(int c = 0; same && c < before->num_components; c++) {
+        const JPEG_COMPONENT* comp = before->components + c;
+        same = comp->blocks_wide == after->components[c].blocks_wide &&
+                comp->blocks_high == after->components[c].blocks_high &&
+                memcmp(comp->quant, after->components[c].quant, sizeof(comp->quant)) == 0 &&
+                memcmp(comp->coeffs, after->components[c].coeffs,
+                        (size_t) comp->blocks_wide * comp->blocks_high * 64 *
+                        sizeof(int16_t)) == 0;
+    }
+    CHECK(same, "%s: the optimized JPEG changed the frame, its tables or its coefficients",
+            name);
+    jpeg_image_free(before);
+    jpeg_image_free(after);
+    jpeg_free(optimized);
+}
+
+/// @brief The jpeg_roundtrip function encodes an image, then checks that
+///        reading and writing the JPEG gives back the same bytes, and that
+///        optimizing its tables keeps its coefficients.
+/// @param name The name of the case.
+/// @param pixels The image.
+/// @param width The image width.
+/// @param height The image height.
+/// @param channels The samples in each pixel.
+/// @param options How to encode it.
+static void jpeg_roundtrip(const char* name, const unsigned char* pixels, unsigned int width,
+                            unsigned int height, unsigned int channels,
+                            const JPEG_ENCODE_OPTIONS* options) {
+    JPEG* jpeg = jpeg_encode(pixels, width, height, channels, options);
+    FILE* original = tmpfile();
+    CHECK(jpeg != NULL && original != NULL && jpeg_write(jpeg, original),
+            "%s: the JPEG was not encoded", name);
+    jpeg_free(jpeg);
+    size_t length = 0;
+    unsigned char* data = original == NULL ? NULL : written_file(original, &length);
+    if(original != NULL)
+        fclose(original);
+    if(data == NULL)
+        return;
+
+    SOURCE src;
+    source_open_memory(&src, data, length);
+    jpeg = jpeg_create();
+    bool read = jpeg != NULL && jpeg_read(jpeg, &src);
+    CHECK(read, "%s: the JPEG was not read", name);
+    FILE* file = tmpfile();
+    if(read && file != NULL) {
+        CHECK(jpeg_write(jpeg, file), "%s: the JPEG was not written", name);
+        check_same(name, data, length, file);
+    }
+    if(file != NULL)
+        fclose(file);
+    if(read)
+        check_optimized(name, jpeg, length);
+    jpeg_free(jpeg);
+    source_close(&src);
+    free(data);
+}
+
+/// @brief The late_table_roundtrip function builds a sequential JPEG whose
+///        components are scanned one at a time, with the chroma quantization
+///        table only defined after the luma scan, and checks that optimizing
+///        it keeps every table ahead of the scans that use it.
+static void late_table_roundtrip(void) {
+    static const HUFF_SPEC* specs[4] = {
+        &huff_std_dc_luma, &huff_std_ac_luma, &huff_std_dc_chroma, &huff_std_ac_chroma
+    };
+    const char* name = "jpeg late table";
+
+    // a 16 by 16 frame of three components at full resolution, luma on
+    // table 0 and chroma on table 1, with the Annex K Huffman tables
+    unsigned char dqt[2][65];
+    for(int t = 0; t < 2; t++) {
+        dqt[t][0] = (unsigned char) t;
+        for(int k = 0; k < 64; k++)
+            dqt[t][1 + k] = (unsigned char) (1 + t + k % 7);
+    }
+    static const unsigned char sof[15] = { 8, 0, 16, 0, 16, 3, 1, 0x11, 0, 2, 0x11, 1, 3, 0x11, 1 };
+    unsigned char dht[4 * (17 + 256)];
+    int dht_length = 0;
+    HUFF_ENCODER encoders[4];
+    for(int t = 0; t < 4; t++) {
+        int num_symbols = huff_spec_symbols(specs[t]);
+        dht[dht_length++] = (unsigned char) (((t & 1) << 4) | (t >> 1));
+        memcpy(dht + dht_length, specs[t]->counts, 16);
+        memcpy(dht + dht_length + 16, specs[t]->symbols, num_symbols);
+        dht_length += 16 + num_symbols;
+        huff_encoder_build(encoders + t, specs[t]);
+    }
+    JPEG* jpeg = jpeg_create();
+    bool built = jpeg != NULL && jpeg_read_quant_table(jpeg, dqt[0], 65) &&
+                    jpeg_read_frame(jpeg, SOF0, sof, 15) &&
+                    jpeg_read_huff_table(jpeg, dht, dht_length);
+
+    // a scan for each component, the chroma table coming between the first two
+    for(int c = 0; c < 3 && built; c++) {
+        int t = c == 0 ? 0 : 1;
+        if(c == 1)
+            built = jpeg_read_quant_table(jpeg, dqt[1], 65);
+        BIT_WRITER bw;
+        int pred = 0;
+        built = built && bit_writer_init(&bw, 256);
+        for(int b = 0; b < 4 && built; b++) {
+            int16_t block[64] = { 0 };
+            block[0] = (int16_t) (test_random() % 64) - 32;
+            for(int k = 1; k < 12; k++)
+                block[huff_natural_order[k]] = (int16_t) (test_random() % 9) - 4;
+            built = huff_encode_block(&bw, encoders + 2 * t, encoders + 2 * t + 1, &pred, block);
+        }
+        built = built && bit_writer_flush(&bw);
+        unsigned char* data = built ? malloc(6 + bw.length) : NULL;
+        if(data != NULL) {
+            unsigned char header[6] = { 1, (unsigned char) (c + 1), (unsigned char) (t << 4 | t),
+                                        0, 63, 0 };
+            memcpy(data, header, 6);
+            memcpy(data + 6, bw.data, bw.length);
+            built = jpeg_read_scan(jpeg, data, 6 + bw.length, 6, 0, NULL, 0, false);
+            if(!built)
+                free(data);
+        }
+        built = built && data != NULL;
+        free(bw.data);
+    }
+    FILE* file = tmpfile();
+    built = built && file != NULL && jpeg_write(jpeg, file);
+    CHECK(built, "%s: the JPEG was not built", name);
+    long length = built ? ftell(file) : -1;
+    if(file != NULL)
+        fclose(file);
+
+    // the optimized scans come first where the luma scan was, so the chroma
+    // table has to move ahead of them
+    if(built) {
+        check_optimized(name, jpeg, (size_t) length);
+        JPEG* optimized = jpeg_optimize(jpeg);
+        bool scanned = false, ordered = optimized != NULL;
+        for(int i = 0; optimized != NULL && i < optimized->num_segments; i++) {
+            scanned = scanned || optimized->segments[i].marker == SOS;
+            ordered = ordered && !(scanned && optimized->segments[i].marker == DQT);
+        }
+        CHECK(ordered, "%s: a quantization table was left after the optimized scans", name);
+        jpeg_free(optimized);
+    }
+    jpeg_free(jpeg);
+}
+
+/// @brief The main function round-trips PNGs built chunk by chunk and JPEGs
+///        from the encoder.
+/// @return Zero if every check passed.
+int main(void) {
+    // several IDAT chunks, one larger than the sink's buffer, full of zero
+    // bytes and every other byte value
+    BUFFER buffer = { NULL, 0, 0 };
+    png_start(&buffer, 640, 480, 8, 2);
+    append_random(&buffer, "IDAT", -1, 1);
+    append_random(&buffer, "IDAT", -1, 8192);
+    append_random(&buffer, "IDAT", -1, SINK_BUFFER_SIZE * 4 + 3);
+    append_random(&buffer, "IDAT", -1, 100);
+    append_chunk(&buffer, "IEND", NULL, 0);
+    png_roundtrip("rgb", &buffer);
+
+    // a palette with transparency
+    buffer.length = 0;
+    png_start(&buffer, 16, 16, 4, 3);
+    unsigned char palette[16 * 3];
+    unsigned char alpha[7];
+    for(size_t i = 0; i < sizeof(palette); i++)
+        palette[i] = (unsigned char) (i * 37);
+    for(size_t i = 0; i < sizeof(alpha); i++)
+        alpha[i] = (unsigned char) (i * 40);
+    append_chunk(&buffer, "PLTE", palette, sizeof(palette));
+    append_chunk(&buffer, "tRNS", alpha, sizeof(alpha));
+    append_random(&buffer, "IDAT", -1, 200);
+    append_chunk(&buffer, "IEND", NULL, 0);
+    png_roundtrip("palette", &buffer);
+
+    // an animation whose default image is its first frame
+    buffer.length = 0;
+    png_start(&buffer, 8, 8, 8, 6);
+    unsigned char actl[8] = { 0, 0, 0, 2, 0, 0, 0, 0 };
+    unsigned char fctl[26] = { 0 };
+    append_chunk(&buffer, "acTL", actl, 8);
+    put_u32(fctl + 4, 8);
+    put_u32(fctl + 8, 8);
+    fctl[21] = 1;
+    fctl[23] = 10;
+    append_chunk(&buffer, "fcTL", fctl, 26);
+    append_random(&buffer, "IDAT", -1, 300);
+    put_u32(fctl, 1);
+    put_u32(fctl + 4, 4);
+    put_u32(fctl + 8, 3);
+    put_u32(fctl + 12, 2);
+    put_u32(fctl + 16, 5);
+    fctl[24] = 1;
+    fctl[25] = 1;
+    append_chunk(&buffer, "fcTL", fctl, 26);
+    append_random(&buffer, "fdAT", 2, 50);
+    append_random(&buffer, "fdAT", 3, 70);
+    append_chunk(&buffer, "IEND", NULL, 0);
+    png_roundtrip("animation", &buffer);
+    free(buffer.data);
+
+    // JPEGs of a smooth color image, with and without restarts and scans
+    enum { WIDTH = 203, HEIGHT = 117 };
+    unsigned char* pixels = malloc(WIDTH * HEIGHT * 4);
+    if(pixels == NULL) {
+        printf("Unable to allocate memory\n");
+        return 1;
+    }
+    for(unsigned int y = 0; y < HEIGHT; y++)
+        for(unsigned int x = 0; x < WIDTH; x++) {
+            unsigned char* p = pixels + 4 * (y * WIDTH + x);
+            p[0] = (unsigned char) (x + y);
+            p[1] = (unsigned char) (x * 2);
+            p[2] = (unsigned char) (y * 3 ^ x);
+            p[3] = 255;
+        }
+    JPEG_ENCODE_OPTIONS options = { 75, JPEG_SUBSAMPLE_420, 0, 1, false, NULL, 0 };
+    jpeg_roundtrip("jpeg baseline", pixels, WIDTH, HEIGHT, 4, &options);
+    options.restart_rows = 2;
+    options.subsampling = JPEG_SUBSAMPLE_444;
+    jpeg_roundtrip("jpeg restarts", pixels, WIDTH, HEIGHT, 4, &options);
+    options.progressive = true;
+    jpeg_roundtrip("jpeg progressive", pixels, WIDTH, HEIGHT, 4, &options);
+    options.restart_rows = 0;
+    jpeg_roundtrip("jpeg gray", pixels, WIDTH, HEIGHT, 1, &options);
+    free(pixels);
+    late_table_roundtrip();
+
+    return test_finish("roundtrip");
+}
@@ -0,0 +1,43 @@
+///
+/// @file test.h
+/// @brief Shared checks for the test programs
+/// @author Sam Cordry
+
+#ifndef TEST_H
+#define TEST_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+/// @brief The number of failed checks in this test program.
+static int test_failures = 0;
+
+/// @brief The CHECK macro records a failure, with a printf-style message,
+///        when the condition is false.
+#define CHECK(cond, ...) do { if(!(cond)) { printf("FAIL %s:%d: ", __FILE__, __LINE__);\
+    printf(__VA_ARGS__); printf("\n"); test_failures++; } } while(0)
+
+/// @brief The test_random function returns the next value of a fixed-seed
+///        xorshift generator, so every run checks the same inputs.
+/// @return The next pseudo-random value.
+static inline uint32_t test_random(void) {
+    static uint32_t state = 2463534242u;
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state;
+}
+
+/// @brief The test_finish function reports the result of a test program.
+/// @param name The name of the test program.
+/// @return The exit status, zero if every check passed.
+static inline int test_finish(const char* name) {
+    if(test_failures != 0) {
+        printf("%s: %d failed checks\n", name, test_failures);
+        return 1;
+    }
+    printf("%s: ok\n", name);
+    return 0;
+}
+
+#endif
@@ -0,0 +1,88 @@
+///
+/// @file crc_table_gen.c
+/// @brief Generator for the precomputed CRC tables in src/crc_table.h
+/// @author Sam Cordry
+
+#include <stdio.h>
+#include <stdint.h>
+
+/// @brief The reflected CRC-32 polynomial from the PNG specification.
+#define CRC_POLY 0xedb88320
+
+/// @brief The multiply function multiplies two polynomials modulo the CRC
+///        polynomial, both in reflected bit order.
+/// @param a The first polynomial.
+/// @param b The second polynomial.
+/// @return The product modulo the CRC polynomial.
+static uint32_t multiply(uint32_t a, uint32_t b) {
+    uint32_t p = 0;
+
+    for(uint32_t m = (uint32_t) 1 << 31; m != 0; m >>= 1) {
+        if(a & m)
+            p ^= b;
+        b = (b & 1) ? (b >> 1) ^ CRC_POLY : b >> 1;
+    }
+
+    return p;
+}
+
+/// @brief The print_values function prints a brace-enclosed list of table
+///        values, six to a line.
+/// @param values The values to print.
+/// @param count The number of values.
+/// @param indent The indent of the braces, in spaces.
+static void print_values(const uint32_t* values, int count, int indent) {
+    printf("%*s{\n", indent, "");
+    for(int i = 0; i < count; i++) {
+        if(i % 6 == 0)
+            printf("%*s", indent + 4, "");
+        printf("0x%08x%s", values[i], i == count - 1 ? "\n" : i % 6 == 5 ? ",\n" : ", ");
+    }
+    printf("%*s}", indent, "");
+}
+
+/// @brief The main function prints src/crc_table.h to standard output.
+/// @return Zero.
+int main(void) {
+    uint32_t table[8][256];
+    uint32_t x2n[32];
+
+    // the byte-at-a-time table from the PNG specification
+    for(uint32_t n = 0; n < 256; n++) {
+        uint32_t c = n;
+        for(int k = 0; k < 8; k++)
+            c = (c & 1) ? CRC_POLY ^ (c >> 1) : c >> 1;
+        table[0][n] = c;
+    }
+
+    // each further table pushes the byte through one more zero byte
+    for(int k = 1; k < 8; k++)
+        for(int n = 0; n < 256; n++)
+            table[k][n] = table[0][table[k - 1][n] & 0xff] ^ (table[k - 1][n] >> 8);
+
+    // x^1, then repeated squaring for x^(2^k)
+    x2n[0] = (uint32_t) 1 << 30;
+    for(int k = 1; k < 32; k++)
+        x2n[k] = multiply(x2n[k - 1], x2n[k - 1]);
+
+    printf("///\n/// @file crc_table.h\n/// @brief Precomputed CRC tables for slicing-by-8\n");
+    printf("/// @author Sam Cordry\n\n");
+    printf("// generated by tools/crc_table_gen.c from the PNG CRC polynomial, do not\n");
+    printf("// edit by hand\n\n");
+    printf("#ifndef CRC_TABLE_H\n#define CRC_TABLE_H\n\n#include <stdint.h>\n\n");
+    printf("// crc_table[0] is the classic byte-at-a-time table from the PNG\n");
+    printf("// specification, crc_table[k] advances a byte through k more zero bytes\n");
+    printf("static const uint32_t crc_table[8][256] = {\n");
+    for(int k = 0; k < 8; k++) {
+        print_values(table[k], 256, 4);
+        printf(k == 7 ? "\n" : ",\n");
+    }
+    printf("};\n\n");
+    printf("// crc_x2n_table[k] holds x^(2^k) modulo the CRC polynomial, used to shift\n");
+    printf("// a CRC past a run of zero bytes when combining\n");
+    printf("static const uint32_t crc_x2n_table[32] = ");
+    print_values(x2n, 32, 0);
+    printf(";\n\n#endif\n");
+
+    return 0;
+}